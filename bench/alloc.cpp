@@ -0,0 +1,129 @@
+// Allocation audit for the native build. Boots the real firmware
+// (src/main.cpp) against the host shims, then exercises every steady-state
+// path and counts the operator new calls each one makes:
+//
+//   * every MQTT command, valid and not, whole and in pieces, through to
+//     heatpump.update()
+//   * settings and room temperature changes on the unit
+//   * an MQTT disconnect and reconnect, which resubscribes and republishes
+//     the boot info
+//   * the minutely status, coalescer, task and metrics reports
+//
+// Allocating during setup() is fine. Anything after it fragments the heap on
+// a unit that runs for months, so any allocation here is a failure and the
+// exit status is 1.
+//
+//   pio run -e bench_alloc && .pio/build/bench_alloc/program [json]
+//
+// Passing "json" turns on the single JSON state topic.
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+
+// As in bench/latency.cpp, each pass through loop() is charged this much for
+// the ESP8266 core's own work, so that the firmware clock moves on
+#define BENCH_LOOP_OVERHEAD_US 1000
+
+static void runFor(unsigned long ms) {
+    unsigned long start = millis();
+    while (millis() - start < ms) {
+        loop();
+        delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+    }
+}
+
+static void inject(const char* suffix, const char* payload) {
+    char topic[64];
+    snprintf(topic, sizeof(topic), BENCH_TOPIC_PREFIX "/%s", suffix);
+    mqttClient.injectMessage(topic, payload, strlen(payload));
+    runFor(3000);
+}
+
+// As the real client delivers a payload that spans TCP segments
+static void injectPieces(const char* suffix, const char* payload, size_t pieceLength) {
+    char topic[64];
+    snprintf(topic, sizeof(topic), BENCH_TOPIC_PREFIX "/%s", suffix);
+    size_t total = strlen(payload);
+    for (size_t index = 0; index < total; index += pieceLength) {
+        mqttClient.injectPiece(topic, payload + index, index + pieceLength > total ? total - index : pieceLength, index, total);
+    }
+    runFor(3000);
+}
+
+static unsigned long failures = 0;
+
+static void report(const char* phase, unsigned long before) {
+    unsigned long allocations = nativeAllocations() - before;
+    printf("%-36s %8lu\n", phase, allocations);
+    if (allocations > 0) failures++;
+}
+
+int main(int argc, char** argv) {
+    bool jsonState = argc > 1 && strcmp(argv[1], "json") == 0;
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\",");
+    configFile.printf("\"mqtt_json_state\":\"%d\"}", jsonState ? 1 : 0);
+    configFile.close();
+
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    unsigned long before = nativeAllocations();
+    setup();
+    // Let the first state publish and saving the connection details happen
+    runFor(5000);
+    printf("%-36s %8s\n", "", "allocs");
+    printf("%-36s %8lu\n", "setup() and first 5s (allowed)", nativeAllocations() - before);
+
+    before = nativeAllocations();
+    inject("power/set", "ON");
+    inject("mode/set", "COOL");
+    inject("temperature/set", "22.5");
+    inject("fan/set", "QUIET");
+    inject("vane/set", "SWING");
+    inject("power/set", "sideways");
+    inject("temperature/set", "99");
+    inject("unknown/set", "1");
+    inject("set", "{\"power\":\"ON\",\"mode\":\"HEAT\",\"temperature\":23,\"fan\":\"2\"}");
+    inject("set", "mode=DRY,vane=3");
+    inject("set", "mode=DRY,fan=9");
+    injectPieces("set", "{\"mode\":\"COOL\",\"temperature\":21.5,\"fan\":\"AUTO\",\"vane\":\"SWING\"}", 16);
+    injectPieces("fan/set", "QUIET", 2);
+    report("MQTT commands", before);
+
+    before = nativeAllocations();
+    heatpumpSettings changed = heatpump.getSettings();
+    changed.fan = "3";
+    heatpump.simulateRemoteChange(changed);
+    runFor(3000);
+    heatpump.simulateRoomTemperature(19);
+    runFor(3000);
+    report("changes on the unit", before);
+
+    before = nativeAllocations();
+    mqttClient.injectDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+    runFor(1000);
+    mqttClient.connect();
+    runFor(3000);
+    report("MQTT disconnect and reconnect", before);
+
+    before = nativeAllocations();
+    runFor(65000);
+    report("status reports", before);
+
+    if (failures > 0) {
+        fprintf(stderr, "%lu phase(s) allocated after startup\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,283 @@
+// PayloadAssembler fuzz test and throughput, for the native build.
+//
+// Fuzz: feeds randomly sized payloads of random bytes, split into random
+// pieces, for one to PAYLOAD_ASSEMBLER_SLOTS + 1 topics at once with their
+// pieces interleaved, as AsyncMqttClient's onMessage would hand them over.
+// A model of the slots says what each message should come to, and the bench
+// checks that:
+//
+//   * a message in one piece comes back in place, without a copy;
+//   * any other that fits, and finds a free slot, comes back byte for byte;
+//   * the rest are rejected, and counted once each as oversize, interleaved
+//     (pieces out of order, or a message cut short by the next on its topic)
+//     or for want of a slot.
+//
+// Throughput: a <prefix>/set payload, whole and in 2, 4 and 8 pieces,
+// through add() and then CommandRouter::parseBatch().
+//
+// Exits 1 on the first message that doesn't come out as the model says.
+//
+//   pio run -e bench_assembler && .pio/build/bench_assembler/program [rounds] [seed]
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.hpp"
+#include "command_router.hpp"
+#include "payload_assembler.hpp"
+
+#define BENCH_MAX_PAYLOAD (PAYLOAD_ASSEMBLER_SIZE * 2)
+#define BENCH_MAX_PIECES 16
+#define BENCH_TOPICS (PAYLOAD_ASSEMBLER_SLOTS + 1)
+
+static const char* const TOPICS[] = { "bench/set", "bench/mode/set", "bench/fan/set", "bench/vane/set" };
+
+typedef struct {
+    const char* topic;
+    char payload[BENCH_MAX_PAYLOAD];
+    size_t total;
+    // Piece boundaries: piece i is [cuts[i], cuts[i + 1])
+    size_t cuts[BENCH_MAX_PIECES + 1];
+    int pieces;
+    int next;
+    // Cut short before its last piece, or with two pieces swapped
+    bool truncated;
+    bool swapped;
+    // What the model expects
+    bool claimed;
+    AssemblyResult expected;
+} FuzzMessage;
+
+static size_t randomBelow(size_t n) {
+    return n == 0 ? 0 : (size_t) (lrand48() % n);
+}
+
+static int compareSizes(const void* a, const void* b) {
+    size_t x = *(const size_t*) a;
+    size_t y = *(const size_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void makeMessage(FuzzMessage* message, const char* topic) {
+    message->topic = topic;
+    // Mostly short, as commands are, with some past the slot size
+    message->total = randomBelow(4) == 0 ? randomBelow(BENCH_MAX_PAYLOAD + 1) : randomBelow(PAYLOAD_ASSEMBLER_SIZE / 2);
+    for (size_t i = 0; i < message->total; i++) message->payload[i] = (char) lrand48();
+
+    int pieces = message->total < 2 ? 1 : 1 + (int) randomBelow(BENCH_MAX_PIECES < message->total ? BENCH_MAX_PIECES : message->total);
+    // Distinct cuts strictly inside the payload, sorted
+    message->cuts[0] = 0;
+    int count = 1;
+    while (count < pieces) {
+        size_t cut = 1 + randomBelow(message->total - 1);
+        bool seen = false;
+        for (int i = 1; i < count; i++) seen |= message->cuts[i] == cut;
+        if (!seen) message->cuts[count++] = cut;
+    }
+    qsort(message->cuts + 1, pieces - 1, sizeof(size_t), compareSizes);
+    message->cuts[pieces] = message->total;
+    message->pieces = pieces;
+    message->next = 0;
+    message->truncated = pieces > 2 && randomBelow(20) == 0;
+    message->swapped = !message->truncated && pieces > 2 && randomBelow(20) == 0;
+    if (message->truncated) message->pieces = 1 + (int) randomBelow(pieces - 1);
+}
+
+class Fuzz {
+    public:
+        Fuzz() : _failures(0), _messages(0) { memset(&_expected, 0, sizeof(_expected)); }
+
+        bool round();
+        unsigned long messages() const { return _messages; }
+        const PayloadAssembler& assembler() const { return _assembler; }
+        bool countersMatch();
+
+    private:
+        bool deliver(FuzzMessage& message, int piece);
+        void fail(const FuzzMessage& message, const char* what);
+
+        PayloadAssembler _assembler;
+        AssemblerStats _expected;
+        unsigned long _failures;
+        unsigned long _messages;
+        int _claimed;
+};
+
+void Fuzz::fail(const FuzzMessage& message, const char* what) {
+    fprintf(stderr, "message %lu to %s, %zu bytes in %d piece(s): %s\n", _messages, message.topic, message.total, message.pieces, what);
+    _failures++;
+}
+
+// Hands one piece over, and checks the outcome against the model
+bool Fuzz::deliver(FuzzMessage& message, int piece) {
+    size_t index = message.cuts[piece];
+    size_t length = message.cuts[piece + 1] - index;
+    const char* bytes = message.payload + index;
+    bool whole = message.cuts[message.pieces] == message.total && message.pieces == 1 && !message.truncated;
+
+    if (piece == 0) {
+        if (whole) {
+            message.expected = ASSEMBLY_COMPLETE;
+            _expected.whole++;
+        } else if (message.total > PAYLOAD_ASSEMBLER_SIZE) {
+            message.expected = ASSEMBLY_REJECTED;
+            _expected.oversize++;
+            // Oversize messages hold a slot too, to swallow their pieces
+            message.claimed = _claimed < PAYLOAD_ASSEMBLER_SLOTS;
+        } else if (_claimed < PAYLOAD_ASSEMBLER_SLOTS) {
+            message.claimed = true;
+            message.expected = message.swapped ? ASSEMBLY_REJECTED : message.truncated ? ASSEMBLY_PENDING : ASSEMBLY_COMPLETE;
+            if (message.swapped) _expected.interleaved++;
+        } else {
+            message.claimed = false;
+            message.expected = ASSEMBLY_REJECTED;
+            _expected.noSlot++;
+        }
+        if (message.claimed) _claimed++;
+    }
+
+    const char* out = NULL;
+    size_t outLength = 0;
+    AssemblyResult result = _assembler.add(message.topic, bytes, length, index, message.total, &out, &outLength);
+    bool last = piece == message.pieces - 1;
+
+    if (message.expected == ASSEMBLY_PENDING || (message.expected == ASSEMBLY_COMPLETE && !last)) {
+        if (result != ASSEMBLY_PENDING) fail(message, "not pending before its last piece");
+        return result == ASSEMBLY_PENDING;
+    }
+    if (message.expected == ASSEMBLY_COMPLETE) {
+        if (result != ASSEMBLY_COMPLETE) {
+            fail(message, "not completed");
+            return false;
+        }
+        if (outLength != message.total || memcmp(out, message.payload, message.total) != 0) {
+            fail(message, "came back changed");
+            return false;
+        }
+        if (whole && out != bytes) {
+            fail(message, "whole, but copied");
+            return false;
+        }
+        if (!whole) _expected.assembled++;
+        return true;
+    }
+    if (result == ASSEMBLY_COMPLETE) {
+        fail(message, "completed, but should have been rejected");
+        return false;
+    }
+    return true;
+}
+
+bool Fuzz::round() {
+    FuzzMessage messages[BENCH_TOPICS];
+    int count = 1 + (int) randomBelow(BENCH_TOPICS);
+    int offset = (int) randomBelow(sizeof(TOPICS) / sizeof(TOPICS[0]));
+    for (int i = 0; i < count; i++) makeMessage(&messages[i], TOPICS[(offset + i) % (sizeof(TOPICS) / sizeof(TOPICS[0]))]);
+
+    _claimed = 0;
+    for (;;) {
+        int remaining = 0;
+        for (int i = 0; i < count; i++) remaining += messages[i].next < messages[i].pieces;
+        if (remaining == 0) break;
+        int pick = (int) randomBelow(remaining);
+        for (int i = 0; i < count; i++) {
+            FuzzMessage& message = messages[i];
+            if (message.next >= message.pieces) continue;
+            if (pick-- > 0) continue;
+            int piece = message.next++;
+            // Pieces 1 and 2 the wrong way round
+            if (message.swapped && (piece == 1 || piece == 2)) piece = 3 - piece;
+            if (!deliver(message, piece)) return false;
+            // An oversize message's slot is freed by the piece that reaches
+            // its end; any other's by its last piece, or the first out of
+            // order
+            bool released;
+            if (message.total > PAYLOAD_ASSEMBLER_SIZE) {
+                released = message.cuts[piece + 1] == message.total;
+            } else {
+                released = (message.next == message.pieces && !message.truncated) || (message.swapped && message.next == 2);
+            }
+            if (released && message.claimed) {
+                message.claimed = false;
+                _claimed--;
+            }
+            break;
+        }
+    }
+
+    // A message cut short holds its slot until the next message on its topic
+    // arrives, which counts it as interleaved
+    for (int i = 0; i < count; i++) {
+        FuzzMessage& message = messages[i];
+        if (!message.truncated) continue;
+        const char* out;
+        size_t length;
+        if (message.claimed && message.total <= PAYLOAD_ASSEMBLER_SIZE) _expected.interleaved++;
+        _expected.whole++;
+        if (_assembler.add(message.topic, "ON", 2, 0, 2, &out, &length) != ASSEMBLY_COMPLETE) {
+            fail(message, "the message after it didn't complete");
+            return false;
+        }
+    }
+    _messages += count;
+    return countersMatch();
+}
+
+bool Fuzz::countersMatch() {
+    const AssemblerStats& actual = _assembler.stats();
+    if (memcmp(&actual, &_expected, sizeof(actual)) == 0) return true;
+    fprintf(stderr, "after %lu messages: whole %lu/%lu, assembled %lu/%lu, oversize %lu/%lu, interleaved %lu/%lu, no slot %lu/%lu\n",
+            _messages, actual.whole, _expected.whole, actual.assembled, _expected.assembled, actual.oversize, _expected.oversize,
+            actual.interleaved, _expected.interleaved, actual.noSlot, _expected.noSlot);
+    return false;
+}
+
+// ns per message for a <prefix>/set payload in `pieces` equal pieces
+static double throughput(const char* payload, int pieces, long iterations) {
+    PayloadAssembler assembler;
+    size_t total = strlen(payload);
+    size_t step = (total + pieces - 1) / pieces;
+    unsigned long fields = 0;
+    uint64_t start = benchNanos();
+    for (long n = 0; n < iterations; n++) {
+        for (size_t index = 0; index < total; index += step) {
+            size_t length = index + step > total ? total - index : step;
+            const char* message;
+            size_t messageLength;
+            if (assembler.add("bench/set", payload + index, length, index, total, &message, &messageLength) != ASSEMBLY_COMPLETE) continue;
+            CommandBatch batch;
+            if (CommandRouter::parseBatch(message, messageLength, &batch)) fields += batch.fields;
+        }
+    }
+    uint64_t nanos = benchNanos() - start;
+    benchKeep(fields);
+    return (double) nanos / iterations;
+}
+
+int main(int argc, char** argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 200000;
+    long seed = argc > 2 ? atol(argv[2]) : 1;
+    srand48(seed);
+
+    Fuzz fuzz;
+    for (long i = 0; i < rounds; i++) {
+        if (!fuzz.round()) {
+            fprintf(stderr, "failed in round %ld (seed %ld)\n", i, seed);
+            return 1;
+        }
+    }
+    const AssemblerStats& stats = fuzz.assembler().stats();
+    printf("fuzz: %lu messages, %lu whole, %lu assembled, %lu oversize, %lu interleaved, %lu without a slot\n\n", fuzz.messages(),
+           stats.whole, stats.assembled, stats.oversize, stats.interleaved, stats.noSlot);
+
+    static const char* PAYLOAD = "{\"power\":\"ON\",\"mode\":\"COOL\",\"temperature\":22.5,\"fan\":\"AUTO\",\"vane\":\"SWING\"}";
+    const long iterations = 1000000;
+    printf("%-36s %12s\n", "", "ns/message");
+    static const int PIECES[] = { 1, 2, 4, 8 };
+    for (size_t i = 0; i < sizeof(PIECES) / sizeof(PIECES[0]); i++) {
+        char name[40];
+        snprintf(name, sizeof(name), "%zu bytes in %d piece(s)", strlen(PAYLOAD), PIECES[i]);
+        printf("%-36s %12.1f\n", name, throughput(PAYLOAD, PIECES[i], iterations));
+    }
+    return 0;
+}
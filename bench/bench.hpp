@@ -0,0 +1,53 @@
+#ifndef __BENCH_HPP_
+#define __BENCH_HPP_
+
+// Small helpers shared by the host-side benchmarks in this directory.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+// Wall-clock time in nanoseconds. Unlike micros() this is never skewed by the
+// native delay(), so it is what the microbenchmarks use.
+inline uint64_t benchNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Keeps the optimiser from discarding a result we only compute to time it.
+template <typename T>
+inline void benchKeep(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+class LatencySamples {
+    public:
+        void add(double value) { _samples.push_back(value); }
+        size_t count() const { return _samples.size(); }
+
+        double percentile(double p) {
+            if (_samples.empty()) return 0;
+            std::sort(_samples.begin(), _samples.end());
+            size_t index = (size_t) (p / 100.0 * (_samples.size() - 1) + 0.5);
+            return _samples[index];
+        }
+
+        static void printHeader(const char* unit) {
+            printf("%-36s %6s %10s %10s %10s %10s %10s  (%s)\n",
+                   "", "n", "min", "p50", "p95", "p99", "max", unit);
+        }
+
+        void print(const char* name) {
+            printf("%-36s %6zu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                   name, count(), percentile(0), percentile(50), percentile(95), percentile(99), percentile(100));
+        }
+
+    private:
+        std::vector<double> _samples;
+};
+
+#endif // __BENCH_HPP_
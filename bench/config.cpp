@@ -0,0 +1,131 @@
+// Boot-time config load: the binary ConfigStore record against the
+// config.json that loadConfig() used to parse, on the native in-memory
+// SPIFFS. Reports the time per load and the heap allocations each makes.
+//
+//   pio run -e bench_config && .pio/build/bench_config/program [iterations]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <ArduinoJson.h>
+
+#include "bench.hpp"
+#include "config_store.hpp"
+#include "settings.hpp"
+
+#define JSON_PATH "/config.json"
+
+// --- The previous loadConfig(), verbatim apart from logging ---
+
+static void jsonLoad(Settings& settings) {
+    if (SPIFFS.begin()) {
+        if (SPIFFS.exists(JSON_PATH)) {
+            File configFile = SPIFFS.open(JSON_PATH, "r");
+            if (configFile) {
+                size_t size = configFile.size();
+                std::unique_ptr<char[]> buf(new char[size]);
+                configFile.readBytes(buf.get(), size);
+                const int capacity = JSON_OBJECT_SIZE(11);
+                StaticJsonBuffer<capacity> jsonBuffer;
+                JsonObject& json = jsonBuffer.parseObject(buf.get());
+                if (json.success()) {
+                    if (json.containsKey("mqtt_host"))
+                        strncpy(settings.mqtt_host, json["mqtt_host"], MAX_LENGTH_MQTT_HOST);
+                    if (json.containsKey("mqtt_port"))
+                        strncpy(settings.mqtt_port, json["mqtt_port"], MAX_LENGTH_MQTT_PORT);
+                    if (json.containsKey("mqtt_username"))
+                        strncpy(settings.mqtt_username, json["mqtt_username"], MAX_LENGTH_MQTT_USERNAME);
+                    if (json.containsKey("mqtt_password"))
+                        strncpy(settings.mqtt_password, json["mqtt_password"], MAX_LENGTH_MQTT_PASSWORD);
+                    if (json.containsKey("mqtt_topic_prefix"))
+                        strncpy(settings.mqtt_topic_prefix, json["mqtt_topic_prefix"], MAX_LENGTH_MQTT_TOPIC_PREFIX);
+                    if (json.containsKey("syslog_host"))
+                        strncpy(settings.syslog_host, json["syslog_host"], MAX_LENGTH_SYSLOG_HOST);
+                    if (json.containsKey("syslog_port"))
+                        strncpy(settings.syslog_port, json["syslog_port"], MAX_LENGTH_SYSLOG_PORT);
+                    if (json.containsKey("syslog_device_hostname"))
+                        strncpy(settings.syslog_device_hostname, json["syslog_device_hostname"], MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME);
+                    if (json.containsKey("syslog_app_name"))
+                        strncpy(settings.syslog_app_name, json["syslog_app_name"], MAX_LENGTH_SYSLOG_APP_NAME);
+                    if (json.containsKey("syslog_log_level"))
+                        strncpy(settings.syslog_log_level, json["syslog_log_level"], MAX_LENGTH_SYSLOG_LOG_LEVEL);
+                    if (json.containsKey("mqtt_json_state"))
+                        strncpy(settings.mqtt_json_state, json["mqtt_json_state"], MAX_LENGTH_MQTT_JSON_STATE);
+                }
+                configFile.close();
+            }
+        }
+    }
+}
+
+static void jsonSave(const Settings& settings) {
+    DynamicJsonBuffer jsonBuffer;
+    JsonObject& json = jsonBuffer.createObject();
+    json["mqtt_host"] = settings.mqtt_host;
+    json["mqtt_port"] = settings.mqtt_port;
+    json["mqtt_username"] = settings.mqtt_username;
+    json["mqtt_password"] = settings.mqtt_password;
+    json["mqtt_topic_prefix"] = settings.mqtt_topic_prefix;
+    json["syslog_host"] = settings.syslog_host;
+    json["syslog_port"] = settings.syslog_port;
+    json["syslog_device_hostname"] = settings.syslog_device_hostname;
+    json["syslog_app_name"] = settings.syslog_app_name;
+    json["syslog_log_level"] = settings.syslog_log_level;
+    json["mqtt_json_state"] = settings.mqtt_json_state;
+
+    File configFile = SPIFFS.open(JSON_PATH, "w");
+    json.printTo(configFile);
+    configFile.close();
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 20000;
+
+    Settings original;
+    strcpy(original.mqtt_host, "mqtt.example.net");
+    strcpy(original.mqtt_username, "aircon");
+    strcpy(original.mqtt_password, "correct horse battery staple");
+    strcpy(original.mqtt_topic_prefix, "home/living-room/aircon");
+    strcpy(original.syslog_host, "logs.example.net");
+    strcpy(original.syslog_device_hostname, "aircon-living-room");
+
+    ConfigStore store("/config.a", "/config.b", SETTINGS_VERSION);
+    jsonSave(original);
+    // Two saves, so that load has both slots to choose between
+    store.save(&original, sizeof(original));
+    store.save(&original, sizeof(original));
+
+    // Both must load the same settings
+    Settings fromJson;
+    Settings fromRecord;
+    jsonLoad(fromJson);
+    if (!store.load(&fromRecord, sizeof(fromRecord)) || memcmp(&fromJson, &fromRecord, sizeof(Settings)) != 0) {
+        fprintf(stderr, "config.json and the record disagree\n");
+        return 1;
+    }
+
+    unsigned long before = nativeAllocations();
+    uint64_t start = benchNanos();
+    for (long n = 0; n < iterations; n++) {
+        Settings settings;
+        jsonLoad(settings);
+        benchKeep(settings);
+    }
+    uint64_t jsonNanos = benchNanos() - start;
+    double jsonAllocations = (double) (nativeAllocations() - before) / iterations;
+
+    before = nativeAllocations();
+    start = benchNanos();
+    for (long n = 0; n < iterations; n++) {
+        Settings settings;
+        store.load(&settings, sizeof(settings));
+        benchKeep(settings);
+    }
+    uint64_t recordNanos = benchNanos() - start;
+    double recordAllocations = (double) (nativeAllocations() - before) / iterations;
+
+    printf("%-36s %12s %12s\n", "", "ns/load", "allocs/load");
+    printf("%-36s %12.1f %12.1f\n", "config.json + ArduinoJson", (double) jsonNanos / iterations, jsonAllocations);
+    printf("%-36s %12.1f %12.1f\n", "ConfigStore record", (double) recordNanos / iterations, recordAllocations);
+    printf("%-36s %11.2fx\n", "speedup", (double) jsonNanos / recordNanos);
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Command confirmation over a lossy CN105 link, for the native build.
+//
+// Boots the real firmware (src/main.cpp) against the host shims and sends
+// commands while the model of the indoor unit ignores some of the writes, as
+// if they had been lost on the link. For each number of lost writes, reports
+// on the firmware's clock how long the command took to be confirmed and how
+// many times it was written, and checks that:
+//
+//   * a command is retried until the unit has it, as long as fewer than
+//     COMMAND_CONFIRM_ATTEMPTS writes are lost;
+//   * once they all are, the field is reported as diverged, and a new
+//     command clears that;
+//   * a command the unit takes at once is confirmed without a retry.
+//
+// Exits 1 if any of those doesn't hold.
+//
+//   pio run -e bench_confirm && .pio/build/bench_confirm/program [rounds]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+
+#include "bench.hpp"
+#include "unit_bridge.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+extern UnitBridge bridge;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+#define BENCH_LOOP_OVERHEAD_US 100
+// Long enough for every attempt's timeout to run out
+#define BENCH_SETTLE_MS 60000
+
+static const char* const FANS[] = { "QUIET", "1", "2", "3", "4" };
+
+static void runFor(unsigned long ms) {
+    unsigned long start = millis();
+    while (millis() - start < ms) {
+        loop();
+        delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+    }
+}
+
+static unsigned long failures = 0;
+
+static void fail(const char* what, unsigned int lost) {
+    fprintf(stderr, "%u lost write(s): %s\n", lost, what);
+    failures++;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\"}");
+    configFile.close();
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    setup();
+    runFor(10000);
+
+    const int fan = CommandTracker::index(COMMAND_FAN);
+    int sent = 0;
+    printf("%-36s %6s %10s %10s\n", "", "n", "p50", "max");
+    for (unsigned int lost = 0; lost <= COMMAND_CONFIRM_ATTEMPTS; lost++) {
+        LatencySamples confirmed;
+        unsigned long attempts = 0;
+        for (int round = 0; round < rounds; round++) {
+            // Always a change, so that there is something to write
+            const char* value = FANS[sent++ % 5];
+            if (strcmp(heatpump.getSettings().fan, value) == 0) value = FANS[sent++ % 5];
+            heatpump.simulateLostWrites(lost);
+            mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/fan/set", value, strlen(value));
+            runFor(BENCH_SETTLE_MS);
+
+            const TrackedField& field = bridge.tracker().field(fan);
+            attempts += field.attempts;
+            bool applied = strcmp(heatpump.getSettings().fan, value) == 0;
+            if (lost < COMMAND_CONFIRM_ATTEMPTS) {
+                if (!applied) fail("the unit doesn't have the command", lost);
+                if (field.state != TRACK_CONFIRMED) fail("the command wasn't confirmed", lost);
+                if (field.attempts != lost + 1) fail("the command wasn't written once per lost write, plus one", lost);
+                confirmed.add(field.lastConfirmMillis);
+            } else {
+                if (applied) fail("the unit has the command after all", lost);
+                if (field.state != TRACK_DIVERGED) fail("the field wasn't reported as diverged", lost);
+            }
+        }
+        char name[40];
+        if (lost < COMMAND_CONFIRM_ATTEMPTS) {
+            snprintf(name, sizeof(name), "%u lost: command -> confirmed, ms", lost);
+            printf("%-36s %6zu %10.0f %10.0f   %.1f writes each\n", name, confirmed.count(),
+                   confirmed.percentile(50), confirmed.percentile(100), (double) attempts / rounds);
+        } else {
+            snprintf(name, sizeof(name), "%u lost: diverged", lost);
+            printf("%-36s %6d   %.1f writes each\n", name, rounds, (double) attempts / rounds);
+        }
+    }
+
+    // A new command clears the divergence
+    mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/fan/set", "AUTO", 4);
+    runFor(BENCH_SETTLE_MS);
+    if (bridge.tracker().field(fan).state != TRACK_CONFIRMED) fail("a new command didn't clear the divergence", 0);
+
+    const TrackerStats& stats = bridge.tracker().stats();
+    printf("\n%lu confirmed, %lu retries, %lu diverged\n", stats.confirmed, stats.retries, stats.diverged);
+    return failures > 0 ? 1 : 0;
+}
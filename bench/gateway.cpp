@@ -0,0 +1,534 @@
+// Gateway scaling, for the native build.
+//
+// Runs the Linux gateway (gateway/) on its own thread against N models of an
+// indoor unit, each on a pseudo-terminal and answering at 2400 baud's pace,
+// and a minimal MQTT broker that stands in for the building's. Every unit
+// gets a fan command every few seconds through the broker, and the time
+// from the command being published to the unit's fan/state coming back is
+// recorded, for N = 1, 4, 16... up to the given maximum. Also reports how
+// busy the gateway's loop was, and checks that:
+//
+//   * every unit connects and publishes its state;
+//   * every command is confirmed, without retries or divergence.
+//
+// Exits 1 if any of those doesn't hold.
+//
+//   pio run -e bench_gateway && .pio/build/bench_gateway/program [max-units] [seconds]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "gateway.hpp"
+
+#define BENCH_UNIT_PREFIX "bench/u"
+// One byte on the wire is start + 8 data + parity + stop bits at 2400 baud
+#define BENCH_BYTE_NANOS (11ULL * 1000000000ULL / 2400)
+#define BENCH_FRAME_LEN 22
+// A unit gets its next command this long after its last state came back
+#define BENCH_COMMAND_GAP_MIN_MS 3000
+#define BENCH_COMMAND_GAP_MAX_MS 6000
+#define BENCH_COMMAND_TIMEOUT_MS 30000
+#define BENCH_READY_TIMEOUT_MS 30000
+#define BENCH_BROKER_BUFFER 4096
+
+#define TAG_LISTEN 0
+#define TAG_UNIT 1
+#define TAG_CLIENT 2
+
+static const char* const FANS[] = { "QUIET", "1", "2", "3", "4" };
+static const uint8_t FAN_BYTES[] = { 0x01, 0x02, 0x03, 0x05, 0x06 };
+
+// One indoor unit on the master side of a pty, like tools/cn105sim.cpp
+typedef struct {
+    int master;
+    // Held open so that the master doesn't see a hangup before the gateway
+    // has opened the port
+    int slave;
+    char path[GATEWAY_MAX_PATH];
+    uint8_t rx[64];
+    size_t rxLength;
+    uint8_t reply[BENCH_FRAME_LEN];
+    size_t replyLength;
+    uint64_t replyDue;
+    uint8_t settings[5];
+    bool connected;
+} UnitModel;
+
+typedef struct {
+    int fd;
+    int unit;
+    uint8_t in[BENCH_BROKER_BUFFER];
+    size_t inLength;
+} BrokerClient;
+
+// What the bench sees of a unit through the broker
+typedef struct {
+    int client;
+    char fan[8];
+    bool pending;
+    char commanded[8];
+    uint64_t commandedAt;
+    uint64_t nextCommandAt;
+} UnitProbe;
+
+static uint8_t checkSum(const uint8_t* bytes, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) sum += bytes[i];
+    return (0xfc - sum) & 0xff;
+}
+
+static uint64_t randomGap() {
+    return (BENCH_COMMAND_GAP_MIN_MS + (uint64_t) (drand48() * (BENCH_COMMAND_GAP_MAX_MS - BENCH_COMMAND_GAP_MIN_MS))) * 1000000ULL;
+}
+
+static bool openUnit(UnitModel* unit) {
+    memset(unit, 0, sizeof(*unit));
+    unit->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (unit->master < 0 || grantpt(unit->master) != 0 || unlockpt(unit->master) != 0) return false;
+    snprintf(unit->path, sizeof(unit->path), "%s", ptsname(unit->master));
+    unit->slave = open(unit->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (unit->slave < 0) return false;
+    struct termios tio;
+    tcgetattr(unit->slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(unit->slave, TCSANOW, &tio);
+    // Off, cool, 23 degrees, fan auto, vane auto
+    const uint8_t settings[5] = { 0x00, 0x03, 0x08, 0x00, 0x00 };
+    memcpy(unit->settings, settings, sizeof(settings));
+    return true;
+}
+
+// Builds the unit's reply to a request, to go out once the request and the
+// reply would have been on the wire
+static void respond(UnitModel* unit, const uint8_t* request, size_t length, uint64_t now) {
+    const uint8_t* data = request + 5;
+    uint8_t* reply = unit->reply;
+    memset(reply, 0, BENCH_FRAME_LEN);
+    switch (request[1]) {
+        case 0x5a: {
+            static const uint8_t CONNECT_ACK[7] = { 0xfc, 0x7a, 0x01, 0x30, 0x01, 0x00, 0x54 };
+            unit->connected = true;
+            memcpy(reply, CONNECT_ACK, sizeof(CONNECT_ACK));
+            unit->replyLength = sizeof(CONNECT_ACK);
+            unit->replyDue = now + (length + unit->replyLength) * BENCH_BYTE_NANOS;
+            return;
+        }
+        case 0x41:
+            if (!unit->connected) return;
+            for (int i = 0; i < 5; i++) {
+                if (data[1] & (1 << i)) unit->settings[i] = data[3 + i];
+            }
+            reply[1] = 0x61;
+            break;
+        case 0x42:
+            if (!unit->connected) return;
+            reply[1] = 0x62;
+            reply[5] = data[0];
+            if (data[0] == 0x02) memcpy(reply + 8, unit->settings, 5);
+            if (data[0] == 0x03) reply[8] = 0x0c;
+            break;
+        default:
+            return;
+    }
+    reply[0] = 0xfc;
+    reply[2] = 0x01;
+    reply[3] = 0x30;
+    reply[4] = 0x10;
+    reply[BENCH_FRAME_LEN - 1] = checkSum(reply, BENCH_FRAME_LEN - 1);
+    unit->replyLength = BENCH_FRAME_LEN;
+    unit->replyDue = now + (length + unit->replyLength) * BENCH_BYTE_NANOS;
+}
+
+static void unitReadable(UnitModel* unit, uint64_t now) {
+    ssize_t count;
+    while ((count = read(unit->master, unit->rx + unit->rxLength, sizeof(unit->rx) - unit->rxLength)) > 0) {
+        unit->rxLength += count;
+        size_t start = 0;
+        while (start < unit->rxLength) {
+            if (unit->rx[start] != 0xfc) {
+                start++;
+                continue;
+            }
+            if (unit->rxLength - start < 5) break;
+            size_t length = 5 + unit->rx[start + 4] + 1;
+            if (length > BENCH_FRAME_LEN) {
+                start++;
+                continue;
+            }
+            if (unit->rxLength - start < length) break;
+            if (unit->rx[start + length - 1] == checkSum(unit->rx + start, length - 1)) respond(unit, unit->rx + start, length, now);
+            start += length;
+        }
+        memmove(unit->rx, unit->rx + start, unit->rxLength - start);
+        unit->rxLength -= start;
+    }
+}
+
+static bool sendAll(int fd, const uint8_t* bytes, size_t length) {
+    while (length > 0) {
+        ssize_t count = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return false;
+        }
+        bytes += count;
+        length -= count;
+    }
+    return true;
+}
+
+static void brokerPublish(int fd, const char* topic, const char* payload) {
+    uint8_t packet[128];
+    size_t topicLength = strlen(topic);
+    size_t payloadLength = strlen(payload);
+    size_t remaining = 2 + topicLength + payloadLength;
+    packet[0] = 0x30;
+    packet[1] = remaining;
+    packet[2] = topicLength >> 8;
+    packet[3] = topicLength & 0xff;
+    memcpy(packet + 4, topic, topicLength);
+    memcpy(packet + 4 + topicLength, payload, payloadLength);
+    sendAll(fd, packet, 2 + remaining);
+}
+
+// Units are told apart by their prefix, "bench/u<index>/"
+static int topicUnit(const char* topic, size_t length, const char** rest) {
+    size_t prefixLength = strlen(BENCH_UNIT_PREFIX);
+    if (length <= prefixLength || strncmp(topic, BENCH_UNIT_PREFIX, prefixLength) != 0) return -1;
+    char* end;
+    long index = strtol(topic + prefixLength, &end, 10);
+    *rest = end;
+    return (int) index;
+}
+
+class BenchRun {
+    public:
+        BenchRun(size_t units) : _unitCount(units), _failures(0) {}
+
+        bool run(unsigned long seconds);
+        unsigned long failures() const { return _failures; }
+
+    private:
+        void clientReadable(size_t index, uint64_t now);
+        void handlePacket(BrokerClient& client, uint8_t header, const uint8_t* body, size_t length, uint64_t now);
+        void fail(const char* what);
+        void pump(uint64_t now, int timeoutMs);
+
+        size_t _unitCount;
+        unsigned long _failures;
+        int _epoll;
+        int _listen;
+        std::vector<UnitModel> _units;
+        std::vector<UnitProbe> _probes;
+        std::vector<BrokerClient*> _clients;
+        LatencySamples _latency;
+        unsigned long _commands;
+        unsigned long _answered;
+};
+
+void BenchRun::fail(const char* what) {
+    fprintf(stderr, "%zu unit(s): %s\n", _unitCount, what);
+    _failures++;
+}
+
+void BenchRun::handlePacket(BrokerClient& client, uint8_t header, const uint8_t* body, size_t length, uint64_t now) {
+    switch (header & 0xf0) {
+        case 0x10: {
+            static const uint8_t CONNACK[4] = { 0x20, 0x02, 0x00, 0x00 };
+            sendAll(client.fd, CONNACK, sizeof(CONNACK));
+            break;
+        }
+        case 0x80: {
+            // Only the first topic matters: they all have the unit's prefix
+            size_t topicLength = (body[2] << 8) | body[3];
+            const char* rest;
+            int unit = topicUnit((const char*) body + 4, topicLength, &rest);
+            if (unit >= 0 && (size_t) unit < _unitCount) {
+                client.unit = unit;
+                _probes[unit].client = client.fd;
+            }
+            const uint8_t suback[5] = { 0x90, 0x03, body[0], body[1], 0x00 };
+            sendAll(client.fd, suback, sizeof(suback));
+            break;
+        }
+        case 0x30: {
+            size_t topicLength = (body[0] << 8) | body[1];
+            const char* topic = (const char*) body + 2;
+            const char* payload = topic + topicLength;
+            size_t payloadLength = length - 2 - topicLength;
+            const char* rest;
+            int unit = topicUnit(topic, topicLength, &rest);
+            if (unit < 0 || (size_t) unit >= _unitCount) break;
+            if ((size_t) (topic + topicLength - rest) != strlen("/fan/state") || strncmp(rest, "/fan/state", strlen("/fan/state")) != 0) break;
+            UnitProbe& probe = _probes[unit];
+            snprintf(probe.fan, sizeof(probe.fan), "%.*s", (int) payloadLength, payload);
+            if (probe.pending && strcmp(probe.fan, probe.commanded) == 0) {
+                _latency.add((now - probe.commandedAt) / 1e6);
+                _answered++;
+                probe.pending = false;
+                probe.nextCommandAt = now + randomGap();
+            }
+            break;
+        }
+        case 0xc0: {
+            static const uint8_t PINGRESP[2] = { 0xd0, 0x00 };
+            sendAll(client.fd, PINGRESP, sizeof(PINGRESP));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void BenchRun::clientReadable(size_t index, uint64_t now) {
+    BrokerClient& client = *_clients[index];
+    ssize_t count;
+    while ((count = recv(client.fd, client.in + client.inLength, sizeof(client.in) - client.inLength, 0)) > 0) {
+        client.inLength += count;
+        size_t start = 0;
+        for (;;) {
+            size_t available = client.inLength - start;
+            size_t remaining = 0;
+            size_t lengthBytes = 0;
+            bool complete = false;
+            while (lengthBytes < 4 && 1 + lengthBytes < available) {
+                uint8_t digit = client.in[start + 1 + lengthBytes];
+                remaining |= (size_t) (digit & 0x7f) << (7 * lengthBytes);
+                lengthBytes++;
+                if (!(digit & 0x80)) {
+                    complete = true;
+                    break;
+                }
+            }
+            if (!complete || available < 1 + lengthBytes + remaining) break;
+            handlePacket(client, client.in[start], client.in + start + 1 + lengthBytes, remaining, now);
+            start += 1 + lengthBytes + remaining;
+        }
+        memmove(client.in, client.in + start, client.inLength - start);
+        client.inLength -= start;
+    }
+}
+
+// Serves the units and the broker for up to timeoutMs
+void BenchRun::pump(uint64_t now, int timeoutMs) {
+    for (size_t i = 0; i < _unitCount; i++) {
+        UnitModel& unit = _units[i];
+        if (unit.replyLength == 0) continue;
+        if (now >= unit.replyDue) {
+            if (write(unit.master, unit.reply, unit.replyLength) < 0) fail("a unit couldn't reply");
+            unit.replyLength = 0;
+        } else if ((int) ((unit.replyDue - now) / 1000000) < timeoutMs) {
+            timeoutMs = (unit.replyDue - now) / 1000000;
+        }
+    }
+
+    struct epoll_event events[64];
+    int count = epoll_wait(_epoll, events, 64, timeoutMs);
+    now = benchNanos();
+    for (int i = 0; i < count; i++) {
+        uint64_t tag = events[i].data.u64;
+        size_t index = tag >> 2;
+        switch (tag & 3) {
+            case TAG_LISTEN: {
+                int fd;
+                while ((fd = accept4(_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    BrokerClient* client = new BrokerClient();
+                    client->fd = fd;
+                    client->unit = -1;
+                    client->inLength = 0;
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    struct epoll_event event;
+                    event.events = EPOLLIN;
+                    event.data.u64 = ((uint64_t) _clients.size() << 2) | TAG_CLIENT;
+                    epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+                    _clients.push_back(client);
+                }
+                break;
+            }
+            case TAG_UNIT:
+                unitReadable(&_units[index], now);
+                break;
+            case TAG_CLIENT:
+                clientReadable(index, now);
+                break;
+        }
+    }
+}
+
+bool BenchRun::run(unsigned long seconds) {
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    _units.resize(_unitCount);
+    _probes.resize(_unitCount);
+    _commands = 0;
+    _answered = 0;
+
+    _listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in broker;
+    memset(&broker, 0, sizeof(broker));
+    broker.sin_family = AF_INET;
+    broker.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t brokerLength = sizeof(broker);
+    if (bind(_listen, (struct sockaddr*) &broker, sizeof(broker)) != 0 || listen(_listen, 1024) != 0 ||
+        getsockname(_listen, (struct sockaddr*) &broker, &brokerLength) != 0) {
+        fail("can't listen");
+        return false;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = TAG_LISTEN;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _listen, &event);
+
+    Gateway* gateway = new Gateway();
+    gateway->setBroker(broker, NULL, NULL);
+    std::vector<std::vector<char> > prefixes(_unitCount);
+    for (size_t i = 0; i < _unitCount; i++) {
+        if (!openUnit(&_units[i])) {
+            fail("can't open a pty; raise the open file limit");
+            return false;
+        }
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t) i << 2) | TAG_UNIT;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, _units[i].master, &event);
+        prefixes[i].resize(GATEWAY_MAX_PREFIX);
+        snprintf(prefixes[i].data(), GATEWAY_MAX_PREFIX, BENCH_UNIT_PREFIX "%zu", i);
+        gateway->addUnit(_units[i].path, prefixes[i].data());
+        memset(&_probes[i], 0, sizeof(UnitProbe));
+        _probes[i].client = -1;
+    }
+
+    volatile bool stop = false;
+    if (!gateway->begin()) {
+        fail("can't start the gateway");
+        return false;
+    }
+    std::thread loop([gateway, &stop]() { gateway->run(&stop); });
+
+    // Every unit connected, and its state published
+    uint64_t start = benchNanos();
+    uint64_t now = start;
+    size_t ready = 0;
+    while (now - start < BENCH_READY_TIMEOUT_MS * 1000000ULL) {
+        pump(now, 10);
+        now = benchNanos();
+        ready = 0;
+        for (size_t i = 0; i < _unitCount; i++) ready += _probes[i].fan[0] != '\0' ? 1 : 0;
+        if (ready == _unitCount) break;
+    }
+    uint64_t readyNanos = now - start;
+    if (ready < _unitCount) fail("not every unit published its state");
+
+    // Spread the first commands over a gap, so they don't all land at once
+    for (size_t i = 0; i < _unitCount; i++) _probes[i].nextCommandAt = now + randomGap();
+    unsigned long long busyBefore = gateway->stats().busyMicros;
+    uint64_t measureStart = now;
+    uint64_t measureEnd = now + seconds * 1000000000ULL;
+    for (;;) {
+        bool pending = false;
+        for (size_t i = 0; i < _unitCount; i++) {
+            UnitProbe& probe = _probes[i];
+            if (probe.pending) {
+                pending = true;
+                if (now - probe.commandedAt > BENCH_COMMAND_TIMEOUT_MS * 1000000ULL) {
+                    fail("a command's state never came back");
+                    probe.pending = false;
+                }
+            } else if (now < measureEnd && now >= probe.nextCommandAt && probe.client >= 0) {
+                int value = (int) (drand48() * 5);
+                if (strcmp(FANS[value], probe.fan) == 0) value = (value + 1) % 5;
+                char topic[GATEWAY_MAX_PREFIX + 16];
+                snprintf(topic, sizeof(topic), BENCH_UNIT_PREFIX "%zu/fan/set", i);
+                snprintf(probe.commanded, sizeof(probe.commanded), "%s", FANS[value]);
+                probe.commandedAt = benchNanos();
+                probe.pending = true;
+                pending = true;
+                _commands++;
+                brokerPublish(probe.client, topic, FANS[value]);
+            }
+        }
+        if (now >= measureEnd && !pending) break;
+        pump(now, 10);
+        now = benchNanos();
+    }
+    unsigned long long busy = gateway->stats().busyMicros - busyBefore;
+    double wall = (now - measureStart) / 1e3;
+
+    stop = true;
+    loop.join();
+
+    TrackerStats tracker = { 0, 0, 0 };
+    for (size_t i = 0; i < _unitCount; i++) {
+        GatewayUnit& unit = gateway->unit(i);
+        const TrackerStats& stats = unit.bridge().tracker().stats();
+        tracker.confirmed += stats.confirmed;
+        tracker.retries += stats.retries;
+        tracker.diverged += stats.diverged;
+        for (int field = 0; field < 5; field++) {
+            if (unit.bridge().tracker().field(field).state == TRACK_DIVERGED) fail("a field diverged");
+        }
+        // The unit model has the last command
+        const UnitProbe& probe = _probes[i];
+        if (probe.commanded[0] != '\0') {
+            int value = 0;
+            while (value < 5 && strcmp(FANS[value], probe.commanded) != 0) value++;
+            if (_units[i].settings[3] != FAN_BYTES[value]) fail("a unit doesn't have its last command");
+        }
+    }
+    if (_answered != _commands) fail("not every command was answered");
+    if (tracker.retries > 0) fail("commands were retried");
+
+    char name[40];
+    snprintf(name, sizeof(name), "%zu unit(s): command -> state, ms", _unitCount);
+    _latency.print(name);
+    printf("%-36s %6lu commands, %lu confirmed, %lu retries, ready in %.1f s, loop busy %.2f%%\n", "",
+           _commands, tracker.confirmed, tracker.retries, readyNanos / 1e9, wall > 0 ? 100.0 * busy / wall : 0.0);
+    fflush(stdout);
+
+    delete gateway;
+    for (size_t i = 0; i < _clients.size(); i++) {
+        close(_clients[i]->fd);
+        delete _clients[i];
+    }
+    for (size_t i = 0; i < _unitCount; i++) {
+        close(_units[i].master);
+        close(_units[i].slave);
+    }
+    close(_listen);
+    close(_epoll);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    size_t maxUnits = argc > 1 ? (size_t) atoi(argv[1]) : 256;
+    unsigned long seconds = argc > 2 ? (unsigned long) atoi(argv[2]) : 30;
+
+    // Three descriptors per unit on the bench's side, two on the gateway's
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    srand48(1);
+
+    unsigned long failures = 0;
+    LatencySamples::printHeader("ms");
+    for (size_t units = 1; units <= maxUnits; units *= 4) {
+        BenchRun run(units);
+        run.run(seconds);
+        failures += run.failures();
+    }
+    return failures > 0 ? 1 : 0;
+}
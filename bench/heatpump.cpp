@@ -0,0 +1,86 @@
+// CN105 link benchmark: drives the HeatPump library over a real tty, normally
+// the pty served by tools/cn105sim, and measures what the firmware's loop()
+// would see from it:
+//
+//   * how long each sync() and update() call blocks
+//   * info replies per second
+//   * how long the link takes to recover after a timeout or a bad frame
+//
+// Run the simulator with whatever faults you want to test against first:
+//
+//   .pio/build/cn105sim/program -l /tmp/cn105 -D 0.01 -c 0.02 &
+//   pio run -e bench_heatpump && .pio/build/bench_heatpump/program /tmp/cn105 [seconds]
+
+#include <Arduino.h>
+#include <HeatPump.h>
+
+#include "bench.hpp"
+
+// How often to change the setpoint, as a slider would
+#define BENCH_UPDATE_INTERVAL_MS 3000
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <tty> [seconds]\n", argv[0]);
+        return 2;
+    }
+    unsigned long seconds = argc > 2 ? strtoul(argv[2], NULL, 10) : 60;
+    if (!Serial.open(argv[1])) return 1;
+    nativeSetRealTime(true);
+
+    HeatPump heatpump;
+    uint64_t start = benchNanos();
+    // If the handshake fails, sync() keeps trying, as it would on a unit
+    bool connected = heatpump.connect(&Serial);
+    printf("connect %s after %.1f ms\n", connected ? "acked" : "not acked", (benchNanos() - start) / 1e6);
+
+    LatencySamples syncTimes;
+    LatencySamples updateTimes;
+    LatencySamples recoveryTimes;
+    unsigned long updatesFailed = 0;
+    uint64_t failedAt = 0;
+    unsigned long failures = 0;
+    unsigned long lastUpdate = millis();
+    int setpoint = 20;
+
+    uint64_t end = benchNanos() + (uint64_t) seconds * 1000000000ULL;
+    unsigned long received = heatpump.packetsReceived;
+    while (benchNanos() < end) {
+        if (millis() - lastUpdate >= BENCH_UPDATE_INTERVAL_MS) {
+            lastUpdate = millis();
+            setpoint = setpoint == 20 ? 24 : 20;
+            heatpump.setTemperature(setpoint);
+            uint64_t before = benchNanos();
+            if (!heatpump.update()) updatesFailed++;
+            updateTimes.add((benchNanos() - before) / 1e6);
+        } else {
+            uint64_t before = benchNanos();
+            heatpump.sync();
+            syncTimes.add((benchNanos() - before) / 1e6);
+        }
+
+        // Recovery runs from the first failure to the next good frame
+        unsigned long failed = heatpump.replyTimeouts + heatpump.badPackets;
+        if (failed != failures) {
+            failures = failed;
+            if (failedAt == 0) failedAt = benchNanos();
+        }
+        if (heatpump.packetsReceived != received) {
+            received = heatpump.packetsReceived;
+            if (failedAt != 0) {
+                recoveryTimes.add((benchNanos() - failedAt) / 1e6);
+                failedAt = 0;
+            }
+        }
+        delay(1);
+    }
+
+    LatencySamples::printHeader("ms");
+    syncTimes.print("sync()");
+    updateTimes.print("update()");
+    recoveryTimes.print("failure -> next good frame");
+    printf("\n%lu frames received (%.1f/s), %lu bad, %lu reply timeouts, %lu reconnects, %lu updates not acked\n",
+           heatpump.packetsReceived, (double) heatpump.packetsReceived / seconds, heatpump.badPackets,
+           heatpump.replyTimeouts, heatpump.reconnects, updatesFailed);
+    return 0;
+}
@@ -0,0 +1,220 @@
+// History over a synthetic day and a half, for the native build.
+//
+// The room temperature drifts by a tenth every so often, as the unit
+// reports it, and the settings change a few times an hour. A model keeps
+// every sample each tier should hold, with the minute and quarter means
+// worked out second by second, and the bench checks that a query of each
+// tier, whole and in part, decodes to the newest of them exactly. It then
+// saves the state, restores it as at the next boot and checks that history
+// carries on from it.
+//
+// For each tier it prints what a sample costs in the ring against the 8
+// bytes of a HistorySample, how far back the ring reaches, and how long a
+// query of the whole tier and its decoding take.
+//
+// Exits 1 on the first sample that doesn't match the model.
+//
+//   pio run -e bench_history && .pio/build/bench_history/program [hours] [seed]
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.hpp"
+#include "command_router.hpp"
+#include "history.hpp"
+
+static const uint32_t PERIODS[HISTORY_TIERS] = { 0, HISTORY_MINUTE_SECONDS, HISTORY_QUARTER_SECONDS };
+
+// What each tier should hold, oldest first
+static std::vector<HistorySample> expected[HISTORY_TIERS];
+static uint8_t batch[HISTORY_RESPONSE_SIZE];
+
+static unsigned long millisAt(uint32_t seconds) {
+    return (unsigned long) seconds * 1000 + 500;
+}
+
+static int roundedMean(int64_t sum, uint32_t count) {
+    int64_t half = count / 2;
+    return (int) (sum >= 0 ? (sum + half) / count : -((-sum + half) / count));
+}
+
+static uint16_t randomSettings() {
+    static const char* const POWER[] = { "OFF", "ON", "ON", "ON" };
+    return History::packSettings(POWER[rand() % 4], CommandRouter::valueName(COMMAND_MODE, rand() % 5),
+                                 160 + 5 * (rand() % 20), CommandRouter::valueName(COMMAND_FAN, rand() % 6),
+                                 CommandRouter::valueName(COMMAND_VANE, rand() % 7));
+}
+
+// Each reading or change is a raw sample, unless nothing changed
+static void expectRaw(uint32_t seconds, int room, uint16_t settings) {
+    std::vector<HistorySample>& raw = expected[HISTORY_RAW];
+    if (!raw.empty() && raw.back().room == room && raw.back().settings == settings) return;
+    HistorySample sample = { seconds, (int16_t) room, settings };
+    raw.push_back(sample);
+}
+
+// Feeds `seconds` of readings from `start`, keeping the model in step. The
+// room temperature is known from the first second.
+static void simulate(History& history, uint32_t start, uint32_t seconds, int* room, uint16_t* settings) {
+    int64_t sums[HISTORY_TIERS] = { 0, 0, 0 };
+    uint32_t counts[HISTORY_TIERS] = { 0, 0, 0 };
+    for (uint32_t t = start; t <= start + seconds; t++) {
+        unsigned long now = millisAt(t);
+        history.tick(now);
+        // Close the periods that end here, as History does on this tick
+        for (int tier = HISTORY_MINUTE; tier < HISTORY_TIERS; tier++) {
+            if (t % PERIODS[tier] != 0 || counts[tier] == 0) continue;
+            HistorySample sample = { t - PERIODS[tier], (int16_t) roundedMean(sums[tier], counts[tier]), *settings };
+            expected[tier].push_back(sample);
+            sums[tier] = 0;
+            counts[tier] = 0;
+        }
+        // The periods that end at the last second are closed, as a query
+        // then would
+        if (t == start + seconds) break;
+
+        if (t == start || rand() % 40 == 0) {
+            *room += rand() % 3 - 1;
+            history.room(*room, now);
+            expectRaw(t, *room, *settings);
+        }
+        if (rand() % 1200 == 0) {
+            *settings = randomSettings();
+            history.settings(*settings, now);
+            expectRaw(t, *room, *settings);
+        }
+        for (int tier = HISTORY_MINUTE; tier < HISTORY_TIERS; tier++) {
+            sums[tier] += *room;
+            counts[tier]++;
+        }
+    }
+}
+
+static bool sameSample(const HistorySample& a, const HistorySample& b) {
+    return a.seconds == b.seconds && a.room == b.room && a.settings == b.settings;
+}
+
+// Queries the tier between since and until seconds ago, and checks the batch
+// against the model's samples in that range that the ring still holds
+static bool check(History& history, HistoryTier tier, uint32_t since, uint32_t until, unsigned long now) {
+    HistoryRequest request = { tier, since, until };
+    size_t length = history.query(request, now, batch, sizeof(batch));
+    HistoryReader reader(batch, length);
+    if (!reader.valid() || reader.tier() != tier || reader.more()) {
+        printf("FAIL %s: batch of %zu bytes isn't valid and whole\n", History::tierName(tier), length);
+        return false;
+    }
+
+    uint32_t at = reader.now();
+    uint32_t from = since < at ? at - since : 0;
+    uint32_t to = until < at ? at - until : 0;
+    const HistoryRing& ring = history.ring(tier);
+    const std::vector<HistorySample>& model = expected[tier];
+    size_t i = model.size() - ring.count;
+    if (!sameSample(model[i], ring.oldest)) {
+        printf("FAIL %s: the ring's oldest sample, at %u, isn't the model's\n", History::tierName(tier), ring.oldest.seconds);
+        return false;
+    }
+    while (i < model.size() && model[i].seconds < from) i++;
+
+    HistorySample sample;
+    size_t count = 0;
+    while (reader.next(&sample)) {
+        if (i >= model.size() || model[i].seconds > to || !sameSample(model[i], sample)) {
+            printf("FAIL %s %u-%u: sample %zu is at %u, %d, %04x\n", History::tierName(tier), since, until, count,
+                   sample.seconds, sample.room, sample.settings);
+            return false;
+        }
+        i++;
+        count++;
+    }
+    if (i < model.size() && model[i].seconds <= to) {
+        printf("FAIL %s %u-%u: stopped after %zu samples\n", History::tierName(tier), since, until, count);
+        return false;
+    }
+    return true;
+}
+
+static bool checkAll(History& history, unsigned long now) {
+    for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+        if (!check(history, (HistoryTier) tier, UINT32_MAX, 0, now)) return false;
+        if (!check(history, (HistoryTier) tier, 6 * 3600, 3600, now)) return false;
+        if (!check(history, (HistoryTier) tier, 600, 0, now)) return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    uint32_t hours = argc > 1 ? atol(argv[1]) : 36;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    static History history;
+    int room = 215;
+    uint16_t settings = randomSettings();
+    history.settings(settings, millisAt(0));
+    simulate(history, 0, hours * 3600, &room, &settings);
+    uint32_t end = hours * 3600;
+    if (!checkAll(history, millisAt(end))) return 1;
+
+    printf("%-8s %8s %8s %12s %8s %10s %10s %10s\n", "tier", "samples", "bytes", "bytes/sample", "hours", "full ring",
+           "structs", "query ns");
+    for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+        const HistoryRing& ring = history.ring((HistoryTier) tier);
+        uint32_t used = ring.head - ring.tail + sizeof(HistorySample);
+        double span = (ring.newest.seconds - ring.oldest.seconds) / 3600.0;
+        // How far back a full ring reaches, and the same bytes of
+        // HistorySample structs would, at this tier's rate of samples
+        double interval = ring.count > 1 ? span / (ring.count - 1) : 0;
+        double fullSpan = interval * HISTORY_RING_SIZE * ring.count / used;
+        double structSpan = interval * (HISTORY_RING_SIZE / sizeof(HistorySample));
+
+        HistoryRequest request = { (HistoryTier) tier, UINT32_MAX, 0 };
+        const int rounds = 2000;
+        uint64_t start = benchNanos();
+        for (int n = 0; n < rounds; n++) {
+            size_t length = history.query(request, millisAt(end), batch, sizeof(batch));
+            HistoryReader reader(batch, length);
+            HistorySample sample;
+            while (reader.next(&sample)) benchKeep(sample);
+        }
+        double nanos = (double) (benchNanos() - start) / rounds;
+        printf("%-8s %8u %8u %12.2f %8.1f %9.1fh %9.1fh %10.0f\n", History::tierName((HistoryTier) tier), ring.count, used,
+               (double) used / ring.count, span, fullSpan, structSpan, nanos);
+    }
+
+    // The next boot: the state as it was saved, 90 seconds into it
+    static History restored;
+    memcpy(restored.state(), history.state(), sizeof(HistoryState));
+    unsigned long boot = 90000;
+    restored.restored(boot);
+    if (restored.seconds(boot) != end) {
+        printf("FAIL restored history is at %u, not %u\n", restored.seconds(boot), end);
+        return 1;
+    }
+    // History time carries on from `end`, and only counts from this boot
+    uint32_t more = 2 * 3600;
+    for (uint32_t t = 0; t < more; t++) {
+        unsigned long now = boot + (unsigned long) t * 1000;
+        restored.tick(now);
+        if (t % 30 == 0) restored.room(room + (t / 30) % 5, now);
+    }
+    HistoryRequest request = { HISTORY_RAW, UINT32_MAX, 0 };
+    HistoryReader reader(batch, restored.query(request, boot + (unsigned long) more * 1000, batch, sizeof(batch)));
+    HistorySample sample, last = { 0, 0, 0 };
+    bool earlier = false, later = false;
+    while (reader.next(&sample)) {
+        if (sample.seconds < last.seconds) {
+            printf("FAIL restored history goes back from %u to %u\n", last.seconds, sample.seconds);
+            return 1;
+        }
+        if (sample.seconds < reader.boot()) earlier = true;
+        else later = true;
+        last = sample;
+    }
+    if (reader.boot() != end || reader.now() != end + more || !earlier || !later) {
+        printf("FAIL restored history: boot %u, now %u\n", reader.boot(), reader.now());
+        return 1;
+    }
+    printf("restored: boot at %u, now %u, samples from both boots\n", reader.boot(), reader.now());
+    return 0;
+}
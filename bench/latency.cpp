@@ -0,0 +1,236 @@
+// End-to-end command latency benchmark for the native build.
+//
+// Boots the real firmware (src/main.cpp) against the host shims, then drives
+// MQTT command messages in and measures, on the firmware's own clock:
+//
+//   * mqttMessage() -> heatpump.update()
+//   * mqttMessage() -> state publish() confirming the command
+//   * settings change on the unit -> last state publish()
+//   * how many CN105 writes a burst of five commands, 300 ms apart, costs
+//   * a scene of mode, setpoint and fan, as three messages back to back and
+//     as one <prefix>/set: the CN105 writes it costs, and the time from the
+//     first message to the last write. More than one write means the unit
+//     went through a half-applied state.
+//
+// The native delay() advances the clock rather than sleeping, and the
+// HeatPump shim charges 2400 baud 8E1 byte times for every CN105 frame, so
+// the figures include the debounce, blocking delays and link time that a
+// real unit would see.
+//
+//   pio run -e bench_latency && .pio/build/bench_latency/program [iterations] [json]
+//
+// Passing "json" turns on the single JSON state topic.
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+
+#include "bench.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+#define BENCH_TIMEOUT_MS 60000
+
+// Each pass through loop() is charged this much on top of the firmware's own
+// work, standing in for the ESP8266 core's WiFi and system tasks. It also
+// keeps the benchmark from spinning in real time through idle periods.
+#define BENCH_LOOP_OVERHEAD_US 100
+
+static unsigned long statePublishes = 0;
+static unsigned long lastStatePublishMicros = 0;
+static unsigned long lastTemperaturePublishMicros = 0;
+static int lastTemperaturePublished = 0;
+
+static void observePublish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    (void) qos; (void) retain;
+    size_t topicLength = strlen(topic);
+    if (topicLength < 6 || strcmp(topic + topicLength - 6, "/state") != 0) return;
+    statePublishes++;
+    lastStatePublishMicros = micros();
+    char value[128];
+    if (length >= sizeof(value)) length = sizeof(value) - 1;
+    memcpy(value, payload, length);
+    value[length] = '\0';
+    if (strcmp(topic, BENCH_TOPIC_PREFIX "/temperature/state") == 0) {
+        lastTemperaturePublished = atoi(value);
+        lastTemperaturePublishMicros = lastStatePublishMicros;
+    } else if (strcmp(topic, BENCH_TOPIC_PREFIX "/state") == 0) {
+        const char* temperature = strstr(value, "\"temperature\":");
+        if (temperature != NULL) {
+            lastTemperaturePublished = atoi(temperature + 14);
+            lastTemperaturePublishMicros = lastStatePublishMicros;
+        }
+    }
+}
+
+static void benchLoop() {
+    loop();
+    delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+}
+
+static void writeConfig(bool jsonState) {
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\",");
+    configFile.printf("\"mqtt_json_state\":\"%d\"}", jsonState ? 1 : 0);
+    configFile.close();
+}
+
+// Runs loop() until the condition holds, returning false on timeout
+template <typename Condition>
+static bool loopUntil(Condition condition) {
+    unsigned long start = millis();
+    while (!condition()) {
+        if (millis() - start > BENCH_TIMEOUT_MS) return false;
+        benchLoop();
+    }
+    return true;
+}
+
+// Runs loop() until there have been no state publishes for the given time,
+// so that one measurement does not bleed into the next
+static void settle(unsigned long quietMs) {
+    unsigned long start = millis();
+    unsigned long seen = statePublishes;
+    while (millis() - start < quietMs) {
+        benchLoop();
+        if (statePublishes != seen) {
+            seen = statePublishes;
+            start = millis();
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    if (iterations < 1) iterations = 1;
+
+    writeConfig(argc > 2 && strcmp(argv[2], "json") == 0);
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    mqttClient.setPublishObserver(observePublish);
+    setup();
+
+    if (!loopUntil([]() { return statePublishes > 0; })) {
+        fprintf(stderr, "firmware never published its initial state\n");
+        return 1;
+    }
+    settle(10000);
+
+    LatencySamples toUpdate;
+    LatencySamples toConfirm;
+    LatencySamples changeToPublish;
+
+    static const char* temperatures[] = {"20", "24"};
+    for (int i = 0; i < iterations; i++) {
+        const char* temperature = temperatures[i % 2];
+        unsigned long updates = heatpump.updateCount;
+        unsigned long start = micros();
+        mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/temperature/set", temperature, strlen(temperature));
+        if (!loopUntil([&]() { return heatpump.updateCount != updates; })) {
+            fprintf(stderr, "command %d never reached heatpump.update()\n", i);
+            return 1;
+        }
+        toUpdate.add((heatpump.lastUpdateMicros - start) / 1000.0);
+
+        if (!loopUntil([&]() {
+                return lastTemperaturePublished == atoi(temperature) &&
+                       (long) (lastTemperaturePublishMicros - start) > 0;
+            })) {
+            fprintf(stderr, "command %d was never confirmed by a state publish\n", i);
+            return 1;
+        }
+        toConfirm.add((lastTemperaturePublishMicros - start) / 1000.0);
+        settle(3000);
+    }
+
+    // Bursts of slider-style commands, 300 ms apart
+    static const char* sliderTemperatures[] = {"21", "22", "23", "24", "25"};
+    unsigned long burstUpdates = 0;
+    int bursts = iterations / 5 > 0 ? iterations / 5 : 1;
+    for (int i = 0; i < bursts; i++) {
+        unsigned long updates = heatpump.updateCount;
+        for (int j = 0; j < 5; j++) {
+            const char* temperature = sliderTemperatures[(i % 2) ? 4 - j : j];
+            mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/temperature/set", temperature, strlen(temperature));
+            unsigned long sent = millis();
+            while (millis() - sent < 300) benchLoop();
+        }
+        settle(5000);
+        burstUpdates += heatpump.updateCount - updates;
+    }
+
+    // Scenes, alternating between two so that every field changes
+    static const char* const sceneTopics[] = {
+        BENCH_TOPIC_PREFIX "/mode/set", BENCH_TOPIC_PREFIX "/temperature/set", BENCH_TOPIC_PREFIX "/fan/set"
+    };
+    static const char* const sceneValues[2][3] = { { "COOL", "22", "2" }, { "HEAT", "24", "4" } };
+    static const char* const sceneBatches[2] = {
+        "{\"mode\":\"COOL\",\"temperature\":22,\"fan\":\"2\"}", "mode=HEAT,temperature=24,fan=4"
+    };
+    LatencySamples sceneSeparate;
+    LatencySamples sceneBatch;
+    unsigned long separateUpdates = 0;
+    unsigned long batchUpdates = 0;
+    for (int i = 0; i < iterations; i++) {
+        bool batch = i % 2 == 1;
+        int scene = (i / 2) % 2;
+        unsigned long updates = heatpump.updateCount;
+        unsigned long start = micros();
+        if (batch) {
+            mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/set", sceneBatches[scene], strlen(sceneBatches[scene]));
+        } else {
+            // A loop() pass between messages, as they'd arrive in separate
+            // TCP segments
+            for (int j = 0; j < 3; j++) {
+                mqttClient.injectMessage(sceneTopics[j], sceneValues[scene][j], strlen(sceneValues[scene][j]));
+                benchLoop();
+            }
+        }
+        if (!loopUntil([&]() { return heatpump.updateCount != updates; })) {
+            fprintf(stderr, "scene %d never reached heatpump.update()\n", i);
+            return 1;
+        }
+        settle(5000);
+        (batch ? sceneBatch : sceneSeparate).add((heatpump.lastUpdateMicros - start) / 1000.0);
+        (batch ? batchUpdates : separateUpdates) += heatpump.updateCount - updates;
+    }
+    int halfScenes = iterations / 2 > 0 ? iterations / 2 : 1;
+
+    unsigned long changePublishes = 0;
+    static const char* fans[] = {"1", "2"};
+    for (int i = 0; i < iterations; i++) {
+        heatpumpSettings changed = heatpump.getSettings();
+        changed.fan = fans[i % 2];
+        unsigned long publishes = statePublishes;
+        unsigned long start = micros();
+        heatpump.simulateRemoteChange(changed);
+        if (!loopUntil([&]() { return statePublishes != publishes; })) {
+            fprintf(stderr, "settings change %d was never published\n", i);
+            return 1;
+        }
+        // Every publish for one change happens within the same callback, so
+        // the last one has been made by the time loop() returns
+        changeToPublish.add((lastStatePublishMicros - start) / 1000.0);
+        settle(3000);
+        changePublishes += statePublishes - publishes;
+    }
+
+    LatencySamples::printHeader("ms, firmware clock");
+    toUpdate.print("mqttMessage -> heatpump.update");
+    toConfirm.print("mqttMessage -> confirming publish");
+    changeToPublish.print("settings change -> last publish");
+    sceneSeparate.print("scene, 3 topics -> last write");
+    sceneBatch.print("scene, <prefix>/set -> last write");
+    printf("\nstate publishes per settings change: %.2f\n", (double) changePublishes / iterations);
+    printf("CN105 writes per 5-command burst: %.2f\n", (double) burstUpdates / bursts);
+    printf("CN105 writes per scene: %.2f as 3 topics, %.2f as one <prefix>/set\n", (double) separateUpdates / halfScenes,
+           (double) batchUpdates / halfScenes);
+    return 0;
+}
@@ -0,0 +1,121 @@
+// CN105 link budget under an MQTT command storm, for the native build.
+//
+// Boots the real firmware (src/main.cpp) against the host shims, then fires
+// commands at it faster than the link can carry them, as a set of
+// automations all triggering at once would: a random power/mode/temperature/
+// fan/vane command every 100-1500 ms for a minute. Reports, on the
+// firmware's clock:
+//
+//   * CN105 writes and polls, and how many writes waited for a token
+//   * how long writes queued between being ready and going out
+//   * link utilisation over the storm and over the quiet minute after it
+//
+// and fails unless the unit ends up with the last value sent for every
+// setting, i.e. no command was lost.
+//
+//   pio run -e bench_link && .pio/build/bench_link/program [seconds] [seed]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+
+#include "bench.hpp"
+#include "unit_bridge.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+extern UnitBridge bridge;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+#define BENCH_LOOP_OVERHEAD_US 100
+
+static const char* const POWERS[] = { "ON", "OFF" };
+static const char* const MODES[] = { "HEAT", "DRY", "COOL", "FAN", "AUTO" };
+static const char* const TEMPERATURES[] = { "18", "20", "22", "24", "26" };
+static const char* const FANS[] = { "AUTO", "QUIET", "1", "2", "3", "4" };
+static const char* const VANES[] = { "AUTO", "1", "2", "3", "4", "5", "SWING" };
+
+static LatencySamples queueTimes;
+static unsigned long writesSeen = 0;
+
+static void benchLoop() {
+    loop();
+    delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+    if (bridge.link().stats().writes != writesSeen) {
+        writesSeen = bridge.link().stats().writes;
+        queueTimes.add(bridge.link().lastQueueMillis());
+    }
+}
+
+static void runFor(unsigned long ms) {
+    unsigned long start = millis();
+    while (millis() - start < ms) benchLoop();
+}
+
+int main(int argc, char** argv) {
+    unsigned long seconds = argc > 1 ? strtoul(argv[1], NULL, 10) : 60;
+    srandom(argc > 2 ? atoi(argv[2]) : 1);
+
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\"}");
+    configFile.close();
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    setup();
+    runFor(10000);
+
+    // The last value sent for each setting
+    const char* power = NULL;
+    const char* mode = NULL;
+    const char* temperature = NULL;
+    const char* fan = NULL;
+    const char* vane = NULL;
+    unsigned long commands = 0;
+
+    LinkStats before = bridge.link().stats();
+    bridge.link().utilisation(millis());
+    unsigned long end = millis() + seconds * 1000;
+    while ((long) (millis() - end) < 0) {
+        const char* topic;
+        const char* value;
+        switch (random() % 5) {
+            case 0: topic = BENCH_TOPIC_PREFIX "/power/set"; value = power = POWERS[random() % 2]; break;
+            case 1: topic = BENCH_TOPIC_PREFIX "/mode/set"; value = mode = MODES[random() % 5]; break;
+            case 2: topic = BENCH_TOPIC_PREFIX "/temperature/set"; value = temperature = TEMPERATURES[random() % 5]; break;
+            case 3: topic = BENCH_TOPIC_PREFIX "/fan/set"; value = fan = FANS[random() % 6]; break;
+            default: topic = BENCH_TOPIC_PREFIX "/vane/set"; value = vane = VANES[random() % 7]; break;
+        }
+        mqttClient.injectMessage(topic, value, strlen(value));
+        commands++;
+        runFor(100 + random() % 1400);
+    }
+    unsigned int stormUtilisation = bridge.link().utilisation(millis());
+    LinkStats storm = bridge.link().stats();
+
+    runFor(60000);
+    unsigned int quietUtilisation = bridge.link().utilisation(millis());
+
+    LatencySamples::printHeader("ms, firmware clock");
+    queueTimes.print("write ready -> on the wire");
+    printf("\n%lu commands in %lus: %lu CN105 writes, %lu throttled, %lu polls\n", commands, seconds,
+           storm.writes - before.writes, storm.throttled - before.throttled, storm.polls - before.polls);
+    printf("link utilisation: %u%% during the storm, %u%% in the minute after\n", stormUtilisation, quietUtilisation);
+
+    heatpumpSettings settings = heatpump.getSettings();
+    bool lost =
+        (power != NULL && strcmp(settings.power, power) != 0) ||
+        (mode != NULL && strcmp(settings.mode, mode) != 0) ||
+        (temperature != NULL && (int) settings.temperature != atoi(temperature)) ||
+        (fan != NULL && strcmp(settings.fan, fan) != 0) ||
+        (vane != NULL && strcmp(settings.vane, vane) != 0);
+    if (lost) {
+        fprintf(stderr, "the unit doesn't have the last value sent for every setting\n");
+        return 1;
+    }
+    return 0;
+}
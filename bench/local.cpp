@@ -0,0 +1,499 @@
+// The local API against MQTT, for the native build.
+//
+// Boots the real firmware (src/main.cpp) against the host shims, with the
+// ESPAsyncTCP shim standing in for the network: the bench is the peer of
+// every local connection, and acknowledges what the firmware sends after
+// each pass through loop(), as a client on the LAN would well within one.
+// It measures, on the firmware's own clock and side by side for a command
+// over MQTT and over a WebSocket:
+//
+//   * command -> heatpump.update()
+//   * command -> the state confirming it, as a publish or a WebSocket message
+//   * settings change on the unit -> last publish, or the message
+//   * room temperature change -> WebSocket message, and how many of the
+//     changes MQTT published. It holds back changes smaller than
+//     ROOM_TEMPERATURE_HYSTERESIS, and the WebSocket doesn't, but the shim
+//     reports whole degrees, so here the two should agree.
+//
+// The broker's own hops are left out, so the MQTT figures are the least a
+// round trip through it could take; a WebSocket client saves both. It then
+// checks that:
+//
+//   * GET /state and POST /set answer as documented, and nothing is answered
+//     without the token, or commanded by a page on another origin
+//   * with the broker down, WebSocket commands still reach the unit
+//   * a client that stops taking data gets the latest state in one message
+//     when it starts again, is dropped after LOCAL_API_STALL_MS if it
+//     doesn't, and holds up no other client meanwhile
+//   * a connection with every slot taken is refused
+//   * the handshake answers the RFC 6455 example key as the RFC does
+//
+// Exits 1 on the first check that fails.
+//
+// The env builds the local API in, on port 80, with a LOCAL_API_STALL_MS of a
+// minute, so that the slow client outlasts the unit's settings polls before
+// it is dropped.
+//
+//   pio run -e bench_local && .pio/build/bench_local/program [iterations]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <ESPAsyncTCP.h>
+#include <HeatPump.h>
+
+#include <string.h>
+
+#include <string>
+
+#include "bench.hpp"
+#include "local_api.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+extern AsyncServer localServer;
+extern LocalApi localApi;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_TOKEN "bench-token"
+#define BENCH_DETECT_PIN 4
+// Longer than the stall the env builds with
+#define BENCH_TIMEOUT_MS 120000
+// See bench/latency.cpp
+#define BENCH_LOOP_OVERHEAD_US 100
+#define BENCH_MAX_PEERS (LOCAL_API_MAX_CLIENTS + 1)
+// Longer than a header line the firmware keeps
+#define BENCH_LONG_ORIGIN "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa" \
+                          "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+// The RFC 6455 example
+#define BENCH_WEBSOCKET_KEY "dGhlIHNhbXBsZSBub25jZQ=="
+#define BENCH_WEBSOCKET_ACCEPT "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+// A connection, as its peer sees it
+struct Peer {
+    AsyncClient* client;
+    bool closed;
+    bool websocket;
+    // Received and not yet parsed, and the messages parsed from it
+    std::string pending;
+    std::vector<std::string> messages;
+    std::vector<unsigned long> messageMicros;
+};
+
+static Peer peers[BENCH_MAX_PEERS];
+
+static unsigned long statePublishes = 0;
+static unsigned long lastStatePublishMicros = 0;
+static unsigned long lastTemperaturePublishMicros = 0;
+static int lastTemperaturePublished = 0;
+static unsigned long roomPublishes = 0;
+
+static void observePublish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    (void) qos; (void) retain;
+    size_t topicLength = strlen(topic);
+    if (topicLength < 6 || strcmp(topic + topicLength - 6, "/state") != 0) return;
+    statePublishes++;
+    lastStatePublishMicros = micros();
+    char value[128];
+    if (length >= sizeof(value)) length = sizeof(value) - 1;
+    memcpy(value, payload, length);
+    value[length] = '\0';
+    if (strcmp(topic, BENCH_TOPIC_PREFIX "/temperature/state") == 0) {
+        lastTemperaturePublished = atoi(value);
+        lastTemperaturePublishMicros = lastStatePublishMicros;
+    } else if (strcmp(topic, BENCH_TOPIC_PREFIX "/current_temperature/state") == 0) {
+        roomPublishes++;
+    }
+}
+
+// Parses the firmware's frames, which are never masked or fragmented
+static void parseFrames(Peer& peer) {
+    while (peer.pending.size() >= 2) {
+        size_t length = (uint8_t) peer.pending[1] & 0x7f;
+        size_t header = 2;
+        if (length == 126) {
+            if (peer.pending.size() < 4) return;
+            length = ((uint8_t) peer.pending[2] << 8) | (uint8_t) peer.pending[3];
+            header = 4;
+        }
+        if (peer.pending.size() < header + length) return;
+        if (((uint8_t) peer.pending[0] & 0x0f) == 0x1) {
+            peer.messages.push_back(peer.pending.substr(header, length));
+            peer.messageMicros.push_back(micros());
+        }
+        peer.pending.erase(0, header + length);
+    }
+}
+
+// The network's part of a pass: delivers what was sent, acknowledges it,
+// and carries out closes
+static void pumpPeers() {
+    for (int i = 0; i < BENCH_MAX_PEERS; i++) {
+        Peer& peer = peers[i];
+        if (peer.client == NULL) continue;
+        peer.pending += peer.client->takeSent();
+        if (peer.websocket) parseFrames(peer);
+        peer.client->injectAck();
+        if (peer.client->poll()) {
+            peer.client = NULL;
+            peer.closed = true;
+        }
+    }
+}
+
+static void benchLoop() {
+    loop();
+    pumpPeers();
+    delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+}
+
+static void writeConfig() {
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\","
+                     "\"local_api_token\":\"" BENCH_TOKEN "\"}");
+    configFile.close();
+}
+
+// Runs loop() until the condition holds, returning false on timeout
+template <typename Condition>
+static bool loopUntil(Condition condition) {
+    unsigned long start = millis();
+    while (!condition()) {
+        if (millis() - start > BENCH_TIMEOUT_MS) return false;
+        benchLoop();
+    }
+    return true;
+}
+
+static void settle(unsigned long quietMs) {
+    unsigned long start = millis();
+    unsigned long seen = statePublishes;
+    while (millis() - start < quietMs) {
+        benchLoop();
+        if (statePublishes != seen) {
+            seen = statePublishes;
+            start = millis();
+        }
+    }
+}
+
+static Peer* connect(const char* request) {
+    for (int i = 0; i < BENCH_MAX_PEERS; i++) {
+        Peer& peer = peers[i];
+        if (peer.client != NULL) continue;
+        peer = Peer();
+        peer.client = localServer.injectConnect();
+        if (peer.client == NULL) return NULL;
+        peer.client->injectData(request, strlen(request));
+        return &peer;
+    }
+    return NULL;
+}
+
+// Opens a WebSocket, and waits for the handshake and the first state
+static Peer* openSocket() {
+    Peer* peer = connect("GET /ws?token=" BENCH_TOKEN " HTTP/1.1\r\nHost: bench\r\nOrigin: http://bench\r\n"
+                         "User-Agent: bench/1.0 (a header line long enough that it is "
+                         "skipped rather than kept, which the parser has to cope with)\r\nUpgrade: websocket\r\n"
+                         "Connection: keep-alive, Upgrade\r\nsec-websocket-key: " BENCH_WEBSOCKET_KEY "\r\n"
+                         "Sec-WebSocket-Version: 13\r\n\r\n");
+    if (peer == NULL) return NULL;
+    pumpPeers();
+    size_t end = peer->pending.find("\r\n\r\n");
+    if (peer->closed || end == std::string::npos || peer->pending.compare(0, 12, "HTTP/1.1 101") != 0 ||
+        peer->pending.find("Sec-WebSocket-Accept: " BENCH_WEBSOCKET_ACCEPT "\r\n") == std::string::npos) {
+        fprintf(stderr, "bad handshake: %s\n", peer->pending.c_str());
+        return NULL;
+    }
+    peer->pending.erase(0, end + 4);
+    peer->websocket = true;
+    parseFrames(*peer);
+    if (peer->messages.empty() || peer->messages[0].find("\"power\":") == std::string::npos ||
+        peer->messages[0].find("\"current_temperature\":") == std::string::npos) {
+        fprintf(stderr, "no whole state on connecting\n");
+        return NULL;
+    }
+    peer->messages.clear();
+    peer->messageMicros.clear();
+    return peer;
+}
+
+// A masked text frame, as a client sends
+static void sendText(Peer* peer, const char* text) {
+    static const uint8_t MASK[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t length = strlen(text);
+    std::string frame;
+    frame += (char) 0x81;
+    frame += (char) (0x80 | length);
+    frame.append((const char*) MASK, 4);
+    for (size_t i = 0; i < length; i++) frame += (char) (text[i] ^ MASK[i % 4]);
+    peer->client->injectData(frame.data(), frame.size());
+}
+
+// The first message since `since` that has `needle` in it
+static bool received(Peer* peer, const char* needle, unsigned long since, unsigned long* at) {
+    for (size_t i = 0; i < peer->messages.size(); i++) {
+        if ((long) (peer->messageMicros[i] - since) >= 0 && peer->messages[i].find(needle) != std::string::npos) {
+            if (at != NULL) *at = peer->messageMicros[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// An HTTP request, answered with `status` and a body that has `body` in it,
+// and nothing that would let a page on another origin read it
+static bool checkHttp(const char* request, const char* status, const char* body) {
+    Peer* peer = connect(request);
+    if (peer == NULL || !loopUntil([&]() { return peer->closed; })) return false;
+    if (peer->pending.compare(0, strlen(status), status) != 0 || peer->pending.find(body) == std::string::npos ||
+        peer->pending.find("Access-Control-") != std::string::npos) {
+        fprintf(stderr, "unexpected response: %s\n", peer->pending.c_str());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    if (iterations < 2) iterations = 2;
+
+    char accept[29];
+    LocalApi::acceptKey(BENCH_WEBSOCKET_KEY, accept);
+    if (strcmp(accept, BENCH_WEBSOCKET_ACCEPT) != 0) {
+        fprintf(stderr, "FAIL accept key %s\n", accept);
+        return 1;
+    }
+
+    writeConfig();
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    mqttClient.setPublishObserver(observePublish);
+    setup();
+    if (!loopUntil([]() { return statePublishes > 0; })) {
+        fprintf(stderr, "firmware never published its initial state\n");
+        return 1;
+    }
+    settle(10000);
+
+#define BENCH_AUTHORIZATION "Authorization: Bearer " BENCH_TOKEN "\r\n"
+    if (!checkHttp("GET /state HTTP/1.1\r\nHost: bench\r\n" BENCH_AUTHORIZATION "\r\n", "HTTP/1.1 200", "\"mode\":") ||
+        !checkHttp("POST /set HTTP/1.1\r\n" BENCH_AUTHORIZATION "Content-Length: 16\r\n\r\n{\"vane\":\"SWING\"}",
+                   "HTTP/1.1 200", "{\"result\":\"ok\"}") ||
+        !checkHttp("POST /set?token=" BENCH_TOKEN " HTTP/1.1\r\nContent-Length: 7\r\n\r\nfan=ten", "HTTP/1.1 400",
+                   "invalid") ||
+        !checkHttp("GET /nothing HTTP/1.1\r\n\r\n", "HTTP/1.1 404", "")) {
+        fprintf(stderr, "FAIL HTTP\n");
+        return 1;
+    }
+    // Turned away: no token, the wrong one, and pages elsewhere, including
+    // one whose Origin is too long to keep
+    if (!checkHttp("GET /state HTTP/1.1\r\nHost: bench\r\n\r\n", "HTTP/1.1 401", "") ||
+        !checkHttp("POST /set HTTP/1.1\r\nAuthorization: Bearer bench-tokem\r\nContent-Length: 16\r\n\r\n"
+                   "{\"vane\":\"SWING\"}", "HTTP/1.1 401", "") ||
+        !checkHttp("POST /set?token=" BENCH_TOKEN "x HTTP/1.1\r\nContent-Length: 16\r\n\r\n{\"vane\":\"SWING\"}",
+                   "HTTP/1.1 401", "") ||
+        !checkHttp("POST /set HTTP/1.1\r\nHost: bench\r\nOrigin: http://elsewhere.example\r\n" BENCH_AUTHORIZATION
+                   "Content-Length: 16\r\n\r\n{\"vane\":\"SWING\"}", "HTTP/1.1 403", "") ||
+        !checkHttp("GET /ws?token=" BENCH_TOKEN " HTTP/1.1\r\nOrigin: null\r\nHost: bench\r\nUpgrade: websocket\r\n"
+                   "Connection: Upgrade\r\nSec-WebSocket-Key: " BENCH_WEBSOCKET_KEY "\r\n\r\n", "HTTP/1.1 403", "") ||
+        !checkHttp("POST /set HTTP/1.1\r\nOrigin: http://bench.example/" BENCH_LONG_ORIGIN "\r\nHost: bench\r\n"
+                   BENCH_AUTHORIZATION "Content-Length: 16\r\n\r\n{\"vane\":\"SWING\"}", "HTTP/1.1 403", "") ||
+        localApi.stats().forbidden != 6) {
+        fprintf(stderr, "FAIL requests without the token, or from another origin\n");
+        return 1;
+    }
+    settle(3000);
+
+    Peer* socket = openSocket();
+    if (socket == NULL) return 1;
+
+    LatencySamples toUpdate[2];
+    LatencySamples toConfirm[2];
+    static const char* temperatures[] = { "20", "24" };
+    for (int i = 0; i < iterations; i++) {
+        // Two over MQTT, then two over the WebSocket, so that each command
+        // changes the setpoint
+        bool local = (i / 2) % 2 == 1;
+        const char* temperature = temperatures[i % 2];
+        char payload[32];
+        snprintf(payload, sizeof(payload), "{\"temperature\":%s}", temperature);
+        char confirmation[32];
+        snprintf(confirmation, sizeof(confirmation), "\"temperature\":%s", temperature);
+
+        unsigned long updates = heatpump.updateCount;
+        unsigned long start = micros();
+        if (local) {
+            sendText(socket, payload);
+        } else {
+            mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/temperature/set", temperature, strlen(temperature));
+        }
+        if (!loopUntil([&]() { return heatpump.updateCount != updates; })) {
+            fprintf(stderr, "command %d never reached heatpump.update()\n", i);
+            return 1;
+        }
+        toUpdate[local].add((heatpump.lastUpdateMicros - start) / 1000.0);
+
+        unsigned long confirmed = 0;
+        bool ok = local ? loopUntil([&]() { return received(socket, confirmation, start, &confirmed); })
+                        : loopUntil([&]() {
+                              return lastTemperaturePublished == atoi(temperature) &&
+                                     (long) (lastTemperaturePublishMicros - start) > 0;
+                          });
+        if (!ok) {
+            fprintf(stderr, "command %d was never confirmed\n", i);
+            return 1;
+        }
+        if (!local) confirmed = lastTemperaturePublishMicros;
+        toConfirm[local].add((confirmed - start) / 1000.0);
+        if (local && !received(socket, "{\"result\":\"ok\"}", start, NULL)) {
+            fprintf(stderr, "command %d wasn't answered\n", i);
+            return 1;
+        }
+        settle(3000);
+        socket->messages.clear();
+        socket->messageMicros.clear();
+    }
+
+    // Both see the same change, so one run measures both
+    LatencySamples changeToClient[2];
+    static const char* fans[] = { "1", "2" };
+    for (int i = 0; i < iterations; i++) {
+        heatpumpSettings changed = heatpump.getSettings();
+        changed.fan = fans[i % 2];
+        char field[16];
+        snprintf(field, sizeof(field), "\"fan\":\"%s\"", fans[i % 2]);
+        unsigned long publishes = statePublishes;
+        unsigned long start = micros();
+        unsigned long seen = 0;
+        heatpump.simulateRemoteChange(changed);
+        if (!loopUntil([&]() { return statePublishes != publishes && received(socket, field, start, &seen); })) {
+            fprintf(stderr, "settings change %d never reached both\n", i);
+            return 1;
+        }
+        changeToClient[0].add((lastStatePublishMicros - start) / 1000.0);
+        changeToClient[1].add((seen - start) / 1000.0);
+        settle(3000);
+        socket->messages.clear();
+        socket->messageMicros.clear();
+    }
+
+    // The room warms and cools by a degree at a time
+    LatencySamples roomToClient;
+    unsigned long published = roomPublishes;
+    for (int i = 0; i < iterations; i++) {
+        char field[40];
+        int room = 21 + i % 2;
+        snprintf(field, sizeof(field), "\"current_temperature\":%d", room);
+        unsigned long start = micros();
+        unsigned long seen = 0;
+        heatpump.simulateRoomTemperature(room);
+        if (!loopUntil([&]() { return received(socket, field, start, &seen); })) {
+            fprintf(stderr, "room temperature change %d never reached the WebSocket\n", i);
+            return 1;
+        }
+        roomToClient.add((seen - start) / 1000.0);
+        socket->messages.clear();
+        socket->messageMicros.clear();
+    }
+    settle(ROOM_TEMPERATURE_MIN_INTERVAL_MS * 2);
+    published = roomPublishes - published;
+
+    LatencySamples::printHeader("ms, firmware clock");
+    toUpdate[0].print("MQTT command -> heatpump.update");
+    toUpdate[1].print("WebSocket command -> heatpump.update");
+    toConfirm[0].print("MQTT command -> confirming publish");
+    toConfirm[1].print("WebSocket command -> confirmation");
+    changeToClient[0].print("settings change -> last publish");
+    changeToClient[1].print("settings change -> WebSocket");
+    roomToClient.print("room change -> WebSocket");
+    printf("\nroom changes: %d, on the WebSocket: %d, published over MQTT: %lu\n", iterations, iterations, published);
+
+    // The broker goes away
+    mqttClient.setBrokerAvailable(false);
+    settle(2000);
+    {
+        unsigned long updates = heatpump.updateCount;
+        unsigned long start = micros();
+        sendText(socket, "power=ON,mode=DRY,temperature=25");
+        if (!loopUntil([&]() { return heatpump.updateCount != updates; })) {
+            fprintf(stderr, "FAIL command with the broker down never reached heatpump.update()\n");
+            return 1;
+        }
+        if (!loopUntil([&]() { return received(socket, "\"mode\":\"DRY\"", start, NULL); }) || mqttClient.connected()) {
+            fprintf(stderr, "FAIL command with the broker down\n");
+            return 1;
+        }
+        printf("broker down: WebSocket command applied in %.1f ms\n", (heatpump.lastUpdateMicros - start) / 1000.0);
+    }
+    mqttClient.setBrokerAvailable(true);
+    settle(3000);
+
+    // A second client that stops taking data
+    Peer* slow = openSocket();
+    if (slow == NULL) return 1;
+    socket->messages.clear();
+    socket->messageMicros.clear();
+    slow->client->setWindow(0);
+    unsigned long mergedBefore = localApi.stats().merged;
+    static const char* vanes[] = { "1", "2", "3", "4", "5" };
+    unsigned long start = micros();
+    for (int i = 0; i < 5; i++) {
+        heatpumpSettings changed = heatpump.getSettings();
+        changed.vane = vanes[i];
+        heatpump.simulateRemoteChange(changed);
+        char field[16];
+        snprintf(field, sizeof(field), "\"vane\":\"%s\"", vanes[i]);
+        if (!loopUntil([&]() { return received(socket, field, start, NULL); })) {
+            fprintf(stderr, "FAIL the other client missed vane %s\n", vanes[i]);
+            return 1;
+        }
+    }
+    if (!slow->messages.empty()) {
+        fprintf(stderr, "FAIL the slow client was sent data without room\n");
+        return 1;
+    }
+    slow->client->setWindow(ASYNC_NATIVE_WINDOW);
+    if (!loopUntil([&]() { return !slow->messages.empty(); }) || slow->messages.size() != 1 ||
+        slow->messages[0].find("\"vane\":\"5\"") == std::string::npos) {
+        fprintf(stderr, "FAIL the slow client didn't get one merged update\n");
+        return 1;
+    }
+    printf("slow client: 5 changes as 1 message, %s (%lu merged)\n", slow->messages[0].c_str(),
+           localApi.stats().merged - mergedBefore);
+
+    slow->client->setWindow(0);
+    heatpumpSettings changed = heatpump.getSettings();
+    changed.vane = "SWING";
+    heatpump.simulateRemoteChange(changed);
+    unsigned long stalled = millis();
+    if (!loopUntil([&]() { return slow->closed; })) {
+        fprintf(stderr, "FAIL the slow client was never dropped\n");
+        return 1;
+    }
+    unsigned long dropped = millis() - stalled;
+    if (dropped < LOCAL_API_STALL_MS) {
+        fprintf(stderr, "FAIL the slow client was dropped after %lu ms\n", dropped);
+        return 1;
+    }
+    start = micros();
+    sendText(socket, "{\"fan\":\"QUIET\"}");
+    if (!loopUntil([&]() { return received(socket, "\"fan\":\"QUIET\"", start, NULL); }) || socket->closed ||
+        localApi.clients() != 1) {
+        fprintf(stderr, "FAIL the other client was held up\n");
+        return 1;
+    }
+    printf("slow client dropped %lu ms after it stalled; %d client left\n", dropped, localApi.clients());
+
+    // One more than there are slots
+    while (localApi.clients() < LOCAL_API_MAX_CLIENTS) {
+        if (openSocket() == NULL) return 1;
+    }
+    if (!checkHttp("GET /state HTTP/1.1\r\n\r\n", "HTTP/1.1 503", "")) {
+        fprintf(stderr, "FAIL a connection with every slot taken\n");
+        return 1;
+    }
+    printf("%d clients, and the next refused (%lu refused)\n", localApi.clients(), localApi.stats().refused);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// The UART log sink against the TX FIFO, for the native build.
+//
+// Logs a short record, then records longer than the 128-byte FIFO up to
+// LOG_MAX_MESSAGE, then a run of short ones, and calls logDrain() every
+// millisecond, as the log task does, with the shim's FIFO emptying at
+// 115200 baud. The UART writes to a file, which must come out as every
+// record in order, each followed by CRLF, with none dropped and no write
+// that would have blocked on a unit. Then the same after logFlush().
+//
+// Exits 1 on the first check that fails.
+//
+//   pio run -e bench_log && .pio/build/bench_log/program
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "bench.hpp"
+#include "log.hpp"
+
+#define BENCH_BAUD 115200
+#define BENCH_SHORT_RECORDS 40
+#define BENCH_MAX_PASSES 10000
+
+static char path[] = "/tmp/bench_log_XXXXXX";
+static std::string expected;
+
+static void fail(const char* what) {
+    printf("FAIL: %s\n", what);
+    unlink(path);
+    exit(1);
+}
+
+static void logRecord(const std::string& text) {
+    logWrite(LOG_INFO, text.c_str());
+    expected += text + "\r\n";
+}
+
+static void logRecords() {
+    logRecord("short one");
+    logRecord(std::string(150, 'a'));
+    logRecord(std::string(LOG_MAX_MESSAGE, 'b'));
+    for (int i = 0; i < BENCH_SHORT_RECORDS; i++) {
+        char text[32];
+        snprintf(text, sizeof(text), "short record %d", i);
+        logRecord(text);
+    }
+}
+
+static std::string written() {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) fail("can't read back what the UART wrote");
+    std::string text;
+    char buffer[512];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, n);
+    fclose(file);
+    return text;
+}
+
+int main() {
+    int fd = mkstemp(path);
+    if (fd < 0) fail("can't create a file for the UART");
+    close(fd);
+    if (!Serial1.open(path)) fail("can't open the file for the UART");
+    Serial1.begin(BENCH_BAUD);
+    logSetSerial(&Serial1);
+
+    logRecords();
+    unsigned long start = millis();
+    int passes = 0;
+    while (written().size() < expected.size() && passes < BENCH_MAX_PASSES) {
+        logDrain(millis());
+        delay(1);
+        passes++;
+    }
+    unsigned long elapsed = millis() - start;
+
+    printf("%d records, %zu bytes at %d baud\n", BENCH_SHORT_RECORDS + 3, expected.size(), BENCH_BAUD);
+    printf("logDrain(): %d passes, %lu ms, %lu writes that would have blocked, %lu dropped\n",
+           passes, elapsed, Serial1.txBlocked(), logStats().uartDropped);
+    if (written() != expected) fail("the UART didn't write every record in order");
+    if (Serial1.txBlocked() != 0) fail("logDrain() wrote more than the FIFO had room for");
+    if (logStats().uartDropped != 0) fail("records dropped");
+
+    // The last byte goes into the FIFO before the ones ahead of it are all
+    // out, so no drain should take longer than the bytes do at the baud rate
+    unsigned long ideal = expected.size() * 10 * 1000 / BENCH_BAUD + 1;
+    printf("%lu ms at the baud rate\n", ideal);
+    if (elapsed > ideal * 2) fail("logDrain() kept the UART waiting");
+
+    size_t drained = expected.size();
+    logRecords();
+    logFlush();
+    printf("logFlush(): %zu bytes\n", expected.size() - drained);
+    if (written() != expected) fail("logFlush() didn't write every record in order");
+
+    unlink(path);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,250 @@
+// Duty-cycled power save, for the native build.
+//
+// Boots the real firmware (src/main.cpp) against the host shims once for
+// each policy, each in a child process, and runs it with commands arriving
+// over MQTT at random times. They are delivered as the SDK would deliver
+// them, from inside whatever delay() or esp_delay() loop() is in. As in core
+// 3.x, esp_schedule() has the shim's esp_delay() ask its `blocked` again and
+// doesn't end a delay(). For each policy it reports, on the firmware's own
+// clock:
+//
+//   * the share of the time loop() was awake, and how many passes it made
+//   * how late sleeps ended, as the firmware measures it for wake_late_us
+//   * mqttMessage() -> heatpump.update(), which sleeping mustn't lengthen
+//   * CN105 polls, which must keep to the same schedule
+//   * task misses, which sleeping mustn't add to
+//
+// The policies:
+//
+//   off    loop() spins, as it always has
+//   modem  loop() sleeps until its next deadline
+//   light  as modem, and every delay() and esp_delay() costs
+//          BENCH_LIGHT_WAKE_US more, an assumed figure for the CPU
+//          waking from light sleep. On a unit, wake_late_us measures the
+//          real one.
+//
+// What the radio saves isn't modelled. With the modem asleep, which is the
+// SDK's default for a station whatever loop() does, inbound frames wait for
+// the next DTIM beacon, ~100 ms on most access points; that comes on top of
+// these figures for every policy alike.
+//
+// Exits 1 on the first check that fails.
+//
+//   pio run -e bench_power && .pio/build/bench_power/program [minutes]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "power_save.hpp"
+#include "scheduler.hpp"
+#include "unit_bridge.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+extern PowerSave powerSave;
+extern Scheduler scheduler;
+extern UnitBridge bridge;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+// See bench/latency.cpp
+#define BENCH_LOOP_OVERHEAD_US 100
+#define BENCH_LIGHT_WAKE_US 3000
+#define BENCH_WARMUP_MS 10000
+// Commands arrive this far apart, at random; each has been written long
+// before the next
+#define BENCH_COMMAND_MIN_MS 3000
+#define BENCH_COMMAND_MAX_MS 20000
+#define BENCH_COMMAND_TIMEOUT_MS 10000
+
+typedef struct {
+    double awakePercent;
+    double passesPerSecond;
+    unsigned long sleeps;
+    unsigned long woken;
+    unsigned long maxLateMicros;
+    unsigned long polls;
+    unsigned long taskMisses;
+    unsigned long commands;
+    unsigned long missed;
+    double p50;
+    double p95;
+    double max;
+} PolicyResult;
+
+static const char* const POLICY_NAMES[] = { "off", "modem", "light" };
+
+static uint32_t seed = 1;
+static unsigned long commandsUntil = 0;
+static unsigned long commands = 0;
+static bool outstanding = false;
+static int commandedTemperature = 0;
+static unsigned long deliveredAt = 0;
+static unsigned long updatesAtDelivery = 0;
+static unsigned long missed = 0;
+
+static unsigned long nextGapMicros() {
+    seed = seed * 1103515245 + 12345;
+    return (BENCH_COMMAND_MIN_MS + (seed >> 8) % (BENCH_COMMAND_MAX_MS - BENCH_COMMAND_MIN_MS)) * 1000UL;
+}
+
+// A setpoint command, as the SDK hands the client a message
+static void deliverCommand(void* arg) {
+    (void) arg;
+    if (outstanding) missed++;
+    char payload[8];
+    commandedTemperature = 18 + commands % 8;
+    snprintf(payload, sizeof(payload), "%d", commandedTemperature);
+    outstanding = true;
+    deliveredAt = micros();
+    updatesAtDelivery = heatpump.updateCount;
+    commands++;
+    mqttClient.injectMessage(BENCH_TOPIC_PREFIX "/temperature/set", payload, strlen(payload));
+    unsigned long next = micros() + nextGapMicros();
+    if ((long) (commandsUntil - next) > 0) nativeAt(next, deliverCommand, NULL);
+}
+
+static unsigned long taskMisses() {
+    unsigned long misses = 0;
+    for (int i = 0; i < scheduler.taskCount(); i++) misses += scheduler.task(i).misses;
+    return misses;
+}
+
+// The child: boots with the policy, and runs until the commands are done
+static PolicyResult run(PowerSavePolicy policy, unsigned long minutes) {
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\"}");
+    configFile.close();
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    powerSave.setPolicy(policy);
+    if (policy == POWER_SAVE_LIGHT) nativeSetWakeMicros(BENCH_LIGHT_WAKE_US);
+    setup();
+
+    unsigned long start = millis();
+    while (millis() - start < BENCH_WARMUP_MS) {
+        loop();
+        delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+    }
+
+    PowerSaveStats before = powerSave.stats();
+    unsigned long polls = bridge.link().stats().polls;
+    unsigned long misses = taskMisses();
+    unsigned long startMicros = micros();
+    unsigned long length = minutes * 60000000UL;
+    commandsUntil = startMicros + length;
+    nativeAt(startMicros + nextGapMicros(), deliverCommand, NULL);
+
+    LatencySamples toUpdate;
+    unsigned long passes = 0;
+    while (micros() - startMicros < length) {
+        loop();
+        delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+        passes++;
+        if (!outstanding) continue;
+        // The write that carried the command, not one already under way
+        // when it arrived
+        if (heatpump.updateCount != updatesAtDelivery && heatpump.getSettings().temperature == commandedTemperature) {
+            toUpdate.add((heatpump.lastUpdateMicros - deliveredAt) / 1000.0);
+            outstanding = false;
+        } else if (micros() - deliveredAt > BENCH_COMMAND_TIMEOUT_MS * 1000UL) {
+            missed++;
+            outstanding = false;
+        }
+    }
+
+    const PowerSaveStats& stats = powerSave.stats();
+    double seconds = (micros() - startMicros) / 1e6;
+    PolicyResult result;
+    result.awakePercent = 100.0 - (double) (stats.sleptMicros - before.sleptMicros) / (seconds * 1e4);
+    result.passesPerSecond = passes / seconds;
+    result.sleeps = stats.sleeps - before.sleeps;
+    result.woken = stats.woken - before.woken;
+    result.maxLateMicros = stats.maxLateMicros;
+    result.polls = bridge.link().stats().polls - polls;
+    result.taskMisses = taskMisses() - misses;
+    result.commands = commands;
+    result.missed = missed;
+    result.p50 = toUpdate.percentile(50);
+    result.p95 = toUpdate.percentile(95);
+    result.max = toUpdate.percentile(100);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    unsigned long minutes = argc > 1 ? atol(argv[1]) : 10;
+    PolicyResult results[3];
+
+    for (int policy = POWER_SAVE_OFF; policy <= POWER_SAVE_LIGHT; policy++) {
+        int fds[2];
+        if (pipe(fds) != 0) return 1;
+        pid_t child = fork();
+        if (child == 0) {
+            close(fds[0]);
+            PolicyResult result = run((PowerSavePolicy) policy, minutes);
+            _exit(write(fds[1], &result, sizeof(result)) == (ssize_t) sizeof(result) ? 0 : 2);
+        }
+        close(fds[1]);
+        ssize_t got = read(fds[0], &results[policy], sizeof(PolicyResult));
+        close(fds[0]);
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (got != (ssize_t) sizeof(PolicyResult) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "FAIL the %s run didn't finish\n", POLICY_NAMES[policy]);
+            return 1;
+        }
+    }
+
+    printf("%-6s %7s %9s %8s %7s %9s %6s %6s %9s %9s %9s\n", "", "awake", "passes/s", "sleeps", "woken", "late max",
+           "polls", "misses", "p50 ms", "p95 ms", "max ms");
+    for (int policy = POWER_SAVE_OFF; policy <= POWER_SAVE_LIGHT; policy++) {
+        const PolicyResult& r = results[policy];
+        printf("%-6s %6.1f%% %9.1f %8lu %7lu %7lu us %6lu %6lu %9.1f %9.1f %9.1f\n", POLICY_NAMES[policy],
+               r.awakePercent, r.passesPerSecond, r.sleeps, r.woken, r.maxLateMicros, r.polls, r.taskMisses, r.p50,
+               r.p95, r.max);
+    }
+    printf("\n%lu commands in %lu min; mqttMessage -> heatpump.update()\n", results[0].commands, minutes);
+
+    const PolicyResult& off = results[POWER_SAVE_OFF];
+    for (int policy = POWER_SAVE_OFF; policy <= POWER_SAVE_LIGHT; policy++) {
+        const PolicyResult& r = results[policy];
+        if (r.missed > 0) {
+            fprintf(stderr, "FAIL %lu commands didn't reach heatpump.update() under %s\n", r.missed, POLICY_NAMES[policy]);
+            return 1;
+        }
+        if (r.commands != off.commands) {
+            fprintf(stderr, "FAIL the %s run had a different number of commands\n", POLICY_NAMES[policy]);
+            return 1;
+        }
+        // The CN105 poll schedule is a deadline like any other
+        if (r.polls + r.polls / 20 < off.polls || off.polls + off.polls / 20 < r.polls) {
+            fprintf(stderr, "FAIL %lu CN105 polls under %s, %lu spinning\n", r.polls, POLICY_NAMES[policy], off.polls);
+            return 1;
+        }
+        // A sleep is no later for a task than the pass it stands in for
+        if (r.taskMisses > off.taskMisses) {
+            fprintf(stderr, "FAIL %lu task misses under %s, %lu spinning\n", r.taskMisses, POLICY_NAMES[policy],
+                    off.taskMisses);
+            return 1;
+        }
+        if (policy != POWER_SAVE_OFF && r.awakePercent >= off.awakePercent / 2) {
+            fprintf(stderr, "FAIL loop() was awake %.1f%% of the time under %s\n", r.awakePercent, POLICY_NAMES[policy]);
+            return 1;
+        }
+    }
+    // A command wakes a sleeping loop(), so it goes out as soon as spinning
+    // would have sent it, bar the wake up
+    if (results[POWER_SAVE_MODEM].p95 > off.p95 + 5) {
+        fprintf(stderr, "FAIL commands took longer to reach the unit under modem sleep\n");
+        return 1;
+    }
+    return 0;
+}
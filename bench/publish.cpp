@@ -0,0 +1,285 @@
+// The outbound publish queue, for the native build.
+//
+// First checks PublishQueue on its own: what it drops when full, a retained
+// publish replacing the one queued for its topic, and the order it drains
+// in. Then boots the real firmware (src/main.cpp) against the host shims,
+// and plays the broker: it keeps the last retained value published to each topic, as a
+// broker would. Then:
+//
+//   * a slow link: the MQTT client gets a TCP send buffer of
+//     BENCH_SEND_BUFFER bytes that empties at BENCH_SEND_RATE bytes/s, and
+//     the unit's settings are changed on the unit every BENCH_CHANGE_MS
+//     while the status goes out every minute
+//   * an outage: the broker goes away for BENCH_OUTAGE_MS, and the settings
+//     are changed three times meanwhile
+//
+// After each, it checks that the broker's retained state is the unit's
+// settings, and reports how many publishes couldn't go out when they were
+// made -- each one a publish that was lost before the queue -- and what
+// became of them: sent late, replaced by a later value for the same
+// retained topic, or dropped, and how long they waited. "attempts" counts
+// the client refusing them, as the queue retries. After the outage it also checks that
+// what waited went out state first, then availability, then the rest.
+//
+// Exits 1 on the first check that fails.
+//
+//   pio run -e bench_publish && .pio/build/bench_publish/program [minutes]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "metrics.hpp"
+#include "publish_queue.hpp"
+#include "temperature.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+extern PublishQueue publishQueue;
+extern Metrics metrics;
+extern int metricMqttQueueMillis;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+// See bench/latency.cpp
+#define BENCH_LOOP_OVERHEAD_US 100
+// Two 536-byte segments, as the core's default lower-memory lwIP build has,
+// emptying as a poor WiFi link would
+#define BENCH_SEND_BUFFER 1072
+#define BENCH_SEND_RATE 400
+#define BENCH_CHANGE_MS 7000
+#define BENCH_OUTAGE_MS 30000
+// Long enough for what is queued to go out, and the unit to be polled
+#define BENCH_SETTLE_MS 15000
+#define BENCH_RECONNECT_MS 120000
+
+static const char* const FANS[] = { "AUTO", "QUIET", "1", "2", "3", "4" };
+static const char* const VANES[] = { "AUTO", "1", "2", "3", "4", "5", "SWING" };
+static const char* const MODES[] = { "HEAT", "COOL", "DRY", "FAN" };
+
+static const char* const STATE_FIELDS[] = { "power/state", "mode/state", "temperature/state", "fan/state",
+                                            "vane/state" };
+
+// Refuses everything until `accepting`, then keeps the order of what it sent
+class ListHost : public PublishQueueHost {
+    public:
+        ListHost() : accepting(false) {}
+
+        uint16_t send(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) override {
+            (void) qos; (void) retain; (void) payload; (void) length;
+            if (!accepting) return 0;
+            order.push_back(topic);
+            return 1;
+        }
+
+        bool accepting;
+        std::vector<StateTopic> order;
+};
+
+static bool checkPolicy() {
+    static ListHost host;
+    static PublishQueue queue(&host);
+    static char payload[PUBLISH_QUEUE_BYTES];
+    memset(payload, 'x', sizeof(payload));
+    const size_t info = 200;
+
+    // Info to more than fill the pool: the oldest go
+    for (int i = 0; i < PUBLISH_QUEUE_ENTRIES; i++) queue.publish(PUBLISH_INFO, TOPIC_INFO, 0, false, payload, info, i);
+    int fitting = PUBLISH_QUEUE_BYTES / info;
+    if (queue.count() != fitting || queue.stats().dropped != (unsigned long) (PUBLISH_QUEUE_ENTRIES - fitting)) {
+        fprintf(stderr, "FAIL %d info publishes queued, %lu dropped\n", queue.count(), queue.stats().dropped);
+        return false;
+    }
+    // A later retained value replaces the earlier
+    queue.publish(PUBLISH_STATE, TOPIC_POWER_STATE, 0, true, "OFF", 3, 100);
+    queue.publish(PUBLISH_STATE, TOPIC_POWER_STATE, 0, true, "ON", 2, 101);
+    if (queue.stats().replaced != 1 || queue.count() != fitting + 1) {
+        fprintf(stderr, "FAIL a retained publish didn't replace the one queued\n");
+        return false;
+    }
+    // State that needs all the pool the power state leaves pushes out the info
+    size_t big = PUBLISH_QUEUE_BYTES - 2;
+    queue.publish(PUBLISH_STATE, TOPIC_CONFIRMATION, 0, true, payload, big, 102);
+    if (queue.count() != 2 || queue.bytes() != PUBLISH_QUEUE_BYTES) {
+        fprintf(stderr, "FAIL %d publishes and %zu bytes queued, not the two state ones\n", queue.count(),
+                queue.bytes());
+        return false;
+    }
+    // Info can't push out state, so it goes itself
+    unsigned long dropped = queue.stats().dropped;
+    queue.publish(PUBLISH_INFO, TOPIC_METRICS, 0, false, payload, info, 103);
+    queue.publish(PUBLISH_AVAILABILITY, TOPIC_AVAILABILITY, 0, true, "online", 6, 104);
+    if (queue.count() != 2 || queue.stats().dropped != dropped + 2) {
+        fprintf(stderr, "FAIL publishes less important than all queued weren't dropped\n");
+        return false;
+    }
+    // Oldest first within a class
+    host.accepting = true;
+    queue.publish(PUBLISH_AVAILABILITY, TOPIC_AVAILABILITY, 0, true, "online", 6, 105);
+    if (host.order.size() != 3 || host.order[0] != TOPIC_POWER_STATE || host.order[1] != TOPIC_CONFIRMATION ||
+        host.order[2] != TOPIC_AVAILABILITY || !queue.empty()) {
+        fprintf(stderr, "FAIL the queue drained out of order\n");
+        return false;
+    }
+    printf("policy: %lu queued, %lu replaced, %lu dropped, as expected\n\n", queue.stats().queued,
+           queue.stats().replaced, queue.stats().dropped);
+    return true;
+}
+
+static std::map<std::string, std::string> retained;
+// Publishes in the order the broker got them, while `recording`
+static bool recording = false;
+static std::vector<std::pair<std::string, bool> > received;
+static unsigned long changes = 0;
+
+// The topic without "<prefix>/"
+static std::string suffix(const char* topic) {
+    const char* slash = strchr(topic, '/');
+    return slash != NULL ? std::string(slash + 1) : std::string(topic);
+}
+
+static void observePublish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    (void) qos;
+    if (retain) retained[suffix(topic)] = std::string(payload, length);
+    if (recording) received.push_back(std::make_pair(suffix(topic), retain));
+}
+
+static void runFor(unsigned long ms) {
+    unsigned long start = millis();
+    while (millis() - start < ms) {
+        loop();
+        delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+    }
+}
+
+static void changeOnUnit() {
+    heatpumpSettings settings = heatpump.getSettings();
+    settings.power = "ON";
+    settings.mode = MODES[changes % 4];
+    settings.temperature = 18 + changes % 8;
+    settings.fan = FANS[changes % 6];
+    settings.vane = VANES[changes % 7];
+    heatpump.simulateRemoteChange(settings);
+    changes++;
+}
+
+// Whether the broker's retained state is the unit's settings
+static bool brokerCurrent() {
+    heatpumpSettings settings = heatpump.getSettings();
+    char temperature[TEMPERATURE_MAX_FORMATTED];
+    formatTemperature(temperature, temperatureFromFloat(settings.temperature));
+    const char* expected[] = { settings.power, strcmp(settings.power, "ON") == 0 ? settings.mode : "OFF",
+                               temperature, settings.fan, settings.vane };
+    bool current = true;
+    for (int i = 0; i < 5; i++) {
+        const std::string& value = retained[STATE_FIELDS[i]];
+        if (value != expected[i]) {
+            fprintf(stderr, "%s is \"%s\" at the broker, \"%s\" on the unit\n", STATE_FIELDS[i], value.c_str(),
+                    expected[i]);
+            current = false;
+        }
+    }
+    return current;
+}
+
+// The phase's figures; the longest wait and the peak are since boot
+static void report(const char* phase, unsigned long refusedBefore, const PublishQueueStats& before,
+                   uint32_t sentBefore) {
+    const PublishQueueStats& stats = publishQueue.stats();
+    const Histogram& waited = metrics.histogram(metricMqttQueueMillis);
+    printf("%-8s %8lu %8lu %8lu %8lu %10lu %8zu %8lu\n", phase, stats.queued - before.queued,
+           stats.replaced - before.replaced, stats.dropped - before.dropped,
+           (unsigned long) (waited.count - sentBefore), (unsigned long) waited.max, stats.peakBytes,
+           mqttClient.publishRefused - refusedBefore);
+}
+
+int main(int argc, char** argv) {
+    unsigned long minutes = argc > 1 ? atol(argv[1]) : 5;
+    if (!checkPolicy()) return 1;
+
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\"}");
+    configFile.close();
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    mqttClient.setPublishObserver(observePublish);
+    setup();
+    runFor(5000);
+
+    printf("%-8s %8s %8s %8s %8s %10s %8s %8s\n", "", "queued", "replaced", "dropped", "sent", "max wait", "peak",
+           "attempts");
+
+    // A slow link
+    mqttClient.setSendBuffer(BENCH_SEND_BUFFER, BENCH_SEND_RATE);
+    unsigned long refused = mqttClient.publishRefused;
+    PublishQueueStats before = publishQueue.stats();
+    uint32_t sent = metrics.histogram(metricMqttQueueMillis).count;
+    unsigned long start = millis();
+    while (millis() - start < minutes * 60000) {
+        changeOnUnit();
+        runFor(BENCH_CHANGE_MS);
+    }
+    runFor(BENCH_SETTLE_MS);
+    report("slow", refused, before, sent);
+    if (!brokerCurrent()) {
+        fprintf(stderr, "FAIL the broker's state is stale after the slow link\n");
+        return 1;
+    }
+
+    // An outage
+    mqttClient.setSendBuffer(0, 0);
+    refused = mqttClient.publishRefused;
+    before = publishQueue.stats();
+    sent = metrics.histogram(metricMqttQueueMillis).count;
+    mqttClient.setBrokerAvailable(false);
+    for (int i = 0; i < 3; i++) {
+        changeOnUnit();
+        runFor(BENCH_OUTAGE_MS / 3);
+    }
+    recording = true;
+    mqttClient.setBrokerAvailable(true);
+    // However long the reconnect backoff has grown
+    start = millis();
+    while (!mqttClient.connected() && millis() - start < BENCH_RECONNECT_MS) runFor(100);
+    runFor(BENCH_SETTLE_MS);
+    recording = false;
+    report("outage", refused, before, sent);
+    if (!brokerCurrent()) {
+        fprintf(stderr, "FAIL the broker's state is stale after the outage\n");
+        return 1;
+    }
+
+    // State, then availability, then the rest
+    size_t availability = received.size();
+    size_t firstInfo = received.size();
+    size_t lastState = 0;
+    bool anyState = false;
+    for (size_t i = 0; i < received.size(); i++) {
+        const std::string& topic = received[i].first;
+        if (topic == "availability" && availability == received.size()) availability = i;
+        if (!received[i].second && firstInfo == received.size()) firstInfo = i;
+        for (int field = 0; field < 5 && availability == received.size(); field++) {
+            if (topic == STATE_FIELDS[field]) {
+                lastState = i;
+                anyState = true;
+            }
+        }
+    }
+    printf("\nafter the outage:");
+    for (size_t i = 0; i < received.size() && i <= firstInfo; i++) printf(" %s", received[i].first.c_str());
+    printf(" ...\n");
+    if (!anyState || lastState > availability || availability > firstInfo) {
+        fprintf(stderr, "FAIL what waited out the outage went out in the wrong order\n");
+        return 1;
+    }
+    return 0;
+}
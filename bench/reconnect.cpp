@@ -0,0 +1,421 @@
+// Reconnect storms, for the native build.
+//
+// Runs N MQTT sessions (gateway/mqtt_session.cpp, with the firmware's
+// ReconnectManager) against a minimal broker in the same process, over
+// loopback TCP. Like a real broker the bench's one only accepts so many
+// CONNECTs a second, and refuses the rest with "server unavailable". Once
+// every device is online the broker restarts: it drops every connection,
+// stays away for a few seconds, and comes back. For each reconnect policy
+// this reports, from the moment the broker is back:
+//
+//   * the peak CONNECT rate the broker saw, per 100 ms;
+//   * the CONNECTs it took, and how many it refused;
+//   * how long until every device was online again.
+//
+// The policies are a fixed 1 s retry, a doubling backoff without jitter, and
+// the firmware's full jitter, both over the firmware's MQTT_RECONNECT_BASE_MS
+// and MQTT_RECONNECT_CAP_MS rather than the gateway's shorter cap. Exits 1 if a policy doesn't get every device
+// online, at boot or after the restart, within BENCH_ONLINE_TIMEOUT_MS.
+//
+//   pio run -e bench_reconnect && .pio/build/bench_reconnect/program [devices] [down-seconds]
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "bench.hpp"
+#include "mqtt_session.hpp"
+
+// What the broker can take: a bucket of CONNECTs that refills at this rate
+#define BENCH_BROKER_CONNECTS_PER_S 100
+#define BENCH_BROKER_BURST 50
+#define BENCH_BUCKET_MS 100
+#define BENCH_ONLINE_TIMEOUT_MS 300000
+#define BENCH_BROKER_BUFFER 1024
+
+#define TAG_LISTEN 0
+#define TAG_CLIENT 1
+#define TAG_DEVICE 2
+
+typedef struct {
+    const char* name;
+    unsigned long baseMs;
+    unsigned long capMs;
+    bool jitter;
+} Policy;
+
+static const Policy POLICIES[] = {
+    { "fixed 1 s", 1000, 1000, false },
+    { "doubling, no jitter", MQTT_RECONNECT_BASE_MS, MQTT_RECONNECT_CAP_MS, false },
+    { "full jitter", MQTT_RECONNECT_BASE_MS, MQTT_RECONNECT_CAP_MS, true },
+};
+
+static unsigned long nowMillis() {
+    return (unsigned long) (benchNanos() / 1000000ULL);
+}
+
+// One simulated device: a session, and what the bench knows of it
+class Device : public MqttListener {
+    public:
+        Device() : online(false), registeredFd(-1), registeredWrite(false), _online(NULL) {}
+
+        void mqttConnected() {
+            online = true;
+            (*_online)++;
+        }
+        void mqttDisconnected() {
+            online = false;
+            (*_online)--;
+        }
+        void mqttMessage(const char* topic, const char* payload, size_t len) {
+            (void) topic;
+            (void) payload;
+            (void) len;
+        }
+
+        void count(size_t* online) { _online = online; }
+
+        MqttSession session;
+        char clientId[32];
+        bool online;
+        int registeredFd;
+        bool registeredWrite;
+
+    private:
+        size_t* _online;
+};
+
+typedef struct {
+    int fd;
+    uint8_t in[BENCH_BROKER_BUFFER];
+    size_t inLength;
+} BrokerClient;
+
+class StormRun {
+    public:
+        StormRun(const Policy& policy, size_t devices, unsigned long downMs) :
+            _policy(policy), _deviceCount(devices), _downMs(downMs), _failures(0) {}
+
+        bool run();
+        unsigned long failures() const { return _failures; }
+
+    private:
+        bool listen();
+        void restart();
+        void accept(unsigned long now);
+        void clientReadable(size_t index, unsigned long now);
+        void closeClient(size_t index);
+        void handlePacket(size_t index, uint8_t header, unsigned long now);
+        void updateRegistrations(size_t index);
+        void pump(unsigned long now);
+        bool waitOnline(unsigned long since, unsigned long* took);
+        void fail(const char* what);
+
+        const Policy& _policy;
+        size_t _deviceCount;
+        unsigned long _downMs;
+        unsigned long _failures;
+        int _epoll;
+        int _listen;
+        struct sockaddr_in _address;
+        std::vector<Device> _devices;
+        std::vector<BrokerClient*> _clients;
+        size_t _online;
+
+        // The broker's admission bucket, in thousandths of a CONNECT
+        unsigned long _tokens;
+        unsigned long _lastRefill;
+        // Counted from the broker coming back
+        bool _counting;
+        unsigned long _countingSince;
+        std::vector<unsigned long> _buckets;
+        unsigned long _connects;
+        unsigned long _refused;
+};
+
+void StormRun::fail(const char* what) {
+    fprintf(stderr, "%s: %s\n", _policy.name, what);
+    _failures++;
+}
+
+bool StormRun::listen() {
+    _listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(_listen, (const struct sockaddr*) &_address, sizeof(_address)) != 0 || ::listen(_listen, 4096) != 0) {
+        close(_listen);
+        return false;
+    }
+    socklen_t length = sizeof(_address);
+    getsockname(_listen, (struct sockaddr*) &_address, &length);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = TAG_LISTEN;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _listen, &event);
+    // Comes back with a full bucket, as a freshly started broker would
+    _tokens = BENCH_BROKER_BURST * 1000UL;
+    _lastRefill = nowMillis();
+    return true;
+}
+
+void StormRun::closeClient(size_t index) {
+    BrokerClient* client = _clients[index];
+    if (client == NULL) return;
+    close(client->fd);
+    delete client;
+    _clients[index] = NULL;
+}
+
+// Drops every connection and stops listening, for _downMs
+void StormRun::restart() {
+    close(_listen);
+    for (size_t i = 0; i < _clients.size(); i++) closeClient(i);
+    _clients.clear();
+    unsigned long downSince = nowMillis();
+    while (nowMillis() - downSince < _downMs) pump(nowMillis());
+}
+
+void StormRun::accept(unsigned long now) {
+    (void) now;
+    int fd;
+    while ((fd = accept4(_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        BrokerClient* client = new BrokerClient();
+        client->fd = fd;
+        client->inLength = 0;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t) _clients.size() << 2) | TAG_CLIENT;
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event);
+        _clients.push_back(client);
+    }
+}
+
+void StormRun::handlePacket(size_t index, uint8_t header, unsigned long now) {
+    BrokerClient& client = *_clients[index];
+    switch (header & 0xf0) {
+        case 0x10: {
+            _tokens += (now - _lastRefill) * BENCH_BROKER_CONNECTS_PER_S;
+            if (_tokens > BENCH_BROKER_BURST * 1000UL) _tokens = BENCH_BROKER_BURST * 1000UL;
+            _lastRefill = now;
+            if (_counting) {
+                _connects++;
+                size_t bucket = (now - _countingSince) / BENCH_BUCKET_MS;
+                if (bucket >= _buckets.size()) _buckets.resize(bucket + 1, 0);
+                _buckets[bucket]++;
+            }
+            if (_tokens >= 1000) {
+                _tokens -= 1000;
+                static const uint8_t CONNACK[4] = { 0x20, 0x02, 0x00, 0x00 };
+                send(client.fd, CONNACK, sizeof(CONNACK), MSG_NOSIGNAL);
+            } else {
+                // Server unavailable, and hang up
+                static const uint8_t REFUSED[4] = { 0x20, 0x02, 0x00, 0x03 };
+                send(client.fd, REFUSED, sizeof(REFUSED), MSG_NOSIGNAL);
+                if (_counting) _refused++;
+                closeClient(index);
+            }
+            break;
+        }
+        case 0xc0: {
+            static const uint8_t PINGRESP[2] = { 0xd0, 0x00 };
+            send(client.fd, PINGRESP, sizeof(PINGRESP), MSG_NOSIGNAL);
+            break;
+        }
+        default:
+            // The devices don't subscribe or publish
+            break;
+    }
+}
+
+void StormRun::clientReadable(size_t index, unsigned long now) {
+    if (index >= _clients.size() || _clients[index] == NULL) return;
+    BrokerClient& client = *_clients[index];
+    ssize_t count = recv(client.fd, client.in + client.inLength, sizeof(client.in) - client.inLength, 0);
+    if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) {
+        closeClient(index);
+        return;
+    }
+    if (count < 0) return;
+    client.inLength += count;
+    size_t start = 0;
+    for (;;) {
+        size_t available = client.inLength - start;
+        size_t remaining = 0;
+        size_t lengthBytes = 0;
+        bool complete = false;
+        while (lengthBytes < 4 && 1 + lengthBytes < available) {
+            uint8_t digit = client.in[start + 1 + lengthBytes];
+            remaining |= (size_t) (digit & 0x7f) << (7 * lengthBytes);
+            lengthBytes++;
+            if (!(digit & 0x80)) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete || available < 1 + lengthBytes + remaining) break;
+        uint8_t header = client.in[start];
+        start += 1 + lengthBytes + remaining;
+        handlePacket(index, header, now);
+        if (_clients[index] == NULL) return;
+    }
+    memmove(client.in, client.in + start, client.inLength - start);
+    client.inLength -= start;
+}
+
+// As Gateway::updateRegistrations does for a unit's session
+void StormRun::updateRegistrations(size_t index) {
+    Device& device = _devices[index];
+    MqttSession& session = device.session;
+    bool wantsWrite = session.wantsWrite();
+    bool changed = session.takeFdChanged();
+    if (session.fd() < 0) {
+        device.registeredFd = -1;
+        return;
+    }
+    if (!changed && wantsWrite == device.registeredWrite) return;
+    struct epoll_event event;
+    event.events = EPOLLIN | (wantsWrite ? (uint32_t) EPOLLOUT : 0);
+    event.data.u64 = ((uint64_t) index << 2) | TAG_DEVICE;
+    epoll_ctl(_epoll, changed || device.registeredFd != session.fd() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, session.fd(), &event);
+    device.registeredFd = session.fd();
+    device.registeredWrite = wantsWrite;
+}
+
+// Serves the broker and the devices for up to 10 ms
+void StormRun::pump(unsigned long now) {
+    struct epoll_event events[256];
+    int count = epoll_wait(_epoll, events, 256, 10);
+    now = nowMillis();
+    for (int i = 0; i < count; i++) {
+        uint64_t tag = events[i].data.u64;
+        size_t index = tag >> 2;
+        switch (tag & 3) {
+            case TAG_LISTEN:
+                accept(now);
+                break;
+            case TAG_CLIENT:
+                clientReadable(index, now);
+                break;
+            case TAG_DEVICE: {
+                MqttSession& session = _devices[index].session;
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) session.writable(now);
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) session.readable(now);
+                updateRegistrations(index);
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < _deviceCount; i++) {
+        _devices[i].session.tick(now);
+        updateRegistrations(i);
+    }
+}
+
+bool StormRun::waitOnline(unsigned long since, unsigned long* took) {
+    unsigned long now = nowMillis();
+    while (_online < _deviceCount) {
+        if (now - since > BENCH_ONLINE_TIMEOUT_MS) return false;
+        pump(now);
+        now = nowMillis();
+    }
+    *took = now - since;
+    return true;
+}
+
+bool StormRun::run() {
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    memset(&_address, 0, sizeof(_address));
+    _address.sin_family = AF_INET;
+    _address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    _online = 0;
+    _counting = false;
+    _connects = 0;
+    _refused = 0;
+    if (!listen()) {
+        fail("can't listen");
+        return false;
+    }
+
+    _devices.resize(_deviceCount);
+    unsigned long now = nowMillis();
+    for (size_t i = 0; i < _deviceCount; i++) {
+        Device& device = _devices[i];
+        snprintf(device.clientId, sizeof(device.clientId), "bench-%zu", i);
+        device.count(&_online);
+        device.session.setListener(&device);
+        // Before configure(), which seeds it from the client id
+        device.session.reconnect() = ReconnectManager(_policy.baseMs, _policy.capMs, _policy.jitter);
+        device.session.configure(_address, device.clientId, NULL, NULL, NULL, NULL);
+        device.session.start(now);
+        updateRegistrations(i);
+    }
+    unsigned long took;
+    if (!waitOnline(now, &took)) {
+        fail("not every device came online at boot");
+        return false;
+    }
+    unsigned long bootAttempts = 0;
+    for (size_t i = 0; i < _deviceCount; i++) bootAttempts += _devices[i].session.reconnect().stats().attempts;
+
+    restart();
+    if (!listen()) {
+        fail("can't listen again");
+        return false;
+    }
+    unsigned long backSince = nowMillis();
+    _counting = true;
+    _countingSince = backSince;
+    bool online = waitOnline(backSince, &took);
+    if (!online) fail("not every device came back online after the restart");
+
+    unsigned long peak = 0;
+    for (size_t i = 0; i < _buckets.size(); i++) peak = _buckets[i] > peak ? _buckets[i] : peak;
+    unsigned long attempts = 0;
+    unsigned long longest = 0;
+    for (size_t i = 0; i < _deviceCount; i++) {
+        const ReconnectStats& stats = _devices[i].session.reconnect().stats();
+        attempts += stats.attempts;
+        longest = stats.longestDownMillis > longest ? stats.longestDownMillis : longest;
+    }
+    printf("%-24s %10lu %10lu %10lu %10lu %10.1f %10.1f\n", _policy.name, peak * (1000 / BENCH_BUCKET_MS), _connects,
+           _refused, attempts - bootAttempts, online ? took / 1000.0 : -1.0, longest / 1000.0);
+
+    for (size_t i = 0; i < _deviceCount; i++) _devices[i].session.stop();
+    for (size_t i = 0; i < _clients.size(); i++) closeClient(i);
+    close(_listen);
+    close(_epoll);
+    return online;
+}
+
+int main(int argc, char** argv) {
+    size_t devices = argc > 1 ? (size_t) atoi(argv[1]) : 300;
+    unsigned long downSeconds = argc > 2 ? (unsigned long) atoi(argv[2]) : 5;
+
+    // Two descriptors per device, one on each side
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("%zu devices, broker down for %lu s, taking %d CONNECT/s (burst %d)\n\n", devices, downSeconds,
+           BENCH_BROKER_CONNECTS_PER_S, BENCH_BROKER_BURST);
+    printf("%-24s %10s %10s %10s %10s %10s %10s\n", "", "peak/s", "connects", "refused", "attempts", "online s", "longest s");
+    unsigned long failures = 0;
+    for (size_t i = 0; i < sizeof(POLICIES) / sizeof(POLICIES[0]); i++) {
+        StormRun run(POLICIES[i], devices, downSeconds * 1000);
+        run.run();
+        failures += run.failures();
+    }
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+// Microbenchmark: the table-driven CommandRouter against the strcmp() chain
+// and validate*Value() ladders that mqttMessage() used before it.
+//
+//   pio run -e bench_router && .pio/build/bench_router/program [iterations]
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.hpp"
+#include "command_router.hpp"
+
+#define PREFIX "home/living-room/aircon"
+
+// --- The previous implementation, verbatim apart from the HeatPump calls ---
+
+static char mqtt_topic_power_command[128];
+static char mqtt_topic_mode_command[128];
+static char mqtt_topic_temperature_command[128];
+static char mqtt_topic_fan_command[128];
+static char mqtt_topic_vane_command[128];
+
+static bool validatePowerValue(const char* value) {
+    return
+        strcmp(value, "ON") == 0 ||
+        strcmp(value, "OFF") == 0;
+}
+
+static bool validateModeValue(const char* value) {
+    return
+        strcmp(value, "HEAT") == 0 ||
+        strcmp(value, "DRY") == 0 ||
+        strcmp(value, "COOL") == 0 ||
+        strcmp(value, "FAN") == 0 ||
+        strcmp(value, "AUTO") == 0;
+}
+
+static bool validateTemperatureValue(const char* value) {
+    float f = atof(value);
+    return f > 15.0 && f < 31;
+}
+
+static bool validateFanValue(const char* value) {
+    return
+        strcmp(value, "AUTO") == 0 ||
+        strcmp(value, "QUIET") == 0 ||
+        strcmp(value, "1") == 0 ||
+        strcmp(value, "2") == 0 ||
+        strcmp(value, "3") == 0 ||
+        strcmp(value, "4") == 0;
+}
+
+static bool validateVaneValue(const char* value) {
+    return
+        strcmp(value, "AUTO") == 0 ||
+        strcmp(value, "1") == 0 ||
+        strcmp(value, "2") == 0 ||
+        strcmp(value, "3") == 0 ||
+        strcmp(value, "4") == 0 ||
+        strcmp(value, "5") == 0 ||
+        strcmp(value, "SWING") == 0;
+}
+
+static void upcase(const char* s, size_t s_len, char* buf, size_t buf_len) {
+    size_t i = s_len;
+    if (buf_len - 1 < i) { i = buf_len - 1; }
+    while (*s && i-- > 0) {
+        *buf++ = toupper(*s++);
+    }
+    *buf = '\0';
+}
+
+static int legacyDispatch(const char* topic, const char* payload, size_t len) {
+    char buffer[6];
+    size_t buflen = 6;
+
+    if (strcmp(topic, mqtt_topic_power_command) == 0) {
+        upcase(payload, len, buffer, buflen);
+        if (validatePowerValue(buffer)) return 1;
+    } else if (strcmp(topic, mqtt_topic_mode_command) == 0) {
+        upcase(payload, len, buffer, buflen);
+        if (validateModeValue(buffer)) return 2;
+    } else if (strcmp(topic, mqtt_topic_temperature_command) == 0) {
+        upcase(payload, len, buffer, buflen);
+        if (validateTemperatureValue(buffer)) return 3 + (int) atof(buffer);
+    } else if (strcmp(topic, mqtt_topic_fan_command) == 0) {
+        upcase(payload, len, buffer, buflen);
+        if (validateFanValue(buffer)) return 4;
+    } else if (strcmp(topic, mqtt_topic_vane_command) == 0) {
+        upcase(payload, len, buffer, buflen);
+        if (validateVaneValue(buffer)) return 5;
+    }
+    return 0;
+}
+
+// --- Workload ---
+
+typedef struct {
+    const char* topic;
+    const char* payload;
+} Message;
+
+static const Message MESSAGES[] = {
+    { PREFIX "/power/set", "on" },
+    { PREFIX "/power/set", "OFF" },
+    { PREFIX "/mode/set", "heat" },
+    { PREFIX "/mode/set", "AUTO" },
+    { PREFIX "/temperature/set", "22" },
+    { PREFIX "/temperature/set", "24.5" },
+    { PREFIX "/fan/set", "quiet" },
+    { PREFIX "/fan/set", "3" },
+    { PREFIX "/vane/set", "swing" },
+    { PREFIX "/vane/set", "2" },
+    { PREFIX "/vane/set", "sideways" },
+    { "home/bedroom/aircon/mode/set", "COOL" },
+};
+static const int MESSAGE_COUNT = sizeof(MESSAGES) / sizeof(MESSAGES[0]);
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    snprintf(mqtt_topic_power_command, 128, "%s/power/set", PREFIX);
+    snprintf(mqtt_topic_mode_command, 128, "%s/mode/set", PREFIX);
+    snprintf(mqtt_topic_temperature_command, 128, "%s/temperature/set", PREFIX);
+    snprintf(mqtt_topic_fan_command, 128, "%s/fan/set", PREFIX);
+    snprintf(mqtt_topic_vane_command, 128, "%s/vane/set", PREFIX);
+
+    CommandRouter router;
+    router.begin(PREFIX);
+
+    size_t lengths[MESSAGE_COUNT];
+    for (int i = 0; i < MESSAGE_COUNT; i++) lengths[i] = strlen(MESSAGES[i].payload);
+
+    // Both must agree on which messages are valid commands
+    for (int i = 0; i < MESSAGE_COUNT; i++) {
+        Command command;
+        bool routed = router.parse(MESSAGES[i].topic, MESSAGES[i].payload, lengths[i], &command);
+        bool legacy = legacyDispatch(MESSAGES[i].topic, MESSAGES[i].payload, lengths[i]) != 0;
+        if (routed != legacy) {
+            fprintf(stderr, "mismatch on %s = %s\n", MESSAGES[i].topic, MESSAGES[i].payload);
+            return 1;
+        }
+    }
+
+    uint64_t start = benchNanos();
+    int legacyResult = 0;
+    for (long n = 0; n < iterations; n++) {
+        const Message& message = MESSAGES[n % MESSAGE_COUNT];
+        legacyResult += legacyDispatch(message.topic, message.payload, lengths[n % MESSAGE_COUNT]);
+    }
+    uint64_t legacyNanos = benchNanos() - start;
+    benchKeep(legacyResult);
+
+    start = benchNanos();
+    int routedResult = 0;
+    for (long n = 0; n < iterations; n++) {
+        const Message& message = MESSAGES[n % MESSAGE_COUNT];
+        Command command;
+        if (router.parse(message.topic, message.payload, lengths[n % MESSAGE_COUNT], &command)) {
+            routedResult += command.topic + command.value;
+        }
+    }
+    uint64_t routedNanos = benchNanos() - start;
+    benchKeep(routedResult);
+
+    printf("%-36s %12s\n", "", "ns/message");
+    printf("%-36s %12.1f\n", "strcmp chain + validate*Value", (double) legacyNanos / iterations);
+    printf("%-36s %12.1f\n", "CommandRouter", (double) routedNanos / iterations);
+    printf("%-36s %11.2fx\n", "speedup", (double) legacyNanos / routedNanos);
+    return 0;
+}
@@ -0,0 +1,208 @@
+// The stall profiler, for the native build.
+//
+// First, what marking a stage costs: ns per enter() and exit() pair, at the
+// depths the firmware nests to, with RTC memory as the ESP shim keeps it.
+//
+// Then a watchdog reset. A child process boots the real firmware
+// (src/main.cpp) against the host shims and runs it for a few minutes, so
+// that there are slow stages to record, then changes the unit's settings.
+// When heatpumpSettingsChanged() publishes the change, the child stops dead,
+// as a unit would that the watchdog reset there: nothing unwinds, and all
+// that is left is RTC memory, which it hands to the parent. The parent
+// boots the firmware with that RTC memory and a software watchdog reset,
+// and checks that the boot info names the stages that were open, and that
+// <prefix>/stalls has them and the child's slow stages, newest first.
+//
+// The env builds with a STALL_SLOW_US low enough for the shims' slowest
+// stages to leave breadcrumbs. Exits 1 on the first check that fails.
+//
+//   pio run -e bench_stall && .pio/build/bench_stall/program [minutes]
+
+#include <Arduino.h>
+#include <FS.h>
+#include <AsyncMqttClient.h>
+#include <HeatPump.h>
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "bench.hpp"
+#include "stall_profiler.hpp"
+
+extern void setup();
+extern void loop();
+extern AsyncMqttClient mqttClient;
+extern HeatPump heatpump;
+extern StallProfiler stallProfiler;
+
+#define BENCH_TOPIC_PREFIX "bench"
+#define BENCH_DETECT_PIN 4
+// See bench/latency.cpp
+#define BENCH_LOOP_OVERHEAD_US 100
+#define BENCH_RTC_BYTES 512
+
+// RTC memory as a plain array, as the firmware's host writes it
+class ArrayStallHost : public StallProfilerHost {
+    public:
+        bool read(uint32_t offset, uint32_t* words, size_t count) override {
+            memcpy(words, (const uint32_t*) _words + offset, count * 4);
+            return true;
+        }
+        void write(uint32_t offset, const uint32_t* words, size_t count) override {
+            for (size_t i = 0; i < count; i++) _words[offset + i] = words[i];
+        }
+
+    private:
+        volatile uint32_t _words[BENCH_RTC_BYTES / 4];
+};
+
+static bool hangOnSettings = false;
+static int hangPipe = -1;
+static std::string lastInfo;
+static std::string lastStalls;
+static bool stateSeen = false;
+
+static bool endsWith(const char* topic, const char* suffix) {
+    size_t topicLength = strlen(topic);
+    size_t suffixLength = strlen(suffix);
+    return topicLength >= suffixLength && strcmp(topic + topicLength - suffixLength, suffix) == 0;
+}
+
+static void observePublish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    (void) qos; (void) retain;
+    if (endsWith(topic, "/state")) {
+        stateSeen = true;
+        if (hangOnSettings) {
+            // The watchdog fires: RTC memory is all that outlives this
+            uint32_t rtc[BENCH_RTC_BYTES / 4];
+            ESP.rtcUserMemoryRead(0, rtc, sizeof(rtc));
+            if (write(hangPipe, rtc, sizeof(rtc)) != (ssize_t) sizeof(rtc)) _exit(2);
+            _exit(0);
+        }
+    } else if (endsWith(topic, "/info") && strncmp(payload, "Running", 7) == 0) {
+        lastInfo.assign(payload, length);
+    } else if (endsWith(topic, "/stalls") && strncmp(payload, "{\"reset\"", 8) == 0) {
+        lastStalls.assign(payload, length);
+    }
+}
+
+static void runFor(unsigned long ms) {
+    unsigned long start = millis();
+    while (millis() - start < ms) {
+        loop();
+        delayMicroseconds(BENCH_LOOP_OVERHEAD_US);
+    }
+}
+
+static void boot() {
+    File configFile = SPIFFS.open("/config.json", "w");
+    configFile.print("{\"mqtt_host\":\"localhost\",\"mqtt_topic_prefix\":\"" BENCH_TOPIC_PREFIX "\"}");
+    configFile.close();
+    nativeSetPinInput(BENCH_DETECT_PIN, HIGH);
+    mqttClient.setPublishObserver(observePublish);
+    setup();
+}
+
+// ns per enter() and exit() pair, `depth` stages deep
+static double stageCost(int depth) {
+    static ArrayStallHost host;
+    static StallProfiler profiler(&host);
+    profiler.restore();
+    const int rounds = 200000;
+    uint64_t start = benchNanos();
+    for (int n = 0; n < rounds; n++) {
+        for (int i = 0; i < depth; i++) profiler.enter(STALL_STAGE_LOOP + i);
+        for (int i = 0; i < depth; i++) profiler.exit();
+    }
+    return (double) (benchNanos() - start) / rounds / depth;
+}
+
+// The child: runs, then hangs in heatpumpSettingsChanged()
+static void runUntilHang(unsigned long minutes, int pipe) {
+    boot();
+    runFor(minutes * 60000);
+    const StallStats& stats = stallProfiler.stats();
+    printf("child: %lu spans in %lu min, %lu slow, slowest %u us (%u us of it in stage %u)\n", stats.spans, minutes,
+           stats.slow, stallProfiler.slowestCount() > 0 ? stallProfiler.slowest(0).micros : 0,
+           stallProfiler.slowestCount() > 0 ? stallProfiler.slowest(0).culpritMicros : 0,
+           stallProfiler.slowestCount() > 0 ? stallProfiler.slowest(0).culprit : 0);
+    fflush(stdout);
+
+    hangPipe = pipe;
+    hangOnSettings = true;
+    heatpumpSettings changed = heatpump.getSettings();
+    changed.fan = strcmp(changed.fan, "QUIET") == 0 ? "4" : "QUIET";
+    heatpump.simulateRemoteChange(changed);
+    runFor(60000);
+    fprintf(stderr, "child: the settings change was never published\n");
+    _exit(1);
+}
+
+int main(int argc, char** argv) {
+    unsigned long minutes = argc > 1 ? atol(argv[1]) : 10;
+
+    printf("%-8s %14s\n", "depth", "ns per stage");
+    for (int depth = 1; depth <= STALL_MAX_DEPTH; depth++) printf("%-8d %14.1f\n", depth, stageCost(depth));
+    printf("\n");
+    fflush(stdout);
+
+    int fds[2];
+    if (pipe(fds) != 0) return 1;
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        runUntilHang(minutes, fds[1]);
+    }
+    close(fds[1]);
+    uint32_t rtc[BENCH_RTC_BYTES / 4];
+    ssize_t got = read(fds[0], rtc, sizeof(rtc));
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (got != (ssize_t) sizeof(rtc) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "FAIL the child didn't hang as planned\n");
+        return 1;
+    }
+    const StallRecord* record = (const StallRecord*) (rtc + STALL_RTC_OFFSET);
+
+    // The next boot
+    ESP.rtcUserMemoryWrite(0, rtc, sizeof(rtc));
+    ESP.setResetReason(REASON_SOFT_WDT_RST);
+    boot();
+    runFor(10000);
+    if (!stateSeen) {
+        fprintf(stderr, "FAIL the firmware never connected\n");
+        return 1;
+    }
+
+    printf("info:   %s\nstalls: %s\n", lastInfo.c_str(), lastStalls.c_str());
+    if (lastInfo.find("loop > heatpump > heatpumpSettingsChanged,") == std::string::npos ||
+        lastStalls.find("\"reset\":\"Software Watchdog\",\"open\":[\"loop\",\"heatpump\",\"heatpumpSettingsChanged\"]") ==
+            std::string::npos) {
+        fprintf(stderr, "FAIL the open stages aren't reported\n");
+        return 1;
+    }
+    char opened[40];
+    snprintf(opened, sizeof(opened), "\"opened_at\":%u,", record->openedAt);
+    if (lastStalls.find(opened) == std::string::npos) {
+        fprintf(stderr, "FAIL the time the stage was entered isn't reported\n");
+        return 1;
+    }
+    // The newest breadcrumb comes first
+    if (record->count > 0) {
+        const StallBreadcrumb& newest = record->crumbs[(record->count - 1) % STALL_BREADCRUMBS];
+        char crumb[40];
+        snprintf(crumb, sizeof(crumb), ",%u,%u]", newest.millis, newest.endedAt);
+        size_t first = lastStalls.find("\"crumbs\":[[");
+        if (first == std::string::npos || lastStalls.find(crumb) == std::string::npos ||
+            lastStalls.find(crumb) > lastStalls.find("]", first + 11)) {
+            fprintf(stderr, "FAIL the newest breadcrumb isn't first\n");
+            return 1;
+        }
+    }
+    printf("\n%u slow stages recorded before the reset, %u reported\n", record->count,
+           record->count < STALL_BREADCRUMBS ? record->count : STALL_BREADCRUMBS);
+    return 0;
+}
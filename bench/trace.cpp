@@ -0,0 +1,138 @@
+// Microbenchmark: TRACE() against LOG_PRINTF() for the call sites in
+// src/main.cpp that now trace rather than log, in ns per call and in bytes
+// per record. A log record is the formatted text, which the syslog sink
+// then sends with a header of its own, so its bytes on the wire are more
+// than shown here; a trace record is published as it is stored.
+//
+// The host has an FPU and a fast vsnprintf(), so the log paths look far
+// cheaper here than on the ESP8266, while micros() is a clock_gettime() call
+// that makes up a good part of each trace; read the ratios as a lower bound.
+//
+//   pio run -e bench_trace && .pio/build/bench_trace/program [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.hpp"
+#include "log.hpp"
+#include "trace.hpp"
+
+// What a call site passes, varied a little so that nothing is constant
+typedef struct {
+    const char* topic;
+    unsigned int length;
+    const char* name;
+    int temperature;
+    float setpoint;
+    unsigned int progress;
+} CallArguments;
+
+static const CallArguments ARGUMENTS[] = {
+    { "aircon/mode/set", 4, "COOL", 225, 22.5f, 12 },
+    { "aircon/set", 58, "QUIET", 180, 18.0f, 47 },
+    { "aircon/temperature/set", 2, "SWING", 305, 30.5f, 99 },
+};
+#define ARGUMENT_COUNT (sizeof(ARGUMENTS) / sizeof(ARGUMENTS[0]))
+
+static void logMessage(const CallArguments& a) {
+    LOG_PRINTF(LOG_INFO, "mqttMessage %s: %u bytes at %u of %u", a.topic, a.length, 0u, a.length);
+}
+
+static void traceMessage(const CallArguments& a) {
+    TRACE("mqttMessage %s: %u bytes at %u of %u", a.topic, a.length, 0u, a.length);
+}
+
+static void logTemperature(const CallArguments& a) {
+    LOG_PRINTF(LOG_INFO, "SET temperature to %d.%d", a.temperature / 10, a.temperature % 10);
+}
+
+static void traceTemperature(const CallArguments& a) {
+    TRACE("SET temperature to %d.%d", a.temperature / 10, a.temperature % 10);
+}
+
+static void logSettings(const CallArguments& a) {
+    LOG_PRINTF(LOG_INFO, "heatpumpSettingsChanged: %s %s %.1f %s %s", "ON", a.name, a.setpoint, "AUTO", a.name);
+}
+
+static void traceSettings(const CallArguments& a) {
+    TRACE("heatpumpSettingsChanged: %s %s %.1f %s %s", "ON", a.name, a.setpoint, "AUTO", a.name);
+}
+
+static void logProgress(const CallArguments& a) {
+    LOG_PRINTF(LOG_WARNING, "OTA Update Progress: %u%%", a.progress);
+}
+
+static void traceProgress(const CallArguments& a) {
+    TRACE("OTA Update Progress: %u%%", a.progress);
+}
+
+// The log calls' text, for its length
+static int textMessage(char* out, size_t size, const CallArguments& a) {
+    return snprintf(out, size, "mqttMessage %s: %u bytes at %u of %u", a.topic, a.length, 0u, a.length);
+}
+
+static int textTemperature(char* out, size_t size, const CallArguments& a) {
+    return snprintf(out, size, "SET temperature to %d.%d", a.temperature / 10, a.temperature % 10);
+}
+
+static int textSettings(char* out, size_t size, const CallArguments& a) {
+    return snprintf(out, size, "heatpumpSettingsChanged: %s %s %.1f %s %s", "ON", a.name, a.setpoint, "AUTO", a.name);
+}
+
+static int textProgress(char* out, size_t size, const CallArguments& a) {
+    return snprintf(out, size, "OTA Update Progress: %u%%", a.progress);
+}
+
+typedef struct {
+    const char* name;
+    void (*log)(const CallArguments&);
+    void (*trace)(const CallArguments&);
+    int (*text)(char*, size_t, const CallArguments&);
+} CallSite;
+
+static const CallSite SITES[] = {
+    { "mqttMessage", logMessage, traceMessage, textMessage },
+    { "SET temperature", logTemperature, traceTemperature, textTemperature },
+    { "heatpumpSettingsChanged", logSettings, traceSettings, textSettings },
+    { "OTA progress", logProgress, traceProgress, textProgress },
+};
+
+static double timeCalls(void (*call)(const CallArguments&), long iterations) {
+    uint64_t start = benchNanos();
+    for (long n = 0; n < iterations; n++) call(ARGUMENTS[n % ARGUMENT_COUNT]);
+    return (double) (benchNanos() - start) / iterations;
+}
+
+// Average bytes per log record: the text, as the log ring stores it
+static double logBytes(int (*text)(char*, size_t, const CallArguments&)) {
+    char message[LOG_MAX_MESSAGE + 1];
+    size_t total = 0;
+    for (size_t i = 0; i < ARGUMENT_COUNT; i++) total += text(message, sizeof(message), ARGUMENTS[i]);
+    return (double) total / ARGUMENT_COUNT;
+}
+
+// Average bytes per trace record, from how far the ring moves on
+static double traceBytes(void (*call)(const CallArguments&)) {
+    TraceCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    uint8_t chunk[TRACE_BUFFER_SIZE];
+    while (traceRead(&cursor, chunk, sizeof(chunk)) > 0) {}
+
+    for (size_t i = 0; i < ARGUMENT_COUNT; i++) call(ARGUMENTS[i]);
+    return (double) tracePending(cursor) / ARGUMENT_COUNT;
+}
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    printf("%-28s %12s %12s %8s %12s %12s\n", "", "log ns", "trace ns", "ratio", "log bytes", "trace bytes");
+    for (size_t i = 0; i < sizeof(SITES) / sizeof(SITES[0]); i++) {
+        const CallSite& site = SITES[i];
+        double logNanos = timeCalls(site.log, iterations);
+        double traceNanos = timeCalls(site.trace, iterations);
+        printf("%-28s %12.1f %12.1f %7.1fx %12.1f %12.1f\n", site.name, logNanos, traceNanos, logNanos / traceNanos,
+               logBytes(site.text), traceBytes(site.trace));
+    }
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include "cn105_port.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+// The same tables as the HeatPump library. The value tables are indexed like
+// CommandRouter's, so a Command's value picks its wire byte directly.
+static const uint8_t CONTROL_FLAGS[TRACKED_FIELDS] = { 0x01, 0x02, 0x04, 0x08, 0x10 };
+static const uint8_t POWER[2] = { 0x00, 0x01 };
+static const char* const POWER_MAP[2] = { "OFF", "ON" };
+static const uint8_t MODE[5] = { 0x01, 0x02, 0x03, 0x07, 0x08 };
+static const char* const MODE_MAP[5] = { "HEAT", "DRY", "COOL", "FAN", "AUTO" };
+static const uint8_t FAN[6] = { 0x00, 0x01, 0x02, 0x03, 0x05, 0x06 };
+static const char* const FAN_MAP[6] = { "AUTO", "QUIET", "1", "2", "3", "4" };
+static const uint8_t VANE[7] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x07 };
+static const char* const VANE_MAP[7] = { "AUTO", "1", "2", "3", "4", "5", "SWING" };
+// Setpoints are whole degrees from 16 to 31, sent as 31 - degrees
+#define SETPOINT_MIN 16
+#define SETPOINT_MAX 31
+// Room temperatures are 10 to 41 degrees, sent as degrees - 10
+#define ROOM_TEMPERATURE_BASE 10
+#define ROOM_TEMPERATURE_MAX 41
+
+static const uint8_t CONNECT[CN105_CONNECT_LEN] = { 0xfc, 0x5a, 0x01, 0x30, 0x02, 0xca, 0x01, 0xa8 };
+static const uint8_t HEADER[CN105_HEADER_LEN] = { 0xfc, 0x41, 0x01, 0x30, 0x10 };
+static const uint8_t INFOHEADER[CN105_HEADER_LEN] = { 0xfc, 0x42, 0x01, 0x30, 0x10 };
+
+#define CN105_CONNECT_REPLY 0x7a
+#define CN105_SET_REPLY 0x61
+#define CN105_INFO_REPLY 0x62
+#define CN105_INFO_SETTINGS 0x02
+#define CN105_INFO_ROOM_TEMPERATURE 0x03
+
+static uint8_t checkSum(const uint8_t* bytes, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) sum += bytes[i];
+    return (0xfc - sum) & 0xff;
+}
+
+static int lookupByte(const uint8_t* values, int count, uint8_t value) {
+    for (int i = 0; i < count; i++) {
+        if (values[i] == value) return i;
+    }
+    return -1;
+}
+
+static const char* lookupName(const char* const names[], const uint8_t* values, int count, uint8_t value) {
+    int index = lookupByte(values, count, value);
+    return names[index < 0 ? 0 : index];
+}
+
+Cn105Port::Cn105Port() :
+    _fd(-1),
+    _connected(false),
+    _awaitingReply(false),
+    _lastSend(0),
+    _lastReceive(0),
+    _pollRoom(false),
+    _wantedMask(0),
+    _haveCurrent(false),
+    _roomTemperature(0),
+    _rxLength(0) {
+    memset(_wanted, 0, sizeof(_wanted));
+    memset(_current, 0, sizeof(_current));
+    memset(&_stats, 0, sizeof(_stats));
+    _settings.power = POWER_MAP[0];
+    _settings.mode = MODE_MAP[0];
+    _settings.temperature = 0;
+    _settings.fan = FAN_MAP[0];
+    _settings.vane = VANE_MAP[0];
+}
+
+Cn105Port::~Cn105Port() {
+    close();
+}
+
+bool Cn105Port::open(const char* path) {
+    close();
+    _fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (_fd < 0) return false;
+
+    struct termios tio;
+    if (tcgetattr(_fd, &tio) != 0) {
+        close();
+        return false;
+    }
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B2400);
+    cfsetospeed(&tio, B2400);
+    tio.c_cflag &= ~(CSIZE | CSTOPB | PARODD | CRTSCTS);
+    tio.c_cflag |= CS8 | PARENB | CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(_fd, TCSANOW, &tio) != 0) {
+        close();
+        return false;
+    }
+    tcflush(_fd, TCIOFLUSH);
+    return true;
+}
+
+void Cn105Port::close() {
+    if (_fd >= 0) ::close(_fd);
+    _fd = -1;
+    _connected = false;
+    _awaitingReply = false;
+    _rxLength = 0;
+}
+
+bool Cn105Port::send(const uint8_t* frame, size_t length, unsigned long now) {
+    if (_fd < 0) return false;
+    // Anything left over from an earlier reply is stale now
+    _rxLength = 0;
+    ssize_t written = ::write(_fd, frame, length);
+    if (written != (ssize_t) length) return false;
+    _stats.framesSent++;
+    _lastSend = now;
+    _awaitingReply = true;
+    return true;
+}
+
+void Cn105Port::connect(unsigned long now) {
+    _connected = false;
+    send(CONNECT, CN105_CONNECT_LEN, now);
+    // Counts as heard from, so that the handshake gets its full retry interval
+    _lastReceive = now;
+}
+
+void Cn105Port::tick(unsigned long now) {
+    if (_fd < 0) return;
+    if (_awaitingReply && now - _lastSend > CN105_REPLY_TIMEOUT_MS) {
+        _stats.replyTimeouts++;
+        _awaitingReply = false;
+        _rxLength = 0;
+    }
+    if (_connected) {
+        if (now - _lastReceive > CN105_QUIET_MS) {
+            _stats.reconnects++;
+            connect(now);
+        }
+    } else if (!_awaitingReply && (_stats.framesSent == 0 || now - _lastSend > CN105_CONNECT_RETRY_MS)) {
+        connect(now);
+    }
+}
+
+void Cn105Port::apply(const Command& command) {
+    if (command.topic < COMMAND_POWER || command.topic > COMMAND_VANE) return;
+    int field = CommandTracker::index(command.topic);
+    if (command.topic == COMMAND_TEMPERATURE) {
+        int degrees = (command.temperature + 5) / 10;
+        if (degrees < SETPOINT_MIN) degrees = SETPOINT_MIN;
+        if (degrees > SETPOINT_MAX) degrees = SETPOINT_MAX;
+        _wanted[field] = SETPOINT_MAX - degrees;
+    } else {
+        static const uint8_t* const BYTES[TRACKED_FIELDS] = { POWER, MODE, NULL, FAN, VANE };
+        _wanted[field] = BYTES[field][command.value];
+    }
+    _wantedMask |= 1 << field;
+}
+
+bool Cn105Port::write(unsigned long now) {
+    uint8_t packet[CN105_PACKET_LEN] = {};
+    memcpy(packet, HEADER, CN105_HEADER_LEN);
+    packet[5] = 0x01;
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        if (!(_wantedMask & (1 << i))) continue;
+        if (_haveCurrent && _current[i] == _wanted[i]) continue;
+        packet[8 + i] = _wanted[i];
+        packet[6] |= CONTROL_FLAGS[i];
+    }
+    packet[CN105_PACKET_LEN - 1] = checkSum(packet, CN105_PACKET_LEN - 1);
+    return send(packet, CN105_PACKET_LEN, now);
+}
+
+bool Cn105Port::poll(unsigned long now, bool settings) {
+    uint8_t packet[CN105_PACKET_LEN] = {};
+    memcpy(packet, INFOHEADER, CN105_HEADER_LEN);
+    // Only the settings and the room temperature are bridged, so only those
+    // are asked for, taking turns unless the settings are wanted
+    packet[5] = (_pollRoom && !settings) ? CN105_INFO_ROOM_TEMPERATURE : CN105_INFO_SETTINGS;
+    _pollRoom = !_pollRoom;
+    packet[CN105_PACKET_LEN - 1] = checkSum(packet, CN105_PACKET_LEN - 1);
+    return send(packet, CN105_PACKET_LEN, now);
+}
+
+unsigned int Cn105Port::readable(unsigned long now) {
+    unsigned int events = 0;
+    if (_fd < 0) return 0;
+
+    for (;;) {
+        ssize_t count = ::read(_fd, _rx + _rxLength, CN105_RX_BUFFER - _rxLength);
+        if (count <= 0) break;
+        _rxLength += count;
+
+        // Frames start with 0xfc and announce their data length; anything
+        // else is skipped a byte at a time until a frame lines up
+        size_t start = 0;
+        while (start < _rxLength) {
+            if (_rx[start] != 0xfc) {
+                start++;
+                continue;
+            }
+            if (_rxLength - start < CN105_HEADER_LEN) break;
+            size_t length = CN105_HEADER_LEN + _rx[start + 4] + 1;
+            if (_rx[start + 4] > CN105_MAX_DATA) {
+                _stats.badFrames++;
+                start++;
+                continue;
+            }
+            if (_rxLength - start < length) break;
+            if (_rx[start + length - 1] != checkSum(_rx + start, length - 1)) {
+                _stats.badFrames++;
+                start++;
+                continue;
+            }
+            events |= decode(_rx + start, length, now);
+            start += length;
+        }
+        memmove(_rx, _rx + start, _rxLength - start);
+        _rxLength -= start;
+    }
+    return events;
+}
+
+unsigned int Cn105Port::decode(const uint8_t* frame, size_t length, unsigned long now) {
+    const uint8_t* data = frame + CN105_HEADER_LEN;
+    unsigned int events = 0;
+    (void) length;
+
+    _stats.framesReceived++;
+    _lastReceive = now;
+    _awaitingReply = false;
+
+    switch (frame[1]) {
+        case CN105_CONNECT_REPLY:
+            if (!_connected) events |= CN105_EVENT_CONNECTED;
+            _connected = true;
+            break;
+        case CN105_SET_REPLY:
+            break;
+        case CN105_INFO_REPLY:
+            if (data[0] == CN105_INFO_SETTINGS) {
+                // i-See units flag the mode with 0x08
+                uint8_t mode = data[4] > 0x08 ? data[4] - 0x08 : data[4];
+                uint8_t current[TRACKED_FIELDS] = { data[3], mode, data[5], data[6], data[7] };
+                if (!_haveCurrent || memcmp(current, _current, sizeof(current)) != 0) events |= CN105_EVENT_SETTINGS_CHANGED;
+                memcpy(_current, current, sizeof(current));
+                _haveCurrent = true;
+                for (int i = 0; i < TRACKED_FIELDS; i++) {
+                    if (_current[i] == _wanted[i]) _wantedMask &= ~(1 << i);
+                }
+
+                int setpoint = data[5] <= SETPOINT_MAX - SETPOINT_MIN ? SETPOINT_MAX - data[5] : SETPOINT_MAX;
+                _settings.power = lookupName(POWER_MAP, POWER, 2, data[3]);
+                _settings.mode = lookupName(MODE_MAP, MODE, 5, mode);
+                _settings.temperature = setpoint * 10;
+                _settings.fan = lookupName(FAN_MAP, FAN, 6, data[6]);
+                _settings.vane = lookupName(VANE_MAP, VANE, 7, data[7]);
+                events |= CN105_EVENT_SETTINGS;
+            } else if (data[0] == CN105_INFO_ROOM_TEMPERATURE) {
+                int degrees = ROOM_TEMPERATURE_BASE + data[3];
+                if (degrees > ROOM_TEMPERATURE_MAX) degrees = ROOM_TEMPERATURE_BASE;
+                _roomTemperature = degrees * 10;
+                events |= CN105_EVENT_ROOM_TEMPERATURE;
+            }
+            break;
+        default:
+            break;
+    }
+    return events;
+}
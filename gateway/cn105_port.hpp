@@ -0,0 +1,106 @@
+#ifndef __CN105_PORT_HPP_
+#define __CN105_PORT_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_router.hpp"
+#include "unit_bridge.hpp"
+
+// One indoor unit's CN105 link on a Linux tty, without ever blocking: frames
+// are written when the gateway says so and replies are decoded as epoll
+// reports the bytes arriving. It speaks the same subset of the protocol as
+// the HeatPump library that the firmware uses, and keeps the same wanted
+// and current settings, with one difference: a wanted field is forgotten
+// once the unit reports it, so that a later write of another field doesn't
+// undo a change made with the IR remote.
+//
+// When and what to send is the UnitBridge's LinkScheduler's business; this
+// only enforces the reply timeout, and reconnects a link that has gone quiet.
+
+#define CN105_PACKET_LEN 22
+#define CN105_CONNECT_LEN 8
+#define CN105_HEADER_LEN 5
+#define CN105_MAX_DATA 16
+// A reply must start within this long of the request, as the library expects
+#define CN105_REPLY_TIMEOUT_MS 500
+// The unit answers every request, so a link this quiet has gone away
+#define CN105_QUIET_MS 10000
+// How often the connect handshake is tried until the unit answers it
+#define CN105_CONNECT_RETRY_MS 2000
+#define CN105_RX_BUFFER 64
+
+// What readable() decoded, as bits
+#define CN105_EVENT_SETTINGS 0x01
+#define CN105_EVENT_SETTINGS_CHANGED 0x02
+#define CN105_EVENT_ROOM_TEMPERATURE 0x04
+#define CN105_EVENT_CONNECTED 0x08
+
+typedef struct {
+    unsigned long framesSent;
+    unsigned long framesReceived;
+    unsigned long badFrames;
+    unsigned long replyTimeouts;
+    unsigned long reconnects;
+} Cn105Stats;
+
+class Cn105Port {
+    public:
+        Cn105Port();
+        ~Cn105Port();
+
+        // Opens the tty raw at 2400 baud 8E1, non-blocking
+        bool open(const char* path);
+        void close();
+        int fd() const { return _fd; }
+
+        bool connected() const { return _connected; }
+        // Handshakes, then keeps the link up; call often
+        void tick(unsigned long now);
+
+        // Sets a wanted field, to go out with the next write()
+        void apply(const Command& command);
+        // Writes the wanted fields that differ from the unit's; false if the
+        // frame couldn't be written
+        bool write(unsigned long now);
+        // Asks for the settings, or alternately the settings and the room
+        // temperature
+        bool poll(unsigned long now, bool settings);
+
+        // Reads and decodes whatever has arrived; returns CN105_EVENT_* bits
+        unsigned int readable(unsigned long now);
+
+        // Only meaningful once a readback has set CN105_EVENT_SETTINGS
+        const UnitSettings& settings() const { return _settings; }
+        int roomTemperature() const { return _roomTemperature; }
+        const Cn105Stats& stats() const { return _stats; }
+
+    private:
+        bool send(const uint8_t* frame, size_t length, unsigned long now);
+        void connect(unsigned long now);
+        unsigned int decode(const uint8_t* frame, size_t length, unsigned long now);
+
+        int _fd;
+        bool _connected;
+        bool _awaitingReply;
+        unsigned long _lastSend;
+        unsigned long _lastReceive;
+        bool _pollRoom;
+
+        // Wire bytes indexed by field (COMMAND_POWER..COMMAND_VANE - 1), and
+        // a bit per field that has one wanted
+        uint8_t _wanted[TRACKED_FIELDS];
+        unsigned int _wantedMask;
+        uint8_t _current[TRACKED_FIELDS];
+        bool _haveCurrent;
+
+        UnitSettings _settings;
+        int _roomTemperature;
+
+        uint8_t _rx[CN105_RX_BUFFER];
+        size_t _rxLength;
+
+        Cn105Stats _stats;
+};
+
+#endif // __CN105_PORT_HPP_
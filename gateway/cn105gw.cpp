@@ -0,0 +1,124 @@
+// Bridges indoor units on Linux serial ports to MQTT, one unit per port, with
+// the same topics as the firmware.
+//
+//   cn105gw -b host[:port] [-u username] [-P password] [-i client-id] [-j]
+//           tty=prefix [tty=prefix...]
+//
+//   -b host[:port]  the broker (port 1883 by default)
+//   -u, -P          credentials for the broker
+//   -i client-id    units connect as <client-id>-0, -1... (default cn105gw)
+//   -j              publish one JSON state snapshot per unit to <prefix>/state
+//
+// Each unit publishes and subscribes under its own prefix, and has its own
+// MQTT session, so that <prefix>/availability goes offline for every unit
+// if the gateway goes away:
+//
+//   cn105gw -b broker.lan /dev/ttyUSB0=home/plant/ahu1 /dev/ttyUSB1=home/plant/ahu2
+//
+// SIGINT or SIGTERM stops it, printing each unit's link and MQTT counters and
+// how long it was without the broker.
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "gateway.hpp"
+
+#define DEFAULT_MQTT_PORT 1883
+
+static volatile bool stopRequested = false;
+
+static void requestStop(int signal) {
+    (void) signal;
+    stopRequested = true;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: cn105gw -b host[:port] [-u username] [-P password] [-i client-id] [-j] tty=prefix [tty=prefix...]\n");
+    exit(2);
+}
+
+// Resolves the broker once: the sessions reconnect to the address
+static bool resolveBroker(char* spec, struct sockaddr_in* broker) {
+    int port = DEFAULT_MQTT_PORT;
+    char* colon = strrchr(spec, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+        if (port <= 0 || port > 65535) return false;
+    }
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(spec, NULL, &hints, &result) != 0) return false;
+    memcpy(broker, result->ai_addr, sizeof(*broker));
+    broker->sin_port = htons(port);
+    freeaddrinfo(result);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Gateway gateway;
+    struct sockaddr_in broker;
+    char* brokerSpec = NULL;
+    const char* username = NULL;
+    const char* password = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "b:u:P:i:j")) != -1) {
+        switch (option) {
+            case 'b': brokerSpec = optarg; break;
+            case 'u': username = optarg; break;
+            case 'P': password = optarg; break;
+            case 'i': gateway.setClientId(optarg); break;
+            case 'j': gateway.setJsonState(true); break;
+            default: usage();
+        }
+    }
+    if (brokerSpec == NULL || optind >= argc) usage();
+    if (!resolveBroker(brokerSpec, &broker)) {
+        fprintf(stderr, "cn105gw: can't resolve %s\n", brokerSpec);
+        return 1;
+    }
+    gateway.setBroker(broker, username, password);
+
+    for (int i = optind; i < argc; i++) {
+        char* equals = strchr(argv[i], '=');
+        if (equals == NULL || equals == argv[i] || equals[1] == '\0') usage();
+        *equals = '\0';
+        if (!gateway.addUnit(argv[i], equals + 1)) {
+            fprintf(stderr, "cn105gw: %s=%s is too long\n", argv[i], equals + 1);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+    signal(SIGPIPE, SIG_IGN);
+    if (!gateway.begin()) {
+        perror("cn105gw: epoll");
+        return 1;
+    }
+    fprintf(stderr, "cn105gw: %zu unit(s), broker %s:%d\n", gateway.unitCount(), inet_ntoa(broker.sin_addr), ntohs(broker.sin_port));
+    gateway.run(&stopRequested);
+
+    printf("%-24s %8s %8s %6s %8s %6s %9s %8s %6s %7s\n", "unit", "sent", "received", "bad", "timeouts", "recon", "published", "pubfail", "mqtt",
+           "down_s");
+    for (size_t i = 0; i < gateway.unitCount(); i++) {
+        GatewayUnit& unit = gateway.unit(i);
+        const Cn105Stats& link = unit.port().stats();
+        const MqttStats& mqtt = unit.mqtt().stats();
+        const ReconnectStats& reconnect = unit.mqtt().reconnect().stats();
+        printf("%-24s %8lu %8lu %6lu %8lu %6lu %9lu %8lu %6lu %7lu\n", unit.prefix(), link.framesSent, link.framesReceived,
+               link.badFrames, link.replyTimeouts, link.reconnects, mqtt.published, mqtt.publishFailed, mqtt.connects,
+               reconnect.downMillis / 1000);
+    }
+    return 0;
+}
@@ -0,0 +1,283 @@
+#include "gateway.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each descriptor's epoll tag is the unit's index and which of its two
+// descriptors it is
+#define TAG_SERIAL 0
+#define TAG_MQTT 1
+
+static unsigned long long monotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+GatewayUnit::GatewayUnit(ScratchArena* scratch) :
+    registeredSerialFd(-1),
+    registeredMqttFd(-1),
+    registeredMqttWrite(false),
+    _bridge(this, scratch),
+    _now(0),
+    _lastOpenAttempt(0) {
+    _path[0] = '\0';
+    _prefix[0] = '\0';
+    _clientId[0] = '\0';
+    _availabilityTopic[0] = '\0';
+}
+
+bool GatewayUnit::configure(const char* path, const char* prefix, const char* clientId, bool jsonState) {
+    if (strlen(path) >= sizeof(_path) || strlen(prefix) >= sizeof(_prefix) || strlen(clientId) >= sizeof(_clientId)) return false;
+    strcpy(_path, path);
+    strcpy(_prefix, prefix);
+    strcpy(_clientId, clientId);
+    if (formatTopic(_availabilityTopic, sizeof(_availabilityTopic), _prefix, topicSuffix(TOPIC_AVAILABILITY)) == 0) return false;
+    _bridge.begin(_prefix, jsonState);
+    _mqtt.setListener(this);
+    return true;
+}
+
+void GatewayUnit::begin(const struct sockaddr_in& broker, const char* username, const char* password, unsigned long now) {
+    _now = now;
+    _mqtt.configure(broker, _clientId, username, password, _availabilityTopic, GATEWAY_AVAILABILITY_OFFLINE);
+    _lastOpenAttempt = now;
+    if (!_port.open(_path)) fprintf(stderr, "%s: can't open %s: %s\n", _prefix, _path, strerror(errno));
+    _mqtt.start(now);
+}
+
+// QoS 0 only: the firmware's QoS 2 availability publish goes out at 0 too, and
+// its retained will covers for it
+uint16_t GatewayUnit::publish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    (void) qos;
+    char name[GATEWAY_MAX_PREFIX + TOPIC_MAX_SUFFIX + 2];
+    if (formatTopic(name, sizeof(name), _prefix, topicSuffix(topic)) == 0) return 0;
+    return _mqtt.publish(name, payload, length, retain);
+}
+
+void GatewayUnit::apply(const Command& command) {
+    _port.apply(command);
+}
+
+void GatewayUnit::mqttConnected() {
+    char topic[GATEWAY_MAX_PREFIX + TOPIC_MAX_SUFFIX + 2];
+    for (int command = COMMAND_POWER; command <= COMMAND_VANE; command++) {
+        if (formatTopic(topic, sizeof(topic), _prefix, CommandRouter::suffix((CommandTopic) command)) > 0) _mqtt.subscribe(topic);
+    }
+    if (formatTopic(topic, sizeof(topic), _prefix, CommandRouter::suffix(COMMAND_SET)) > 0) _mqtt.subscribe(topic);
+    publish(TOPIC_AVAILABILITY, 0, true, GATEWAY_AVAILABILITY_ONLINE, strlen(GATEWAY_AVAILABILITY_ONLINE));
+    _bridge.mqttConnected();
+}
+
+void GatewayUnit::mqttDisconnected() {
+    fprintf(stderr, "%s: disconnected from the broker\n", _prefix);
+}
+
+void GatewayUnit::mqttMessage(const char* topic, const char* payload, size_t len) {
+    Command command;
+    if (_bridge.message(topic, payload, len, _now, &command) == MESSAGE_INVALID) {
+        fprintf(stderr, "%s: invalid %s command \"%.*s\"\n", _prefix, CommandRouter::topicName(command.topic), (int) len, payload);
+    }
+}
+
+void GatewayUnit::mqttReadable(unsigned long now) {
+    _now = now;
+    _mqtt.readable(now);
+}
+
+void GatewayUnit::mqttWritable(unsigned long now) {
+    _now = now;
+    _mqtt.writable(now);
+}
+
+void GatewayUnit::serialReadable(unsigned long now) {
+    _now = now;
+    unsigned int events = _port.readable(now);
+    if (events & CN105_EVENT_CONNECTED) fprintf(stderr, "%s: connected to the unit on %s\n", _prefix, _path);
+    // Every readback, not only those that changed: the bridge only publishes
+    // what differs from what it last published, so state lost while the
+    // session was down goes out again as soon as it is back
+    if (events & CN105_EVENT_SETTINGS) {
+        _bridge.settingsChanged(_port.settings());
+        _bridge.settingsReadback(_port.settings(), now);
+    }
+    if (events & CN105_EVENT_ROOM_TEMPERATURE) _bridge.roomTemperature(_port.roomTemperature(), now);
+}
+
+void GatewayUnit::service(unsigned long now) {
+    _now = now;
+    _mqtt.tick(now);
+    if (_port.fd() < 0) {
+        if (now - _lastOpenAttempt < GATEWAY_RETRY_OPEN_MS) return;
+        _lastOpenAttempt = now;
+        if (!_port.open(_path)) return;
+    }
+
+    _port.tick(now);
+    if (_port.connected()) {
+        switch (_bridge.next(now)) {
+            case LINK_WRITE:
+                _bridge.writing();
+                _port.write(now);
+                _bridge.wrote(now);
+                break;
+            case LINK_POLL:
+                _port.poll(now, _bridge.confirming());
+                _bridge.polled(now);
+                break;
+            default:
+                break;
+        }
+    }
+    _bridge.service(now);
+}
+
+Gateway::Gateway() :
+    _username(NULL),
+    _password(NULL),
+    _clientId("cn105gw"),
+    _jsonState(false),
+    _epoll(-1),
+    _units(NULL),
+    _unitCount(0),
+    _unitCapacity(0),
+    _lastTick(0) {
+    memset(&_broker, 0, sizeof(_broker));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+Gateway::~Gateway() {
+    for (size_t i = 0; i < _unitCount; i++) delete _units[i];
+    delete[] _units;
+    if (_epoll >= 0) close(_epoll);
+}
+
+void Gateway::setBroker(const struct sockaddr_in& broker, const char* username, const char* password) {
+    _broker = broker;
+    _username = username;
+    _password = password;
+}
+
+bool Gateway::addUnit(const char* path, const char* prefix) {
+    if (_unitCount == _unitCapacity) {
+        size_t capacity = _unitCapacity == 0 ? 8 : _unitCapacity * 2;
+        GatewayUnit** units = new GatewayUnit*[capacity];
+        for (size_t i = 0; i < _unitCount; i++) units[i] = _units[i];
+        delete[] _units;
+        _units = units;
+        _unitCapacity = capacity;
+    }
+    char clientId[GATEWAY_MAX_CLIENT_ID];
+    snprintf(clientId, sizeof(clientId), "%s-%zu", _clientId, _unitCount);
+    GatewayUnit* unit = new GatewayUnit(&_scratch);
+    if (!unit->configure(path, prefix, clientId, _jsonState)) {
+        delete unit;
+        return false;
+    }
+    _units[_unitCount++] = unit;
+    return true;
+}
+
+unsigned long Gateway::nowMillis() {
+    return (unsigned long) (monotonicMicros() / 1000);
+}
+
+bool Gateway::begin() {
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0) return false;
+    unsigned long now = nowMillis();
+    _lastTick = now;
+    for (size_t i = 0; i < _unitCount; i++) {
+        _units[i]->begin(_broker, _username, _password, now);
+        updateRegistrations(i);
+    }
+    return true;
+}
+
+// Registers descriptors that have been opened since the last call, and asks
+// for EPOLLOUT only while a session has output waiting. Closing a descriptor
+// takes it out of the epoll set by itself.
+void Gateway::updateRegistrations(size_t index) {
+    GatewayUnit& unit = *_units[index];
+    struct epoll_event event;
+
+    int serialFd = unit.port().fd();
+    if (serialFd != unit.registeredSerialFd) {
+        unit.registeredSerialFd = serialFd;
+        if (serialFd >= 0) {
+            event.events = EPOLLIN;
+            event.data.u64 = ((uint64_t) index << 1) | TAG_SERIAL;
+            epoll_ctl(_epoll, EPOLL_CTL_ADD, serialFd, &event);
+        }
+    }
+
+    MqttSession& mqtt = unit.mqtt();
+    bool wantsWrite = mqtt.wantsWrite();
+    bool changed = mqtt.takeFdChanged();
+    if (mqtt.fd() < 0) {
+        unit.registeredMqttFd = -1;
+        return;
+    }
+    if (!changed && wantsWrite == unit.registeredMqttWrite) return;
+    event.events = EPOLLIN | (wantsWrite ? (uint32_t) EPOLLOUT : 0);
+    event.data.u64 = ((uint64_t) index << 1) | TAG_MQTT;
+    if (changed || unit.registeredMqttFd != mqtt.fd()) {
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, mqtt.fd(), &event);
+    } else {
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, mqtt.fd(), &event);
+    }
+    unit.registeredMqttFd = mqtt.fd();
+    unit.registeredMqttWrite = wantsWrite;
+}
+
+void Gateway::dispatch(uint64_t tag, uint32_t events, unsigned long now) {
+    size_t index = tag >> 1;
+    if (index >= _unitCount) return;
+    GatewayUnit& unit = *_units[index];
+
+    if ((tag & 1) == TAG_SERIAL) {
+        _stats.serialEvents++;
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            // An adapter that was unplugged: service() opens it again
+            fprintf(stderr, "%s: lost %s\n", unit.prefix(), unit.path());
+            unit.port().close();
+        } else {
+            unit.serialReadable(now);
+        }
+    } else {
+        _stats.mqttEvents++;
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) unit.mqttWritable(now);
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) unit.mqttReadable(now);
+    }
+    updateRegistrations(index);
+}
+
+void Gateway::runOnce() {
+    struct epoll_event events[GATEWAY_EPOLL_EVENTS];
+    unsigned long now = nowMillis();
+    long wait = (long) GATEWAY_TICK_MS - (long) (now - _lastTick);
+    int count = epoll_wait(_epoll, events, GATEWAY_EPOLL_EVENTS, wait > 0 ? (int) wait : 0);
+
+    unsigned long long start = monotonicMicros();
+    now = (unsigned long) (start / 1000);
+    _stats.loops++;
+    for (int i = 0; i < count; i++) dispatch(events[i].data.u64, events[i].events, now);
+
+    if (now - _lastTick >= GATEWAY_TICK_MS) {
+        _lastTick = now;
+        _stats.ticks++;
+        for (size_t i = 0; i < _unitCount; i++) {
+            _units[i]->service(now);
+            updateRegistrations(i);
+        }
+    }
+    _stats.busyMicros += monotonicMicros() - start;
+}
+
+void Gateway::run(volatile bool* stop) {
+    while (!*stop) runOnce();
+}
@@ -0,0 +1,136 @@
+#ifndef __GATEWAY_HPP_
+#define __GATEWAY_HPP_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cn105_port.hpp"
+#include "mqtt_session.hpp"
+#include "scratch.hpp"
+#include "unit_bridge.hpp"
+
+// Bridges many indoor units to MQTT from one Linux host, each on its own
+// serial port (a USB adapter, or a port server's tty). Every unit has what
+// the firmware has: a UnitBridge for the command routing, link scheduling,
+// confirmation and state publishing, with a Cn105Port instead of the HeatPump
+// library and an MqttSession instead of AsyncMqttClient. A single thread runs
+// all of them from one epoll loop: serial replies and MQTT messages are
+// handled as they arrive, and every unit's link is serviced each
+// GATEWAY_TICK_MS.
+
+#define GATEWAY_TICK_MS 10
+#define GATEWAY_MAX_PREFIX 64
+#define GATEWAY_MAX_PATH 64
+#define GATEWAY_MAX_CLIENT_ID 48
+#define GATEWAY_EPOLL_EVENTS 64
+// How often a serial port that couldn't be opened is tried again
+#define GATEWAY_RETRY_OPEN_MS 5000
+
+#define GATEWAY_AVAILABILITY_ONLINE "online"
+#define GATEWAY_AVAILABILITY_OFFLINE "offline"
+
+class GatewayUnit : public UnitBridgeHost, public MqttListener {
+    public:
+        GatewayUnit(ScratchArena* scratch);
+
+        bool configure(const char* path, const char* prefix, const char* clientId, bool jsonState);
+        // Opens the port and starts the MQTT session
+        void begin(const struct sockaddr_in& broker, const char* username, const char* password, unsigned long now);
+
+        // UnitBridgeHost
+        uint16_t publish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length);
+        void apply(const Command& command);
+
+        // MqttListener
+        void mqttConnected();
+        void mqttDisconnected();
+        void mqttMessage(const char* topic, const char* payload, size_t len);
+
+        // Decodes what the unit sent and hands it to the bridge
+        void serialReadable(unsigned long now);
+        void mqttReadable(unsigned long now);
+        void mqttWritable(unsigned long now);
+        // Opens the port if it isn't, and carries out the bridge's next link
+        // action
+        void service(unsigned long now);
+
+        const char* path() const { return _path; }
+        const char* prefix() const { return _prefix; }
+        Cn105Port& port() { return _port; }
+        MqttSession& mqtt() { return _mqtt; }
+        UnitBridge& bridge() { return _bridge; }
+
+        // What the gateway last registered with epoll for each descriptor
+        int registeredSerialFd;
+        int registeredMqttFd;
+        bool registeredMqttWrite;
+
+    private:
+        char _path[GATEWAY_MAX_PATH];
+        char _prefix[GATEWAY_MAX_PREFIX];
+        char _clientId[GATEWAY_MAX_CLIENT_ID];
+        char _availabilityTopic[GATEWAY_MAX_PREFIX + 16];
+
+        Cn105Port _port;
+        MqttSession _mqtt;
+        UnitBridge _bridge;
+        unsigned long _now;
+        unsigned long _lastOpenAttempt;
+};
+
+typedef struct {
+    unsigned long loops;
+    unsigned long ticks;
+    unsigned long serialEvents;
+    unsigned long mqttEvents;
+    // Time spent handling events and ticks, as opposed to waiting in epoll
+    unsigned long long busyMicros;
+} GatewayStats;
+
+class Gateway {
+    public:
+        Gateway();
+        ~Gateway();
+
+        // The strings must outlive the gateway; username may be NULL
+        void setBroker(const struct sockaddr_in& broker, const char* username, const char* password);
+        // Units connect as "<clientId>-<n>"
+        void setClientId(const char* clientId) { _clientId = clientId; }
+        void setJsonState(bool jsonState) { _jsonState = jsonState; }
+
+        // Adds a unit on the tty at path, publishing under prefix. Only before
+        // begin().
+        bool addUnit(const char* path, const char* prefix);
+        size_t unitCount() const { return _unitCount; }
+        GatewayUnit& unit(size_t index) { return *_units[index]; }
+
+        bool begin();
+        // Waits up to GATEWAY_TICK_MS for events and handles them
+        void runOnce();
+        void run(volatile bool* stop);
+
+        const GatewayStats& stats() const { return _stats; }
+        static unsigned long nowMillis();
+
+    private:
+        void dispatch(uint64_t tag, uint32_t events, unsigned long now);
+        void updateRegistrations(size_t index);
+
+        struct sockaddr_in _broker;
+        const char* _username;
+        const char* _password;
+        const char* _clientId;
+        bool _jsonState;
+
+        int _epoll;
+        GatewayUnit** _units;
+        size_t _unitCount;
+        size_t _unitCapacity;
+        ScratchArena _scratch;
+        unsigned long _lastTick;
+
+        GatewayStats _stats;
+};
+
+#endif // __GATEWAY_HPP_
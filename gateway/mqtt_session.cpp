@@ -0,0 +1,391 @@
+#include "mqtt_session.hpp"
+
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xc0
+#define MQTT_PINGRESP 0xd0
+#define MQTT_DISCONNECT 0xe0
+
+// Clean session, retained will at QoS 0, and the username and password flags
+#define MQTT_FLAG_CLEAN 0x02
+#define MQTT_FLAG_WILL 0x04
+#define MQTT_FLAG_WILL_RETAIN 0x20
+#define MQTT_FLAG_PASSWORD 0x40
+#define MQTT_FLAG_USERNAME 0x80
+
+static uint8_t* putString(uint8_t* p, const char* s, size_t length) {
+    *p++ = length >> 8;
+    *p++ = length & 0xff;
+    memcpy(p, s, length);
+    return p + length;
+}
+
+MqttSession::MqttSession() :
+    _clientId(""),
+    _username(NULL),
+    _password(NULL),
+    _willTopic(NULL),
+    _willPayload(NULL),
+    _listener(NULL),
+    _fd(-1),
+    _fdChanged(false),
+    _tcpConnected(false),
+    _state(MQTT_IDLE),
+    _now(0),
+    _stateSince(0),
+    _lastSend(0),
+    _lastReceive(0),
+    _reconnect(MQTT_BACKOFF_MIN_MS, MQTT_BACKOFF_MAX_MS),
+    _nextPacketId(1),
+    _outLength(0),
+    _inLength(0),
+    _skip(0) {
+    memset(&_broker, 0, sizeof(_broker));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+MqttSession::~MqttSession() {
+    stop();
+}
+
+void MqttSession::configure(const struct sockaddr_in& broker, const char* clientId, const char* username, const char* password,
+                            const char* willTopic, const char* willPayload) {
+    _broker = broker;
+    _clientId = clientId;
+    _username = username;
+    _password = password;
+    _willTopic = willTopic;
+    _willPayload = willPayload;
+    // FNV-1a of the client id, so that every session waits differently
+    uint32_t hash = 2166136261u;
+    for (const char* c = clientId; *c != '\0'; c++) hash = (hash ^ (uint8_t) *c) * 16777619u;
+    _reconnect.seed(hash);
+}
+
+void MqttSession::start(unsigned long now) {
+    _now = now;
+    _state = MQTT_BACKOFF;
+    _reconnect.networkUp(now);
+    if (_reconnect.shouldConnect(now)) openSocket();
+}
+
+void MqttSession::stop() {
+    if (_fd >= 0) {
+        if (_state == MQTT_CONNECTED) {
+            static const uint8_t disconnect[2] = { MQTT_DISCONNECT, 0 };
+            send(_fd, disconnect, sizeof(disconnect), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        close(_fd);
+        _fdChanged = true;
+    }
+    _fd = -1;
+    _state = MQTT_IDLE;
+    _reconnect.networkDown(_now);
+}
+
+bool MqttSession::takeFdChanged() {
+    bool changed = _fdChanged;
+    _fdChanged = false;
+    return changed;
+}
+
+bool MqttSession::openSocket() {
+    _fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    _fdChanged = true;
+    _tcpConnected = false;
+    _outLength = 0;
+    _inLength = 0;
+    _skip = 0;
+    _state = MQTT_CONNECTING;
+    _stateSince = _now;
+    if (_fd < 0) {
+        disconnected();
+        return false;
+    }
+    int one = 1;
+    setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(_fd, (const struct sockaddr*) &_broker, sizeof(_broker)) != 0 && errno != EINPROGRESS) {
+        disconnected();
+        return false;
+    }
+    // Goes out once the TCP connect completes
+    return queueConnect();
+}
+
+void MqttSession::disconnected() {
+    if (_fd >= 0) close(_fd);
+    _fd = -1;
+    _fdChanged = true;
+    bool wasConnected = _state == MQTT_CONNECTED;
+    _state = MQTT_BACKOFF;
+    _stateSince = _now;
+    _reconnect.disconnected(_now);
+    if (wasConnected) {
+        _stats.disconnects++;
+        if (_listener != NULL) _listener->mqttDisconnected();
+    }
+}
+
+// Reserves a packet of `remaining` bytes after the fixed header in the output
+// buffer, returning where its body goes
+bool MqttSession::reserve(uint8_t header, size_t remaining, uint8_t** body) {
+    uint8_t length[4];
+    size_t lengthBytes = 0;
+    size_t value = remaining;
+    do {
+        uint8_t digit = value & 0x7f;
+        value >>= 7;
+        if (value > 0) digit |= 0x80;
+        length[lengthBytes++] = digit;
+    } while (value > 0 && lengthBytes < 4);
+    if (value > 0 || _outLength + 1 + lengthBytes + remaining > MQTT_OUTPUT_BUFFER) return false;
+
+    uint8_t* p = _out + _outLength;
+    *p++ = header;
+    memcpy(p, length, lengthBytes);
+    *body = p + lengthBytes;
+    _outLength += 1 + lengthBytes + remaining;
+    return true;
+}
+
+bool MqttSession::queueConnect() {
+    size_t clientIdLength = strlen(_clientId);
+    size_t remaining = 10 + 2 + clientIdLength;
+    uint8_t flags = MQTT_FLAG_CLEAN;
+    if (_willTopic != NULL) {
+        remaining += 2 + strlen(_willTopic) + 2 + strlen(_willPayload);
+        flags |= MQTT_FLAG_WILL | MQTT_FLAG_WILL_RETAIN;
+    }
+    if (_username != NULL) {
+        remaining += 2 + strlen(_username);
+        flags |= MQTT_FLAG_USERNAME;
+        if (_password != NULL) {
+            remaining += 2 + strlen(_password);
+            flags |= MQTT_FLAG_PASSWORD;
+        }
+    }
+
+    uint8_t* p;
+    if (!reserve(MQTT_CONNECT, remaining, &p)) return false;
+    p = putString(p, "MQTT", 4);
+    *p++ = 4;
+    *p++ = flags;
+    *p++ = MQTT_KEEPALIVE_S >> 8;
+    *p++ = MQTT_KEEPALIVE_S & 0xff;
+    p = putString(p, _clientId, clientIdLength);
+    if (flags & MQTT_FLAG_WILL) {
+        p = putString(p, _willTopic, strlen(_willTopic));
+        p = putString(p, _willPayload, strlen(_willPayload));
+    }
+    if (flags & MQTT_FLAG_USERNAME) p = putString(p, _username, strlen(_username));
+    if (flags & MQTT_FLAG_PASSWORD) p = putString(p, _password, strlen(_password));
+    return true;
+}
+
+uint16_t MqttSession::publish(const char* topic, const char* payload, size_t length, bool retain) {
+    size_t topicLength = strlen(topic);
+    uint8_t* p;
+    if (_state != MQTT_CONNECTED || !reserve(MQTT_PUBLISH | (retain ? 0x01 : 0x00), 2 + topicLength + length, &p)) {
+        _stats.publishFailed++;
+        return 0;
+    }
+    p = putString(p, topic, topicLength);
+    memcpy(p, payload, length);
+    _stats.published++;
+    flush();
+    return 1;
+}
+
+bool MqttSession::subscribe(const char* topic) {
+    size_t topicLength = strlen(topic);
+    uint8_t* p;
+    if (_state != MQTT_CONNECTED || !reserve(MQTT_SUBSCRIBE, 2 + 2 + topicLength + 1, &p)) return false;
+    uint16_t packetId = _nextPacketId++;
+    if (_nextPacketId == 0) _nextPacketId = 1;
+    *p++ = packetId >> 8;
+    *p++ = packetId & 0xff;
+    p = putString(p, topic, topicLength);
+    *p = 0;
+    flush();
+    return true;
+}
+
+void MqttSession::flush() {
+    if (_fd < 0 || !_tcpConnected) return;
+    size_t sent = 0;
+    while (sent < _outLength) {
+        ssize_t count = send(_fd, _out + sent, _outLength - sent, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            disconnected();
+            return;
+        }
+        sent += count;
+    }
+    if (sent > 0) _lastSend = _now;
+    memmove(_out, _out + sent, _outLength - sent);
+    _outLength -= sent;
+}
+
+void MqttSession::writable(unsigned long now) {
+    _now = now;
+    if (_fd < 0) return;
+    if (!_tcpConnected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+            disconnected();
+            return;
+        }
+        _tcpConnected = true;
+        _lastReceive = now;
+    }
+    flush();
+}
+
+void MqttSession::readable(unsigned long now) {
+    _now = now;
+    while (_fd >= 0) {
+        ssize_t count = recv(_fd, _in + _inLength, MQTT_INPUT_BUFFER - _inLength, 0);
+        if (count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            disconnected();
+            return;
+        }
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        _lastReceive = now;
+        _inLength += count;
+
+        size_t start = 0;
+        for (;;) {
+            if (_skip > 0) {
+                size_t skipped = _inLength - start < _skip ? _inLength - start : _skip;
+                start += skipped;
+                _skip -= skipped;
+                if (_skip > 0) break;
+            }
+            // Fixed header: type byte and a remaining length of up to 4 bytes
+            size_t available = _inLength - start;
+            size_t remaining = 0;
+            size_t lengthBytes = 0;
+            bool complete = false;
+            while (lengthBytes < 4 && 1 + lengthBytes < available) {
+                uint8_t digit = _in[start + 1 + lengthBytes];
+                remaining |= (size_t) (digit & 0x7f) << (7 * lengthBytes);
+                lengthBytes++;
+                if (!(digit & 0x80)) {
+                    complete = true;
+                    break;
+                }
+            }
+            if (!complete) {
+                if (lengthBytes == 4) {
+                    disconnected();
+                    return;
+                }
+                break;
+            }
+            size_t headerLength = 1 + lengthBytes;
+            if (headerLength + remaining > MQTT_INPUT_BUFFER) {
+                // Too big for us: thrown away as it arrives
+                _skip = remaining;
+                start += headerLength;
+                continue;
+            }
+            if (available < headerLength + remaining) break;
+            if (!handlePacket(_in[start], _in + start + headerLength, remaining)) {
+                disconnected();
+                return;
+            }
+            if (_fd < 0) return;
+            start += headerLength + remaining;
+        }
+        memmove(_in, _in + start, _inLength - start);
+        _inLength -= start;
+    }
+}
+
+// Returns false if the session should be dropped
+bool MqttSession::handlePacket(uint8_t header, const uint8_t* body, size_t length) {
+    switch (header & 0xf0) {
+        case MQTT_CONNACK:
+            if (_state != MQTT_CONNECTING || length < 2 || body[1] != 0) return false;
+            _state = MQTT_CONNECTED;
+            _stateSince = _now;
+            _reconnect.connected(_now);
+            _stats.connects++;
+            if (_listener != NULL) _listener->mqttConnected();
+            return true;
+        case MQTT_PUBLISH: {
+            if (length < 2) return false;
+            size_t topicLength = (body[0] << 8) | body[1];
+            size_t offset = 2 + topicLength;
+            uint8_t qos = (header >> 1) & 0x03;
+            uint16_t packetId = 0;
+            if (qos > 0) {
+                if (offset + 2 > length) return false;
+                packetId = (body[offset] << 8) | body[offset + 1];
+                offset += 2;
+            }
+            if (offset > length) return false;
+            _stats.received++;
+            if (topicLength < MQTT_MAX_TOPIC && _listener != NULL) {
+                char topic[MQTT_MAX_TOPIC];
+                memcpy(topic, body + 2, topicLength);
+                topic[topicLength] = '\0';
+                _listener->mqttMessage(topic, (const char*) body + offset, length - offset);
+            }
+            if (qos == 1) {
+                uint8_t* p;
+                if (reserve(MQTT_PUBACK, 2, &p)) {
+                    p[0] = packetId >> 8;
+                    p[1] = packetId & 0xff;
+                    flush();
+                }
+            }
+            return true;
+        }
+        case MQTT_SUBACK:
+        case MQTT_PINGRESP:
+            return true;
+        default:
+            return _state == MQTT_CONNECTED;
+    }
+}
+
+void MqttSession::tick(unsigned long now) {
+    _now = now;
+    switch (_state) {
+        case MQTT_CONNECTING:
+            if (now - _stateSince > MQTT_CONNECT_TIMEOUT_MS) disconnected();
+            break;
+        case MQTT_CONNECTED:
+            // The broker answers pings, so half again the keepalive without a
+            // byte from it means the connection is gone
+            if (now - _lastReceive > MQTT_KEEPALIVE_S * 1500UL) {
+                disconnected();
+            } else if (now - _lastSend >= MQTT_KEEPALIVE_S * 500UL && _outLength == 0) {
+                uint8_t* p;
+                if (reserve(MQTT_PINGREQ, 0, &p)) flush();
+            }
+            break;
+        case MQTT_BACKOFF:
+            if (_reconnect.shouldConnect(now)) openSocket();
+            break;
+        default:
+            break;
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef __MQTT_SESSION_HPP_
+#define __MQTT_SESSION_HPP_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "reconnect_manager.hpp"
+
+// A minimal MQTT 3.1.1 client for the gateway, on a non-blocking socket that
+// the gateway's epoll loop drives: QoS 0 publishes and subscriptions, a
+// retained last will, keepalive pings, and reconnecting with the firmware's
+// jittered backoff. Each unit gets its own session, so that its availability topic
+// goes offline with its own will when the gateway loses the broker.
+//
+// Packets are built straight into a fixed output buffer; a publish that
+// doesn't fit while the socket is backed up fails, as it does on the
+// firmware when AsyncMqttClient's buffers are full.
+
+#define MQTT_OUTPUT_BUFFER 8192
+#define MQTT_INPUT_BUFFER 2048
+#define MQTT_MAX_TOPIC 128
+#define MQTT_KEEPALIVE_S 15
+// Until CONNACK; then the broker has the keepalive to answer pings
+#define MQTT_CONNECT_TIMEOUT_MS 10000
+// The reconnect backoff's first window and cap
+#define MQTT_BACKOFF_MIN_MS 1000
+#define MQTT_BACKOFF_MAX_MS 30000
+
+class MqttListener {
+    public:
+        virtual ~MqttListener() {}
+        virtual void mqttConnected() = 0;
+        virtual void mqttDisconnected() = 0;
+        // topic is NUL-terminated; the payload isn't
+        virtual void mqttMessage(const char* topic, const char* payload, size_t len) = 0;
+};
+
+enum MqttState {
+    MQTT_IDLE = 0,
+    // Waiting for the TCP connect, then for CONNACK
+    MQTT_CONNECTING,
+    MQTT_CONNECTED,
+    // Waiting out the backoff before connecting again
+    MQTT_BACKOFF
+};
+
+typedef struct {
+    unsigned long connects;
+    unsigned long disconnects;
+    unsigned long published;
+    unsigned long publishFailed;
+    unsigned long received;
+} MqttStats;
+
+class MqttSession {
+    public:
+        MqttSession();
+        ~MqttSession();
+
+        // The strings must outlive the session; username may be NULL
+        void configure(const struct sockaddr_in& broker, const char* clientId, const char* username, const char* password,
+                       const char* willTopic, const char* willPayload);
+        void setListener(MqttListener* listener) { _listener = listener; }
+
+        // Starts connecting; the session then reconnects by itself
+        void start(unsigned long now);
+        void stop();
+
+        int fd() const { return _fd; }
+        // The socket changed since the last call: the gateway (re)registers it
+        bool takeFdChanged();
+        // Whether there is output waiting for the socket to drain
+        bool wantsWrite() const { return _outLength > 0 || _state == MQTT_CONNECTING; }
+
+        void readable(unsigned long now);
+        void writable(unsigned long now);
+        // Keepalive, connect timeouts and reconnecting
+        void tick(unsigned long now);
+
+        bool connected() const { return _state == MQTT_CONNECTED; }
+        MqttState state() const { return _state; }
+        // QoS 0. Returns 1, or 0 if it couldn't be queued.
+        uint16_t publish(const char* topic, const char* payload, size_t length, bool retain);
+        bool subscribe(const char* topic);
+
+        const MqttStats& stats() const { return _stats; }
+        // Attempts and downtime; assigning another manager before start()
+        // changes the policy
+        ReconnectManager& reconnect() { return _reconnect; }
+
+    private:
+        bool openSocket();
+        void disconnected();
+        bool queueConnect();
+        bool reserve(uint8_t header, size_t remaining, uint8_t** body);
+        void flush();
+        bool handlePacket(uint8_t header, const uint8_t* body, size_t length);
+
+        struct sockaddr_in _broker;
+        const char* _clientId;
+        const char* _username;
+        const char* _password;
+        const char* _willTopic;
+        const char* _willPayload;
+        MqttListener* _listener;
+
+        int _fd;
+        bool _fdChanged;
+        bool _tcpConnected;
+        MqttState _state;
+        // The time the loop last gave us, for the packets queued in between
+        unsigned long _now;
+        unsigned long _stateSince;
+        unsigned long _lastSend;
+        unsigned long _lastReceive;
+        ReconnectManager _reconnect;
+        uint16_t _nextPacketId;
+
+        uint8_t _out[MQTT_OUTPUT_BUFFER];
+        size_t _outLength;
+        uint8_t _in[MQTT_INPUT_BUFFER];
+        size_t _inLength;
+        // Bytes of an oversized packet still to be thrown away
+        size_t _skip;
+
+        MqttStats _stats;
+};
+
+#endif // __MQTT_SESSION_HPP_
@@ -0,0 +1,59 @@
+#ifndef __COMMAND_COALESCER_HPP_
+#define __COMMAND_COALESCER_HPP_
+
+#include <stdint.h>
+
+// Decides when pending MQTT commands should be written to the heatpump.
+//
+// A command that arrives after the link has been quiet for `idle` ms is sent
+// after `min` ms (immediately by default). Commands that follow each other
+// more closely than that are treated as a burst: the window widens to twice
+// the recent gap between them, capped at `max` ms, so that e.g. a dragged UI
+// slider ends up as one CN105 write. No command waits longer than `max` ms
+// after the first one it is merged with.
+
+// Buckets for the number of commands merged into one write: 1, 2, 3-4, 5-8, 9+
+#define COALESCER_MERGE_BUCKETS 5
+
+typedef struct {
+    unsigned long writes;
+    unsigned long commands;
+    unsigned long maxMerged;
+    unsigned long merged[COALESCER_MERGE_BUCKETS];
+} CoalescerStats;
+
+class CommandCoalescer {
+    public:
+        CommandCoalescer(unsigned long minWindow, unsigned long maxWindow, unsigned long idle);
+
+        void commandReceived(unsigned long now);
+        bool pending() const { return _pending; }
+        bool shouldFlush(unsigned long now) const;
+        // ms until shouldFlush() will be true, measured from now: 0 if it is,
+        // (unsigned long) -1 if nothing is pending
+        unsigned long flushIn(unsigned long now) const;
+        // Call when the pending commands have been handed to the heatpump
+        void flushed();
+
+        unsigned long window() const { return _window; }
+        // When the oldest pending command arrived; only meaningful while pending()
+        unsigned long firstCommandAt() const { return _firstCommandAt; }
+        const CoalescerStats& stats() const { return _stats; }
+
+    private:
+        unsigned long _minWindow;
+        unsigned long _maxWindow;
+        unsigned long _idle;
+
+        bool _pending;
+        bool _seenCommand;
+        unsigned long _firstCommandAt;
+        unsigned long _lastCommandAt;
+        unsigned long _gap;
+        unsigned long _window;
+        unsigned long _merged;
+
+        CoalescerStats _stats;
+};
+
+#endif // __COMMAND_COALESCER_HPP_
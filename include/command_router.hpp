@@ -0,0 +1,111 @@
+#ifndef __COMMAND_ROUTER_HPP_
+#define __COMMAND_ROUTER_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Routes inbound MQTT command messages. The topic prefix is stripped once and
+// the remaining suffix is looked up in a small hash table that is built by
+// begin(), so dispatch costs the same however many command topics there are.
+// The payload is then matched case-insensitively against the topic's value
+// table in a single pass, without copying it.
+//
+// "<prefix>/set" takes several fields at once, as a JSON object or as
+// key=value pairs separated by commas, semicolons or spaces:
+//
+//   {"power":"ON","mode":"COOL","temperature":22.5,"fan":"AUTO"}
+//   power=ON,mode=COOL,temperature=22.5,fan=AUTO
+//
+// Any of power, mode, temperature, fan and vane may be given, each once,
+// with the values their own topics take. parseBatch() rejects the whole
+// payload if any key or value is invalid.
+//
+// "<prefix>/history/get" asks for a range of the on-device history; its
+// payload is for History::parseRequest(), in the same two forms.
+
+enum CommandTopic {
+    COMMAND_NONE = 0,
+    COMMAND_POWER,
+    COMMAND_MODE,
+    COMMAND_TEMPERATURE,
+    COMMAND_FAN,
+    COMMAND_VANE,
+    COMMAND_CAPTURE,
+    COMMAND_SET,
+    COMMAND_HISTORY
+};
+
+enum PowerValue { POWER_VALUE_OFF, POWER_VALUE_ON };
+enum ModeValue { MODE_VALUE_HEAT, MODE_VALUE_DRY, MODE_VALUE_COOL, MODE_VALUE_FAN, MODE_VALUE_AUTO };
+enum FanValue { FAN_VALUE_AUTO, FAN_VALUE_QUIET, FAN_VALUE_1, FAN_VALUE_2, FAN_VALUE_3, FAN_VALUE_4 };
+enum VaneValue { VANE_VALUE_AUTO, VANE_VALUE_1, VANE_VALUE_2, VANE_VALUE_3, VANE_VALUE_4, VANE_VALUE_5, VANE_VALUE_SWING };
+enum CaptureValue { CAPTURE_VALUE_DUMP, CAPTURE_VALUE_CLEAR };
+
+// Setpoints are accepted in (15, 31) degrees, as tenths of a degree
+#define COMMAND_TEMPERATURE_MIN 150
+#define COMMAND_TEMPERATURE_MAX 310
+
+typedef struct {
+    CommandTopic topic;
+    // Index into the topic's value table, i.e. one of the *Value enums. For
+    // COMMAND_SET, a bit per field the batch set, from COMMAND_POWER.
+    uint8_t value;
+    // Canonical spelling of the value, as HeatPump expects it ("HEAT", "1"...)
+    const char* name;
+    // Setpoint in tenths of a degree; COMMAND_TEMPERATURE only
+    int temperature;
+} Command;
+
+// A <prefix>/set payload: the power, mode, temperature, fan and vane
+// commands, indexed from COMMAND_POWER, of which those with a bit in
+// `fields` were given
+#define COMMAND_BATCH_FIELDS 5
+
+typedef struct {
+    unsigned int fields;
+    Command commands[COMMAND_BATCH_FIELDS];
+} CommandBatch;
+
+#define COMMAND_ROUTER_SLOTS 16
+
+// Called with each key and value of a payload in either of the <prefix>/set
+// forms; returns false to reject the payload
+typedef bool (*PairHandler)(void* context, const char* key, size_t keyLength, const char* value, size_t valueLength);
+
+class CommandRouter {
+    public:
+        CommandRouter();
+
+        // Builds the route table for "<prefix>/<topic>/set"
+        void begin(const char* prefix);
+
+        // Returns the command topic addressed by an inbound topic, or
+        // COMMAND_NONE if it isn't one of ours.
+        CommandTopic route(const char* topic) const;
+
+        // Routes the topic and parses the payload. Returns false, leaving
+        // command->topic set, if the topic is known but the value is invalid.
+        // COMMAND_SET's payload is for parseBatch().
+        bool parse(const char* topic, const char* payload, size_t len, Command* command) const;
+
+        static bool parseValue(CommandTopic topic, const char* payload, size_t len, Command* command);
+        // Parses a <prefix>/set payload. Returns false if it is malformed,
+        // sets no field, or has a key or value that isn't valid.
+        static bool parseBatch(const char* payload, size_t len, CommandBatch* batch);
+        // Splits a flat JSON object or key=value pairs, as parseBatch() does,
+        // without interpreting them. An empty payload has no pairs.
+        static bool parsePairs(const char* payload, size_t len, PairHandler handler, void* context);
+        static const char* topicName(CommandTopic topic);
+        // The name of the topic's value with the given index, or NULL
+        static const char* valueName(CommandTopic topic, int index);
+        // The topic's suffix, such as "power/set", for subscribing to it
+        static const char* suffix(CommandTopic topic);
+
+    private:
+        const char* _prefix;
+        size_t _prefixLength;
+        // Open-addressed table of CommandTopic, indexed by suffix hash
+        uint8_t _slots[COMMAND_ROUTER_SLOTS];
+};
+
+#endif // __COMMAND_ROUTER_HPP_
@@ -0,0 +1,96 @@
+#ifndef __COMMAND_TRACKER_HPP_
+#define __COMMAND_TRACKER_HPP_
+
+#include <stddef.h>
+
+#include "command_router.hpp"
+
+// Confirms that commands written to the heatpump took effect. The last
+// command for each field is remembered until a settings readback taken after
+// the write shows the commanded value. If one has shown something else and
+// `timeoutMs` has passed since the write, the field is written again, the
+// timeout doubling with each attempt; once `attempts` writes have gone
+// unconfirmed the field is reported as diverged. A write that no readback
+// has followed yet, as when polls are held off by other writes, waits: only
+// the unit saying otherwise is taken as the write having been lost.
+// A diverged field stays so until a readback matches or a new command for it
+// arrives. A confirmed field is no longer watched, so later changes made with
+// the IR remote aren't fought.
+
+// Power, mode, temperature, fan and vane: COMMAND_POWER to COMMAND_VANE
+#define TRACKED_FIELDS 5
+// A setpoint is confirmed by a readback within this many tenths of a degree,
+// as units that only take whole degrees round it
+#define TRACKED_TEMPERATURE_TOLERANCE 5
+
+enum TrackState {
+    // Never commanded
+    TRACK_IDLE = 0,
+    // Commanded, waiting to be written
+    TRACK_QUEUED,
+    // Written, waiting for a readback to confirm it
+    TRACK_SENT,
+    TRACK_CONFIRMED,
+    // Every attempt went unconfirmed
+    TRACK_DIVERGED
+};
+
+typedef struct {
+    TrackState state;
+    Command commanded;
+    // The last value read back; its topic is COMMAND_NONE until there is one
+    Command actual;
+    unsigned int attempts;
+    // Whether a readback since the last write has shown another value
+    bool contradicted;
+    unsigned long commandedAt;
+    unsigned long deadline;
+    // Command to confirmation, for the last confirmed command and the slowest
+    unsigned long lastConfirmMillis;
+    unsigned long maxConfirmMillis;
+} TrackedField;
+
+typedef struct {
+    unsigned long confirmed;
+    unsigned long retries;
+    unsigned long diverged;
+} TrackerStats;
+
+class CommandTracker {
+    public:
+        CommandTracker(unsigned long timeoutMs, unsigned int attempts);
+
+        // A command for one of the tracked fields has been handed to the link
+        void commanded(const Command& command, unsigned long now);
+        // The link's wanted settings have gone out
+        void wrote(unsigned long now);
+        // A settings readback, indexed like field(). Returns a bit per field
+        // that it confirmed.
+        unsigned int readback(const Command actual[TRACKED_FIELDS], unsigned long now);
+        // Returns a bit per field whose confirmation has timed out, with a
+        // readback contradicting it, and which should be written again.
+        // Fields that have run out of attempts are marked diverged instead,
+        // and get a bit in *diverged if it's given.
+        unsigned int retriesDue(unsigned long now, unsigned int* diverged = NULL);
+
+        // Whether a field has been confirmed, has diverged or has had a
+        // divergence cleared by a new command since the last call
+        bool takeChanged();
+
+        static int index(CommandTopic topic) { return (int) topic - COMMAND_POWER; }
+        static const char* stateName(TrackState state);
+        const TrackedField& field(int index) const { return _fields[index]; }
+        const TrackerStats& stats() const { return _stats; }
+
+    private:
+        static bool matches(const Command& commanded, const Command& actual);
+
+        unsigned long _timeoutMs;
+        unsigned int _attempts;
+        bool _changed;
+
+        TrackedField _fields[TRACKED_FIELDS];
+        TrackerStats _stats;
+};
+
+#endif // __COMMAND_TRACKER_HPP_
@@ -0,0 +1,55 @@
+#ifndef __CONFIG_STORE_HPP_
+#define __CONFIG_STORE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stores a fixed-size struct on SPIFFS as a versioned, CRC-checked binary
+// record, so that loading it is a couple of fixed-size reads, with no
+// parsing and no heap allocation.
+//
+// There are two slots, A and B. Each save goes to the slot that doesn't hold
+// the newest record, with the next sequence number, so a save that is cut
+// short by a reset or power loss leaves the previous record to fall back on.
+// A record only loads if its magic, version, length and CRC all match.
+
+#define CONFIG_STORE_MAGIC 0x47464341  // "ACFG"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length;
+    uint32_t sequence;
+    // CRC-32 of the fields above and the payload that follows
+    uint32_t crc;
+} ConfigRecordHeader;
+
+class ConfigStore {
+    public:
+        ConfigStore(const char* pathA, const char* pathB, uint16_t version);
+
+        // Reads the newest valid record into data. Returns false if neither
+        // slot holds one, in which case data may have been overwritten. With
+        // a `version`, reads a record of that earlier version instead, to be
+        // converted; the next save() goes to the other slot all the same.
+        bool load(void* data, size_t length, uint16_t version = 0);
+        bool save(const void* data, size_t length);
+        // Removes both slots
+        void clear();
+
+        uint32_t sequence() const { return _sequence; }
+
+        static uint32_t crc32(const void* data, size_t length, uint32_t crc = 0);
+
+    private:
+        bool readHeader(int slot, size_t length, uint16_t version, ConfigRecordHeader* header);
+        bool readRecord(int slot, void* data, size_t length);
+
+        const char* _paths[2];
+        uint16_t _version;
+        // The slot holding the newest record, or -1 if there isn't one
+        int _slot;
+        uint32_t _sequence;
+};
+
+#endif // __CONFIG_STORE_HPP_
@@ -0,0 +1,30 @@
+#ifndef __CONNECTION_CACHE_HPP_
+#define __CONNECTION_CACHE_HPP_
+
+#include <stdint.h>
+
+// What we need to rejoin the network and reach the broker without scanning,
+// DHCP or DNS: remembered from the last boot that got as far as connecting
+// to MQTT, and stored as a ConfigStore record. Addresses are in IPAddress's
+// uint32_t form.
+//
+// The IP configuration is reused as-is, so a unit that comes back within its
+// lease keeps its address; one that doesn't, or whose access point or broker
+// has moved, fails the fast path and falls back to WiFiManager and DNS.
+
+#define CONNECTION_CACHE_VERSION 1
+
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t reserved;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint32_t broker;
+    // CRC-32 of the mqtt_host the broker address was resolved from
+    uint32_t brokerHostCrc;
+} ConnectionCache;
+
+#endif // __CONNECTION_CACHE_HPP_
@@ -0,0 +1,182 @@
+#ifndef __HISTORY_HPP_
+#define __HISTORY_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Room temperature and settings history, kept on the device so that gaps in
+// what the broker recorded can be filled in afterwards. There are three
+// tiers, each a fixed-size ring that drops its oldest samples when full:
+//
+//   raw      a sample whenever the room temperature or the settings change
+//   minute   one a minute: the room temperature averaged over the minute,
+//            and the settings at its end
+//   quarter  the same, every 15 minutes
+//
+// The unit has no wall clock, so sample times are seconds of history time:
+// seconds since boot, carried on from the last boot's history if it was
+// restored from flash. The time the unit was off isn't counted.
+//
+// Samples are stored as deltas from the one before, as varints: the seconds
+// since, the change in room temperature, zigzagged and shifted left one to
+// make room for a flag that is set when the settings word that follows
+// changed. A sample whose settings didn't change takes two or three bytes.
+// The oldest sample of each ring is kept whole, and the next delta is folded
+// into it when it is dropped.
+//
+// A query returns a range of one tier as a single batch in the same
+// encoding:
+//
+//   [version][tier][flags][now, varint][boot, varint]
+//   [seconds, varint][room, zigzag varint][settings, 2]  the first sample
+//   [delta]...                                           the rest
+//
+// `now` is the history time of the query and `boot` that of this boot, so
+// with the time the batch was received, any sample's age can be worked out;
+// samples from before `boot` are from an earlier boot. HISTORY_FLAG_MORE is
+// set when the batch didn't hold the whole range. HistoryReader decodes it.
+
+#ifndef HISTORY_RING_SIZE
+#define HISTORY_RING_SIZE 1024
+#endif
+#define HISTORY_MINUTE_SECONDS 60
+#define HISTORY_QUARTER_SECONDS 900
+
+#define HISTORY_VERSION 1
+// HistoryState is mirrored to flash as it is: bump this whenever it changes
+#define HISTORY_STATE_VERSION 1
+#define HISTORY_FLAG_MORE 0x01
+// Longest delta: 5 byte time, 3 byte room temperature, 2 byte settings
+#define HISTORY_MAX_ENTRY 10
+// Longest header and first sample
+#define HISTORY_MAX_HEADER 26
+// Room for a whole ring
+#define HISTORY_RESPONSE_SIZE (HISTORY_MAX_HEADER + HISTORY_RING_SIZE)
+
+// Settings are packed into a word: power in bit 0, mode in bits 1-3, fan in
+// 4-6, vane in 7-9 (CommandRouter's value indices, 7 if unknown) and the
+// setpoint in half degrees above 10 in bits 10-15
+#define HISTORY_SETTINGS_UNKNOWN 0xffff
+#define HISTORY_UNKNOWN_VALUE 7
+#define HISTORY_SETPOINT_BASE 100
+
+enum HistoryTier {
+    HISTORY_RAW = 0,
+    HISTORY_MINUTE,
+    HISTORY_QUARTER,
+    HISTORY_TIERS
+};
+
+typedef struct {
+    uint32_t seconds;
+    // Tenths of a degree
+    int16_t room;
+    uint16_t settings;
+} HistorySample;
+
+// A tier's samples, as deltas after the oldest. Positions only ever
+// increase; they are reduced modulo the ring size when used.
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t count;
+    HistorySample oldest;
+    HistorySample newest;
+    uint8_t bytes[HISTORY_RING_SIZE];
+} HistoryRing;
+
+// Everything that is mirrored to flash
+typedef struct {
+    uint32_t seconds;
+    HistoryRing rings[HISTORY_TIERS];
+} HistoryState;
+
+// A range of one tier, in seconds before the query
+typedef struct {
+    HistoryTier tier;
+    uint32_t since;
+    uint32_t until;
+} HistoryRequest;
+
+class History {
+    public:
+        History();
+
+        // Call with every reading and every change. Nothing is recorded
+        // until the room temperature is known.
+        void room(int tenths, unsigned long now);
+        void settings(uint16_t settings, unsigned long now);
+        // Closes off minutes and quarters; call at least once a second
+        void tick(unsigned long now);
+
+        // Writes the request's range as a batch into out, which needs
+        // HISTORY_RESPONSE_SIZE bytes to be sure of holding a whole tier.
+        // Returns the length.
+        size_t query(const HistoryRequest& request, unsigned long now, uint8_t* out, size_t size);
+
+        // The state to mirror to flash, or to load it into. Call restored()
+        // once it has been loaded, or clear() if it couldn't be.
+        HistoryState* state() { return &_state; }
+        void restored(unsigned long now);
+        void clear();
+
+        uint32_t seconds(unsigned long now);
+        const HistoryRing& ring(HistoryTier tier) const { return _state.rings[tier]; }
+
+        static uint16_t packSettings(const char* power, const char* mode, int temperature, const char* fan, const char* vane);
+        // Parses "tier=minute since=3600 until=0" or the same as a flat JSON
+        // object. Every key is optional: the whole raw tier by default.
+        static bool parseRequest(const char* payload, size_t len, HistoryRequest* request);
+        static const char* tierName(HistoryTier tier);
+
+    private:
+        typedef struct {
+            uint32_t start;
+            // Room temperature times seconds, so far this period
+            int64_t sum;
+            uint32_t covered;
+        } Period;
+
+        void advance(unsigned long now);
+        void accumulate(uint32_t until);
+        void record(uint32_t seconds);
+
+        HistoryState _state;
+        Period _periods[HISTORY_TIERS];
+        uint32_t _bootSeconds;
+        uint64_t _millis;
+        unsigned long _lastMillis;
+        uint32_t _accumulatedTo;
+        bool _hasRoom;
+        int _room;
+        uint16_t _settings;
+};
+
+// Walks a batch written by History::query()
+class HistoryReader {
+    public:
+        HistoryReader(const uint8_t* bytes, size_t length);
+
+        bool valid() const { return _valid; }
+        HistoryTier tier() const { return _tier; }
+        bool more() const { return _flags & HISTORY_FLAG_MORE; }
+        uint32_t now() const { return _now; }
+        uint32_t boot() const { return _boot; }
+
+        // The next sample, or false at the end of the batch
+        bool next(HistorySample* sample);
+
+    private:
+        const uint8_t* _bytes;
+        size_t _length;
+        size_t _position;
+        bool _valid;
+        bool _started;
+        HistoryTier _tier;
+        uint8_t _flags;
+        uint32_t _now;
+        uint32_t _boot;
+        HistorySample _sample;
+};
+
+#endif // __HISTORY_HPP_
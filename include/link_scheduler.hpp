@@ -0,0 +1,115 @@
+#ifndef __LINK_SCHEDULER_HPP_
+#define __LINK_SCHEDULER_HPP_
+
+#include <stdint.h>
+
+// Decides what the heatpump task does with the CN105 link on each pass. At
+// 2400 baud 8E1 a request and its 22-byte reply take ~200 ms of wire time, and
+// the HeatPump library blocks in update() until a second has passed since the
+// last frame, so the link is a budget to be spent rather than something to
+// call on every loop():
+//
+//  * a pending write goes first: no info poll is started while commands
+//    wait, and the write is issued as soon as the link is free, so update()
+//    never blocks waiting for it;
+//  * writes are limited by a token bucket of `burst` tokens, one returned
+//    every `refillMs`, so that a storm of commands can't saturate the link.
+//    Commands that arrive meanwhile are merged into the next write by the
+//    HeatPump library's wanted settings, so none are lost;
+//  * the unit is polled every `fastPollMs` for `boostMs` after a write, the
+//    first poll asking for the settings so the write is confirmed quickly,
+//    and every `idlePollMs` otherwise;
+//  * for LINK_REPLY_WINDOW_MS after a poll, the library is given the chance
+//    to read the reply.
+
+// The HeatPump library's own minimum gaps after any frame before it sends a
+// command, and before it sends an info request. It times them from its own
+// millis() reading, taken a little after ours, so we wait a margin longer.
+#define LINK_SEND_INTERVAL_MS 1000
+#define LINK_INFO_INTERVAL_MS 2000
+#define LINK_CLOCK_MARGIN_MS 10
+// A reply must have arrived within PACKET_REPLY_TIMEOUT_MS of the request,
+// so this leaves the library time to notice that it hasn't
+#define LINK_REPLY_WINDOW_MS 600
+// While a reply is awaited, how often to look for it. The UART's FIFO holds
+// far more than a reply, so this only bounds how soon it is decoded.
+#define LINK_READ_INTERVAL_MS 20
+// Wire time of one exchange: a 22-byte frame each way, 11 bits per byte
+#define LINK_EXCHANGE_MICROS (2UL * 22 * 11 * 1000000UL / 2400)
+
+enum LinkAction {
+    LINK_IDLE = 0,
+    // Call heatpump.update()
+    LINK_WRITE,
+    // Call heatpump.sync(), for the settings if confirming() is true
+    LINK_POLL,
+    // Call heatpump.sync() to read a reply
+    LINK_READ
+};
+
+typedef struct {
+    unsigned long writes;
+    unsigned long polls;
+    // Writes that had to wait for a token
+    unsigned long throttled;
+    unsigned long maxQueueMillis;
+} LinkStats;
+
+class LinkScheduler {
+    public:
+        LinkScheduler(unsigned long idlePollMs, unsigned long fastPollMs, unsigned long boostMs,
+                      unsigned int burst, unsigned long refillMs);
+
+        // pending: commands are waiting in the coalescer; ready: they should
+        // be written now
+        LinkAction next(unsigned long now, bool pending, bool ready);
+        // ms until next() may return something other than LINK_IDLE,
+        // measured from now, for a caller that sleeps between passes: 0 if
+        // it may now, (unsigned long) -1 if only pending becoming ready
+        // would change that
+        unsigned long idleFor(unsigned long now, bool pending, bool ready) const;
+
+        // Call once next()'s action has been carried out, with the time that
+        // next() was given
+        void wrote(unsigned long now);
+        void polled(unsigned long now);
+
+        // Whether the next poll should ask for the settings
+        bool confirming() const { return _confirming; }
+        // How long the last write waited between being ready and going out
+        unsigned long lastQueueMillis() const { return _lastQueueMillis; }
+        // Percentage of the time since the last call that the link was busy
+        unsigned int utilisation(unsigned long now);
+
+        const LinkStats& stats() const { return _stats; }
+
+    private:
+        void refill(unsigned long now);
+
+        unsigned long _idlePollMs;
+        unsigned long _fastPollMs;
+        unsigned long _boostMs;
+        unsigned int _burst;
+        unsigned long _refillMs;
+
+        unsigned int _tokens;
+        unsigned long _lastRefill;
+        bool _sent;
+        unsigned long _lastSend;
+        bool _written;
+        unsigned long _lastWrite;
+        unsigned long _lastPoll;
+        bool _awaitingReply;
+        bool _confirming;
+        bool _waiting;
+        unsigned long _waitingSince;
+        bool _throttled;
+        unsigned long _lastQueueMillis;
+
+        uint64_t _busyMicros;
+        unsigned long _utilisationSince;
+
+        LinkStats _stats;
+};
+
+#endif // __LINK_SCHEDULER_HPP_
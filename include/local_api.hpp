@@ -0,0 +1,225 @@
+#ifndef __LOCAL_API_HPP_
+#define __LOCAL_API_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_router.hpp"
+#include "scratch.hpp"
+#include "unit_bridge.hpp"
+
+// A small HTTP and WebSocket server for clients on the same LAN, such as
+// wall panels, so that they can control the unit without a round trip
+// through the broker, and keep working while it is down. Nothing in it
+// depends on the platform: a LocalApiHost carries the bytes on whatever TCP
+// stack there is, and hands commands to the UnitBridge.
+//
+// It is off unless built with a LOCAL_API_PORT, and every request must carry
+// the shared token given to setToken(), as "Authorization: Bearer <token>"
+// or, since browsers can't set headers on a WebSocket, "?token=<token>";
+// without one it is answered with a 401. A POST /set or GET /ws from a web
+// page on another origin, one whose Origin header doesn't name the Host it
+// was sent to, is answered with a 403, so that a page the user visits can't
+// drive the unit through their browser.
+//
+//   GET /state   the state as one JSON object, as on <prefix>/state
+//   POST /set    a <prefix>/set payload, answered with {"result":"ok"} or,
+//                with a 400, {"result":"invalid"}
+//   GET /ws      a WebSocket. A text message is a <prefix>/set payload, and
+//                is answered the same way. The whole state is sent on
+//                connecting, and then just the fields that changed, as soon
+//                as the unit reports them: {"mode":"COOL","temperature":22.5}
+//
+// The state has the fields of <prefix>/state and "current_temperature",
+// which is sent on every change, without MQTT's hysteresis.
+//
+// Everything is in fixed per-client slots. Requests are read a line at a
+// time, and only the headers that matter are kept, so a browser's long
+// request fits in LOCAL_API_RECEIVE_SIZE. A client that can't take an
+// update when it is due has the fields that changed marked instead, and
+// gets their latest values in one message when it has room again, however
+// many changes that covers. One that has had no room for LOCAL_API_STALL_MS
+// is dropped. Fragmented WebSocket messages aren't supported.
+
+#ifndef LOCAL_API_PORT
+#define LOCAL_API_PORT 0
+#endif
+#ifndef LOCAL_API_MAX_CLIENTS
+#define LOCAL_API_MAX_CLIENTS 4
+#endif
+// A request line, header line, POST body or WebSocket frame
+#define LOCAL_API_RECEIVE_SIZE 192
+// The largest response or message sent, headers and all
+#define LOCAL_API_SEND_SIZE 320
+#ifndef LOCAL_API_STALL_MS
+#define LOCAL_API_STALL_MS 10000
+#endif
+// A connection that hasn't sent a whole request by then is closed
+#ifndef LOCAL_API_REQUEST_MS
+#define LOCAL_API_REQUEST_MS 5000
+#endif
+
+// The state fields, as bits
+#define LOCAL_FIELD_POWER 0x01
+#define LOCAL_FIELD_MODE 0x02
+#define LOCAL_FIELD_TEMPERATURE 0x04
+#define LOCAL_FIELD_FAN 0x08
+#define LOCAL_FIELD_VANE 0x10
+#define LOCAL_FIELD_ROOM 0x20
+#define LOCAL_FIELDS_ALL 0x3f
+
+#define LOCAL_WEBSOCKET_KEY_LENGTH 24
+// The longest Host kept to compare with the Origin; a longer one matches none
+#define LOCAL_API_HOST_SIZE 64
+
+enum LocalClientState {
+    LOCAL_FREE = 0,
+    // Reading the request line and headers
+    LOCAL_REQUEST,
+    // Reading a POST body
+    LOCAL_BODY,
+    LOCAL_WEBSOCKET,
+    // Answered; waiting for the host to report the connection closed
+    LOCAL_CLOSING
+};
+
+enum LocalRoute {
+    // The request line hasn't been read yet
+    LOCAL_ROUTE_NONE = 0,
+    LOCAL_ROUTE_UNKNOWN,
+    LOCAL_ROUTE_STATE,
+    LOCAL_ROUTE_SET,
+    LOCAL_ROUTE_SOCKET
+};
+
+enum LocalReply {
+    LOCAL_REPLY_NONE = 0,
+    LOCAL_REPLY_OK,
+    LOCAL_REPLY_INVALID
+};
+
+typedef struct {
+    LocalClientState state;
+    LocalRoute route;
+    unsigned long connectedAt;
+    // What a WebSocket client hasn't been sent yet: the answer to its last
+    // message, and the fields that have changed
+    LocalReply reply;
+    uint8_t dirty;
+    // Since when that has been held back for want of room
+    bool blocked;
+    unsigned long blockedAt;
+    // The request so far: whether the rest of a header line too long to keep
+    // is being skipped, whether it asked for a WebSocket, and with what key
+    bool skipping;
+    bool upgrade;
+    char key[LOCAL_WEBSOCKET_KEY_LENGTH + 1];
+    // Whether it carried the token. Whichever of its Host and Origin came
+    // first is kept in `seen` to compare the other with; `foreign` is set
+    // when they differ, or can't be compared.
+    bool authorized;
+    bool hostSeen;
+    bool originSeen;
+    bool foreign;
+    char seen[LOCAL_API_HOST_SIZE + 1];
+    size_t contentLength;
+    // Bytes of the current line, body or frame in buffer
+    size_t received;
+    uint8_t buffer[LOCAL_API_RECEIVE_SIZE];
+} LocalClient;
+
+typedef struct {
+    unsigned long connections;
+    // Turned away with all slots taken
+    unsigned long refused;
+    unsigned long commands;
+    unsigned long invalid;
+    unsigned long updates;
+    // Updates that went out late, merged with later ones
+    unsigned long merged;
+    // Clients dropped for not keeping up
+    unsigned long stalled;
+    // Requests turned away for a missing or wrong token, or from a page on
+    // another origin
+    unsigned long forbidden;
+} LocalApiStats;
+
+class LocalApiHost {
+    public:
+        virtual ~LocalApiHost() {}
+
+        // Bytes the client's connection can take now
+        virtual size_t space(int client) = 0;
+        // Sends bytes, no more than space() said there was room for
+        virtual void send(int client, const char* data, size_t length) = 0;
+        // Closes the connection once what was sent has gone. The host calls
+        // disconnected() when it has.
+        virtual void close(int client) = 0;
+        // A <prefix>/set payload, for UnitBridge::set()
+        virtual MessageResult command(const char* payload, size_t length) = 0;
+};
+
+class LocalApi {
+    public:
+        LocalApi(LocalApiHost* host, ScratchArena* scratch);
+
+        // The token every request must carry, which must outlive the
+        // LocalApi. Until one is set, or with an empty one, every request is
+        // turned away.
+        void setToken(const char* token) { _token = token; }
+
+        // A new connection: returns the client number the host is to use
+        // for it, or -1 if every slot is taken, in which case the host is
+        // to send it REFUSED_RESPONSE and close it
+        int connected(unsigned long now);
+        void received(int client, const uint8_t* data, size_t length, unsigned long now);
+        // The connection has room again
+        void acked(int client, unsigned long now);
+        void disconnected(int client);
+
+        // What the unit reports, as the bridge is given it
+        void settingsChanged(const UnitSettings& settings, unsigned long now);
+        void roomTemperature(int tenths, unsigned long now);
+
+        // Sends what was held back, and closes stalled and idle connections;
+        // call every so often
+        void service(unsigned long now);
+
+        int clients() const;
+        const LocalApiStats& stats() const { return _stats; }
+
+        static const char REFUSED_RESPONSE[];
+
+        // The Sec-WebSocket-Accept value for a key, which needs 29 bytes
+        static void acceptKey(const char* key, char* out);
+
+    private:
+        void requestLine(int client, const char* line, size_t length);
+        void headerLine(int client, const char* line, size_t length, bool truncated);
+        void sameOrigin(int client, const char* value, size_t length, bool truncated, bool origin);
+        bool tokenMatches(const char* value, size_t length) const;
+        void endOfHeaders(int client, unsigned long now);
+        void receiveRequest(int client, const uint8_t* data, size_t length, unsigned long now);
+        void receiveFrames(int client, unsigned long now);
+        void message(int client, const char* payload, size_t length, unsigned long now);
+        void flush(int client, unsigned long now);
+
+        void respond(int client, const char* status, const char* body, size_t length);
+        bool sendFrame(int client, uint8_t opcode, const char* payload, size_t length);
+        void closeSocket(int client, uint16_t code);
+        void finish(int client);
+        size_t formatState(char* out, size_t size, uint8_t fields) const;
+        void changed(uint8_t fields, unsigned long now);
+
+        LocalApiHost* _host;
+        ScratchArena* _scratch;
+        const char* _token;
+        LocalClient _clients[LOCAL_API_MAX_CLIENTS];
+        LocalApiStats _stats;
+
+        // The state as last reported, formatted as it is sent
+        PublishedSettings _state;
+        char _room[TEMPERATURE_MAX_FORMATTED];
+};
+
+#endif // __LOCAL_API_HPP_
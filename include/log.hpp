@@ -0,0 +1,56 @@
+#ifndef __LOG_HPP_
+#define __LOG_HPP_
+
+#include <Arduino.h>
+#include <Udp.h>
+#include <Syslog.h>
+
+// Logging pipeline. Each message is formatted exactly once, into a ring
+// buffer, and the sinks drain that buffer from the scheduler:
+//
+//  * the UART sink writes to the debug serial port, never more than its TX
+//    FIFO can take without blocking;
+//  * the syslog sink packs as many records as fit into one UDP datagram,
+//    newline-separated, and sends at most one datagram per
+//    LOG_SYSLOG_FLUSH_MS unless a full datagram's worth is waiting.
+//
+// Messages less severe than LOG_COMPILE_LEVEL are removed by the compiler,
+// arguments and all. The syslog_log_level setting filters further at
+// runtime, for the syslog sink only.
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+
+#define LOG_BUFFER_SIZE 2048
+#define LOG_MAX_MESSAGE 192
+#define LOG_SYSLOG_FLUSH_MS 1000
+#define LOG_SYSLOG_MAX_DATAGRAM 1024
+
+#define LOG_PRINT(pri, message) \
+    do { if ((pri) <= LOG_COMPILE_LEVEL) logWrite((pri), (message)); } while (0)
+#define LOG_PRINTF(pri, ...) \
+    do { if ((pri) <= LOG_COMPILE_LEVEL) logWritef((pri), __VA_ARGS__); } while (0)
+
+typedef struct {
+    unsigned long records;
+    unsigned long truncated;
+    unsigned long uartDropped;
+    unsigned long syslogDropped;
+    unsigned long syslogDatagrams;
+} LogStats;
+
+void logWrite(uint8_t pri, const char* message);
+void logWritef(uint8_t pri, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+
+void logSetSerial(HardwareSerial* serial);
+void logSetSyslog(UDP* udp, const char* host, uint16_t port, const char* hostname, const char* appName, uint8_t mask);
+
+// Non-blocking; call often
+void logDrain(unsigned long now);
+// Blocks until both sinks have sent everything, e.g. before a restart
+void logFlush();
+
+const LogStats& logStats();
+
+#endif // __LOG_HPP_
@@ -8,6 +8,10 @@
 #include <WiFiManager.h>
 #include <Bounce2.h>
 
+#include "scheduler.hpp"
+#include "settings.hpp"
+#include "topics.hpp"
+
 const char* otaPassword = "aircon";
 
 #ifndef HARDWARE_V02
@@ -46,94 +50,217 @@ HardwareSerial* DebugSerial = &Serial;
 
 bool heatPumpDetected = false;
 bool detectHeatPump();
-bool updateHeatpump = false;
-unsigned long lastHeatpumpSettingsChange = 0;
 
+// The bridging tunables, COALESCE_*, LINK_*, COMMAND_CONFIRM_* and
+// ROOM_TEMPERATURE_*, are in unit_bridge.hpp.
+
+// Commands are checked against the CN105 reply carrying the unit's settings:
+// command byte 0x62, with 0x02 as the first data byte
+#define CN105_INFO_REPLY 0x62
+#define CN105_INFO_SETTINGS 0x02
+
+// loop() task periods and deadlines, in ms; see scheduler.hpp. The heatpump
+// task runs on every pass and between every other task; it counts a miss
+// whenever it is kept waiting longer than its deadline.
+#define HEATPUMP_TASK_DEADLINE_MS 50
+#define LOG_TASK_DEADLINE_MS 100
+#define OTA_TASK_PERIOD_MS 20
+#define PUBLISH_TASK_PERIOD_MS 20
+#define STATUS_TASK_PERIOD_MS 60000
+#define BUTTON_TASK_PERIOD_MS 10
+#define CAPTURE_TASK_PERIOD_MS 50
+#define CONNECTION_TASK_PERIOD_MS 1000
+#define MQTT_TASK_PERIOD_MS 100
+#define TRACE_TASK_PERIOD_MS 100
+#define HISTORY_TASK_PERIOD_MS 1000
+#define LOCAL_API_TASK_PERIOD_MS 100
+// Under POWER_SAVE, the publish, trace, ota, mqtt, local, capture and button
+// tasks, which only look for work, run at most every POWER_SAVE_POLL_MS; see
+// power_save.hpp
+
+// Each task's stats, published to <prefix>/tasks; about 80 bytes a task
+#define TASK_STATS_PAYLOAD_SIZE (SCHEDULER_MAX_TASKS * 80)
+
+// The metrics registry (see metrics.hpp) is published to <prefix>/metrics
+// with the status: the counters and gauges in one message, then each
+// histogram in its own. METRICS_PAYLOAD_SIZE holds the largest of them.
+#define METRICS_PAYLOAD_SIZE \
+    (METRICS_FORMAT_MAX_LENGTH > METRICS_HISTOGRAM_MAX_LENGTH ? METRICS_FORMAT_MAX_LENGTH : METRICS_HISTOGRAM_MAX_LENGTH)
+
+// Build with -DPACKET_CAPTURE to record the CN105 link into a ring buffer; see
+// packet_capture.hpp. It is dumped to <prefix>/capture, as pcap, in chunks of
+// at most PACKET_CAPTURE_CHUNK bytes.
+#define PACKET_CAPTURE_CHUNK 1024
+
+// The binary trace (see trace.hpp) is published to <prefix>/trace in chunks
+// of at most TRACE_CHUNK bytes: as soon as a chunk's worth is waiting, and
+// otherwise at most once per TRACE_FLUSH_MS
+#define TRACE_CHUNK 512
+#define TRACE_FLUSH_MS 1000
+
+// The stall profiler (see stall_profiler.hpp) publishes the slowest passes
+// through loop() to <prefix>/stalls with the status, and after a reset, what
+// the last boot was doing, in at most STALLS_PAYLOAD_SIZE bytes
+#define STALLS_PAYLOAD_SIZE 1024
+
+// The room temperature and settings history (see history.hpp) answers
+// <prefix>/history/get on <prefix>/history. Build with -DHISTORY_FLASH to
+// save it every HISTORY_FLASH_PERIOD_MS, as a record like the settings, and
+// load it again at boot.
+#ifndef HISTORY_FLASH_PERIOD_MS
+#define HISTORY_FLASH_PERIOD_MS 3600000
+#endif
+#define HISTORY_RECORD_PATH_A "/history.a"
+#define HISTORY_RECORD_PATH_B "/history.b"
+
+// Settings are stored as a binary record in two slots, written alternately;
+// see config_store.hpp. CONFIG_SPIFFS_PATH is the JSON file that earlier
+// firmware used. It is only read to migrate it to a record, and only
+// written in builds with -DCONFIG_JSON_EXPORT, for debugging.
+#define CONFIG_RECORD_PATH_A "/config.a"
+#define CONFIG_RECORD_PATH_B "/config.b"
 #define CONFIG_SPIFFS_PATH "/config.json"
 
+// What the fast boot path needs to rejoin the network without WiFiManager;
+// see connection_cache.hpp. The direct connect is abandoned for WiFiManager
+// after FAST_CONNECT_TIMEOUT_MS.
+#define CONNECTION_RECORD_PATH_A "/connection.a"
+#define CONNECTION_RECORD_PATH_B "/connection.b"
+#ifndef FAST_CONNECT_TIMEOUT_MS
+#define FAST_CONNECT_TIMEOUT_MS 3000
+#endif
+
 
 #ifndef WIFIMANAGER_AP_PASSWORD
 #define WIFIMANAGER_AP_PASSWORD "espaircon"
 #endif
 
-#define MAX_LENGTH_MQTT_HOST 128
-#define MAX_LENGTH_MQTT_PORT 6
-#define MAX_LENGTH_MQTT_USERNAME 64
-#define MAX_LENGTH_MQTT_PASSWORD 64
-#define MAX_LENGTH_MQTT_TOPIC_PREFIX 32
-#define MAX_LENGTH_SYSLOG_HOST 128
-#define MAX_LENGTH_SYSLOG_PORT 6
-#define MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME 32
-#define MAX_LENGTH_SYSLOG_APP_NAME 32
-#define MAX_LENGTH_SYSLOG_LOG_LEVEL 8
-
-typedef struct {
-    char mqtt_host[MAX_LENGTH_MQTT_HOST] = "";
-    char mqtt_port[MAX_LENGTH_MQTT_PORT] = "1883";
-    char mqtt_username[MAX_LENGTH_MQTT_USERNAME] = "";
-    char mqtt_password[MAX_LENGTH_MQTT_PASSWORD] = "";
-    char mqtt_topic_prefix[MAX_LENGTH_MQTT_TOPIC_PREFIX] = "";
-    char syslog_host[MAX_LENGTH_SYSLOG_HOST] = "";
-    char syslog_port[MAX_LENGTH_SYSLOG_PORT] = "514";
-    char syslog_device_hostname[MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME] = "";
-    char syslog_app_name[MAX_LENGTH_SYSLOG_APP_NAME] = "aircon";
-    char syslog_log_level[MAX_LENGTH_SYSLOG_LOG_LEVEL] = "INFO";
-} Settings;
-
 WiFiManagerParameter *custom_mqtt_host;
 WiFiManagerParameter *custom_mqtt_port;
 WiFiManagerParameter *custom_mqtt_username;
 WiFiManagerParameter *custom_mqtt_password;
+WiFiManagerParameter *custom_local_api_token;
 WiFiManagerParameter *custom_mqtt_topic_prefix;
 WiFiManagerParameter *custom_syslog_host;
 WiFiManagerParameter *custom_syslog_port;
 WiFiManagerParameter *custom_syslog_device_hostname;
 WiFiManagerParameter *custom_syslog_app_name;
 WiFiManagerParameter *custom_syslog_log_level;
-WiFiManager *wifiManager;
+WiFiManagerParameter *custom_mqtt_json_state;
+WiFiManager *wifiManager = NULL;
 
 Settings settings;
 
-char mqtt_topic_info[128];
+// AsyncMqttClient keeps a pointer to the will topic rather than a copy, so
+// it is the one topic kept formatted; the rest are composed from topics.hpp
+// when they are used
+char mqtt_topic_will[MAX_LENGTH_MQTT_TOPIC_PREFIX + TOPIC_MAX_SUFFIX + 2];
+
+// What ESP.getResetReason() and friends return as Strings, copied out once at
+// boot so that publishing them on each MQTT connect doesn't allocate
+#define MAX_LENGTH_CORE_VERSION 32
+#define MAX_LENGTH_SKETCH_MD5 33
+char systemCoreVersion[MAX_LENGTH_CORE_VERSION];
+char systemSketchMD5[MAX_LENGTH_SKETCH_MD5];
 
-char mqtt_topic_availability[128];
-char mqtt_topic_power_state[128];
-char mqtt_topic_mode_state[128];
-char mqtt_topic_temperature_state[128];
-char mqtt_topic_fan_state[128];
-char mqtt_topic_vane_state[128];
-char mqtt_topic_current_temperature_state[128];
+// Boot progress: whether WiFi came up on the fast path, whether MQTT has
+// connected yet and whether that was to a cached broker address, and when
+// the first retained state went out
+bool bootFastConnect = false;
+bool mqttHasConnected = false;
+bool mqttBrokerCached = false;
+bool mqttRetryByName = false;
+bool connectionRemembered = false;
+unsigned long bootPublishMillis = 0;
 
-char mqtt_topic_power_command[128];
-char mqtt_topic_mode_command[128];
-char mqtt_topic_temperature_command[128];
-char mqtt_topic_fan_command[128];
-char mqtt_topic_vane_command[128];
+// Set by the WiFi event handlers, which run in the SDK's context, for
+// mqttTask() to act on
+volatile bool wifiCameUp = false;
+volatile bool wifiWentDown = false;
 
 #define MQTT_DISCONNECTED false
 #define MQTT_CONNECTED true
 bool mqttStatus;
 long mqttLastSeen;
 
+// Indices into the metrics registry; see setupMetrics()
+int metricMqttPublished = -1;
+int metricMqttPublishFailed = -1;
+int metricMqttQueued = -1;
+int metricMqttDropped = -1;
+int metricMqttQueuePeak = -1;
+int metricMqttQueueMillis = -1;
+int metricMqttConnects = -1;
+int metricMqttDisconnects = -1;
+int metricMqttAttempts = -1;
+int metricPayloadAssembled = -1;
+int metricPayloadRejected = -1;
+int metricTracePublished = -1;
+int metricTraceDropped = -1;
+int metricMqttDownMillis = -1;
+int metricMqttLongestDownMillis = -1;
+int metricCommands = -1;
+int metricRoomTemperatureSkipped = -1;
+int metricLinkWrites = -1;
+int metricLinkPolls = -1;
+int metricLinkThrottled = -1;
+int metricConfirmRetries = -1;
+int metricConfirmDiverged = -1;
+int metricLinkUtilisation = -1;
+int metricLinkQueueMillis = -1;
+int metricConfirmMillis = -1;
+int metricHeapFree = -1;
+int metricHeapMaxBlock = -1;
+int metricHeapFragmentation = -1;
+int metricBootFastConnect = -1;
+int metricBootPublishMillis = -1;
+int metricScratchPeak = -1;
+int metricLoopMicros = -1;
+int metricSyncMicros = -1;
+int metricUpdateMicros = -1;
+int metricCommandMillis = -1;
+int metricLocalCommands = -1;
+int metricLocalStalled = -1;
+int metricLocalForbidden = -1;
+int metricLocalClients = -1;
+int metricAwakePercent = -1;
+int metricWakeLateMicros = -1;
+
 Bounce clearSettingsButton;
 bool shouldStartConfigAP = false;
 bool shouldResetSettings = false;
 
 void setupClearSettingsButtonHandler();
+bool importConfigJson();
 void loadConfig();
+bool fastConnectWifi();
+void rememberConnection();
 void setupWifiManager();
+void readWifiManagerParameters();
 bool startWifiManager();
+void teardownWifiManager();
 void saveConfig();
 
 void handleClearSettingsButton();
 
-bool validatePowerValue(const char* value);
-bool validateModeValue(const char* value);
-bool validateTemperatureValue(const char* value);
-bool validateFanValue(const char* value);
-bool validateVaneValue(const char* value);
-
+void readSystemBootInfo();
 void publishSystemBootInfo();
 void publishSystemStatus();
+void publishCoalescerStats();
+void publishTaskStats();
+void publishPacketCapture();
+void publishMetrics();
+void publishStalls();
+void publishStallRecord(const char* resetReason);
+uint16_t mqttPublish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length = 0);
+uint16_t mqttSend(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length);
+void mqttTask();
+uint16_t mqttSubscribe(const char* suffix);
+void setupMetrics();
+void setupLocalApi();
+void addTask(const char* name, TaskFunction run, unsigned long period, unsigned long deadline, bool critical = false);
+void setupScheduler();
+void wakeLoop();
+void sleepUntilDue();
 
 #endif // __MAIN_HPP_
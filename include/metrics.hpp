@@ -0,0 +1,90 @@
+#ifndef __METRICS_HPP_
+#define __METRICS_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A fixed-size registry of counters, gauges and histograms. Metrics are added
+// once, in setup(), and referred to afterwards by the index that add*()
+// returns; recording one is a few instructions and never allocates. An index
+// of -1, as returned when a table is full or a name is longer than
+// METRICS_MAX_NAME, is ignored.
+//
+// Histograms are log2-bucketed: bucket 0 counts zeros, bucket i counts values
+// in [2^(i-1), 2^i), and the last bucket counts everything larger.
+
+#define METRICS_MAX_COUNTERS 24
+#define METRICS_MAX_GAUGES 16
+#define METRICS_MAX_HISTOGRAMS 10
+#define METRICS_HISTOGRAM_BUCKETS 24
+#define METRICS_MAX_NAME 20
+
+// The most that format() and formatHistogram() can write, NUL included, with
+// every table full, every name METRICS_MAX_NAME long and every number at its
+// widest: 10 digits for a uint32_t, 11 for an int32_t and 20 for the sum
+#define METRICS_FORMAT_MAX_LENGTH \
+    (32 + METRICS_MAX_COUNTERS * (METRICS_MAX_NAME + 14) + METRICS_MAX_GAUGES * (METRICS_MAX_NAME + 15))
+#define METRICS_HISTOGRAM_MAX_LENGTH (METRICS_MAX_NAME + 72 + METRICS_HISTOGRAM_BUCKETS * 11)
+
+typedef struct {
+    const char* name;
+    uint32_t value;
+} Counter;
+
+typedef struct {
+    const char* name;
+    int32_t value;
+} Gauge;
+
+typedef struct {
+    const char* name;
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} Histogram;
+
+class Metrics {
+    public:
+        Metrics();
+
+        int addCounter(const char* name);
+        int addGauge(const char* name);
+        int addHistogram(const char* name);
+
+        void increment(int counter, uint32_t by = 1);
+        void set(int gauge, int32_t value);
+        void observe(int histogram, uint32_t value);
+
+        // Write the counters and gauges, and one histogram, as compact JSON
+        // objects:
+        //
+        //   {"up":<s>,"c":{"<name>":n,...},"g":{"<name>":n,...}}
+        //   {"up":<s>,"h":{"<name>":[count,sum,max,bucket0,bucket1,...]}}
+        //
+        // The histograms are written one at a time so that no payload grows
+        // past METRICS_FORMAT_MAX_LENGTH, however long the firmware has been
+        // up. Trailing empty buckets are left out. Return the length written,
+        // or 0 if it didn't fit.
+        size_t format(char* out, size_t size, unsigned long uptimeSeconds) const;
+        size_t formatHistogram(int histogram, char* out, size_t size, unsigned long uptimeSeconds) const;
+
+        static int bucket(uint32_t value);
+
+        const Counter& counter(int index) const { return _counters[index]; }
+        const Histogram& histogram(int index) const { return _histograms[index]; }
+        int histograms() const { return _histogramCount; }
+        // How many add*() calls returned -1
+        int refused() const { return _refused; }
+
+    private:
+        Counter _counters[METRICS_MAX_COUNTERS];
+        Gauge _gauges[METRICS_MAX_GAUGES];
+        Histogram _histograms[METRICS_MAX_HISTOGRAMS];
+        int _counterCount;
+        int _gaugeCount;
+        int _histogramCount;
+        int _refused;
+};
+
+#endif // __METRICS_HPP_
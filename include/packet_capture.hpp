@@ -0,0 +1,71 @@
+#ifndef __PACKET_CAPTURE_HPP_
+#define __PACKET_CAPTURE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary capture of the CN105 link. Each packet the HeatPump library sends or
+// receives is copied, with a micros() timestamp and its direction, into a
+// fixed-size ring of records; the oldest records are overwritten once it is
+// full. Recording is a memcpy, so it doesn't disturb the link timing it is
+// there to observe.
+//
+// The capture is read back as a pcap stream (LINKTYPE_USER0), a chunk at a
+// time. Each record's data starts with one pseudo-header byte giving the
+// direction, followed by the frame as it appeared on the wire. Timestamps
+// are micros() since boot and wrap after ~71 minutes.
+
+#ifndef PACKET_CAPTURE_RECORDS
+#define PACKET_CAPTURE_RECORDS 128
+#endif
+// Longest CN105 frame: 5 header bytes, 16 data bytes and a checksum
+#define PACKET_CAPTURE_MAX_PACKET 22
+
+#define PACKET_CAPTURE_SENT 0
+#define PACKET_CAPTURE_RECEIVED 1
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINKTYPE_USER0 147
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_HEADER_SIZE 16
+// A chunk must have room for at least the file header and one record
+#define PCAP_MIN_CHUNK (PCAP_HEADER_SIZE + PCAP_RECORD_HEADER_SIZE + 1 + PACKET_CAPTURE_MAX_PACKET)
+
+typedef struct {
+    uint32_t micros;
+    uint8_t direction;
+    // Length on the wire; only the first PACKET_CAPTURE_MAX_PACKET bytes are kept
+    uint8_t length;
+    uint8_t data[PACKET_CAPTURE_MAX_PACKET];
+} CapturedPacket;
+
+class PacketCapture {
+    public:
+        PacketCapture();
+
+        void record(uint8_t direction, const uint8_t* packet, unsigned int length, unsigned long micros);
+        void clear();
+
+        // Writes the next chunk of the capture, as pcap, into out. Start with
+        // *cursor = 0; returns the number of bytes written, or 0 once the
+        // whole capture has been read. Chunks only contain whole records, so
+        // concatenating them in order gives a valid pcap file. Recording may
+        // carry on between chunks.
+        size_t read(uint32_t* cursor, uint8_t* out, size_t size) const;
+
+        unsigned int count() const { return _count; }
+        uint32_t captured() const { return _captured; }
+        uint32_t overwritten() const { return _overwritten; }
+
+    private:
+        CapturedPacket _records[PACKET_CAPTURE_RECORDS];
+        unsigned int _next;
+        unsigned int _count;
+        // Sequence number of the next record
+        uint32_t _captured;
+        uint32_t _overwritten;
+};
+
+#endif // __PACKET_CAPTURE_HPP_
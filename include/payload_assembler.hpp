@@ -0,0 +1,83 @@
+#ifndef __PAYLOAD_ASSEMBLER_HPP_
+#define __PAYLOAD_ASSEMBLER_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Puts inbound MQTT payloads back together. AsyncMqttClient hands a message
+// that doesn't arrive in one TCP segment to onMessage in pieces, each with
+// its offset (`index`) into the whole payload (`total` bytes). A message
+// that arrives whole is returned as it is, without a copy; the pieces of
+// any other are copied into one of PAYLOAD_ASSEMBLER_SLOTS fixed buffers,
+// one per topic being assembled, and returned once the last one is in.
+//
+// Rejected, and counted:
+//   * a message longer than PAYLOAD_ASSEMBLER_SIZE; its other pieces are
+//     dropped without being counted again;
+//   * a message whose next piece isn't the one that follows, or that a new
+//     message on the same topic interrupts (interleaved);
+//   * the first piece of a message when every slot is busy.
+//
+// Nothing is allocated: the slots are part of the object.
+
+#ifndef PAYLOAD_ASSEMBLER_SLOTS
+#define PAYLOAD_ASSEMBLER_SLOTS 2
+#endif
+// Room for any <prefix>/set payload, with whitespace to spare
+#ifndef PAYLOAD_ASSEMBLER_SIZE
+#define PAYLOAD_ASSEMBLER_SIZE 256
+#endif
+
+enum AssemblyResult {
+    // Part of a message; wait for the rest
+    ASSEMBLY_PENDING = 0,
+    // A whole message, in *payload and *length
+    ASSEMBLY_COMPLETE,
+    // Dropped; see the counters
+    ASSEMBLY_REJECTED
+};
+
+typedef struct {
+    // Messages that arrived whole, and messages put together from pieces
+    unsigned long whole;
+    unsigned long assembled;
+    unsigned long oversize;
+    unsigned long interleaved;
+    unsigned long noSlot;
+} AssemblerStats;
+
+class PayloadAssembler {
+    public:
+        PayloadAssembler();
+
+        // One onMessage callback's worth. On ASSEMBLY_COMPLETE, *payload
+        // points either at the callback's own payload or at a slot, which
+        // stays valid until the next call.
+        AssemblyResult add(const char* topic, const char* payload, size_t len, size_t index, size_t total,
+                           const char** message, size_t* length);
+        // Drops every message in progress, as when the connection is lost
+        void reset();
+
+        // Messages rejected for any reason
+        unsigned long rejected() const { return _stats.oversize + _stats.interleaved + _stats.noSlot; }
+        const AssemblerStats& stats() const { return _stats; }
+
+    private:
+        typedef struct {
+            bool used;
+            // Oversize: the rest of its pieces are swallowed
+            bool discarding;
+            uint32_t topicHash;
+            size_t total;
+            size_t received;
+            char buffer[PAYLOAD_ASSEMBLER_SIZE];
+        } Slot;
+
+        Slot* find(uint32_t topicHash);
+        Slot* claim(uint32_t topicHash, size_t total, bool discarding);
+
+        Slot _slots[PAYLOAD_ASSEMBLER_SLOTS];
+        AssemblerStats _stats;
+};
+
+#endif // __PAYLOAD_ASSEMBLER_HPP_
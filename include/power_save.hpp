@@ -0,0 +1,110 @@
+#ifndef __POWER_SAVE_HPP_
+#define __POWER_SAVE_HPP_
+
+#include <stdint.h>
+
+// Lets loop() sleep until its next deadline instead of spinning through
+// passes that find nothing to do, so that the SDK can power the modem down
+// between DTIM beacons, and with light sleep the CPU too.
+//
+// After each pass the firmware works out how long it has until the soonest
+// thing it knows is due: the next scheduled task, the next CN105 poll or
+// reply read, the coalesced command flush. It asks sleepFor() whether that
+// is worth sleeping through, and sleeps in esp_delay() until woken(), which
+// is where the SDK enters the sleep mode WiFi was set to. A callback that
+// brings work in, an MQTT message or a local API command, calls wake(),
+// which says whether there is a sleep to cut short; esp_schedule() then has
+// esp_delay() look at woken() again. (A plain delay() would sleep on: as of
+// core 3.x, esp_schedule() doesn't end one.)
+//
+// Sleeps are capped at maxSleepMs, for what has no deadline that loop() can
+// see: command retries, a small room temperature change, and the MQTT
+// keepalive, which the TCP stack's timers send. A gap shorter than
+// minSleepMs isn't worth waking up from, and is spun through.
+//
+// The firmware measures its own duty cycle, the share of the time that
+// loop() was awake, and how late each sleep ended: after it was due, or
+// after wake() asked for it to end. With light sleep, that is the cost of
+// the CPU waking.
+
+enum PowerSavePolicy {
+    // loop() runs pass after pass, and nothing sleeps but the modem, when the
+    // SDK finds it idle
+    POWER_SAVE_OFF = 0,
+    // loop() sleeps between deadlines, with WiFi in modem sleep
+    POWER_SAVE_MODEM,
+    // as POWER_SAVE_MODEM, with WiFi in light sleep, which stops the CPU too
+    POWER_SAVE_LIGHT
+};
+
+#ifndef POWER_SAVE
+#define POWER_SAVE POWER_SAVE_OFF
+#endif
+#ifndef POWER_SAVE_MIN_SLEEP_MS
+#define POWER_SAVE_MIN_SLEEP_MS 2
+#endif
+// Well inside the MQTT keepalive, and short enough that the deadlines loop()
+// can't see are met about as well as they were
+#ifndef POWER_SAVE_MAX_SLEEP_MS
+#define POWER_SAVE_MAX_SLEEP_MS 1000
+#endif
+// Under power save, tasks that only look for work run no more often than
+// this, so that they don't wake loop() every few ms
+#ifndef POWER_SAVE_POLL_MS
+#define POWER_SAVE_POLL_MS 250
+#endif
+
+typedef struct {
+    unsigned long sleeps;
+    // Sleeps that wake() cut short
+    unsigned long woken;
+    uint64_t sleptMicros;
+    // How late the last sleep ended, and the latest any did
+    unsigned long lastLateMicros;
+    unsigned long maxLateMicros;
+} PowerSaveStats;
+
+class PowerSave {
+    public:
+        PowerSave(PowerSavePolicy policy, unsigned long minSleepMs, unsigned long maxSleepMs);
+
+        PowerSavePolicy policy() const { return _policy; }
+        void setPolicy(PowerSavePolicy policy) { _policy = policy; }
+        bool enabled() const { return _policy != POWER_SAVE_OFF; }
+
+        // How long to sleep for, in ms, given how long it is until the
+        // soonest deadline; 0 to carry straight on
+        unsigned long sleepFor(unsigned long idleMs) const;
+        // Call either side of a sleep of `ms`, with micros()
+        void sleeping(unsigned long nowMicros, unsigned long ms);
+        void awake(unsigned long nowMicros);
+        // Call, with micros(), from a callback that brings in work. Returns
+        // true if a sleep is under way, for the caller to cut short.
+        bool wake(unsigned long nowMicros);
+        // Whether wake() has cut the sleep under way short
+        bool woken() const { return _woken; }
+
+        // Percentage of the time since the last call that loop() was awake
+        unsigned int dutyCycle(unsigned long nowMicros);
+
+        const PowerSaveStats& stats() const { return _stats; }
+
+    private:
+        PowerSavePolicy _policy;
+        unsigned long _minSleepMs;
+        unsigned long _maxSleepMs;
+
+        // Set by callbacks, which run while loop() sleeps
+        volatile bool _sleeping;
+        volatile bool _woken;
+        volatile unsigned long _wokenAt;
+        unsigned long _sleptAt;
+        unsigned long _sleepMs;
+
+        uint64_t _asleepMicros;
+        unsigned long _dutySince;
+
+        PowerSaveStats _stats;
+};
+
+#endif // __POWER_SAVE_HPP_
@@ -0,0 +1,109 @@
+#ifndef __PUBLISH_QUEUE_HPP_
+#define __PUBLISH_QUEUE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "topics.hpp"
+
+// Holds on to publishes that couldn't go out, because the TCP send buffer
+// was full or the MQTT session was down, and sends them once they can.
+//
+// A publish goes straight out unless something of its priority or a higher
+// one is waiting, so that the queue doesn't reorder a class. drain() sends
+// what is waiting, retained state first, then availability, then info and
+// metrics, and oldest first within each, stopping at the first that doesn't
+// go, as the rest would most likely not fit either. A retained publish
+// replaces one still queued for the same topic: only the latest value
+// matters to the broker.
+//
+// Payloads are copied into a fixed pool, so queueing never allocates. When
+// the pool or the entry table is full, the oldest publish of the least
+// important class queued is dropped to make room, or the new one if it is
+// the least important.
+
+// Entries, and bytes of payload, that can be queued at once. The pool must
+// hold the largest payload queued, <prefix>/metrics.
+#ifndef PUBLISH_QUEUE_ENTRIES
+#define PUBLISH_QUEUE_ENTRIES 16
+#endif
+#ifndef PUBLISH_QUEUE_BYTES
+#define PUBLISH_QUEUE_BYTES 2048
+#endif
+
+// Most important first
+enum PublishPriority {
+    PUBLISH_STATE = 0,
+    PUBLISH_AVAILABILITY,
+    PUBLISH_INFO,
+    PUBLISH_PRIORITIES
+};
+
+typedef struct {
+    // Publishes that had to wait, and of them those replaced by a later
+    // retained value and those dropped for want of room
+    unsigned long queued;
+    unsigned long replaced;
+    unsigned long dropped;
+    // The most payload bytes queued at once
+    size_t peakBytes;
+} PublishQueueStats;
+
+class PublishQueueHost {
+    public:
+        virtual ~PublishQueueHost() {}
+
+        // Publishes to "<prefix>/<suffix>". Returns the packet id, or 0 if it
+        // couldn't be published.
+        virtual uint16_t send(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) = 0;
+
+        // A publish was queued, went out after waiting `waitedMs`, or was
+        // dropped; for logging and metrics
+        virtual void queued(StateTopic topic) { (void) topic; }
+        virtual void sent(StateTopic topic, unsigned long waitedMs) { (void) topic; (void) waitedMs; }
+        virtual void dropped(StateTopic topic) { (void) topic; }
+};
+
+class PublishQueue {
+    public:
+        PublishQueue(PublishQueueHost* host);
+
+        // Sends the publish, or queues a copy of it. Returns the packet id,
+        // or 0 if it was queued or dropped.
+        uint16_t publish(PublishPriority priority, StateTopic topic, uint8_t qos, bool retain, const char* payload,
+                         size_t length, unsigned long now);
+        // Sends what is queued, in order, until one doesn't go, leaving
+        // anything less important than `lowest`. Returns how many went.
+        int drain(unsigned long now, PublishPriority lowest = PUBLISH_INFO);
+
+        bool empty() const { return _count == 0; }
+        int count() const { return _count; }
+        size_t bytes() const { return _used; }
+        const PublishQueueStats& stats() const { return _stats; }
+
+    private:
+        typedef struct {
+            uint8_t topic;
+            uint8_t priority;
+            uint8_t qos;
+            bool retain;
+            // Where the payload is in the pool
+            uint16_t offset;
+            uint16_t length;
+            unsigned long queuedAt;
+        } Entry;
+
+        bool waiting(PublishPriority priority) const;
+        bool makeRoom(PublishPriority priority, size_t length);
+        void remove(int index);
+
+        PublishQueueHost* _host;
+        // In the order queued, as are their payloads in the pool
+        Entry _entries[PUBLISH_QUEUE_ENTRIES];
+        int _count;
+        uint8_t _pool[PUBLISH_QUEUE_BYTES];
+        size_t _used;
+        PublishQueueStats _stats;
+};
+
+#endif // __PUBLISH_QUEUE_HPP_
@@ -0,0 +1,95 @@
+#ifndef __RECONNECT_MANAGER_HPP_
+#define __RECONNECT_MANAGER_HPP_
+
+#include <stdint.h>
+
+// Decides when an MQTT client should (re)connect. After the connection drops,
+// or the network comes back, the next attempt waits a random time between
+// zero and `baseMs`; each attempt that fails doubles that window, up to
+// `capMs` ("full jitter"). A fleet that loses its broker at the same moment
+// therefore comes back spread out over the window instead of all at once,
+// and keeps spreading out for as long as the broker stays away. Nothing is
+// attempted while the network is down. The first attempt after boot goes
+// out at once.
+//
+// The manager doesn't time out attempts: the client must report every one
+// that fails, with disconnected(), as AsyncMqttClient's onDisconnect does.
+
+// The firmware's first window and cap. bench/reconnect.cpp runs these too;
+// the gateway caps its own sooner, see gateway/mqtt_session.hpp.
+#ifndef MQTT_RECONNECT_BASE_MS
+#define MQTT_RECONNECT_BASE_MS 1000
+#endif
+#ifndef MQTT_RECONNECT_CAP_MS
+#define MQTT_RECONNECT_CAP_MS 60000
+#endif
+
+enum ReconnectState {
+    // No network: waiting for networkUp()
+    RECONNECT_OFFLINE = 0,
+    // Waiting out the backoff
+    RECONNECT_WAITING,
+    // An attempt is in progress
+    RECONNECT_CONNECTING,
+    RECONNECT_CONNECTED
+};
+
+typedef struct {
+    unsigned long attempts;
+    // Connections lost, and connections made again after one was lost
+    unsigned long disconnects;
+    unsigned long reconnects;
+    // Time spent without a connection after having had one, in all and the
+    // longest stretch
+    unsigned long downMillis;
+    unsigned long longestDownMillis;
+} ReconnectStats;
+
+class ReconnectManager {
+    public:
+        // Without jitter every wait is the whole window, as for comparison
+        ReconnectManager(unsigned long baseMs, unsigned long capMs, bool jitter = true);
+
+        // Devices must not share a seed, or they share their waits too
+        void seed(uint32_t seed);
+
+        void networkUp(unsigned long now);
+        void networkDown(unsigned long now);
+        // The client connected; the client's connection dropped, or an
+        // attempt failed
+        void connected(unsigned long now);
+        void disconnected(unsigned long now);
+
+        // Whether to connect now. If so, the attempt is counted, and the
+        // manager waits for connected() or disconnected().
+        bool shouldConnect(unsigned long now);
+
+        ReconnectState state() const { return _state; }
+        // How long the current outage has lasted, or 0 if connected
+        unsigned long downFor(unsigned long now) const;
+        const ReconnectStats& stats() const { return _stats; }
+
+    private:
+        void schedule(unsigned long now);
+        void wentDown(unsigned long now);
+        uint32_t random();
+
+        unsigned long _baseMs;
+        unsigned long _capMs;
+        bool _jitter;
+
+        ReconnectState _state;
+        bool _networkUp;
+        bool _hasConnected;
+        bool _down;
+        // Consecutive failed attempts, for the backoff window
+        unsigned int _failures;
+        unsigned long _waitStart;
+        unsigned long _wait;
+        unsigned long _downSince;
+        uint32_t _random;
+
+        ReconnectStats _stats;
+};
+
+#endif // __RECONNECT_MANAGER_HPP_
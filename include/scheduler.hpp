@@ -0,0 +1,74 @@
+#ifndef __SCHEDULER_HPP_
+#define __SCHEDULER_HPP_
+
+#include <stdint.h>
+
+#include "stall_profiler.hpp"
+
+// A cooperative scheduler for loop(). Each task runs every `period` ms (or on
+// every pass if the period is 0) and must return promptly. A run that starts
+// more than `deadline` ms after it was due counts as a miss.
+//
+// Critical tasks, such as servicing the heatpump UART, are also given a
+// chance to run between every other task, so that one slow task doesn't
+// starve them for a whole pass.
+//
+// With a StallProfiler set, each task is a stage, numbered by its index.
+
+// Twelve tasks with every option built in, and room to spare
+#define SCHEDULER_MAX_TASKS 16
+static_assert(SCHEDULER_MAX_TASKS <= STALL_STAGE_LOOP, "task indices are stall stages");
+
+typedef void (*TaskFunction)();
+
+typedef struct {
+    const char* name;
+    TaskFunction run;
+    unsigned long period;
+    unsigned long deadline;
+    bool critical;
+
+    unsigned long nextRun;
+
+    unsigned long runs;
+    unsigned long misses;
+    unsigned long lastMicros;
+    unsigned long maxMicros;
+    uint64_t totalMicros;
+} Task;
+
+class Scheduler {
+    public:
+        Scheduler();
+
+        // Returns the task's index, or -1 if the table is full
+        int add(const char* name, TaskFunction run, unsigned long period, unsigned long deadline, bool critical = false);
+
+        // Runs every task that is due, once
+        void run();
+
+        void setProfiler(StallProfiler* profiler) { _profiler = profiler; }
+
+        // ms until the next task with a period is due, measured from now, or
+        // (unsigned long) -1 if there are none. Tasks that run on every pass
+        // don't count: they run whenever the next pass is.
+        unsigned long idleFor(unsigned long now) const;
+        // Call when loop() wakes from a sleep that idleFor() allowed. Tasks
+        // that run on every pass are due from now, rather than late by
+        // however long it slept.
+        void slept(unsigned long now);
+
+        int taskCount() const { return _taskCount; }
+        const Task& task(int index) const { return _tasks[index]; }
+
+    private:
+        bool due(const Task& task, unsigned long now) const;
+        void runTask(Task& task, unsigned long now);
+        void runCritical(int except);
+
+        Task _tasks[SCHEDULER_MAX_TASKS];
+        int _taskCount;
+        StallProfiler* _profiler;
+};
+
+#endif // __SCHEDULER_HPP_
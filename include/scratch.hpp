@@ -0,0 +1,59 @@
+#ifndef __SCRATCH_HPP_
+#define __SCRATCH_HPP_
+
+#include <stddef.h>
+
+// A fixed bump allocator for the buffers that messages and topics are
+// formatted into on their way out, so that formatting never touches the heap
+// and never needs more stack than its own frame. Allocations are released in
+// LIFO order by ScratchScope, which rewinds the arena to where it was when
+// the scope was entered:
+//
+//     ScratchScope scope(scratch);
+//     char* buffer = scratch.allocate(256);
+//     if (buffer == NULL) return;
+//
+// allocate() returns NULL, and counts an overflow, rather than ever handing
+// out memory past the end; size SCRATCH_ARENA_SIZE for the deepest nesting
+// of scopes that the firmware has.
+
+#ifndef SCRATCH_ARENA_SIZE
+#define SCRATCH_ARENA_SIZE 1536
+#endif
+// Every allocation starts on this boundary
+#define SCRATCH_ALIGNMENT 4
+
+class ScratchArena {
+    public:
+        ScratchArena();
+
+        char* allocate(size_t size);
+
+        size_t used() const { return _used; }
+        // The most that has been in use at once since boot
+        size_t highWater() const { return _highWater; }
+        unsigned long overflows() const { return _overflows; }
+
+    private:
+        friend class ScratchScope;
+
+        char _buffer[SCRATCH_ARENA_SIZE] __attribute__ ((aligned (SCRATCH_ALIGNMENT)));
+        size_t _used;
+        size_t _highWater;
+        unsigned long _overflows;
+};
+
+class ScratchScope {
+    public:
+        ScratchScope(ScratchArena& arena) : _arena(arena), _mark(arena._used) {}
+        ~ScratchScope() { _arena._used = _mark; }
+
+    private:
+        ScratchScope(const ScratchScope&);
+        ScratchScope& operator=(const ScratchScope&);
+
+        ScratchArena& _arena;
+        size_t _mark;
+};
+
+#endif // __SCRATCH_HPP_
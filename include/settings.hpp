@@ -0,0 +1,43 @@
+#ifndef __SETTINGS_HPP_
+#define __SETTINGS_HPP_
+
+// The settings collected by the WiFiManager portal. They are stored as the
+// payload of a binary config record (see config_store.hpp), so the layout is
+// part of the on-flash format: bump SETTINGS_VERSION whenever it changes, and
+// teach loadConfig() to convert records of the previous version.
+
+#define SETTINGS_VERSION 2
+
+#define MAX_LENGTH_MQTT_HOST 128
+#define MAX_LENGTH_MQTT_PORT 6
+#define MAX_LENGTH_MQTT_USERNAME 64
+#define MAX_LENGTH_MQTT_PASSWORD 64
+#define MAX_LENGTH_MQTT_TOPIC_PREFIX 32
+#define MAX_LENGTH_SYSLOG_HOST 128
+#define MAX_LENGTH_SYSLOG_PORT 6
+#define MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME 32
+#define MAX_LENGTH_SYSLOG_APP_NAME 32
+#define MAX_LENGTH_SYSLOG_LOG_LEVEL 8
+#define MAX_LENGTH_MQTT_JSON_STATE 2
+// 32 characters and the terminator. Nothing follows the token in Settings,
+// so a copy into it has to keep the terminator.
+#define MAX_LENGTH_LOCAL_API_TOKEN 33
+
+typedef struct {
+    char mqtt_host[MAX_LENGTH_MQTT_HOST] = "";
+    char mqtt_port[MAX_LENGTH_MQTT_PORT] = "1883";
+    char mqtt_username[MAX_LENGTH_MQTT_USERNAME] = "";
+    char mqtt_password[MAX_LENGTH_MQTT_PASSWORD] = "";
+    char mqtt_topic_prefix[MAX_LENGTH_MQTT_TOPIC_PREFIX] = "";
+    char syslog_host[MAX_LENGTH_SYSLOG_HOST] = "";
+    char syslog_port[MAX_LENGTH_SYSLOG_PORT] = "514";
+    char syslog_device_hostname[MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME] = "";
+    char syslog_app_name[MAX_LENGTH_SYSLOG_APP_NAME] = "aircon";
+    char syslog_log_level[MAX_LENGTH_SYSLOG_LOG_LEVEL] = "INFO";
+    char mqtt_json_state[MAX_LENGTH_MQTT_JSON_STATE] = "0";
+    // The shared token the local API requires; new in version 2. While it is
+    // empty the local API isn't started.
+    char local_api_token[MAX_LENGTH_LOCAL_API_TOKEN] = "";
+} Settings;
+
+#endif // __SETTINGS_HPP_
@@ -0,0 +1,182 @@
+#ifndef __STALL_PROFILER_HPP_
+#define __STALL_PROFILER_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Finds what the firmware was doing when loop() stalled, or when the unit
+// reset. Each stage the firmware runs -- a pass through loop(), each
+// scheduler task, each callback a library makes into it -- is marked with a
+// StallScope, and stages nest: a callback made while a task runs is inside
+// that task.
+//
+// A stage's own time is what it took less what the stages inside it took.
+// When an outermost stage ends, the stage with the most own time within it
+// is held responsible, and the STALL_SLOWEST slowest outermost stages are
+// kept, with the stage responsible for each.
+//
+// The stages open at any moment, and a ring of the last STALL_BREADCRUMBS
+// stages that ran for STALL_SLOW_US of their own time or more, are also
+// written to RTC memory, which keeps its contents through any reset but a
+// power cycle. restore() reads back what the last boot wrote, so that a
+// watchdog reset comes with the stage it happened in. Nothing runs to time
+// a stage that never ends, so all that is known of how long that one took
+// is when it was entered, and that the watchdog fired: about 3.2 s later for
+// the software one.
+//
+// Entering or leaving a stage costs two 32-bit writes to RTC memory, and a
+// slow stage three more.
+
+#define STALL_MAX_DEPTH 4
+#define STALL_BREADCRUMBS 16
+#define STALL_SLOWEST 4
+#ifndef STALL_SLOW_US
+#define STALL_SLOW_US 20000
+#endif
+// Where the record starts in RTC user memory, in 4-byte blocks. The OTA
+// bootloader has the first 128 bytes.
+#ifndef STALL_RTC_OFFSET
+#define STALL_RTC_OFFSET 32
+#endif
+#define STALL_RECORD_MAGIC 0x53544c01
+
+#define STALL_NONE 0xff
+
+// Stages below STALL_STAGE_LOOP are scheduler task indices
+enum StallStage {
+    STALL_STAGE_LOOP = 32,
+    STALL_STAGE_MQTT_CONNECT,
+    STALL_STAGE_MQTT_DISCONNECT,
+    STALL_STAGE_MQTT_MESSAGE,
+    STALL_STAGE_HEATPUMP_CONNECT,
+    STALL_STAGE_HEATPUMP_PACKET,
+    STALL_STAGE_SETTINGS_CHANGED,
+    STALL_STAGE_STATUS_CHANGED,
+    STALL_STAGE_OTA_START,
+    STALL_STAGE_OTA_PROGRESS,
+    STALL_STAGE_OTA_END,
+    STALL_STAGE_OTA_ERROR,
+    STALL_STAGE_LOCAL_DATA,
+    STALL_STAGE_LOCAL_ACK,
+    STALL_STAGE_END
+};
+
+typedef struct {
+    // Uptime, in ms, when the stage ended
+    uint32_t endedAt;
+    uint8_t stage;
+    // The stage it ran inside, or STALL_NONE
+    uint8_t parent;
+    // Its own time, in ms, up to 65535
+    uint16_t millis;
+} StallBreadcrumb;
+
+// As kept in RTC memory
+typedef struct {
+    uint32_t magic;
+    // The stages open, outermost first, then STALL_NONE
+    uint8_t open[STALL_MAX_DEPTH];
+    // Uptime, in ms, when the innermost of them was entered
+    uint32_t openedAt;
+    // Breadcrumbs written; the next goes at count % STALL_BREADCRUMBS
+    uint32_t count;
+    StallBreadcrumb crumbs[STALL_BREADCRUMBS];
+} StallRecord;
+
+typedef struct {
+    // The outermost stage, and how long it took in all
+    uint8_t stage;
+    uint32_t micros;
+    // The stage with the most own time inside it, and how much
+    uint8_t culprit;
+    uint32_t culpritMicros;
+    // Uptime, in ms, when it ended
+    uint32_t endedAt;
+} StallSpan;
+
+typedef struct {
+    // Outermost stages ended, and of them, those that took STALL_SLOW_US or
+    // more
+    unsigned long spans;
+    unsigned long slow;
+    // Stages nested deeper than STALL_MAX_DEPTH, which go untimed
+    unsigned long tooDeep;
+} StallStats;
+
+class StallProfilerHost {
+    public:
+        virtual ~StallProfilerHost() {}
+
+        // `count` words of RTC memory at `offset`, in 4-byte blocks
+        virtual bool read(uint32_t offset, uint32_t* words, size_t count) = 0;
+        virtual void write(uint32_t offset, const uint32_t* words, size_t count) = 0;
+};
+
+class StallProfiler {
+    public:
+        StallProfiler(StallProfilerHost* host);
+
+        // Reads back the record the last boot left in RTC memory, and starts
+        // a new one. Returns false if there wasn't one, as after a power
+        // cycle.
+        bool restore();
+        const StallRecord& previous() const { return _previous; }
+
+        void enter(uint8_t stage);
+        void exit();
+
+        // The slowest outermost stages since boot, slowest first
+        int slowestCount() const { return _slowestCount; }
+        const StallSpan& slowest(int index) const { return _slowest[index]; }
+        const StallStats& stats() const { return _stats; }
+
+        // The name of a stage from STALL_STAGE_LOOP on, or NULL
+        static const char* stageName(uint8_t stage);
+
+    private:
+        typedef struct {
+            uint8_t stage;
+            unsigned long enteredMicros;
+            uint32_t enteredMillis;
+            // Time spent in the stages inside this one
+            unsigned long nestedMicros;
+        } Frame;
+
+        void writeOpen();
+        void breadcrumb(uint8_t stage, uint8_t parent, unsigned long micros, uint32_t now);
+        void endSpan(uint8_t stage, unsigned long micros, uint32_t now);
+
+        StallProfilerHost* _host;
+        StallRecord _record;
+        StallRecord _previous;
+
+        Frame _frames[STALL_MAX_DEPTH];
+        // May run past STALL_MAX_DEPTH
+        int _depth;
+        uint8_t _culprit;
+        unsigned long _culpritMicros;
+
+        StallSpan _slowest[STALL_SLOWEST];
+        int _slowestCount;
+        StallStats _stats;
+};
+
+// Marks a stage for as long as it is in scope. A NULL profiler marks
+// nothing.
+class StallScope {
+    public:
+        StallScope(StallProfiler* profiler, uint8_t stage) : _profiler(profiler) {
+            if (_profiler != NULL) _profiler->enter(stage);
+        }
+        ~StallScope() {
+            if (_profiler != NULL) _profiler->exit();
+        }
+
+    private:
+        StallScope(const StallScope&);
+        StallScope& operator=(const StallScope&);
+
+        StallProfiler* _profiler;
+};
+
+#endif // __STALL_PROFILER_HPP_
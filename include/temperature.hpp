@@ -0,0 +1,59 @@
+#ifndef __TEMPERATURE_HPP_
+#define __TEMPERATURE_HPP_
+
+#include <stddef.h>
+
+// Temperatures in tenths of a degree, held in an int. The unit reports to the
+// half degree; keeping that as an integer means parsing and formatting never
+// go through the soft-float printf/atof of a chip without an FPU, and never
+// round the half degree away.
+
+// Longest formatted temperature, e.g. "-100.5", plus the NUL
+#define TEMPERATURE_MAX_FORMATTED 8
+
+// Nearest tenth to a float from the HeatPump library
+int temperatureFromFloat(float degrees);
+
+// Parses "22", "22.5", "-3.5" or "22.54" into tenths. Digits past the first
+// decimal place are ignored; at most three whole digits are accepted.
+bool parseTemperature(const char* text, size_t length, int* tenths);
+
+// Writes "22" or "22.5" (the fraction only when it isn't zero) into out,
+// which needs TEMPERATURE_MAX_FORMATTED bytes. Returns the length.
+size_t formatTemperature(char* out, int tenths);
+
+// Decides when a reading that changes on its own, like the room temperature,
+// is worth a retained publish. A reading that moves by at least `hysteresis`
+// tenths from the last one published goes out straight away; a smaller move,
+// e.g. a sensor flickering between two half degrees, only once it has been
+// `smallChangeMs` since that publish. Either way, publishes are at least
+// `minIntervalMs` apart. The first reading, and the first after reset(), is
+// always published.
+class TemperatureHysteresis {
+    public:
+        TemperatureHysteresis(int hysteresis, unsigned long minIntervalMs, unsigned long smallChangeMs);
+
+        void reading(int tenths);
+        bool shouldPublish(unsigned long now) const;
+        // Call once current() has been published
+        void published(unsigned long now);
+        void reset() { _hasPublished = false; }
+
+        int current() const { return _current; }
+        unsigned long suppressed() const { return _suppressed; }
+
+    private:
+        int _hysteresis;
+        unsigned long _minIntervalMs;
+        unsigned long _smallChangeMs;
+
+        bool _hasReading;
+        bool _hasPublished;
+        int _current;
+        int _published;
+        unsigned long _publishedAt;
+        // Readings that were superseded before they were published
+        unsigned long _suppressed;
+};
+
+#endif // __TEMPERATURE_HPP_
@@ -0,0 +1,42 @@
+#ifndef __TOPICS_HPP_
+#define __TOPICS_HPP_
+
+#include <stddef.h>
+
+// The topics we publish to, as suffixes of the configured prefix. Topics are
+// composed when they are used rather than kept formatted, so they cost a
+// table entry each instead of a buffer. The command topics we subscribe to
+// are CommandRouter's; see CommandRouter::suffix().
+
+enum StateTopic {
+    TOPIC_INFO = 0,
+    TOPIC_COALESCER,
+    TOPIC_TASKS,
+    TOPIC_CAPTURE,
+    TOPIC_TRACE,
+    TOPIC_HISTORY,
+    TOPIC_STALLS,
+    TOPIC_METRICS,
+    TOPIC_CONFIRMATION,
+    TOPIC_AVAILABILITY,
+    TOPIC_STATE,
+    TOPIC_POWER_STATE,
+    TOPIC_MODE_STATE,
+    TOPIC_TEMPERATURE_STATE,
+    TOPIC_FAN_STATE,
+    TOPIC_VANE_STATE,
+    TOPIC_CURRENT_TEMPERATURE_STATE,
+    TOPIC_COUNT
+};
+
+// Longest suffix, without the '/' or NUL
+#define TOPIC_MAX_SUFFIX 25
+
+const char* topicSuffix(StateTopic topic);
+
+// Writes "<prefix>/<suffix>" into out, which must have room for
+// strlen(prefix) + TOPIC_MAX_SUFFIX + 2 bytes. Returns the length, or 0 if
+// it doesn't fit.
+size_t formatTopic(char* out, size_t size, const char* prefix, const char* suffix);
+
+#endif // __TOPICS_HPP_
@@ -0,0 +1,133 @@
+#ifndef __TRACE_HPP_
+#define __TRACE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <type_traits>
+
+// Binary tracing, for call sites too frequent to log as text. TRACE(format,
+// args...) formats nothing: it writes the format's ID, a micros() timestamp
+// and the raw arguments as one record into a ring buffer, which the firmware
+// publishes to <prefix>/trace in chunks. tools/tracedump.cpp turns the
+// chunks back into text, using the firmware ELF the records came from.
+//
+// The format strings are assembled into .trace_formats, a section that
+// isn't loaded, so they take up no flash; a format's ID is the FNV-1a hash
+// of its text, worked out by the compiler. Formats must not contain a '"'
+// or a backslash escape, since they pass through the assembler as they are.
+//
+// Arguments are stored as 32 bits each: integers (wider ones truncated),
+// pointers, and floats or doubles (as floats). A string is copied, up to
+// TRACE_MAX_STRING bytes, so %s arguments needn't outlive the call; %.*s
+// isn't supported. A record is at most TRACE_MAX_RECORD bytes, and
+// arguments that don't fit are left off and counted as truncated.
+//
+// A record is [size][micros, 4][ID, 4][arguments], little-endian. A chunk
+// is whole records, starting with one whose ID is TRACE_ID_CHUNK and whose
+// arguments are the sequence number of the record after it and the number
+// of records overwritten before they could be read since the last chunk.
+
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 2048
+#endif
+#define TRACE_MAX_RECORD 64
+#define TRACE_MAX_STRING 32
+#define TRACE_HEADER_SIZE 9
+#define TRACE_ID_CHUNK 0
+#define TRACE_SECTION ".trace_formats"
+
+#define TRACE(format, ...) \
+    do { \
+        __asm__(".pushsection " TRACE_SECTION ",\"\",@progbits\n.asciz \"" format "\"\n.popsection"); \
+        if (false) traceCheckFormat(format, ##__VA_ARGS__); \
+        constexpr uint32_t traceFormatId = traceId(format); \
+        traceWrite(traceFormatId, ##__VA_ARGS__); \
+    } while (0)
+
+// A chunk must have room for its first record as well as the chunk record
+#define TRACE_MIN_CHUNK (TRACE_HEADER_SIZE + 8 + TRACE_MAX_RECORD)
+
+typedef struct {
+    unsigned long records;
+    unsigned long truncated;
+    // Pushed out of the ring by newer records, read or not
+    unsigned long overwritten;
+} TraceStats;
+
+typedef struct {
+    uint32_t position;
+    uint32_t sequence;
+    // Records overwritten before this cursor got to them
+    uint32_t dropped;
+} TraceCursor;
+
+typedef struct {
+    uint8_t bytes[TRACE_MAX_RECORD];
+    size_t size;
+    bool truncated;
+} TraceRecord;
+
+// Recursive, to stay a C++11 constexpr
+constexpr uint32_t traceId(const char* format, uint32_t hash = 2166136261u) {
+    return *format == '\0' ? hash : traceId(format + 1, (hash ^ (uint8_t) *format) * 16777619u);
+}
+
+// Never called; only there for the compiler to check arguments against
+inline void traceCheckFormat(const char* format, ...) __attribute__ ((format (printf, 1, 2)));
+inline void traceCheckFormat(const char*, ...) {}
+
+void traceBegin(TraceRecord& record, uint32_t id);
+void tracePut(TraceRecord& record, uint32_t value);
+void tracePutString(TraceRecord& record, const char* value);
+void traceCommit(TraceRecord& record);
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+traceArgument(TraceRecord& record, T value) {
+    tracePut(record, (uint32_t) value);
+}
+
+inline void traceArgument(TraceRecord& record, double value) {
+    float narrowed = (float) value;
+    uint32_t bits;
+    memcpy(&bits, &narrowed, sizeof(bits));
+    tracePut(record, bits);
+}
+
+inline void traceArgument(TraceRecord& record, const char* value) {
+    tracePutString(record, value);
+}
+
+inline void traceArgument(TraceRecord& record, const void* value) {
+    tracePut(record, (uint32_t) (uintptr_t) value);
+}
+
+inline void traceArguments(TraceRecord&) {}
+
+template <typename T, typename... Rest>
+inline void traceArguments(TraceRecord& record, T value, Rest... rest) {
+    traceArgument(record, value);
+    traceArguments(record, rest...);
+}
+
+template <typename... Args>
+void traceWrite(uint32_t id, Args... args) {
+    TraceRecord record;
+    traceBegin(record, id);
+    traceArguments(record, args...);
+    traceCommit(record);
+}
+
+// Writes the records after *cursor into out, as one chunk, and moves the
+// cursor past them. Start with a zeroed cursor. Returns the chunk's length,
+// or 0 if there were no new records. The cursor is the caller's, so a chunk
+// that couldn't be sent can be read again from the same one.
+size_t traceRead(TraceCursor* cursor, uint8_t* out, size_t size);
+// Bytes of records after cursor
+uint32_t tracePending(const TraceCursor& cursor);
+
+const TraceStats& traceStats();
+
+#endif // __TRACE_HPP_
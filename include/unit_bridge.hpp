@@ -0,0 +1,222 @@
+#ifndef __UNIT_BRIDGE_HPP_
+#define __UNIT_BRIDGE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_coalescer.hpp"
+#include "command_router.hpp"
+#include "command_tracker.hpp"
+#include "link_scheduler.hpp"
+#include "scratch.hpp"
+#include "temperature.hpp"
+#include "topics.hpp"
+
+// The MQTT <-> CN105 bridging for one indoor unit, with nothing in it that
+// depends on the platform: routing commands, deciding when the link writes
+// and polls, confirming commands, and publishing the unit's state. The
+// firmware runs one for its unit on top of the HeatPump library and
+// AsyncMqttClient; the Linux gateway in gateway/ runs one per serial port.
+//
+// What it can't do itself it asks of a UnitBridgeHost: publishing to a state
+// topic under the unit's prefix, and handing a command to the link. The host
+// carries out the LinkAction that next() returns and reports what the unit
+// sends back with settingsChanged(), settingsReadback() and
+// roomTemperature().
+
+// Command coalescing windows, in ms; see command_coalescer.hpp. A lone
+// command is written after COALESCE_MIN_MS, a burst of commands closer
+// together than COALESCE_IDLE_MS is merged for at most COALESCE_MAX_MS.
+#ifndef COALESCE_MIN_MS
+#define COALESCE_MIN_MS 0
+#endif
+#ifndef COALESCE_MAX_MS
+#define COALESCE_MAX_MS 1500
+#endif
+#ifndef COALESCE_IDLE_MS
+#define COALESCE_IDLE_MS 2000
+#endif
+
+// CN105 link budget; see link_scheduler.hpp. The unit is polled every
+// LINK_POLL_IDLE_MS, or every LINK_POLL_FAST_MS for LINK_POLL_BOOST_MS after
+// a write. At most LINK_WRITE_BURST writes go out back to back, and then one
+// per LINK_WRITE_REFILL_MS.
+#ifndef LINK_POLL_IDLE_MS
+#define LINK_POLL_IDLE_MS 3000
+#endif
+#ifndef LINK_POLL_FAST_MS
+#define LINK_POLL_FAST_MS 2000
+#endif
+#ifndef LINK_POLL_BOOST_MS
+#define LINK_POLL_BOOST_MS 10000
+#endif
+#ifndef LINK_WRITE_BURST
+#define LINK_WRITE_BURST 3
+#endif
+#ifndef LINK_WRITE_REFILL_MS
+#define LINK_WRITE_REFILL_MS 3000
+#endif
+
+// Command confirmation; see command_tracker.hpp. A command that a settings
+// readback has contradicted COMMAND_CONFIRM_TIMEOUT_MS after it was written
+// is written again, the timeout doubling each time, up to
+// COMMAND_CONFIRM_ATTEMPTS writes in all.
+#ifndef COMMAND_CONFIRM_TIMEOUT_MS
+#define COMMAND_CONFIRM_TIMEOUT_MS 4000
+#endif
+#ifndef COMMAND_CONFIRM_ATTEMPTS
+#define COMMAND_CONFIRM_ATTEMPTS 3
+#endif
+
+// Room temperature publishing; see TemperatureHysteresis in temperature.hpp.
+// A change of ROOM_TEMPERATURE_HYSTERESIS tenths of a degree or more is
+// published at once, a smaller one only ROOM_TEMPERATURE_SMALL_CHANGE_MS
+// after the last publish, and never more often than
+// ROOM_TEMPERATURE_MIN_INTERVAL_MS.
+#ifndef ROOM_TEMPERATURE_HYSTERESIS
+#define ROOM_TEMPERATURE_HYSTERESIS 10
+#endif
+#ifndef ROOM_TEMPERATURE_MIN_INTERVAL_MS
+#define ROOM_TEMPERATURE_MIN_INTERVAL_MS 10000
+#endif
+#ifndef ROOM_TEMPERATURE_SMALL_CHANGE_MS
+#define ROOM_TEMPERATURE_SMALL_CHANGE_MS 300000
+#endif
+
+// The retained command confirmation status, <prefix>/confirmation, must fit
+// in CONFIRMATION_PAYLOAD_SIZE bytes
+#define CONFIRMATION_PAYLOAD_SIZE 768
+// The JSON state snapshot, <prefix>/state
+#define STATE_PAYLOAD_SIZE 128
+
+// The last value published to each retained state topic, so that only the
+// fields that changed are published again
+#define MAX_LENGTH_PUBLISHED_VALUE 8
+
+typedef struct {
+    char power[MAX_LENGTH_PUBLISHED_VALUE];
+    char mode[MAX_LENGTH_PUBLISHED_VALUE];
+    char temperature[MAX_LENGTH_PUBLISHED_VALUE];
+    char fan[MAX_LENGTH_PUBLISHED_VALUE];
+    char vane[MAX_LENGTH_PUBLISHED_VALUE];
+} PublishedSettings;
+
+// The unit's settings as the link reports them, in CommandRouter's spelling
+// ("ON", "HEAT", "QUIET"...), with the setpoint in tenths of a degree
+typedef struct {
+    const char* power;
+    const char* mode;
+    int temperature;
+    const char* fan;
+    const char* vane;
+} UnitSettings;
+
+class UnitBridgeHost {
+    public:
+        virtual ~UnitBridgeHost() {}
+
+        // Publishes to "<prefix>/<suffix>" for the unit. Returns the packet
+        // id, or 0 if it couldn't be published.
+        virtual uint16_t publish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) = 0;
+        // Hands a power, mode, temperature, fan or vane command to the link,
+        // to go out with the next LINK_WRITE
+        virtual void apply(const Command& command) = 0;
+
+        // A command was confirmed, is being written again, or has diverged;
+        // for logging and metrics
+        virtual void confirmed(const TrackedField& field) { (void) field; }
+        virtual void retrying(const TrackedField& field) { (void) field; }
+        virtual void diverged(const TrackedField& field) { (void) field; }
+};
+
+enum MessageResult {
+    // Not one of the unit's command topics
+    MESSAGE_IGNORED = 0,
+    // One of them, with a value that didn't parse
+    MESSAGE_INVALID,
+    // A power, mode, temperature, fan or vane command, or a <prefix>/set
+    // batch of them, now applied
+    MESSAGE_COMMAND,
+    // Any other command, such as COMMAND_CAPTURE, for the host to carry out.
+    // COMMAND_HISTORY's payload isn't parsed; see History::parseRequest().
+    MESSAGE_OTHER
+};
+
+class UnitBridge {
+    public:
+        UnitBridge(UnitBridgeHost* host, ScratchArena* scratch);
+
+        // prefix must outlive the bridge. jsonState publishes one retained
+        // JSON snapshot to <prefix>/state instead of the per-field topics.
+        void begin(const char* prefix, bool jsonState);
+        const char* prefix() const { return _prefix; }
+
+        // An inbound MQTT message. The command is parsed into `command`,
+        // which is left with its topic set if the value was invalid. For a
+        // <prefix>/set batch, only the topic and the bits of the fields it
+        // set are.
+        MessageResult message(const char* topic, const char* payload, size_t len, unsigned long now, Command* command);
+        // A <prefix>/set payload that came some other way than MQTT, such as
+        // the local API; as message() takes one
+        MessageResult set(const char* payload, size_t len, unsigned long now, Command* command) {
+            return batch(payload, len, now, command);
+        }
+        // The MQTT session has (re)connected, and the broker may have lost
+        // our retained state: the next readback publishes everything again
+        void mqttConnected();
+
+        // The link's settings readback differs from the last one
+        void settingsChanged(const UnitSettings& settings);
+        // Any settings readback at all, for confirming commands. Call once
+        // the readback has been decoded, and before wrote() if it arrived
+        // while the write was being issued.
+        void settingsReadback(const UnitSettings& settings, unsigned long now);
+        void roomTemperature(int tenths, unsigned long now);
+
+        // What to do with the link now; see LinkScheduler
+        LinkAction next(unsigned long now);
+        // ms until next() may have something for the link, measured from
+        // now, or (unsigned long) -1. Doesn't count service()'s retries and
+        // small room temperature changes, which a caller that sleeps between
+        // passes must wake for often enough itself.
+        unsigned long idleFor(unsigned long now) const;
+        // Call just before carrying out a LINK_WRITE
+        void writing();
+        // Call once a LINK_WRITE or LINK_POLL has been carried out, with the
+        // time that next() was given
+        void wrote(unsigned long now);
+        void polled(unsigned long now);
+        // Whether the next poll should ask for the settings
+        bool confirming() const { return _link.confirming(); }
+
+        // Retries unconfirmed commands, and publishes what is due; call after
+        // each pass over the link
+        void service(unsigned long now);
+        void publishConfirmation();
+
+        const CommandCoalescer& coalescer() const { return _coalescer; }
+        LinkScheduler& link() { return _link; }
+        const CommandTracker& tracker() const { return _tracker; }
+        const TemperatureHysteresis& roomTemperatures() const { return _roomTemperature; }
+
+    private:
+        MessageResult batch(const char* payload, size_t len, unsigned long now, Command* command);
+        bool publishStateIfChanged(StateTopic topic, bool publish, char* published, const char* value);
+        void publishRoomTemperature(unsigned long now);
+        void retryUnconfirmed(unsigned long now);
+
+        UnitBridgeHost* _host;
+        ScratchArena* _scratch;
+        const char* _prefix;
+        bool _jsonState;
+        bool _retryPending;
+
+        CommandRouter _router;
+        CommandCoalescer _coalescer;
+        LinkScheduler _link;
+        CommandTracker _tracker;
+        TemperatureHysteresis _roomTemperature;
+        PublishedSettings _published;
+};
+
+#endif // __UNIT_BRIDGE_HPP_
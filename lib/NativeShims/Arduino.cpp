@@ -0,0 +1,179 @@
+#include "Arduino.h"
+#include "coredecls.h"
+
+#include <time.h>
+#include <unistd.h>
+
+#include <new>
+
+static uint8_t pinModes[NATIVE_NUM_PINS];
+static uint8_t pinValues[NATIVE_NUM_PINS];
+static uint8_t pinInputs[NATIVE_NUM_PINS];
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin >= NATIVE_NUM_PINS) return;
+    pinModes[pin] = mode;
+    if (mode == INPUT_PULLUP && pinInputs[pin] == 0) pinValues[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    if (pin >= NATIVE_NUM_PINS) return;
+    pinValues[pin] = value;
+}
+
+int digitalRead(uint8_t pin) {
+    if (pin >= NATIVE_NUM_PINS) return LOW;
+    if (pinModes[pin] == OUTPUT) return pinValues[pin];
+    if (pinInputs[pin]) return pinInputs[pin] - 1;
+    return pinModes[pin] == INPUT_PULLUP ? HIGH : LOW;
+}
+
+void nativeSetPinInput(uint8_t pin, uint8_t value) {
+    if (pin >= NATIVE_NUM_PINS) return;
+    pinInputs[pin] = value + 1;
+}
+
+static uint64_t clockSkewMicros = 0;
+
+static uint64_t monotonicMicros() {
+    static uint64_t start = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    if (start == 0) start = now;
+    return now - start;
+}
+
+unsigned long micros() {
+    return (unsigned long) (monotonicMicros() + clockSkewMicros);
+}
+
+unsigned long millis() {
+    return (unsigned long) ((monotonicMicros() + clockSkewMicros) / 1000);
+}
+
+static bool realTime = false;
+
+void nativeSetRealTime(bool enabled) {
+    realTime = enabled;
+}
+
+#define NATIVE_MAX_EVENTS 32
+
+typedef struct {
+    unsigned long at;
+    void (*run)(void*);
+    void* arg;
+} NativeEvent;
+
+static NativeEvent events[NATIVE_MAX_EVENTS];
+static int eventCount = 0;
+static bool scheduled = false;
+static unsigned long wakeMicros = 0;
+
+bool nativeAt(unsigned long atMicros, void (*event)(void*), void* arg) {
+    if (eventCount == NATIVE_MAX_EVENTS) return false;
+    events[eventCount].at = atMicros;
+    events[eventCount].run = event;
+    events[eventCount].arg = arg;
+    eventCount++;
+    return true;
+}
+
+void nativeSetWakeMicros(unsigned long us) {
+    wakeMicros = us;
+}
+
+extern "C" void esp_schedule() {
+    scheduled = true;
+}
+
+// Moves the clock on by `us`, running the events that fall due on the way,
+// in order. With `blocked`, returns early once an event that calls
+// esp_schedule() leaves it false.
+static void advance(uint64_t us, const std::function<bool()>* blocked) {
+    uint64_t end = monotonicMicros() + clockSkewMicros + us;
+    while (eventCount > 0) {
+        int next = 0;
+        for (int i = 1; i < eventCount; i++) {
+            if (events[i].at < events[next].at) next = i;
+        }
+        NativeEvent event = events[next];
+        if (event.at > end) break;
+        events[next] = events[--eventCount];
+        uint64_t now = monotonicMicros() + clockSkewMicros;
+        if (event.at > now) clockSkewMicros += event.at - now;
+        scheduled = false;
+        event.run(event.arg);
+        if (blocked != NULL && scheduled && !(*blocked)()) return;
+    }
+    uint64_t now = monotonicMicros() + clockSkewMicros;
+    if (end > now) clockSkewMicros += end - now;
+}
+
+// As in core 3.x, esp_schedule() doesn't end a delay()
+void delay(unsigned long ms) {
+    if (realTime) {
+        usleep(ms * 1000);
+        return;
+    }
+    advance((uint64_t) ms * 1000, NULL);
+    clockSkewMicros += wakeMicros;
+}
+
+void esp_delay(uint32_t timeoutMs, const std::function<bool()>& blocked) {
+    if (!blocked()) return;
+    if (realTime) {
+        usleep(timeoutMs * 1000);
+        return;
+    }
+    advance((uint64_t) timeoutMs * 1000, &blocked);
+    clockSkewMicros += wakeMicros;
+}
+
+void delayMicroseconds(unsigned int us) {
+    if (realTime) {
+        usleep(us);
+    } else {
+        advance(us, NULL);
+    }
+}
+
+void yield() {
+    if (!realTime) advance(0, NULL);
+}
+
+static unsigned long allocations = 0;
+
+unsigned long nativeAllocations() {
+    return allocations;
+}
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    allocations++;
+    void* p = malloc(size);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    allocations++;
+    return malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    allocations++;
+    return malloc(size);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
@@ -0,0 +1,71 @@
+#ifndef __NATIVE_ARDUINO_H_
+#define __NATIVE_ARDUINO_H_
+
+// Host-side stand-in for the Arduino core. Only the parts of the API that the
+// firmware actually uses are provided.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <functional>
+#include <memory>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x00
+#define OUTPUT       0x01
+#define INPUT_PULLUP 0x02
+
+#define NATIVE_NUM_PINS 17
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+// Drives the level seen by digitalRead() on an input pin, e.g. to make the
+// firmware believe that a heatpump is connected.
+void nativeSetPinInput(uint8_t pin, uint8_t value);
+
+// The clock is real (monotonic) time plus a skew. delay() advances the skew
+// instead of sleeping, so that benchmarks run quickly but still observe the
+// same latencies that a unit would.
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+// Makes delay() really sleep, for when the firmware is talking to something
+// outside the process that runs on real time, like tools/cn105sim.
+void nativeSetRealTime(bool realTime);
+
+// Runs `event(arg)` once the clock reaches `atMicros`, from inside whichever
+// delay(), esp_delay(), delayMicroseconds() or yield() the firmware is in, as
+// the SDK runs network callbacks while loop() waits. An event that calls
+// esp_schedule() has an esp_delay() ask its `blocked` again at that point;
+// see coredecls.h. Returns false if too many are waiting. Not supported in
+// real time.
+bool nativeAt(unsigned long atMicros, void (*event)(void*), void* arg);
+// Charges each delay() and esp_delay() this much more, for a CPU waking from
+// light sleep
+void nativeSetWakeMicros(unsigned long us);
+
+// Every operator new in the process is counted, so that benchmarks can check
+// which code paths allocate. malloc() itself is not; nothing in the firmware
+// calls it directly.
+unsigned long nativeAllocations();
+
+#include "WString.h"
+#include "HardwareSerial.h"
+#include "Esp.h"
+
+#endif // __NATIVE_ARDUINO_H_
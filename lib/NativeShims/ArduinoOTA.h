@@ -0,0 +1,43 @@
+#ifndef __NATIVE_ARDUINOOTA_H_
+#define __NATIVE_ARDUINOOTA_H_
+
+#include <functional>
+
+#define U_FLASH  0
+#define U_SPIFFS 100
+
+typedef enum {
+    OTA_AUTH_ERROR,
+    OTA_BEGIN_ERROR,
+    OTA_CONNECT_ERROR,
+    OTA_RECEIVE_ERROR,
+    OTA_END_ERROR
+} ota_error_t;
+
+// Never receives an update; handle() is a no-op.
+class ArduinoOTAClass {
+    public:
+        typedef std::function<void(void)> THandlerFunction;
+        typedef std::function<void(ota_error_t)> THandlerFunction_Error;
+        typedef std::function<void(unsigned int, unsigned int)> THandlerFunction_Progress;
+
+        void onStart(THandlerFunction fn) { _startCallback = fn; }
+        void onEnd(THandlerFunction fn) { _endCallback = fn; }
+        void onError(THandlerFunction_Error fn) { _errorCallback = fn; }
+        void onProgress(THandlerFunction_Progress fn) { _progressCallback = fn; }
+
+        void setPassword(const char* password) { (void) password; }
+        void begin() {}
+        void handle() {}
+        int getCommand() { return U_FLASH; }
+
+    private:
+        THandlerFunction _startCallback;
+        THandlerFunction _endCallback;
+        THandlerFunction_Error _errorCallback;
+        THandlerFunction_Progress _progressCallback;
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif // __NATIVE_ARDUINOOTA_H_
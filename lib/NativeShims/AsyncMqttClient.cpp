@@ -0,0 +1,127 @@
+#include "AsyncMqttClient.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+AsyncMqttClient::AsyncMqttClient() :
+    publishCount(0),
+    subscribeCount(0),
+    connectCount(0),
+    publishRefused(0),
+    _connected(false),
+    _brokerAvailable(true),
+    _nextPacketId(1),
+    _sendBuffer(0),
+    _sendRate(0),
+    _inFlight(0),
+    _drainedAt(0) {}
+
+AsyncMqttClient& AsyncMqttClient::setWill(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    (void) topic; (void) qos; (void) retain; (void) payload; (void) length;
+    return *this;
+}
+
+void AsyncMqttClient::connect() {
+    if (_connected) return;
+    connectCount++;
+    if (!_brokerAvailable || WiFi.status() != WL_CONNECTED) {
+        if (_onDisconnect) _onDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+        return;
+    }
+    _connected = true;
+    _inFlight = 0;
+    _drainedAt = millis();
+    if (_onConnect) _onConnect(false);
+}
+
+void AsyncMqttClient::disconnect(bool force) {
+    (void) force;
+    if (!_connected) return;
+    _connected = false;
+    if (_onDisconnect) _onDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+}
+
+uint16_t AsyncMqttClient::subscribe(const char* topic, uint8_t qos) {
+    (void) topic; (void) qos;
+    if (!_connected) return 0;
+    subscribeCount++;
+    return _nextPacketId++;
+}
+
+uint16_t AsyncMqttClient::unsubscribe(const char* topic) {
+    (void) topic;
+    if (!_connected) return 0;
+    return _nextPacketId++;
+}
+
+uint16_t AsyncMqttClient::publish(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length, bool dup, uint16_t message_id) {
+    (void) dup; (void) message_id;
+    if (!_connected) return 0;
+    if (payload != nullptr && length == 0) length = strlen(payload);
+    // Fixed header, topic length, topic and payload, and the packet id
+    size_t needed = 5 + strlen(topic) + length + (qos > 0 ? 2 : 0);
+    if (_sendBuffer > 0) {
+        if (sendSpace() < needed) {
+            publishRefused++;
+            return 0;
+        }
+        _inFlight += needed;
+    }
+    publishCount++;
+    if (_publishObserver) _publishObserver(topic, qos, retain, payload, length);
+    uint16_t packetId = qos == 0 ? 1 : _nextPacketId++;
+    if (qos > 0 && _onPublish) _onPublish(packetId);
+    return packetId;
+}
+
+void AsyncMqttClient::setSendBuffer(size_t bytes, unsigned long bytesPerSecond) {
+    _sendBuffer = bytes;
+    _sendRate = bytesPerSecond;
+    _inFlight = 0;
+    _drainedAt = millis();
+}
+
+size_t AsyncMqttClient::sendSpace() {
+    unsigned long now = millis();
+    size_t sent = (size_t) ((now - _drainedAt) * _sendRate / 1000);
+    if (sent > 0) {
+        _inFlight = sent < _inFlight ? _inFlight - sent : 0;
+        _drainedAt = now;
+    }
+    return _inFlight < _sendBuffer ? _sendBuffer - _inFlight : 0;
+}
+
+void AsyncMqttClient::injectMessage(const char* topic, const char* payload, size_t length, uint8_t qos, bool retain) {
+    AsyncMqttClientMessageProperties properties = { qos, false, retain };
+    deliver(topic, payload, length, 0, length, properties);
+}
+
+void AsyncMqttClient::injectPiece(const char* topic, const char* payload, size_t length, size_t index, size_t total) {
+    AsyncMqttClientMessageProperties properties = { 0, false, false };
+    deliver(topic, payload, length, index, total, properties);
+}
+
+void AsyncMqttClient::deliver(const char* topic, const char* payload, size_t length, size_t index, size_t total,
+                              AsyncMqttClientMessageProperties properties) {
+    if (!_onMessage) return;
+    // The real client hands over mutable pointers into its own receive
+    // buffer, and the payload is not NUL-terminated there either.
+    static char topicBuffer[256];
+    static char payloadBuffer[1024];
+    size_t topicLength = strlen(topic);
+    if (topicLength >= sizeof(topicBuffer) || length > sizeof(payloadBuffer)) return;
+    memcpy(topicBuffer, topic, topicLength + 1);
+    memcpy(payloadBuffer, payload, length);
+    if (length < sizeof(payloadBuffer)) payloadBuffer[length] = '\0';
+    _onMessage(topicBuffer, payloadBuffer, properties, length, index, total);
+}
+
+void AsyncMqttClient::injectDisconnect(AsyncMqttClientDisconnectReason reason) {
+    _connected = false;
+    if (_onDisconnect) _onDisconnect(reason);
+}
+
+void AsyncMqttClient::setBrokerAvailable(bool available) {
+    _brokerAvailable = available;
+    if (!available && _connected) injectDisconnect(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+}
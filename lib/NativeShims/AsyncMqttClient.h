@@ -0,0 +1,108 @@
+#ifndef __NATIVE_ASYNCMQTTCLIENT_H_
+#define __NATIVE_ASYNCMQTTCLIENT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <functional>
+
+#include "ESP8266WiFi.h"
+
+struct AsyncMqttClientMessageProperties {
+    uint8_t qos;
+    bool dup;
+    bool retain;
+};
+
+enum class AsyncMqttClientDisconnectReason : int8_t {
+    TCP_DISCONNECTED = 0,
+    MQTT_UNACCEPTABLE_PROTOCOL_VERSION = 1,
+    MQTT_IDENTIFIER_REJECTED = 2,
+    MQTT_SERVER_UNAVAILABLE = 3,
+    MQTT_MALFORMED_CREDENTIALS = 4,
+    MQTT_NOT_AUTHORIZED = 5,
+    ESP8266_NOT_ENOUGH_SPACE = 6,
+    TLS_BAD_FINGERPRINT = 7
+};
+
+namespace AsyncMqttClientInternals {
+typedef std::function<void(bool sessionPresent)> OnConnectUserCallback;
+typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
+typedef std::function<void(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> OnMessageUserCallback;
+typedef std::function<void(uint16_t packetId)> OnPublishUserCallback;
+}
+
+// There is no broker. connect() succeeds immediately, unless
+// setBrokerAvailable(false) says the broker is down, when it fails as the
+// real client does, through onDisconnect. publish() hands each message to an
+// optional observer, and injectMessage() delivers an inbound message exactly
+// as the real client's onMessage callback would. injectPiece() delivers part
+// of one, as the real client does with a payload that spans TCP segments.
+// setSendBuffer() gives the connection a TCP send buffer that empties at a
+// fixed rate; publish() fails when a message doesn't fit in what is free, as
+// the real client's does.
+class AsyncMqttClient {
+    public:
+        typedef std::function<void(const char* topic, uint8_t qos, bool retain, const char* payload, size_t length)> PublishObserver;
+
+        AsyncMqttClient();
+
+        AsyncMqttClient& setKeepAlive(uint16_t keepAlive) { (void) keepAlive; return *this; }
+        AsyncMqttClient& setClientId(const char* clientId) { (void) clientId; return *this; }
+        AsyncMqttClient& setCleanSession(bool cleanSession) { (void) cleanSession; return *this; }
+        AsyncMqttClient& setCredentials(const char* username, const char* password = nullptr) { (void) username; (void) password; return *this; }
+        AsyncMqttClient& setWill(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0);
+        AsyncMqttClient& setServer(const char* host, uint16_t port) { (void) host; (void) port; return *this; }
+        AsyncMqttClient& setServer(IPAddress ip, uint16_t port) { (void) ip; (void) port; return *this; }
+
+        AsyncMqttClient& onConnect(AsyncMqttClientInternals::OnConnectUserCallback callback) { _onConnect = callback; return *this; }
+        AsyncMqttClient& onDisconnect(AsyncMqttClientInternals::OnDisconnectUserCallback callback) { _onDisconnect = callback; return *this; }
+        AsyncMqttClient& onMessage(AsyncMqttClientInternals::OnMessageUserCallback callback) { _onMessage = callback; return *this; }
+        AsyncMqttClient& onPublish(AsyncMqttClientInternals::OnPublishUserCallback callback) { _onPublish = callback; return *this; }
+
+        bool connected() const { return _connected; }
+        void connect();
+        void disconnect(bool force = false);
+        uint16_t subscribe(const char* topic, uint8_t qos);
+        uint16_t unsubscribe(const char* topic);
+        uint16_t publish(const char* topic, uint8_t qos, bool retain, const char* payload = nullptr, size_t length = 0, bool dup = false, uint16_t message_id = 0);
+
+        // Host-only hooks
+        void setPublishObserver(PublishObserver observer) { _publishObserver = observer; }
+        void injectMessage(const char* topic, const char* payload, size_t length, uint8_t qos = 0, bool retain = false);
+        // `length` bytes at `index` of a `total` byte payload
+        void injectPiece(const char* topic, const char* payload, size_t length, size_t index, size_t total);
+        void injectDisconnect(AsyncMqttClientDisconnectReason reason);
+        // Drops the connection too, if there is one
+        void setBrokerAvailable(bool available);
+        // `bytes` of send buffer, emptying at `bytesPerSecond`; 0 bytes for
+        // one that never fills, the default
+        void setSendBuffer(size_t bytes, unsigned long bytesPerSecond);
+
+        unsigned long publishCount;
+        unsigned long subscribeCount;
+        unsigned long connectCount;
+        // Publishes that didn't fit in the send buffer
+        unsigned long publishRefused;
+
+    private:
+        bool _connected;
+        bool _brokerAvailable;
+        uint16_t _nextPacketId;
+        size_t _sendBuffer;
+        unsigned long _sendRate;
+        size_t _inFlight;
+        unsigned long _drainedAt;
+
+        AsyncMqttClientInternals::OnConnectUserCallback _onConnect;
+        AsyncMqttClientInternals::OnDisconnectUserCallback _onDisconnect;
+        AsyncMqttClientInternals::OnMessageUserCallback _onMessage;
+        AsyncMqttClientInternals::OnPublishUserCallback _onPublish;
+        PublishObserver _publishObserver;
+
+        size_t sendSpace();
+        void deliver(const char* topic, const char* payload, size_t length, size_t index, size_t total,
+                     AsyncMqttClientMessageProperties properties);
+};
+
+#endif // __NATIVE_ASYNCMQTTCLIENT_H_
@@ -0,0 +1,9 @@
+#include "Bounce2.h"
+
+bool Bounce::update() {
+    int state = digitalRead(_pin);
+    if (state == _state) return false;
+    _state = state;
+    _changedAt = millis();
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef __NATIVE_BOUNCE2_H_
+#define __NATIVE_BOUNCE2_H_
+
+#include "Arduino.h"
+
+class Bounce {
+    public:
+        Bounce() : _pin(0), _state(HIGH), _changedAt(0) {}
+
+        void attach(int pin, int mode) { _pin = pin; pinMode(pin, mode); _state = digitalRead(pin); _changedAt = millis(); }
+        void attach(int pin) { _pin = pin; _state = digitalRead(pin); _changedAt = millis(); }
+
+        bool update();
+        int read() { return _state; }
+        unsigned long duration() { return millis() - _changedAt; }
+
+    private:
+        int _pin;
+        int _state;
+        unsigned long _changedAt;
+};
+
+#endif // __NATIVE_BOUNCE2_H_
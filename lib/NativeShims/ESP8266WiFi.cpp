@@ -0,0 +1,61 @@
+#include "ESP8266WiFi.h"
+
+ESP8266WiFiClass WiFi;
+
+// The SDK's default for a station is modem sleep
+ESP8266WiFiClass::ESP8266WiFiClass() : _associated(true), _static(false), _sleepMode(WIFI_MODEM_SLEEP) {
+    strcpy(_ssid, "native");
+    strcpy(_psk, "native");
+    static const uint8_t BSSID[6] = {0x02, 0x00, 0x00, 0xc0, 0xff, 0xee};
+    memcpy(_bssid, BSSID, sizeof(_bssid));
+}
+
+bool ESP8266WiFiClass::config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns) {
+    (void) gateway; (void) subnet; (void) dns;
+    // All zeroes goes back to DHCP
+    _static = (uint32_t) local != 0;
+    _localIP = local;
+    return true;
+}
+
+wl_status_t ESP8266WiFiClass::begin(const char* ssid, const char* passphrase, int32_t channel, const uint8_t* bssid, bool connect) {
+    (void) channel; (void) connect;
+    strncpy(_ssid, ssid, sizeof(_ssid) - 1);
+    _ssid[sizeof(_ssid) - 1] = '\0';
+    strncpy(_psk, passphrase ? passphrase : "", sizeof(_psk) - 1);
+    _psk[sizeof(_psk) - 1] = '\0';
+    if (bssid != NULL) memcpy(_bssid, bssid, sizeof(_bssid));
+    delay(NATIVE_WIFI_DIRECT_CONNECT_MS);
+    return WL_CONNECTED;
+}
+
+int ESP8266WiFiClass::hostByName(const char* host, IPAddress& result) {
+    (void) host;
+    result = IPAddress(127, 0, 0, 1);
+    return 1;
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> handler) {
+    _onGotIP = handler;
+    return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> handler) {
+    _onDisconnected = handler;
+    return std::make_shared<WiFiEventHandlerOpaque>();
+}
+
+void ESP8266WiFiClass::simulateDisconnect() {
+    if (!_associated) return;
+    _associated = false;
+    // REASON_BEACON_TIMEOUT
+    WiFiEventStationModeDisconnected event = { 200 };
+    if (_onDisconnected) _onDisconnected(event);
+}
+
+void ESP8266WiFiClass::simulateReconnect() {
+    if (_associated) return;
+    _associated = true;
+    WiFiEventStationModeGotIP event = { localIP(), subnetMask(), gatewayIP() };
+    if (_onGotIP) _onGotIP(event);
+}
@@ -0,0 +1,115 @@
+#ifndef __NATIVE_ESP8266WIFI_H_
+#define __NATIVE_ESP8266WIFI_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+
+#include "Arduino.h"
+
+typedef enum {
+    WL_IDLE_STATUS     = 0,
+    WL_NO_SSID_AVAIL   = 1,
+    WL_CONNECTED       = 3,
+    WL_CONNECT_FAILED  = 4,
+    WL_DISCONNECTED    = 6
+} wl_status_t;
+
+class IPAddress {
+    public:
+        IPAddress() : _address(0) {}
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) :
+            _address((uint32_t) a | (uint32_t) b << 8 | (uint32_t) c << 16 | (uint32_t) d << 24) {}
+        IPAddress(uint32_t address) : _address(address) {}
+
+        operator uint32_t() const { return _address; }
+        uint8_t operator[](int index) const { return (_address >> (index * 8)) & 0xff; }
+
+    private:
+        uint32_t _address;
+};
+
+typedef enum {
+    WIFI_OFF = 0,
+    WIFI_STA = 1,
+    WIFI_AP = 2,
+    WIFI_AP_STA = 3
+} WiFiMode_t;
+
+typedef enum {
+    WIFI_NONE_SLEEP = 0,
+    WIFI_LIGHT_SLEEP = 1,
+    WIFI_MODEM_SLEEP = 2
+} WiFiSleepType_t;
+
+struct WiFiEventStationModeGotIP {
+    IPAddress ip;
+    IPAddress mask;
+    IPAddress gw;
+};
+
+struct WiFiEventStationModeDisconnected {
+    uint8_t reason;
+};
+
+// The SDK removes a handler when the last copy of this goes away
+struct WiFiEventHandlerOpaque {};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+// Joining a known BSSID on a known channel with a static IP skips the scan
+// and DHCP; on the host that costs this much clock instead of WiFiManager's
+// NATIVE_WIFI_AUTOCONNECT_MS
+#define NATIVE_WIFI_DIRECT_CONNECT_MS 300
+
+// Associated with one access point unless simulateDisconnect() says not.
+// The credentials the SDK would have persisted are those of the last
+// begin(), or "native" at first.
+class ESP8266WiFiClass {
+    public:
+        ESP8266WiFiClass();
+
+        bool mode(WiFiMode_t mode) { (void) mode; return true; }
+        bool setSleepMode(WiFiSleepType_t type) { _sleepMode = type; return true; }
+        WiFiSleepType_t getSleepMode() { return _sleepMode; }
+        bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns = IPAddress());
+        wl_status_t begin(const char* ssid, const char* passphrase = NULL, int32_t channel = 0, const uint8_t* bssid = NULL, bool connect = true);
+        bool disconnect(bool wifiOff = false) { (void) wifiOff; return true; }
+
+        wl_status_t status() { return _associated ? WL_CONNECTED : WL_DISCONNECTED; }
+        String SSID() { return String(_ssid); }
+        String psk() { return String(_psk); }
+        uint8_t* BSSID() { return _bssid; }
+        int32_t channel() { return 6; }
+        IPAddress localIP() { return _static ? _localIP : IPAddress(127, 0, 0, 1); }
+        IPAddress gatewayIP() { return IPAddress(127, 0, 0, 254); }
+        IPAddress subnetMask() { return IPAddress(255, 0, 0, 0); }
+        IPAddress dnsIP(uint8_t index = 0) { (void) index; return IPAddress(127, 0, 0, 53); }
+        int32_t RSSI() { return -60; }
+
+        // Resolves every name to the loopback address
+        int hostByName(const char* host, IPAddress& result);
+
+        // One handler of each kind, which is all the firmware registers
+        WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> handler);
+        WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> handler);
+
+        // Host-only hooks: the access point goes away, and comes back
+        void simulateDisconnect();
+        void simulateReconnect();
+
+    private:
+        bool _associated;
+        std::function<void(const WiFiEventStationModeGotIP&)> _onGotIP;
+        std::function<void(const WiFiEventStationModeDisconnected&)> _onDisconnected;
+        char _ssid[33];
+        char _psk[65];
+        uint8_t _bssid[6];
+        bool _static;
+        IPAddress _localIP;
+        WiFiSleepType_t _sleepMode;
+};
+
+extern ESP8266WiFiClass WiFi;
+
+#endif // __NATIVE_ESP8266WIFI_H_
@@ -0,0 +1,68 @@
+#include "ESPAsyncTCP.h"
+
+AsyncClient::AsyncClient() :
+    _window(ASYNC_NATIVE_WINDOW),
+    _inFlight(0),
+    _closing(false),
+    _disconnectArg(0),
+    _ackArg(0),
+    _dataArg(0) {}
+
+size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags) {
+    (void) apiflags;
+    if (size > space()) size = space();
+    _sent.append(data, size);
+    _inFlight += size;
+    return size;
+}
+
+size_t AsyncClient::write(const char* data, size_t size, uint8_t apiflags) {
+    size_t added = add(data, size, apiflags);
+    send();
+    return added;
+}
+
+void AsyncClient::close(bool now) {
+    (void) now;
+    _closing = true;
+}
+
+void AsyncClient::injectData(const char* data, size_t length) {
+    if (_closing || !_onData) return;
+    _onData(_dataArg, this, (void*) data, length);
+}
+
+void AsyncClient::injectAck(size_t length) {
+    if (length > _inFlight) length = _inFlight;
+    if (length == 0) return;
+    _inFlight -= length;
+    if (!_closing && _onAck) _onAck(_ackArg, this, length, 0);
+}
+
+void AsyncClient::injectDisconnect() {
+    _closing = true;
+}
+
+std::string AsyncClient::takeSent() {
+    std::string sent;
+    sent.swap(_sent);
+    return sent;
+}
+
+bool AsyncClient::poll() {
+    if (!_closing) return false;
+    // The callback deletes this client, so nothing is touched after it
+    if (_onDisconnect) {
+        _onDisconnect(_disconnectArg, this);
+    } else {
+        delete this;
+    }
+    return true;
+}
+
+AsyncClient* AsyncServer::injectConnect() {
+    if (!_listening || !_onClient) return NULL;
+    AsyncClient* client = new AsyncClient();
+    _onClient(_arg, client);
+    return client;
+}
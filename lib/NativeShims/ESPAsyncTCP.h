@@ -0,0 +1,105 @@
+#ifndef __NATIVE_ESPASYNCTCP_H_
+#define __NATIVE_ESPASYNCTCP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+// AsyncServer and AsyncClient, for the local API. AsyncMqttClient is shimmed
+// separately.
+//
+// There is no network. injectConnect() hands the server's onClient callback
+// a new AsyncClient, as a peer connecting would, and the hooks on the client
+// act as its peer: injectData() delivers bytes through onData, takeSent()
+// reads what was sent, and injectAck() acknowledges it, which frees send
+// window and calls onAck. close() is carried out, with onDisconnect, at the
+// next poll(), as the real stack does after its own poll; the firmware
+// deletes the client there, so the peer must not use it after a poll() that
+// found it closing.
+
+#define ASYNC_WRITE_FLAG_COPY 0x01
+// The real stack's send buffer, TCP_SND_BUF
+#define ASYNC_NATIVE_WINDOW 2920
+
+class AsyncClient;
+
+typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
+typedef std::function<void(void*, AsyncClient*, void* data, size_t len)> AcDataHandler;
+typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+    public:
+        AsyncClient();
+
+        void onDisconnect(AcConnectHandler callback, void* arg = 0) { _onDisconnect = callback; _disconnectArg = arg; }
+        void onAck(AcAckHandler callback, void* arg = 0) { _onAck = callback; _ackArg = arg; }
+        void onData(AcDataHandler callback, void* arg = 0) { _onData = callback; _dataArg = arg; }
+        void onError(AcErrorHandler callback, void* arg = 0) { (void) callback; (void) arg; }
+        void onTimeout(AcTimeoutHandler callback, void* arg = 0) { (void) callback; (void) arg; }
+        void onPoll(AcConnectHandler callback, void* arg = 0) { (void) callback; (void) arg; }
+
+        size_t space() const { return _closing || _inFlight >= _window ? 0 : _window - _inFlight; }
+        bool canSend() const { return space() > 0; }
+        size_t add(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+        bool send() { return !_closing; }
+        size_t write(const char* data, size_t size, uint8_t apiflags = ASYNC_WRITE_FLAG_COPY);
+        void close(bool now = false);
+        bool connected() const { return !_closing; }
+        void setNoDelay(bool nodelay) { (void) nodelay; }
+        void setRxTimeout(uint32_t timeout) { (void) timeout; }
+
+        // Host-only hooks: the peer's side
+        void injectData(const char* data, size_t length);
+        // Acknowledges `length` bytes in flight, or all of them
+        void injectAck(size_t length = (size_t) -1);
+        // The peer hangs up
+        void injectDisconnect();
+        // The peer's receive window; 0 stops it taking anything
+        void setWindow(size_t bytes) { _window = bytes; }
+        // Everything sent since the last call
+        std::string takeSent();
+        bool closing() const { return _closing; }
+        // Carries out a close(); returns true if the client was closed, and
+        // so deleted
+        bool poll();
+
+    private:
+        size_t _window;
+        size_t _inFlight;
+        bool _closing;
+        std::string _sent;
+
+        AcConnectHandler _onDisconnect;
+        void* _disconnectArg;
+        AcAckHandler _onAck;
+        void* _ackArg;
+        AcDataHandler _onData;
+        void* _dataArg;
+};
+
+class AsyncServer {
+    public:
+        AsyncServer(uint16_t port) : _port(port), _listening(false), _arg(0) {}
+
+        void onClient(AcConnectHandler callback, void* arg) { _onClient = callback; _arg = arg; }
+        void begin() { _listening = true; }
+        void end() { _listening = false; }
+        void setNoDelay(bool nodelay) { (void) nodelay; }
+
+        // Host-only: a peer connects. Returns the new client, or NULL if the
+        // server isn't listening.
+        AsyncClient* injectConnect();
+        uint16_t port() const { return _port; }
+
+    private:
+        uint16_t _port;
+        bool _listening;
+        AcConnectHandler _onClient;
+        void* _arg;
+};
+
+#endif // __NATIVE_ESPASYNCTCP_H_
@@ -0,0 +1,24 @@
+#include "Esp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+EspClass ESP;
+
+void EspClass::restart() {
+    fprintf(stderr, "ESP.restart() called; exiting\n");
+    exit(1);
+}
+
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size) {
+    if (offset * 4 + size > sizeof(_rtcUserMemory) || size % 4 != 0) return false;
+    memcpy(data, &_rtcUserMemory[offset], size);
+    return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size) {
+    if (offset * 4 + size > sizeof(_rtcUserMemory) || size % 4 != 0) return false;
+    memcpy(&_rtcUserMemory[offset], data, size);
+    return true;
+}
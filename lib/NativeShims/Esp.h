@@ -0,0 +1,66 @@
+#ifndef __NATIVE_ESP_H_
+#define __NATIVE_ESP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WString.h"
+
+enum rst_reason {
+    REASON_DEFAULT_RST      = 0,
+    REASON_WDT_RST          = 1,
+    REASON_EXCEPTION_RST    = 2,
+    REASON_SOFT_WDT_RST     = 3,
+    REASON_SOFT_RESTART     = 4,
+    REASON_DEEP_SLEEP_AWAKE = 5,
+    REASON_EXT_SYS_RST      = 6
+};
+
+struct rst_info {
+    uint32_t reason;
+    uint32_t exccause;
+    uint32_t epc1;
+    uint32_t epc2;
+    uint32_t epc3;
+    uint32_t excvaddr;
+    uint32_t depc;
+};
+
+class EspClass {
+    public:
+        uint32_t getChipId() { return 0x00c0ffee; }
+        uint32_t getFreeHeap() { return 40960; }
+        uint16_t getMaxFreeBlockSize() { return 32768; }
+        uint8_t getHeapFragmentation() { return 20; }
+        uint8_t getCpuFreqMHz() { return 80; }
+        uint32_t getSketchSize() { return 400000; }
+        uint32_t getFreeSketchSpace() { return 600000; }
+
+        String getResetReason() { return String("Power on"); }
+        rst_info* getResetInfoPtr() { return &_resetInfo; }
+        String getCoreVersion() { return String("native"); }
+        const char* getSdkVersion() { return "native"; }
+        String getSketchMD5() { return String("00000000000000000000000000000000"); }
+
+        // The 512 bytes of RTC user memory, as 4-byte blocks. They keep their
+        // contents for as long as the process runs, as the real ones do
+        // through any reset but a power cycle.
+        bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+        bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+
+        // Host-only: what getResetInfoPtr() reports, as if the unit had just
+        // reset for that reason
+        void setResetReason(rst_reason reason) { _resetInfo.reason = reason; }
+
+        // The firmware calls restart() from paths that would never return on
+        // a real unit, so on the host it ends the process.
+        void restart();
+
+    private:
+        rst_info _resetInfo = { REASON_DEFAULT_RST, 0, 0, 0, 0, 0, 0 };
+        uint32_t _rtcUserMemory[128] = {};
+};
+
+extern EspClass ESP;
+
+#endif // __NATIVE_ESP_H_
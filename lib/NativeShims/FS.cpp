@@ -0,0 +1,33 @@
+#include "FS.h"
+
+FS SPIFFS;
+
+int File::read() {
+    if (!_data || _position >= _data->size()) return -1;
+    return (uint8_t) (*_data)[_position++];
+}
+
+int File::peek() {
+    if (!_data || _position >= _data->size()) return -1;
+    return (uint8_t) (*_data)[_position];
+}
+
+size_t File::write(uint8_t c) {
+    if (!_data || !_writable) return 0;
+    _data->push_back((char) c);
+    return 1;
+}
+
+File FS::open(const char* path, const char* mode) {
+    bool writable = mode[0] == 'w' || mode[0] == 'a';
+    std::shared_ptr<std::string>& data = _files[path];
+    if (!data) {
+        if (!writable) {
+            _files.erase(path);
+            return File();
+        }
+        data = std::make_shared<std::string>();
+    }
+    if (mode[0] == 'w') data->clear();
+    return File(data, writable);
+}
@@ -0,0 +1,51 @@
+#ifndef __NATIVE_FS_H_
+#define __NATIVE_FS_H_
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "Print.h"
+
+// An in-memory SPIFFS. Files live for as long as the process does.
+class File : public Stream {
+    public:
+        File() : _position(0), _writable(false) {}
+        File(std::shared_ptr<std::string> data, bool writable) :
+            _data(data), _position(0), _writable(writable) {}
+
+        operator bool() const { return (bool) _data; }
+
+        size_t size() const { return _data ? _data->size() : 0; }
+        void close() { _data.reset(); }
+
+        int available() override { return _data ? (int) (_data->size() - _position) : 0; }
+        int read() override;
+        int peek() override;
+
+        size_t write(uint8_t c) override;
+        using Print::write;
+
+    private:
+        std::shared_ptr<std::string> _data;
+        size_t _position;
+        bool _writable;
+};
+
+class FS {
+    public:
+        bool begin() { return true; }
+        void end() {}
+        bool format() { _files.clear(); return true; }
+
+        bool exists(const char* path) { return _files.count(path) > 0; }
+        bool remove(const char* path) { return _files.erase(path) > 0; }
+        File open(const char* path, const char* mode);
+
+    private:
+        std::map<std::string, std::shared_ptr<std::string> > _files;
+};
+
+extern FS SPIFFS;
+
+#endif // __NATIVE_FS_H_
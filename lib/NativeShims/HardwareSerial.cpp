@@ -0,0 +1,125 @@
+#include "HardwareSerial.h"
+#include "Arduino.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+
+static speed_t termiosSpeed(unsigned long baud) {
+    switch (baud) {
+        case 2400: return B2400;
+        case 9600: return B9600;
+        case 115200: return B115200;
+        default: return B9600;
+    }
+}
+
+bool HardwareSerial::open(const char* path) {
+    int fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    if (_fd >= 0) ::close(_fd);
+    _fd = fd;
+    _peeked = -1;
+    return true;
+}
+
+// A pty ignores the line settings, but a USB-serial adapter needs them to
+// talk to a real unit
+void HardwareSerial::begin(unsigned long baud, uint8_t config) {
+    _baud = baud;
+    if (_fd < 0) return;
+    struct termios tio;
+    if (tcgetattr(_fd, &tio) != 0) return;
+    cfsetspeed(&tio, termiosSpeed(baud));
+    tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB);
+    tio.c_cflag |= CS8 | CLOCAL | CREAD;
+    if (config == SERIAL_8E1) tio.c_cflag |= PARENB;
+    tcsetattr(_fd, TCSANOW, &tio);
+}
+
+bool HardwareSerial::waitAvailable(unsigned long timeoutMicros) {
+    if (_fd < 0) return false;
+    if (_peeked >= 0) return true;
+    struct pollfd pfd = { _fd, POLLIN, 0 };
+    return poll(&pfd, 1, (int) ((timeoutMicros + 999) / 1000)) > 0 && (pfd.revents & POLLIN);
+}
+
+int HardwareSerial::available() {
+    if (_fd < 0) return 0;
+    int count = 0;
+    if (ioctl(_fd, FIONREAD, &count) != 0) count = 0;
+    return count + (_peeked >= 0 ? 1 : 0);
+}
+
+int HardwareSerial::read() {
+    if (_peeked >= 0) {
+        int c = _peeked;
+        _peeked = -1;
+        return c;
+    }
+    uint8_t c;
+    if (_fd < 0 || ::read(_fd, &c, 1) != 1) return -1;
+    return c;
+}
+
+int HardwareSerial::peek() {
+    if (_peeked < 0) _peeked = read();
+    return _peeked;
+}
+
+// Takes out of the FIFO what the UART has sent since, at about 10 bits a
+// byte
+void HardwareSerial::txDrain() {
+    unsigned long now = micros();
+    size_t sent = (uint64_t) (now - _txAt) * _baud / 10000000;
+    if (sent >= _txQueued) {
+        _txQueued = 0;
+        _txAt = now;
+    } else if (sent > 0) {
+        _txQueued -= sent;
+        _txAt += (uint64_t) sent * 10000000 / _baud;
+    }
+}
+
+int HardwareSerial::availableForWrite() {
+    txDrain();
+    return _txQueued < UART_TX_FIFO_SIZE ? UART_TX_FIFO_SIZE - _txQueued : 0;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+    if (size > (size_t) availableForWrite()) _txBlocked++;
+    _txQueued += size;
+    if (_fd < 0) {
+        if (_echo) fwrite(buffer, 1, size, stdout);
+        return size;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = ::write(_fd, buffer + written, size - written);
+        if (n > 0) {
+            written += n;
+        } else {
+            struct pollfd pfd = { _fd, POLLOUT, 0 };
+            if (poll(&pfd, 1, 100) <= 0) break;
+        }
+    }
+    return written;
+}
@@ -0,0 +1,68 @@
+#ifndef __NATIVE_HARDWARESERIAL_H_
+#define __NATIVE_HARDWARESERIAL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "Print.h"
+
+#define SERIAL_8N1 0x1c
+#define SERIAL_8E1 0x1e
+
+#define UART_TX_FIFO_SIZE 128
+
+// A UART that discards its output unless echo is enabled, in which case it is
+// written to stdout. Reads always come back empty.
+//
+// Host-only: open() attaches it to a tty instead, e.g. the pty served by
+// tools/cn105sim or a USB-serial adapter, and reads and writes go there.
+//
+// availableForWrite() is the room in the core's TX FIFO, which empties at
+// the baud rate on the native clock. Writes never wait for it, as the
+// core's do; txBlocked() counts the ones that would have.
+class HardwareSerial : public Stream {
+    public:
+        HardwareSerial(int uart_nr) : _uart_nr(uart_nr), _echo(false), _fd(-1), _peeked(-1),
+            _baud(115200), _txQueued(0), _txAt(0), _txBlocked(0) {}
+
+        void begin(unsigned long baud) { begin(baud, SERIAL_8N1); }
+        void begin(unsigned long baud, uint8_t config);
+        void end() {}
+        void swap() {}
+        void setDebugOutput(bool enabled) { (void) enabled; }
+
+        void setEcho(bool echo) { _echo = echo; }
+
+        bool open(const char* path);
+        bool isOpen() const { return _fd >= 0; }
+        // Waits up to timeoutMicros for a byte to read; true if there is one
+        bool waitAvailable(unsigned long timeoutMicros);
+
+        int availableForWrite();
+        unsigned long txBlocked() const { return _txBlocked; }
+
+        int available() override;
+        int read() override;
+        int peek() override;
+
+        size_t write(uint8_t c) override;
+        size_t write(const uint8_t *buffer, size_t size) override;
+        using Print::write;
+
+    private:
+        int _uart_nr;
+        bool _echo;
+        int _fd;
+        int _peeked;
+        unsigned long _baud;
+        size_t _txQueued;
+        unsigned long _txAt;
+        unsigned long _txBlocked;
+
+        void txDrain();
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#endif // __NATIVE_HARDWARESERIAL_H_
@@ -0,0 +1,454 @@
+#include "HeatPump.h"
+
+#include <string.h>
+
+static const byte CONTROL_PACKET_1[5] = {0x01, 0x02, 0x04, 0x08, 0x10};
+static const byte CONTROL_PACKET_2[1] = {0x01};
+
+static const byte POWER[2] = {0x00, 0x01};
+static const char* POWER_MAP[2] = {"OFF", "ON"};
+static const byte MODE[5] = {0x01, 0x02, 0x03, 0x07, 0x08};
+static const char* MODE_MAP[5] = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
+static const byte TEMP[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+static const int TEMP_MAP[16] = {31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16};
+static const byte FAN[6] = {0x00, 0x01, 0x02, 0x03, 0x05, 0x06};
+static const char* FAN_MAP[6] = {"AUTO", "QUIET", "1", "2", "3", "4"};
+static const byte VANE[7] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x07};
+static const char* VANE_MAP[7] = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
+static const byte WIDEVANE[7] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x0c};
+static const char* WIDEVANE_MAP[7] = {"<<", "<", "|", ">", ">>", "<>", "SWING"};
+static const byte ROOM_TEMP[32] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+                                   0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f};
+static const int ROOM_TEMP_MAP[32] = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+                                      26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41};
+
+static const byte CONNECT[CONNECT_LEN] = {0xfc, 0x5a, 0x01, 0x30, 0x02, 0xca, 0x01, 0xa8};
+static const byte HEADER[5] = {0xfc, 0x41, 0x01, 0x30, 0x10};
+static const byte INFOHEADER[5] = {0xfc, 0x42, 0x01, 0x30, 0x10};
+static const int INFOMODE_LEN = 4;
+static const byte INFOMODE[INFOMODE_LEN] = {0x02, 0x03, 0x05, 0x06};
+
+static int lookupByteMapIndex(const char* valuesMap[], int len, const char* lookupValue) {
+    if (lookupValue == NULL) return -1;
+    for (int i = 0; i < len; i++) {
+        if (strcmp(valuesMap[i], lookupValue) == 0) return i;
+    }
+    return -1;
+}
+
+static int lookupByteMapIndex(const byte byteMap[], int len, byte value) {
+    for (int i = 0; i < len; i++) {
+        if (byteMap[i] == value) return i;
+    }
+    return -1;
+}
+
+static const char* lookupByteMapValue(const char* valuesMap[], const byte byteMap[], int len, byte byteValue) {
+    int index = lookupByteMapIndex(byteMap, len, byteValue);
+    return index < 0 ? valuesMap[0] : valuesMap[index];
+}
+
+static byte checkSum(const byte bytes[], int len) {
+    byte sum = 0;
+    for (int i = 0; i < len; i++) sum += bytes[i];
+    return (0xfc - sum) & 0xff;
+}
+
+static bool sameString(const char* a, const char* b) {
+    if (a == b) return true;
+    if (a == NULL || b == NULL) return false;
+    return strcmp(a, b) == 0;
+}
+
+bool operator==(const heatpumpSettings& lhs, const heatpumpSettings& rhs) {
+    return sameString(lhs.power, rhs.power) &&
+           sameString(lhs.mode, rhs.mode) &&
+           lhs.temperature == rhs.temperature &&
+           sameString(lhs.fan, rhs.fan) &&
+           sameString(lhs.vane, rhs.vane) &&
+           sameString(lhs.wideVane, rhs.wideVane) &&
+           lhs.iSee == rhs.iSee;
+}
+
+bool operator!=(const heatpumpSettings& lhs, const heatpumpSettings& rhs) {
+    return !(lhs == rhs);
+}
+
+HeatPump::HeatPump() :
+    updateCount(0),
+    syncCount(0),
+    bytesSent(0),
+    bytesReceived(0),
+    lastUpdateMicros(0),
+    packetsReceived(0),
+    badPackets(0),
+    replyTimeouts(0),
+    reconnects(0),
+    _serial(NULL),
+    _connected(false),
+    _firstRun(true),
+    _externalUpdate(false),
+    _autoUpdate(false),
+    _lastSend(0),
+    _lastRecv(0),
+    _awaitingReply(false),
+    _infoMode(0),
+    _unitPower(0x00),
+    _unitMode(0x03),
+    _unitTemperature(0x08),
+    _unitFan(0x00),
+    _unitVane(0x00),
+    _unitWideVane(0x03),
+    _unitRoomTemperature(0x0c),
+    _lostWrites(0),
+    _responseLength(0),
+    _responseDueMicros(0) {
+    memset(&_currentSettings, 0, sizeof(_currentSettings));
+    memset(&_wantedSettings, 0, sizeof(_wantedSettings));
+    memset(&_currentStatus, 0, sizeof(_currentStatus));
+}
+
+// Like the real library, connect(NULL) reconnects on the last serial port
+bool HeatPump::connect(HardwareSerial *serial) {
+    if (serial != NULL) _serial = serial;
+    if (_serial == NULL) return false;
+    if (onConnectCallback) onConnectCallback();
+    _connected = false;
+    _awaitingReply = false;
+    _serial->begin(CN105_BAUD, SERIAL_8E1);
+    // settle before we start sending packets
+    delay(2000);
+
+    byte packet[CONNECT_LEN];
+    memcpy(packet, CONNECT, CONNECT_LEN);
+    writePacket(packet, CONNECT_LEN);
+    readResponse();
+    return _connected;
+}
+
+bool HeatPump::canSend(bool isInfo) {
+    return (millis() - (isInfo ? PACKET_INFO_INTERVAL_MS : PACKET_SENT_INTERVAL_MS)) > _lastSend;
+}
+
+bool HeatPump::update() {
+    while (!canSend(false)) { delay(10); }
+    // Drain any info reply still in flight before writing
+    if (_responseLength > 0 || _awaitingReply) readResponse();
+
+    byte packet[PACKET_LEN] = {};
+    memcpy(packet, HEADER, 5);
+    packet[5] = 0x01;
+
+    int index;
+    if (!sameString(_wantedSettings.power, _currentSettings.power) && (index = lookupByteMapIndex(POWER_MAP, 2, _wantedSettings.power)) >= 0) {
+        packet[8] = POWER[index];
+        packet[6] += CONTROL_PACKET_1[0];
+    }
+    if (!sameString(_wantedSettings.mode, _currentSettings.mode) && (index = lookupByteMapIndex(MODE_MAP, 5, _wantedSettings.mode)) >= 0) {
+        packet[9] = MODE[index];
+        packet[6] += CONTROL_PACKET_1[1];
+    }
+    if (_wantedSettings.temperature != _currentSettings.temperature && _wantedSettings.temperature >= 16 && _wantedSettings.temperature <= 31) {
+        packet[10] = TEMP[31 - (int) _wantedSettings.temperature];
+        packet[6] += CONTROL_PACKET_1[2];
+    }
+    if (!sameString(_wantedSettings.fan, _currentSettings.fan) && (index = lookupByteMapIndex(FAN_MAP, 6, _wantedSettings.fan)) >= 0) {
+        packet[11] = FAN[index];
+        packet[6] += CONTROL_PACKET_1[3];
+    }
+    if (!sameString(_wantedSettings.vane, _currentSettings.vane) && (index = lookupByteMapIndex(VANE_MAP, 7, _wantedSettings.vane)) >= 0) {
+        packet[12] = VANE[index];
+        packet[6] += CONTROL_PACKET_1[4];
+    }
+    if (!sameString(_wantedSettings.wideVane, _currentSettings.wideVane) && (index = lookupByteMapIndex(WIDEVANE_MAP, 7, _wantedSettings.wideVane)) >= 0) {
+        packet[18] = WIDEVANE[index];
+        packet[7] += CONTROL_PACKET_2[0];
+    }
+    packet[21] = checkSum(packet, 21);
+
+    writePacket(packet, PACKET_LEN);
+    byte reply = readResponse();
+
+    updateCount++;
+    lastUpdateMicros = micros();
+    return !usingLink() || reply == 0x61;
+}
+
+void HeatPump::sync(byte packetType) {
+    syncCount++;
+    if (usingLink()) {
+        // The unit answers every request, so a quiet link has gone away
+        if (!_connected || millis() - _lastRecv > PACKET_SENT_INTERVAL_MS * 10) {
+            reconnects++;
+            connect(NULL);
+            return;
+        }
+        if (_awaitingReply) {
+            if (_serial->available() > 0) {
+                readResponse();
+            } else if (millis() - _lastSend > PACKET_REPLY_TIMEOUT_MS) {
+                replyTimeouts++;
+                _awaitingReply = false;
+            }
+            return;
+        }
+    }
+    if (!_connected) return;
+
+    if (_responseLength > 0) {
+        if ((long) (micros() - _responseDueMicros) >= 0) readResponse();
+        return;
+    }
+
+    if (canSend(true)) {
+        byte packet[PACKET_LEN] = {};
+        memcpy(packet, INFOHEADER, 5);
+        if (packetType != PACKET_TYPE_DEFAULT) {
+            packet[5] = INFOMODE[packetType];
+        } else {
+            packet[5] = INFOMODE[_infoMode];
+            _infoMode = (_infoMode + 1) % INFOMODE_LEN;
+        }
+        packet[21] = checkSum(packet, 21);
+        writePacket(packet, PACKET_LEN);
+    }
+}
+
+void HeatPump::writePacket(byte *packet, int length) {
+    if (packetCallback) packetCallback(packet, length, (char*) "packetSent");
+    bytesSent += length;
+    _lastSend = millis();
+    if (usingLink()) {
+        // Anything left over from an earlier reply is stale now
+        while (_serial->available() > 0) _serial->read();
+        _serial->write(packet, length);
+        _awaitingReply = true;
+        return;
+    }
+    unitRespond(packet, length);
+    // The reply can only start arriving once our frame is fully on the wire
+    _responseDueMicros = micros() + (length + _responseLength) * CN105_BYTE_MICROS;
+}
+
+// Returns the command byte of the reply, or 0 if there wasn't a valid one
+byte HeatPump::readResponse() {
+    if (usingLink()) {
+        if (!_awaitingReply) return 0;
+        _awaitingReply = false;
+        return readLinkPacket();
+    }
+    if (_responseLength == 0) return 0;
+    long wait = (long) (_responseDueMicros - micros());
+    if (wait > 0) delayMicroseconds(wait);
+    int length = _responseLength;
+    _responseLength = 0;
+    return receivePacket(_response, length);
+}
+
+// Reads one frame off the link: skip to a 0xfc header, then the rest of the
+// header, the data it announces and the checksum. Time spent waiting is real,
+// so it shows up on millis() as it would on a unit.
+byte HeatPump::readLinkPacket() {
+    byte packet[PACKET_LEN];
+    int length = 0;
+    int expected = 5;
+    unsigned long timeout = PACKET_REPLY_TIMEOUT_MS * 1000UL;
+
+    while (length < expected) {
+        if (!_serial->waitAvailable(timeout)) {
+            replyTimeouts++;
+            if (length > 0) receivePacket(packet, length);
+            return 0;
+        }
+        int c = _serial->read();
+        if (c < 0) continue;
+        if (length == 0 && c != 0xfc) continue;
+        packet[length++] = c;
+        timeout = PACKET_BYTE_TIMEOUT_MS * 1000UL;
+        if (length == 5) {
+            if (packet[4] > PACKET_LEN - 6) {
+                receivePacket(packet, length);
+                return 0;
+            }
+            expected = 5 + packet[4] + 1;
+        }
+    }
+    return receivePacket(packet, length);
+}
+
+// Returns the command byte, or 0 if the packet was truncated or corrupt
+byte HeatPump::receivePacket(byte *packet, int length) {
+    bytesReceived += length;
+    if (packetCallback) packetCallback(packet, length, (char*) "packetRecv");
+    if (length < 6 || packet[0] != 0xfc || packet[length - 1] != checkSum(packet, length - 1)) {
+        badPackets++;
+        return 0;
+    }
+    packetsReceived++;
+    _lastRecv = millis();
+
+    byte *data = packet + 5;
+    switch (packet[1]) {
+        case 0x7a:
+            _connected = true;
+            break;
+        case 0x61:
+            // set-settings acknowledged
+            break;
+        case 0x62:
+            if (data[0] == 0x02) {
+                heatpumpSettings receivedSettings;
+                receivedSettings.connected = true;
+                receivedSettings.iSee = data[4] > 0x08;
+                receivedSettings.power = lookupByteMapValue(POWER_MAP, POWER, 2, data[3]);
+                receivedSettings.mode = lookupByteMapValue(MODE_MAP, MODE, 5, receivedSettings.iSee ? (data[4] - 0x08) : data[4]);
+                receivedSettings.temperature = TEMP_MAP[lookupByteMapIndex(TEMP, 16, data[5]) < 0 ? 0 : lookupByteMapIndex(TEMP, 16, data[5])];
+                receivedSettings.fan = lookupByteMapValue(FAN_MAP, FAN, 6, data[6]);
+                receivedSettings.vane = lookupByteMapValue(VANE_MAP, VANE, 7, data[7]);
+                receivedSettings.wideVane = lookupByteMapValue(WIDEVANE_MAP, WIDEVANE, 7, data[10] & 0x0f);
+
+                if (_firstRun || (_autoUpdate && _externalUpdate)) {
+                    _wantedSettings = receivedSettings;
+                    _firstRun = false;
+                }
+                if (settingsChangedCallback && receivedSettings != _currentSettings) {
+                    _currentSettings = receivedSettings;
+                    settingsChangedCallback();
+                } else {
+                    _currentSettings = receivedSettings;
+                }
+            } else if (data[0] == 0x03) {
+                heatpumpStatus receivedStatus = _currentStatus;
+                int index = lookupByteMapIndex(ROOM_TEMP, 32, data[3]);
+                receivedStatus.roomTemperature = ROOM_TEMP_MAP[index < 0 ? 0 : index];
+                if (statusChangedCallback && receivedStatus.roomTemperature != _currentStatus.roomTemperature) {
+                    _currentStatus = receivedStatus;
+                    statusChangedCallback(_currentStatus);
+                } else {
+                    _currentStatus = receivedStatus;
+                }
+            }
+            break;
+    }
+    return packet[1];
+}
+
+// The indoor unit's side of the link: apply the request and queue its reply
+void HeatPump::unitRespond(const byte *request, int length) {
+    byte *reply = _response;
+    memset(reply, 0, PACKET_LEN);
+    _responseLength = 0;
+    if (length < 6 || request[length - 1] != checkSum(request, length - 1)) return;
+
+    const byte *data = request + 5;
+    switch (request[1]) {
+        case 0x5a: {
+            static const byte CONNECT_ACK[7] = {0xfc, 0x7a, 0x01, 0x30, 0x01, 0x00, 0x54};
+            memcpy(reply, CONNECT_ACK, 7);
+            _responseLength = 7;
+            return;
+        }
+        case 0x41:
+            if (_lostWrites > 0) {
+                _lostWrites--;
+                return;
+            }
+            if (data[0] == 0x01) {
+                if (data[1] & CONTROL_PACKET_1[0]) _unitPower = data[3];
+                if (data[1] & CONTROL_PACKET_1[1]) _unitMode = data[4];
+                if (data[1] & CONTROL_PACKET_1[2]) _unitTemperature = data[5];
+                if (data[1] & CONTROL_PACKET_1[3]) _unitFan = data[6];
+                if (data[1] & CONTROL_PACKET_1[4]) _unitVane = data[7];
+                if (data[2] & CONTROL_PACKET_2[0]) _unitWideVane = data[13];
+            }
+            reply[1] = 0x61;
+            break;
+        case 0x42:
+            reply[1] = 0x62;
+            reply[5] = data[0];
+            if (data[0] == 0x02) {
+                reply[8] = _unitPower;
+                reply[9] = _unitMode;
+                reply[10] = _unitTemperature;
+                reply[11] = _unitFan;
+                reply[12] = _unitVane;
+                reply[15] = _unitWideVane;
+            } else if (data[0] == 0x03) {
+                reply[8] = _unitRoomTemperature;
+            }
+            break;
+        default:
+            return;
+    }
+    reply[0] = 0xfc;
+    reply[2] = 0x01;
+    reply[3] = 0x30;
+    reply[4] = 0x10;
+    reply[21] = checkSum(reply, 21);
+    _responseLength = PACKET_LEN;
+}
+
+void HeatPump::setSettings(heatpumpSettings settings) {
+    setPowerSetting(settings.power);
+    setModeSetting(settings.mode);
+    setTemperature(settings.temperature);
+    setFanSpeed(settings.fan);
+    setVaneSetting(settings.vane);
+    setWideVaneSetting(settings.wideVane);
+}
+
+bool HeatPump::getPowerSettingBool() {
+    return sameString(_currentSettings.power, POWER_MAP[1]);
+}
+
+void HeatPump::setPowerSetting(bool setting) {
+    _wantedSettings.power = POWER_MAP[setting ? 1 : 0];
+}
+
+void HeatPump::setPowerSetting(const char* setting) {
+    int index = lookupByteMapIndex(POWER_MAP, 2, setting);
+    _wantedSettings.power = POWER_MAP[index < 0 ? 0 : index];
+}
+
+void HeatPump::setModeSetting(const char* setting) {
+    int index = lookupByteMapIndex(MODE_MAP, 5, setting);
+    _wantedSettings.mode = MODE_MAP[index < 0 ? 0 : index];
+}
+
+void HeatPump::setTemperature(float setting) {
+    if (setting < 16) setting = 16;
+    if (setting > 31) setting = 31;
+    _wantedSettings.temperature = (int) (setting + 0.5f);
+}
+
+void HeatPump::setFanSpeed(const char* setting) {
+    int index = lookupByteMapIndex(FAN_MAP, 6, setting);
+    _wantedSettings.fan = FAN_MAP[index < 0 ? 0 : index];
+}
+
+void HeatPump::setVaneSetting(const char* setting) {
+    int index = lookupByteMapIndex(VANE_MAP, 7, setting);
+    _wantedSettings.vane = VANE_MAP[index < 0 ? 0 : index];
+}
+
+void HeatPump::setWideVaneSetting(const char* setting) {
+    int index = lookupByteMapIndex(WIDEVANE_MAP, 7, setting);
+    _wantedSettings.wideVane = WIDEVANE_MAP[index < 0 ? 0 : index];
+}
+
+void HeatPump::simulateRemoteChange(heatpumpSettings settings) {
+    int index;
+    if ((index = lookupByteMapIndex(POWER_MAP, 2, settings.power)) >= 0) _unitPower = POWER[index];
+    if ((index = lookupByteMapIndex(MODE_MAP, 5, settings.mode)) >= 0) _unitMode = MODE[index];
+    if (settings.temperature >= 16 && settings.temperature <= 31) _unitTemperature = TEMP[31 - (int) settings.temperature];
+    if ((index = lookupByteMapIndex(FAN_MAP, 6, settings.fan)) >= 0) _unitFan = FAN[index];
+    if ((index = lookupByteMapIndex(VANE_MAP, 7, settings.vane)) >= 0) _unitVane = VANE[index];
+    if ((index = lookupByteMapIndex(WIDEVANE_MAP, 7, settings.wideVane)) >= 0) _unitWideVane = WIDEVANE[index];
+}
+
+void HeatPump::simulateRoomTemperature(float temperature) {
+    int t = (int) (temperature + 0.5f);
+    if (t < 10) t = 10;
+    if (t > 41) t = 41;
+    _unitRoomTemperature = ROOM_TEMP[t - 10];
+}
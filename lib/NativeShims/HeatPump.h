@@ -0,0 +1,179 @@
+#ifndef __NATIVE_HEATPUMP_H_
+#define __NATIVE_HEATPUMP_H_
+
+#include <stdint.h>
+
+#include <functional>
+
+#include "Arduino.h"
+#include "HardwareSerial.h"
+
+// Host-side stand-in for the HeatPump library, paired with a model of the
+// indoor unit on the far end of the CN105 link. Frames are really encoded,
+// "sent" and decoded, and every byte costs the clock what it would at 2400
+// baud 8E1, so callers see the same link timing that the real library does.
+//
+// If the serial port passed to connect() has been open()ed on a tty, the
+// model is bypassed and frames really go over it, to tools/cn105sim or to a
+// unit. Replies are then read like the real library does, byte by byte with
+// timeouts, and a link that goes quiet is reconnected from sync().
+
+#define PACKET_LEN 22
+#define CONNECT_LEN 8
+#define PACKET_SENT_INTERVAL_MS 1000
+#define PACKET_INFO_INTERVAL_MS 2000
+#define PACKET_TYPE_DEFAULT 99
+
+// Link mode only: how long to wait for a reply to start, and for each of its
+// following bytes
+#define PACKET_REPLY_TIMEOUT_MS 500
+#define PACKET_BYTE_TIMEOUT_MS 50
+
+#define RQST_PKT_SETTINGS  0
+#define RQST_PKT_ROOM_TEMP 1
+#define RQST_PKT_TIMERS    3
+#define RQST_PKT_STATUS    4
+
+// One byte on the wire is start + 8 data + parity + stop bits
+#define CN105_BAUD 2400
+#define CN105_BYTE_MICROS (11UL * 1000000UL / CN105_BAUD)
+
+struct heatpumpSettings {
+    const char* power;
+    const char* mode;
+    float temperature;
+    const char* fan;
+    const char* vane;
+    const char* wideVane;
+    bool iSee;
+    bool connected;
+};
+
+bool operator==(const heatpumpSettings& lhs, const heatpumpSettings& rhs);
+bool operator!=(const heatpumpSettings& lhs, const heatpumpSettings& rhs);
+
+struct heatpumpTimers {
+    const char* mode;
+    int onMinutesSet;
+    int onMinutesRemaining;
+    int offMinutesSet;
+    int offMinutesRemaining;
+};
+
+struct heatpumpStatus {
+    float roomTemperature;
+    bool operating;
+    heatpumpTimers timers;
+    int compressorFrequency;
+};
+
+#define ON_CONNECT_CALLBACK_SIGNATURE std::function<void()> onConnectCallback
+#define SETTINGS_CHANGED_CALLBACK_SIGNATURE std::function<void()> settingsChangedCallback
+#define STATUS_CHANGED_CALLBACK_SIGNATURE std::function<void(heatpumpStatus newStatus)> statusChangedCallback
+#define PACKET_CALLBACK_SIGNATURE std::function<void(byte* packet, unsigned int length, char* packetDirection)> packetCallback
+
+class HeatPump {
+    public:
+        HeatPump();
+
+        bool connect(HardwareSerial *serial);
+        bool update();
+        void sync(byte packetType = PACKET_TYPE_DEFAULT);
+        void enableExternalUpdate() { _externalUpdate = true; }
+        void disableExternalUpdate() { _externalUpdate = false; }
+        void enableAutoUpdate() { _autoUpdate = true; }
+        void disableAutoUpdate() { _autoUpdate = false; }
+
+        heatpumpSettings getSettings() { return _currentSettings; }
+        void setSettings(heatpumpSettings settings);
+        bool isConnected() { return _connected; }
+
+        bool getPowerSettingBool();
+        const char* getPowerSetting() { return _currentSettings.power; }
+        void setPowerSetting(bool setting);
+        void setPowerSetting(const char* setting);
+        const char* getModeSetting() { return _currentSettings.mode; }
+        void setModeSetting(const char* setting);
+        float getTemperature() { return _currentSettings.temperature; }
+        void setTemperature(float setting);
+        const char* getFanSpeed() { return _currentSettings.fan; }
+        void setFanSpeed(const char* setting);
+        const char* getVaneSetting() { return _currentSettings.vane; }
+        void setVaneSetting(const char* setting);
+        const char* getWideVaneSetting() { return _currentSettings.wideVane; }
+        void setWideVaneSetting(const char* setting);
+        bool getIseeBool() { return _currentSettings.iSee; }
+
+        heatpumpStatus getStatus() { return _currentStatus; }
+        float getRoomTemperature() { return _currentStatus.roomTemperature; }
+        bool getOperating() { return _currentStatus.operating; }
+
+        void setOnConnectCallback(ON_CONNECT_CALLBACK_SIGNATURE) { this->onConnectCallback = onConnectCallback; }
+        void setSettingsChangedCallback(SETTINGS_CHANGED_CALLBACK_SIGNATURE) { this->settingsChangedCallback = settingsChangedCallback; }
+        void setStatusChangedCallback(STATUS_CHANGED_CALLBACK_SIGNATURE) { this->statusChangedCallback = statusChangedCallback; }
+        void setPacketCallback(PACKET_CALLBACK_SIGNATURE) { this->packetCallback = packetCallback; }
+
+        // Host-only: drive the model of the indoor unit, as if someone had
+        // used the IR remote or the room had warmed up.
+        void simulateRemoteChange(heatpumpSettings settings);
+        void simulateRoomTemperature(float temperature);
+        // Host-only: the unit ignores the next `count` set-settings frames,
+        // as if they were lost on the link
+        void simulateLostWrites(unsigned int count) { _lostWrites = count; }
+
+        // Host-only: link counters
+        unsigned long updateCount;
+        unsigned long syncCount;
+        unsigned long bytesSent;
+        unsigned long bytesReceived;
+        unsigned long lastUpdateMicros;
+        unsigned long packetsReceived;
+        unsigned long badPackets;
+        unsigned long replyTimeouts;
+        unsigned long reconnects;
+
+    private:
+        ON_CONNECT_CALLBACK_SIGNATURE;
+        SETTINGS_CHANGED_CALLBACK_SIGNATURE;
+        STATUS_CHANGED_CALLBACK_SIGNATURE;
+        PACKET_CALLBACK_SIGNATURE;
+
+        bool canSend(bool isInfo);
+        void writePacket(byte *packet, int length);
+        byte receivePacket(byte *packet, int length);
+        void unitRespond(const byte *request, int length);
+        byte readResponse();
+        byte readLinkPacket();
+        bool usingLink() { return _serial != NULL && _serial->isOpen(); }
+
+        HardwareSerial *_serial;
+
+        bool _connected;
+        bool _firstRun;
+        bool _externalUpdate;
+        bool _autoUpdate;
+        unsigned long _lastSend;
+        unsigned long _lastRecv;
+        bool _awaitingReply;
+        int _infoMode;
+
+        heatpumpSettings _currentSettings;
+        heatpumpSettings _wantedSettings;
+        heatpumpStatus _currentStatus;
+
+        // Model of the indoor unit, in wire encoding
+        byte _unitPower;
+        byte _unitMode;
+        byte _unitTemperature;
+        byte _unitFan;
+        byte _unitVane;
+        byte _unitWideVane;
+        byte _unitRoomTemperature;
+        unsigned int _lostWrites;
+
+        byte _response[PACKET_LEN];
+        int _responseLength;
+        unsigned long _responseDueMicros;
+};
+
+#endif // __NATIVE_HEATPUMP_H_
@@ -0,0 +1,51 @@
+#ifndef __NATIVE_PRINT_H_
+#define __NATIVE_PRINT_H_
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "WString.h"
+
+class Print {
+    public:
+        virtual ~Print() {}
+
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size);
+        size_t write(const char *s);
+
+        size_t printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+        size_t print(const char *s);
+        size_t print(const String &s);
+        size_t print(char c);
+        size_t print(int n);
+        size_t print(unsigned int n);
+        size_t print(long n);
+        size_t print(unsigned long n);
+        size_t print(double n);
+
+        size_t println();
+        size_t println(const char *s);
+        size_t println(const String &s);
+        size_t println(char c);
+        size_t println(int n);
+        size_t println(unsigned int n);
+        size_t println(long n);
+        size_t println(unsigned long n);
+        size_t println(double n);
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+        virtual void flush() {}
+
+        size_t readBytes(char *buffer, size_t length);
+        size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *) buffer, length); }
+};
+
+#endif // __NATIVE_PRINT_H_
@@ -0,0 +1,101 @@
+#include "Syslog.h"
+
+#include <stdio.h>
+#include <string.h>
+
+Syslog::Syslog(UDP &client, uint8_t protocol) :
+    _client(&client),
+    _protocol(protocol),
+    _server(NULL),
+    _port(0),
+    _deviceHostname(SYSLOG_NILVALUE),
+    _appName(SYSLOG_NILVALUE),
+    _priDefault(LOG_KERN),
+    _priMask(0xff) {}
+
+Syslog &Syslog::server(const char* server, uint16_t port) {
+    _server = server;
+    _port = port;
+    return *this;
+}
+
+Syslog &Syslog::deviceHostname(const char* deviceHostname) {
+    _deviceHostname = (deviceHostname == NULL) ? SYSLOG_NILVALUE : deviceHostname;
+    return *this;
+}
+
+Syslog &Syslog::appName(const char* appName) {
+    _appName = (appName == NULL) ? SYSLOG_NILVALUE : appName;
+    return *this;
+}
+
+Syslog &Syslog::defaultPriority(uint16_t pri) {
+    _priDefault = pri;
+    return *this;
+}
+
+Syslog &Syslog::logMask(uint8_t priMask) {
+    if (priMask != 0) _priMask = priMask;
+    return *this;
+}
+
+bool Syslog::log(uint16_t pri, const String &message) {
+    return _sendLog(pri, message.c_str());
+}
+
+bool Syslog::log(uint16_t pri, const char *message) {
+    return _sendLog(pri, message);
+}
+
+bool Syslog::vlogf(uint16_t pri, const char *fmt, va_list args) {
+    va_list copy;
+    size_t initialLen = strlen(fmt);
+    char *message = new char[initialLen + 1];
+
+    va_copy(copy, args);
+    size_t len = vsnprintf(message, initialLen + 1, fmt, copy);
+    va_end(copy);
+    if (len > initialLen) {
+        delete[] message;
+        message = new char[len + 1];
+        vsnprintf(message, len + 1, fmt, args);
+    }
+
+    bool result = _sendLog(pri, message);
+    delete[] message;
+    return result;
+}
+
+bool Syslog::logf(uint16_t pri, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    bool result = vlogf(pri, fmt, args);
+    va_end(args);
+    return result;
+}
+
+bool Syslog::log(const char *message) {
+    return log(_priDefault, message);
+}
+
+bool Syslog::logf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    bool result = vlogf(_priDefault, fmt, args);
+    va_end(args);
+    return result;
+}
+
+bool Syslog::_sendLog(uint16_t pri, const char *message) {
+    if (_server == NULL || _port == 0) return false;
+    if ((pri & LOG_PRIMASK) == pri) pri |= (_priDefault & ~LOG_PRIMASK);
+    if (!(LOG_MASK(LOG_PRI(pri)) & _priMask)) return true;
+
+    if (!_client->beginPacket(_server, _port)) return false;
+    _client->printf("<%d>%s%s %s - - - ", pri,
+                    _protocol == SYSLOG_PROTO_IETF ? "1 - " : "",
+                    _deviceHostname, _appName);
+    _client->print(message);
+    _client->endPacket();
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef __NATIVE_SYSLOG_H_
+#define __NATIVE_SYSLOG_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "Udp.h"
+#include "WString.h"
+
+#define SYSLOG_NILVALUE "-"
+
+#define SYSLOG_PROTO_IETF 0
+#define SYSLOG_PROTO_BSD  1
+
+#define LOG_EMERG   0
+#define LOG_ALERT   1
+#define LOG_CRIT    2
+#define LOG_ERR     3
+#define LOG_WARNING 4
+#define LOG_NOTICE  5
+#define LOG_INFO    6
+#define LOG_DEBUG   7
+
+#define LOG_PRIMASK 0x07
+#define LOG_PRI(p)  ((p) & LOG_PRIMASK)
+
+#define LOG_KERN   (0<<3)
+#define LOG_USER   (1<<3)
+#define LOG_LOCAL0 (16<<3)
+
+#define LOG_MASK(pri) (1 << (pri))
+#define LOG_UPTO(pri) ((1 << ((pri)+1)) - 1)
+
+// Behaves like arcao/Syslog: messages are formatted (on the heap) before the
+// mask is checked, and each one goes out as its own UDP datagram.
+class Syslog {
+    public:
+        Syslog(UDP &client, uint8_t protocol = SYSLOG_PROTO_IETF);
+
+        Syslog &server(const char* server, uint16_t port);
+        Syslog &deviceHostname(const char* deviceHostname);
+        Syslog &appName(const char* appName);
+        Syslog &defaultPriority(uint16_t pri = LOG_KERN);
+        Syslog &logMask(uint8_t priMask);
+
+        bool log(uint16_t pri, const String &message);
+        bool log(uint16_t pri, const char *message);
+        bool vlogf(uint16_t pri, const char *fmt, va_list args);
+        bool logf(uint16_t pri, const char *fmt, ...);
+
+        bool log(const char *message);
+        bool logf(const char *fmt, ...);
+
+    private:
+        bool _sendLog(uint16_t pri, const char *message);
+
+        UDP* _client;
+        uint8_t _protocol;
+        const char* _server;
+        uint16_t _port;
+        const char* _deviceHostname;
+        const char* _appName;
+        uint16_t _priDefault;
+        uint8_t _priMask;
+};
+
+#endif // __NATIVE_SYSLOG_H_
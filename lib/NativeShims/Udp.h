@@ -0,0 +1,16 @@
+#ifndef __NATIVE_UDP_H_
+#define __NATIVE_UDP_H_
+
+#include <stdint.h>
+
+#include "Print.h"
+#include "ESP8266WiFi.h"
+
+class UDP : public Print {
+    public:
+        virtual int beginPacket(const char* host, uint16_t port) = 0;
+        virtual int beginPacket(IPAddress ip, uint16_t port) = 0;
+        virtual int endPacket() = 0;
+};
+
+#endif // __NATIVE_UDP_H_
@@ -0,0 +1,27 @@
+#ifndef __NATIVE_WSTRING_H_
+#define __NATIVE_WSTRING_H_
+
+#include <string>
+
+class String {
+    public:
+        String() {}
+        String(const char* s) : _s(s ? s : "") {}
+        String(const std::string& s) : _s(s) {}
+
+        const char* c_str() const { return _s.c_str(); }
+        unsigned int length() const { return _s.length(); }
+
+        String& operator=(const char* s) { _s = s ? s : ""; return *this; }
+        String& operator+=(const String& s) { _s += s._s; return *this; }
+        bool operator==(const char* s) const { return _s == s; }
+
+        friend String operator+(const String& a, const String& b) { return String(a._s + b._s); }
+        friend String operator+(const char* a, const String& b) { return String(std::string(a) + b._s); }
+        friend String operator+(const String& a, const char* b) { return String(a._s + b); }
+
+    private:
+        std::string _s;
+};
+
+#endif // __NATIVE_WSTRING_H_
@@ -0,0 +1,18 @@
+#include "WiFiManager.h"
+
+WiFiManagerParameter::WiFiManagerParameter(const char *id, const char *label, const char *defaultValue, int length) :
+    _id(id), _label(label), _value(NULL), _length(length) {
+    setValue(defaultValue, length);
+}
+
+WiFiManagerParameter::~WiFiManagerParameter() {
+    delete[] _value;
+}
+
+void WiFiManagerParameter::setValue(const char *value, int length) {
+    delete[] _value;
+    _length = length;
+    _value = new char[length + 1];
+    memset(_value, 0, length + 1);
+    if (value != NULL) strncpy(_value, value, length);
+}
@@ -0,0 +1,54 @@
+#ifndef __NATIVE_WIFIMANAGER_H_
+#define __NATIVE_WIFIMANAGER_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+
+#include "Arduino.h"
+
+class WiFiManagerParameter {
+    public:
+        WiFiManagerParameter(const char *id, const char *label, const char *defaultValue, int length);
+        ~WiFiManagerParameter();
+
+        const char *getID() const { return _id; }
+        const char *getValue() const { return _value; }
+        int getValueLength() const { return _length; }
+        void setValue(const char *value, int length);
+
+    private:
+        const char *_id;
+        const char *_label;
+        char *_value;
+        int _length;
+};
+
+// Scanning, joining and waiting for a DHCP lease, as autoConnect() does,
+// costs this much clock
+#define NATIVE_WIFI_AUTOCONNECT_MS 3000
+
+// Always "connects"; the captive portal is never started.
+class WiFiManager {
+    public:
+        WiFiManager() {}
+        WiFiManager(Stream &consolePort) { (void) consolePort; }
+
+        void addParameter(WiFiManagerParameter *p) { (void) p; }
+        void setSaveParamsCallback(std::function<void()> func) { _saveParamsCallback = func; }
+        void setConfigPortalTimeout(unsigned long seconds) { (void) seconds; }
+        void setRestorePersistent(bool persistent) { (void) persistent; }
+        void setWiFiAutoReconnect(bool enabled) { (void) enabled; }
+        void setClass(const char *str) { (void) str; }
+        void setDebugOutput(bool debug) { (void) debug; }
+
+        bool autoConnect(const char *apName, const char *apPassword = NULL) { (void) apName; (void) apPassword; delay(NATIVE_WIFI_AUTOCONNECT_MS); return true; }
+        bool startConfigPortal(const char *apName, const char *apPassword = NULL) { (void) apName; (void) apPassword; return true; }
+        void resetSettings() {}
+
+    private:
+        std::function<void()> _saveParamsCallback;
+};
+
+#endif // __NATIVE_WIFIMANAGER_H_
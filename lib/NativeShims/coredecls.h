@@ -0,0 +1,19 @@
+#ifndef __NATIVE_COREDECLS_H_
+#define __NATIVE_COREDECLS_H_
+
+#include <stdint.h>
+
+#include <functional>
+
+// The ESP8266 core 3.x scheduling calls that the firmware uses, on the
+// native clock; see Arduino.h.
+
+// Resumes loop() from the esp_delay() it is in, which then asks its
+// `blocked` again. It doesn't end a plain delay(), as of core 3.x.
+extern "C" void esp_schedule();
+
+// Waits up to `timeoutMs` while `blocked()` holds, asking it again whenever
+// an event calls esp_schedule()
+void esp_delay(uint32_t timeoutMs, const std::function<bool()>& blocked);
+
+#endif // __NATIVE_COREDECLS_H_
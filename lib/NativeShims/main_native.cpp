@@ -0,0 +1,29 @@
+#include "Arduino.h"
+
+// Like the ESP8266 core's own main(): run setup() once, then loop() forever.
+// It is weak so that benchmarks and tools can provide their own main() and
+// drive setup()/loop() themselves.
+//
+// With CN105_PORT set to a tty, e.g. the pty that tools/cn105sim prints, the
+// heatpump is "detected" and its link goes over that tty in real time.
+
+extern void setup();
+extern void loop();
+
+#define NATIVE_DETECT_PIN 4
+
+__attribute__((weak)) int main() {
+    Serial.setEcho(true);
+    Serial1.setEcho(true);
+    const char* port = getenv("CN105_PORT");
+    if (port != NULL) {
+        if (!Serial.open(port)) return 1;
+        nativeSetRealTime(true);
+        nativeSetPinInput(NATIVE_DETECT_PIN, HIGH);
+    }
+    setup();
+    for (;;) {
+        loop();
+    }
+    return 0;
+}
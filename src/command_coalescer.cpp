@@ -0,0 +1,69 @@
+#include "command_coalescer.hpp"
+
+#include <string.h>
+
+CommandCoalescer::CommandCoalescer(unsigned long minWindow, unsigned long maxWindow, unsigned long idle) :
+    _minWindow(minWindow),
+    _maxWindow(maxWindow < minWindow ? minWindow : maxWindow),
+    _idle(idle),
+    _pending(false),
+    _seenCommand(false),
+    _firstCommandAt(0),
+    _lastCommandAt(0),
+    _gap(0),
+    _window(minWindow),
+    _merged(0) {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void CommandCoalescer::commandReceived(unsigned long now) {
+    unsigned long gap = now - _lastCommandAt;
+
+    if (!_seenCommand || gap > _idle) {
+        // A lone command, or the first of a new burst
+        _gap = 0;
+        _window = _minWindow;
+    } else {
+        // Follow the burst's pace, smoothing out jitter between arrivals
+        _gap = _gap == 0 ? gap : (_gap + gap) / 2;
+        _window = 2 * _gap;
+        if (_window < _minWindow) _window = _minWindow;
+        if (_window > _maxWindow) _window = _maxWindow;
+    }
+
+    if (!_pending) {
+        _pending = true;
+        _firstCommandAt = now;
+        _merged = 0;
+    }
+    _merged++;
+    _seenCommand = true;
+    _lastCommandAt = now;
+    _stats.commands++;
+}
+
+bool CommandCoalescer::shouldFlush(unsigned long now) const {
+    if (!_pending) return false;
+    return now - _lastCommandAt >= _window || now - _firstCommandAt >= _maxWindow;
+}
+
+unsigned long CommandCoalescer::flushIn(unsigned long now) const {
+    if (!_pending) return (unsigned long) -1;
+    unsigned long quiet = now - _lastCommandAt;
+    unsigned long waited = now - _firstCommandAt;
+    if (quiet >= _window || waited >= _maxWindow) return 0;
+    unsigned long windowEnds = _window - quiet;
+    unsigned long maxEnds = _maxWindow - waited;
+    return windowEnds < maxEnds ? windowEnds : maxEnds;
+}
+
+void CommandCoalescer::flushed() {
+    if (!_pending) return;
+    _pending = false;
+
+    int bucket = 0;
+    for (unsigned long n = _merged - 1; n > 0 && bucket < COALESCER_MERGE_BUCKETS - 1; n >>= 1) bucket++;
+    _stats.merged[bucket]++;
+    _stats.writes++;
+    if (_merged > _stats.maxMerged) _stats.maxMerged = _merged;
+}
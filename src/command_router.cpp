@@ -0,0 +1,254 @@
+#include "command_router.hpp"
+
+#include <string.h>
+
+#include "temperature.hpp"
+
+typedef struct {
+    const char* suffix;
+    uint8_t length;
+} CommandRoute;
+
+// Indexed by CommandTopic
+static const CommandRoute ROUTES[] = {
+    { "", 0 },
+    { "power/set", 9 },
+    { "mode/set", 8 },
+    { "temperature/set", 15 },
+    { "fan/set", 7 },
+    { "vane/set", 8 },
+    { "capture/set", 11 },
+    { "set", 3 },
+    { "history/get", 11 },
+};
+static const int ROUTE_COUNT = sizeof(ROUTES) / sizeof(ROUTES[0]);
+
+static const char* const POWER_VALUES[] = { "OFF", "ON" };
+static const char* const MODE_VALUES[] = { "HEAT", "DRY", "COOL", "FAN", "AUTO" };
+static const char* const FAN_VALUES[] = { "AUTO", "QUIET", "1", "2", "3", "4" };
+static const char* const VANE_VALUES[] = { "AUTO", "1", "2", "3", "4", "5", "SWING" };
+static const char* const CAPTURE_VALUES[] = { "DUMP", "CLEAR" };
+
+static inline uint8_t suffixHash(const char* suffix, size_t length) {
+    return (uint8_t) ((length * 7) ^ suffix[0]) & (COMMAND_ROUTER_SLOTS - 1);
+}
+
+static inline char upcase(char c) {
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+// Finds the payload in a table of upper-case values. Entries are skipped on
+// length and first character, so at most one full comparison is made.
+static int lookupValue(const char* const values[], int count, const char* payload, size_t len) {
+    if (len == 0) return -1;
+    char first = upcase(payload[0]);
+    for (int i = 0; i < count; i++) {
+        const char* value = values[i];
+        if (value[0] != first || strlen(value) != len) continue;
+        size_t j = 1;
+        while (j < len && value[j] == upcase(payload[j])) j++;
+        if (j == len) return i;
+    }
+    return -1;
+}
+
+CommandRouter::CommandRouter() : _prefix(""), _prefixLength(0) {
+    memset(_slots, COMMAND_NONE, sizeof(_slots));
+}
+
+void CommandRouter::begin(const char* prefix) {
+    _prefix = prefix;
+    _prefixLength = strlen(prefix);
+    memset(_slots, COMMAND_NONE, sizeof(_slots));
+    for (int topic = 1; topic < ROUTE_COUNT; topic++) {
+        uint8_t slot = suffixHash(ROUTES[topic].suffix, ROUTES[topic].length);
+        while (_slots[slot] != COMMAND_NONE) slot = (slot + 1) & (COMMAND_ROUTER_SLOTS - 1);
+        _slots[slot] = topic;
+    }
+}
+
+CommandTopic CommandRouter::route(const char* topic) const {
+    if (strncmp(topic, _prefix, _prefixLength) != 0 || topic[_prefixLength] != '/') return COMMAND_NONE;
+
+    const char* suffix = topic + _prefixLength + 1;
+    size_t length = strlen(suffix);
+    if (length == 0) return COMMAND_NONE;
+
+    uint8_t slot = suffixHash(suffix, length);
+    while (_slots[slot] != COMMAND_NONE) {
+        const CommandRoute& route = ROUTES[_slots[slot]];
+        if (route.length == length && memcmp(route.suffix, suffix, length) == 0) {
+            return (CommandTopic) _slots[slot];
+        }
+        slot = (slot + 1) & (COMMAND_ROUTER_SLOTS - 1);
+    }
+    return COMMAND_NONE;
+}
+
+bool CommandRouter::parse(const char* topic, const char* payload, size_t len, Command* command) const {
+    command->topic = route(topic);
+    if (command->topic == COMMAND_NONE) return false;
+    return parseValue(command->topic, payload, len, command);
+}
+
+bool CommandRouter::parseValue(CommandTopic topic, const char* payload, size_t len, Command* command) {
+    int index = -1;
+
+    command->topic = topic;
+    command->name = NULL;
+    switch (topic) {
+        case COMMAND_POWER:
+            index = lookupValue(POWER_VALUES, 2, payload, len);
+            if (index >= 0) command->name = POWER_VALUES[index];
+            break;
+        case COMMAND_MODE:
+            index = lookupValue(MODE_VALUES, 5, payload, len);
+            if (index >= 0) command->name = MODE_VALUES[index];
+            break;
+        case COMMAND_FAN:
+            index = lookupValue(FAN_VALUES, 6, payload, len);
+            if (index >= 0) command->name = FAN_VALUES[index];
+            break;
+        case COMMAND_VANE:
+            index = lookupValue(VANE_VALUES, 7, payload, len);
+            if (index >= 0) command->name = VANE_VALUES[index];
+            break;
+        case COMMAND_CAPTURE:
+            index = lookupValue(CAPTURE_VALUES, 2, payload, len);
+            if (index >= 0) command->name = CAPTURE_VALUES[index];
+            break;
+        case COMMAND_TEMPERATURE:
+            if (!parseTemperature(payload, len, &command->temperature)) return false;
+            if (command->temperature <= COMMAND_TEMPERATURE_MIN || command->temperature >= COMMAND_TEMPERATURE_MAX) return false;
+            command->value = 0;
+            return true;
+        default:
+            return false;
+    }
+    if (index < 0) return false;
+    command->value = index;
+    return true;
+}
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Separates key=value pairs
+static inline bool isSeparator(char c) {
+    return c == ',' || c == ';' || isSpace(c);
+}
+
+// Adds one field to a batch, refusing unknown and repeated keys
+static bool batchField(void* context, const char* key, size_t keyLength, const char* value, size_t valueLength) {
+    CommandBatch* batch = (CommandBatch*) context;
+    for (int topic = COMMAND_POWER; topic <= COMMAND_VANE; topic++) {
+        const char* name = CommandRouter::topicName((CommandTopic) topic);
+        if (strlen(name) != keyLength || memcmp(name, key, keyLength) != 0) continue;
+        unsigned int bit = 1 << (topic - COMMAND_POWER);
+        if (batch->fields & bit) return false;
+        batch->fields |= bit;
+        return CommandRouter::parseValue((CommandTopic) topic, value, valueLength, &batch->commands[topic - COMMAND_POWER]);
+    }
+    return false;
+}
+
+// A flat JSON object of strings and numbers, from just after its '{'.
+// Strings can't have escapes: no valid value needs one.
+static bool parseJsonPairs(const char* p, const char* end, PairHandler handler, void* context) {
+    while (p < end && isSpace(*p)) p++;
+    if (p < end && *p == '}') return ++p == end;
+    for (;;) {
+        while (p < end && isSpace(*p)) p++;
+        if (p == end || *p != '"') return false;
+        const char* key = ++p;
+        while (p < end && *p != '"' && *p != '\\') p++;
+        if (p == end || *p != '"') return false;
+        size_t keyLength = p++ - key;
+
+        while (p < end && isSpace(*p)) p++;
+        if (p == end || *p != ':') return false;
+        p++;
+        while (p < end && isSpace(*p)) p++;
+        const char* value;
+        size_t valueLength;
+        if (p < end && *p == '"') {
+            value = ++p;
+            while (p < end && *p != '"' && *p != '\\') p++;
+            if (p == end || *p != '"') return false;
+            valueLength = p++ - value;
+        } else {
+            // A number, or a bare word that no table will match
+            value = p;
+            while (p < end && *p != ',' && *p != '}' && !isSpace(*p)) p++;
+            valueLength = p - value;
+        }
+        if (!handler(context, key, keyLength, value, valueLength)) return false;
+
+        while (p < end && isSpace(*p)) p++;
+        if (p == end) return false;
+        if (*p == '}') break;
+        if (*p++ != ',') return false;
+    }
+    p++;
+    while (p < end && isSpace(*p)) p++;
+    return p == end;
+}
+
+static bool parseTextPairs(const char* p, const char* end, PairHandler handler, void* context) {
+    for (;;) {
+        while (p < end && isSeparator(*p)) p++;
+        if (p == end) return true;
+        const char* key = p;
+        while (p < end && *p != '=' && !isSeparator(*p)) p++;
+        if (p == end || *p != '=') return false;
+        size_t keyLength = p++ - key;
+        const char* value = p;
+        while (p < end && !isSeparator(*p)) p++;
+        if (!handler(context, key, keyLength, value, p - value)) return false;
+    }
+}
+
+bool CommandRouter::parsePairs(const char* payload, size_t len, PairHandler handler, void* context) {
+    const char* p = payload;
+    const char* end = payload + len;
+    while (p < end && isSpace(*p)) p++;
+    return p < end && *p == '{' ? parseJsonPairs(p + 1, end, handler, context) : parseTextPairs(p, end, handler, context);
+}
+
+bool CommandRouter::parseBatch(const char* payload, size_t len, CommandBatch* batch) {
+    batch->fields = 0;
+    return parsePairs(payload, len, batchField, batch) && batch->fields != 0;
+}
+
+const char* CommandRouter::suffix(CommandTopic topic) {
+    return topic > COMMAND_NONE && topic < ROUTE_COUNT ? ROUTES[topic].suffix : "";
+}
+
+const char* CommandRouter::valueName(CommandTopic topic, int index) {
+    const char* const* values;
+    int count;
+    switch (topic) {
+        case COMMAND_POWER: values = POWER_VALUES; count = 2; break;
+        case COMMAND_MODE: values = MODE_VALUES; count = 5; break;
+        case COMMAND_FAN: values = FAN_VALUES; count = 6; break;
+        case COMMAND_VANE: values = VANE_VALUES; count = 7; break;
+        case COMMAND_CAPTURE: values = CAPTURE_VALUES; count = 2; break;
+        default: return NULL;
+    }
+    return index >= 0 && index < count ? values[index] : NULL;
+}
+
+const char* CommandRouter::topicName(CommandTopic topic) {
+    switch (topic) {
+        case COMMAND_POWER: return "power";
+        case COMMAND_MODE: return "mode";
+        case COMMAND_TEMPERATURE: return "temperature";
+        case COMMAND_FAN: return "fan";
+        case COMMAND_VANE: return "vane";
+        case COMMAND_CAPTURE: return "capture";
+        case COMMAND_SET: return "set";
+        case COMMAND_HISTORY: return "history";
+        default: return "none";
+    }
+}
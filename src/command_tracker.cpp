@@ -0,0 +1,97 @@
+#include "command_tracker.hpp"
+
+#include <string.h>
+
+static const char* const STATE_NAMES[] = { "idle", "queued", "sent", "confirmed", "diverged" };
+
+CommandTracker::CommandTracker(unsigned long timeoutMs, unsigned int attempts) :
+    _timeoutMs(timeoutMs),
+    _attempts(attempts < 1 ? 1 : attempts),
+    _changed(false) {
+    memset(_fields, 0, sizeof(_fields));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void CommandTracker::commanded(const Command& command, unsigned long now) {
+    if (command.topic < COMMAND_POWER || command.topic > COMMAND_VANE) return;
+    TrackedField& field = _fields[index(command.topic)];
+    // Only a divergence being cleared is worth reporting straight away
+    if (field.state == TRACK_DIVERGED) _changed = true;
+    field.state = TRACK_QUEUED;
+    field.commanded = command;
+    field.attempts = 0;
+    field.commandedAt = now;
+}
+
+void CommandTracker::wrote(unsigned long now) {
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        TrackedField& field = _fields[i];
+        if (field.state != TRACK_QUEUED) continue;
+        field.state = TRACK_SENT;
+        field.contradicted = false;
+        field.deadline = now + (_timeoutMs << field.attempts);
+        field.attempts++;
+    }
+}
+
+unsigned int CommandTracker::readback(const Command actual[TRACKED_FIELDS], unsigned long now) {
+    unsigned int confirmed = 0;
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        TrackedField& field = _fields[i];
+        field.actual = actual[i];
+        // A queued field hasn't been written yet, so the readback says
+        // nothing about it
+        if (field.state != TRACK_SENT && field.state != TRACK_DIVERGED) continue;
+        if (!matches(field.commanded, field.actual)) {
+            field.contradicted = true;
+            continue;
+        }
+
+        field.state = TRACK_CONFIRMED;
+        field.lastConfirmMillis = now - field.commandedAt;
+        if (field.lastConfirmMillis > field.maxConfirmMillis) field.maxConfirmMillis = field.lastConfirmMillis;
+        _stats.confirmed++;
+        _changed = true;
+        confirmed |= 1 << i;
+    }
+    return confirmed;
+}
+
+unsigned int CommandTracker::retriesDue(unsigned long now, unsigned int* diverged) {
+    unsigned int due = 0;
+    if (diverged != NULL) *diverged = 0;
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        TrackedField& field = _fields[i];
+        if (field.state != TRACK_SENT || !field.contradicted || (long) (now - field.deadline) < 0) continue;
+        if (field.attempts >= _attempts) {
+            field.state = TRACK_DIVERGED;
+            _stats.diverged++;
+            if (diverged != NULL) *diverged |= 1 << i;
+            _changed = true;
+        } else {
+            field.state = TRACK_QUEUED;
+            _stats.retries++;
+            due |= 1 << i;
+        }
+    }
+    return due;
+}
+
+bool CommandTracker::takeChanged() {
+    bool changed = _changed;
+    _changed = false;
+    return changed;
+}
+
+const char* CommandTracker::stateName(TrackState state) {
+    return state <= TRACK_DIVERGED ? STATE_NAMES[state] : "";
+}
+
+bool CommandTracker::matches(const Command& commanded, const Command& actual) {
+    if (actual.topic != commanded.topic) return false;
+    if (commanded.topic == COMMAND_TEMPERATURE) {
+        int difference = actual.temperature - commanded.temperature;
+        return difference <= TRACKED_TEMPERATURE_TOLERANCE && difference >= -TRACKED_TEMPERATURE_TOLERANCE;
+    }
+    return actual.value == commanded.value;
+}
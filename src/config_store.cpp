@@ -0,0 +1,108 @@
+#include "config_store.hpp"
+
+#include <FS.h>
+#include <string.h>
+
+// Reflected CRC-32 (as in zlib), a nibble at a time to keep the table small
+static const uint32_t CRC32_NIBBLES[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+uint32_t ConfigStore::crc32(const void* data, size_t length, uint32_t crc) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ CRC32_NIBBLES[crc & 0x0f];
+        crc = (crc >> 4) ^ CRC32_NIBBLES[crc & 0x0f];
+    }
+    return ~crc;
+}
+
+static uint32_t recordCrc(const ConfigRecordHeader& header, const void* data, size_t length) {
+    uint32_t crc = ConfigStore::crc32(&header, offsetof(ConfigRecordHeader, crc));
+    return ConfigStore::crc32(data, length, crc);
+}
+
+// Sequence numbers are compared so that they can wrap
+static bool newer(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) > 0;
+}
+
+ConfigStore::ConfigStore(const char* pathA, const char* pathB, uint16_t version) :
+    _version(version),
+    _slot(-1),
+    _sequence(0) {
+    _paths[0] = pathA;
+    _paths[1] = pathB;
+}
+
+bool ConfigStore::readHeader(int slot, size_t length, uint16_t version, ConfigRecordHeader* header) {
+    File file = SPIFFS.open(_paths[slot], "r");
+    if (!file) return false;
+    bool ok = file.size() == sizeof(ConfigRecordHeader) + length &&
+              file.readBytes((char*) header, sizeof(ConfigRecordHeader)) == sizeof(ConfigRecordHeader);
+    file.close();
+    return ok && header->magic == CONFIG_STORE_MAGIC && header->version == version && header->length == length;
+}
+
+bool ConfigStore::readRecord(int slot, void* data, size_t length) {
+    ConfigRecordHeader header;
+    File file = SPIFFS.open(_paths[slot], "r");
+    if (!file) return false;
+    bool ok = file.readBytes((char*) &header, sizeof(header)) == sizeof(header) &&
+              file.readBytes((char*) data, length) == length;
+    file.close();
+    return ok && header.crc == recordCrc(header, data, length);
+}
+
+bool ConfigStore::load(void* data, size_t length, uint16_t version) {
+    ConfigRecordHeader headers[2];
+    bool valid[2];
+    if (version == 0) version = _version;
+    for (int slot = 0; slot < 2; slot++) valid[slot] = readHeader(slot, length, version, &headers[slot]);
+
+    // Try the newer slot first, and fall back to the other if its payload
+    // doesn't check out
+    int first = valid[1] && (!valid[0] || newer(headers[1].sequence, headers[0].sequence)) ? 1 : 0;
+    for (int i = 0; i < 2; i++) {
+        int slot = i == 0 ? first : 1 - first;
+        if (valid[slot] && readRecord(slot, data, length)) {
+            _slot = slot;
+            _sequence = headers[slot].sequence;
+            return true;
+        }
+    }
+    _slot = -1;
+    return false;
+}
+
+bool ConfigStore::save(const void* data, size_t length) {
+    ConfigRecordHeader header;
+    int slot = _slot == 0 ? 1 : 0;
+
+    header.magic = CONFIG_STORE_MAGIC;
+    header.version = _version;
+    header.length = length;
+    header.sequence = _sequence + 1;
+    header.crc = recordCrc(header, data, length);
+
+    File file = SPIFFS.open(_paths[slot], "w");
+    if (!file) return false;
+    size_t written = file.write((const uint8_t*) &header, sizeof(header));
+    written += file.write((const uint8_t*) data, length);
+    file.close();
+    if (written != sizeof(header) + length) return false;
+
+    _slot = slot;
+    _sequence = header.sequence;
+    return true;
+}
+
+void ConfigStore::clear() {
+    SPIFFS.remove(_paths[0]);
+    SPIFFS.remove(_paths[1]);
+    _slot = -1;
+    _sequence = 0;
+}
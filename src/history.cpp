@@ -0,0 +1,370 @@
+#include "history.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "command_router.hpp"
+
+static const uint32_t PERIODS[HISTORY_TIERS] = { 0, HISTORY_MINUTE_SECONDS, HISTORY_QUARTER_SECONDS };
+
+static inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+static size_t writeVarint(uint8_t* out, uint32_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+}
+
+// Returns the bytes read, or 0 if the varint runs past the end
+static size_t readVarint(const uint8_t* bytes, size_t available, uint32_t* value) {
+    *value = 0;
+    for (size_t i = 0; i < available && i < 5; i++) {
+        *value |= (uint32_t) (bytes[i] & 0x7f) << (7 * i);
+        if (!(bytes[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+static size_t encodeDelta(uint8_t* out, const HistorySample& previous, const HistorySample& sample) {
+    bool changed = sample.settings != previous.settings;
+    size_t length = writeVarint(out, sample.seconds - previous.seconds);
+    length += writeVarint(out + length, zigzag(sample.room - previous.room) << 1 | changed);
+    if (changed) {
+        out[length++] = sample.settings;
+        out[length++] = sample.settings >> 8;
+    }
+    return length;
+}
+
+// Applies the delta to *sample. Returns the bytes read, or 0 if it's cut
+// short.
+static size_t decodeDelta(const uint8_t* bytes, size_t available, HistorySample* sample) {
+    uint32_t seconds, room;
+    size_t length = readVarint(bytes, available, &seconds);
+    if (length == 0) return 0;
+    size_t roomLength = readVarint(bytes + length, available - length, &room);
+    if (roomLength == 0) return 0;
+    length += roomLength;
+    if (room & 1) {
+        if (length + 2 > available) return 0;
+        sample->settings = bytes[length] | bytes[length + 1] << 8;
+        length += 2;
+    }
+    sample->seconds += seconds;
+    sample->room += unzigzag(room >> 1);
+    return length;
+}
+
+// Copies out what may be the next delta, which may wrap around the ring
+static size_t peekEntry(const HistoryRing& ring, uint32_t position, uint8_t* entry) {
+    uint32_t length = ring.head - position < HISTORY_MAX_ENTRY ? ring.head - position : HISTORY_MAX_ENTRY;
+    for (uint32_t i = 0; i < length; i++) entry[i] = ring.bytes[(position + i) % HISTORY_RING_SIZE];
+    return length;
+}
+
+static void dropOldest(HistoryRing& ring) {
+    uint8_t entry[HISTORY_MAX_ENTRY];
+    size_t length = decodeDelta(entry, peekEntry(ring, ring.tail, entry), &ring.oldest);
+    // Only a corrupt ring has a delta that doesn't decode; start it again
+    if (length == 0) {
+        ring.count = 0;
+        ring.tail = ring.head;
+        return;
+    }
+    ring.tail += length;
+    ring.count--;
+}
+
+static void append(HistoryRing& ring, HistorySample sample) {
+    if (ring.count == 0) {
+        ring.oldest = sample;
+        ring.newest = sample;
+        ring.tail = ring.head;
+        ring.count = 1;
+        return;
+    }
+    if (sample.seconds < ring.newest.seconds) sample.seconds = ring.newest.seconds;
+
+    uint8_t entry[HISTORY_MAX_ENTRY];
+    size_t length = encodeDelta(entry, ring.newest, sample);
+    while (ring.head + length - ring.tail > HISTORY_RING_SIZE && ring.count > 1) dropOldest(ring);
+    for (size_t i = 0; i < length; i++) ring.bytes[(ring.head + i) % HISTORY_RING_SIZE] = entry[i];
+    ring.head += length;
+    ring.newest = sample;
+    ring.count++;
+}
+
+History::History() {
+    clear();
+}
+
+void History::clear() {
+    memset(&_state, 0, sizeof(_state));
+    memset(_periods, 0, sizeof(_periods));
+    _bootSeconds = 0;
+    _millis = 0;
+    _lastMillis = 0;
+    _accumulatedTo = 0;
+    _hasRoom = false;
+    _room = 0;
+    _settings = HISTORY_SETTINGS_UNKNOWN;
+}
+
+void History::restored(unsigned long now) {
+    // This boot's history carries on from where the last one was saved
+    _bootSeconds = _state.seconds;
+    _millis = 0;
+    _lastMillis = now;
+    _accumulatedTo = _bootSeconds;
+    _hasRoom = false;
+}
+
+// millis() wraps after 49 days; history time doesn't
+void History::advance(unsigned long now) {
+    _millis += (unsigned long) (now - _lastMillis);
+    _lastMillis = now;
+    _state.seconds = _bootSeconds + (uint32_t) (_millis / 1000);
+}
+
+uint32_t History::seconds(unsigned long now) {
+    advance(now);
+    return _state.seconds;
+}
+
+void History::accumulate(uint32_t until) {
+    if (_hasRoom && until > _accumulatedTo) {
+        uint32_t covered = until - _accumulatedTo;
+        for (int tier = HISTORY_MINUTE; tier < HISTORY_TIERS; tier++) {
+            _periods[tier].sum += (int64_t) _room * covered;
+            _periods[tier].covered += covered;
+        }
+    }
+    if (until > _accumulatedTo) _accumulatedTo = until;
+}
+
+void History::record(uint32_t seconds) {
+    HistoryRing& raw = _state.rings[HISTORY_RAW];
+    if (raw.count > 0 && raw.newest.room == _room && raw.newest.settings == _settings) return;
+    HistorySample sample = { seconds, (int16_t) _room, _settings };
+    append(raw, sample);
+}
+
+void History::room(int tenths, unsigned long now) {
+    tick(now);
+    if (!_hasRoom) {
+        // The first reading: minutes and quarters start from the one it is in
+        for (int tier = HISTORY_MINUTE; tier < HISTORY_TIERS; tier++) {
+            _periods[tier].start = _state.seconds - _state.seconds % PERIODS[tier];
+            _periods[tier].sum = 0;
+            _periods[tier].covered = 0;
+        }
+        _accumulatedTo = _state.seconds;
+        _hasRoom = true;
+    }
+    _room = tenths;
+    record(_state.seconds);
+}
+
+void History::settings(uint16_t settings, unsigned long now) {
+    tick(now);
+    _settings = settings;
+    if (_hasRoom) record(_state.seconds);
+}
+
+// Closes every minute and quarter that has ended, in time order, so that
+// each gets exactly the readings that fell within it
+void History::tick(unsigned long now) {
+    advance(now);
+    if (!_hasRoom) return;
+    for (;;) {
+        uint32_t boundary = 0;
+        for (int tier = HISTORY_MINUTE; tier < HISTORY_TIERS; tier++) {
+            uint32_t end = _periods[tier].start + PERIODS[tier];
+            if (tier == HISTORY_MINUTE || end < boundary) boundary = end;
+        }
+        if (boundary > _state.seconds) break;
+        accumulate(boundary);
+
+        for (int tier = HISTORY_MINUTE; tier < HISTORY_TIERS; tier++) {
+            Period& period = _periods[tier];
+            if (period.start + PERIODS[tier] != boundary) continue;
+            int64_t room = _room;
+            if (period.covered > 0) {
+                int64_t half = period.covered / 2;
+                room = period.sum >= 0 ? (period.sum + half) / period.covered : -((-period.sum + half) / period.covered);
+            }
+            HistorySample sample = { period.start, (int16_t) room, _settings };
+            append(_state.rings[tier], sample);
+            period.start = boundary;
+            period.sum = 0;
+            period.covered = 0;
+        }
+    }
+    accumulate(_state.seconds);
+}
+
+size_t History::query(const HistoryRequest& request, unsigned long now, uint8_t* out, size_t size) {
+    tick(now);
+    uint32_t at = _state.seconds;
+    uint32_t from = request.since < at ? at - request.since : 0;
+    uint32_t to = request.until < at ? at - request.until : 0;
+    if (size < HISTORY_MAX_HEADER) return 0;
+
+    size_t length = 0;
+    out[length++] = HISTORY_VERSION;
+    out[length++] = request.tier;
+    out[length++] = 0;
+    length += writeVarint(out + length, at);
+    length += writeVarint(out + length, _bootSeconds);
+
+    const HistoryRing& ring = _state.rings[request.tier];
+    HistorySample sample = ring.oldest;
+    HistorySample previous;
+    bool started = false;
+    uint32_t position = ring.tail;
+    for (uint32_t i = 0; i < ring.count; i++) {
+        if (i > 0) {
+            uint8_t entry[HISTORY_MAX_ENTRY];
+            size_t entryLength = decodeDelta(entry, peekEntry(ring, position, entry), &sample);
+            if (entryLength == 0) break;
+            position += entryLength;
+        }
+        if (sample.seconds < from) continue;
+        if (sample.seconds > to) break;
+        if (!started) {
+            length += writeVarint(out + length, sample.seconds);
+            length += writeVarint(out + length, zigzag(sample.room));
+            out[length++] = sample.settings;
+            out[length++] = sample.settings >> 8;
+            started = true;
+        } else {
+            if (length + HISTORY_MAX_ENTRY > size) {
+                out[2] |= HISTORY_FLAG_MORE;
+                break;
+            }
+            length += encodeDelta(out + length, previous, sample);
+        }
+        previous = sample;
+    }
+    return length;
+}
+
+// A value's index in CommandRouter's table for the topic, or
+// HISTORY_UNKNOWN_VALUE
+static unsigned int valueIndex(CommandTopic topic, const char* name) {
+    Command command;
+    if (name == NULL || !CommandRouter::parseValue(topic, name, strlen(name), &command)) return HISTORY_UNKNOWN_VALUE;
+    return command.value;
+}
+
+uint16_t History::packSettings(const char* power, const char* mode, int temperature, const char* fan, const char* vane) {
+    if (power == NULL) return HISTORY_SETTINGS_UNKNOWN;
+    int setpoint = (temperature - HISTORY_SETPOINT_BASE) / 5;
+    if (setpoint < 0) setpoint = 0;
+    if (setpoint > 63) setpoint = 63;
+    return (valueIndex(COMMAND_POWER, power) == POWER_VALUE_ON) |
+           valueIndex(COMMAND_MODE, mode) << 1 |
+           valueIndex(COMMAND_FAN, fan) << 4 |
+           valueIndex(COMMAND_VANE, vane) << 7 |
+           setpoint << 10;
+}
+
+static bool parseSeconds(const char* value, size_t length, uint32_t* seconds) {
+    if (length == 0 || length > 9) return false;
+    *seconds = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (value[i] < '0' || value[i] > '9') return false;
+        *seconds = *seconds * 10 + (value[i] - '0');
+    }
+    return true;
+}
+
+static bool requestField(void* context, const char* key, size_t keyLength, const char* value, size_t valueLength) {
+    HistoryRequest* request = (HistoryRequest*) context;
+    if (keyLength == 4 && memcmp(key, "tier", 4) == 0) {
+        for (int tier = 0; tier < HISTORY_TIERS; tier++) {
+            const char* name = History::tierName((HistoryTier) tier);
+            if (strlen(name) == valueLength && memcmp(name, value, valueLength) == 0) {
+                request->tier = (HistoryTier) tier;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (keyLength == 5 && memcmp(key, "since", 5) == 0) return parseSeconds(value, valueLength, &request->since);
+    if (keyLength == 5 && memcmp(key, "until", 5) == 0) return parseSeconds(value, valueLength, &request->until);
+    return false;
+}
+
+bool History::parseRequest(const char* payload, size_t len, HistoryRequest* request) {
+    request->tier = HISTORY_RAW;
+    request->since = UINT32_MAX;
+    request->until = 0;
+    return CommandRouter::parsePairs(payload, len, requestField, request) && request->until <= request->since;
+}
+
+const char* History::tierName(HistoryTier tier) {
+    switch (tier) {
+        case HISTORY_RAW: return "raw";
+        case HISTORY_MINUTE: return "minute";
+        case HISTORY_QUARTER: return "quarter";
+        default: return "?";
+    }
+}
+
+HistoryReader::HistoryReader(const uint8_t* bytes, size_t length) :
+    _bytes(bytes),
+    _length(length),
+    _position(0),
+    _valid(false),
+    _started(false),
+    _tier(HISTORY_RAW),
+    _flags(0),
+    _now(0),
+    _boot(0) {
+    memset(&_sample, 0, sizeof(_sample));
+    if (length < 5 || bytes[0] != HISTORY_VERSION || bytes[1] >= HISTORY_TIERS) return;
+    _tier = (HistoryTier) bytes[1];
+    _flags = bytes[2];
+    _position = 3;
+    size_t read = readVarint(bytes + _position, length - _position, &_now);
+    if (read == 0) return;
+    _position += read;
+    read = readVarint(bytes + _position, length - _position, &_boot);
+    if (read == 0) return;
+    _position += read;
+    _valid = true;
+}
+
+bool HistoryReader::next(HistorySample* sample) {
+    if (!_valid || _position >= _length) return false;
+    if (_started) {
+        size_t read = decodeDelta(_bytes + _position, _length - _position, &_sample);
+        if (read == 0) return false;
+        _position += read;
+    } else {
+        uint32_t seconds, room;
+        size_t read = readVarint(_bytes + _position, _length - _position, &seconds);
+        if (read == 0) return false;
+        size_t roomRead = readVarint(_bytes + _position + read, _length - _position - read, &room);
+        if (roomRead == 0 || _position + read + roomRead + 2 > _length) return false;
+        read += roomRead;
+        _sample.seconds = seconds;
+        _sample.room = unzigzag(room);
+        _sample.settings = _bytes[_position + read] | _bytes[_position + read + 1] << 8;
+        _position += read + 2;
+        _started = true;
+    }
+    *sample = _sample;
+    return true;
+}
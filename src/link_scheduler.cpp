@@ -0,0 +1,139 @@
+#include "link_scheduler.hpp"
+
+#include <string.h>
+
+LinkScheduler::LinkScheduler(unsigned long idlePollMs, unsigned long fastPollMs, unsigned long boostMs,
+                             unsigned int burst, unsigned long refillMs) :
+    _idlePollMs(idlePollMs),
+    // The library won't poll any faster than this anyway
+    _fastPollMs(fastPollMs < LINK_INFO_INTERVAL_MS ? LINK_INFO_INTERVAL_MS : fastPollMs),
+    _boostMs(boostMs),
+    _burst(burst > 0 ? burst : 1),
+    _refillMs(refillMs),
+    _tokens(burst > 0 ? burst : 1),
+    _lastRefill(0),
+    _sent(false),
+    _lastSend(0),
+    _written(false),
+    _lastWrite(0),
+    _lastPoll(0),
+    _awaitingReply(false),
+    _confirming(false),
+    _waiting(false),
+    _waitingSince(0),
+    _throttled(false),
+    _lastQueueMillis(0),
+    _busyMicros(0),
+    _utilisationSince(0) {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void LinkScheduler::refill(unsigned long now) {
+    if (_tokens >= _burst) {
+        _lastRefill = now;
+        return;
+    }
+    while (_tokens < _burst && now - _lastRefill >= _refillMs) {
+        _tokens++;
+        _lastRefill += _refillMs;
+    }
+}
+
+LinkAction LinkScheduler::next(unsigned long now, bool pending, bool ready) {
+    refill(now);
+
+    if (_awaitingReply) {
+        if (now - _lastSend < LINK_REPLY_WINDOW_MS) return LINK_READ;
+        _awaitingReply = false;
+    }
+
+    if (ready) {
+        if (!_waiting) {
+            _waiting = true;
+            _waitingSince = now;
+        }
+        if (_tokens > 0) {
+            if (!_sent || now - _lastSend >= LINK_SEND_INTERVAL_MS + LINK_CLOCK_MARGIN_MS) return LINK_WRITE;
+            return LINK_IDLE;
+        }
+        if (!_throttled) {
+            _throttled = true;
+            _stats.throttled++;
+        }
+        // Out of tokens: polls carry on until one comes back
+    } else if (pending) {
+        // Keep the link clear for the write that's about to be ready
+        return LINK_IDLE;
+    }
+
+    unsigned long interval = _written && now - _lastWrite < _boostMs ? _fastPollMs : _idlePollMs;
+    if (now - _lastPoll >= interval && (!_sent || now - _lastSend >= LINK_INFO_INTERVAL_MS + LINK_CLOCK_MARGIN_MS)) return LINK_POLL;
+    return LINK_IDLE;
+}
+
+// ms from now until `at`, or 0 if that has passed
+static unsigned long until(unsigned long now, unsigned long at) {
+    long wait = (long) (at - now);
+    return wait > 0 ? (unsigned long) wait : 0;
+}
+
+// Follows next(), without its side effects
+unsigned long LinkScheduler::idleFor(unsigned long now, bool pending, bool ready) const {
+    if (_awaitingReply && now - _lastSend < LINK_REPLY_WINDOW_MS) {
+        unsigned long window = LINK_REPLY_WINDOW_MS - (now - _lastSend);
+        return window < LINK_READ_INTERVAL_MS ? window : LINK_READ_INTERVAL_MS;
+    }
+
+    unsigned long idle = (unsigned long) -1;
+    if (ready) {
+        if (_tokens > 0 || now - _lastRefill >= _refillMs) {
+            return _sent ? until(now, _lastSend + LINK_SEND_INTERVAL_MS + LINK_CLOCK_MARGIN_MS) : 0;
+        }
+        idle = until(now, _lastRefill + _refillMs);
+    } else if (pending) {
+        return idle;
+    }
+
+    unsigned long interval = _written && now - _lastWrite < _boostMs ? _fastPollMs : _idlePollMs;
+    unsigned long poll = until(now, _lastPoll + interval);
+    if (_sent) {
+        unsigned long gap = until(now, _lastSend + LINK_INFO_INTERVAL_MS + LINK_CLOCK_MARGIN_MS);
+        if (gap > poll) poll = gap;
+    }
+    return poll < idle ? poll : idle;
+}
+
+void LinkScheduler::wrote(unsigned long now) {
+    if (_tokens > 0) _tokens--;
+    _sent = true;
+    _lastSend = now;
+    _written = true;
+    _lastWrite = now;
+    _confirming = true;
+    // The confirming poll is due as soon as the library will send it
+    _lastPoll = now - _fastPollMs;
+    _lastQueueMillis = _waiting ? now - _waitingSince : 0;
+    if (_lastQueueMillis > _stats.maxQueueMillis) _stats.maxQueueMillis = _lastQueueMillis;
+    _waiting = false;
+    _throttled = false;
+    _busyMicros += LINK_EXCHANGE_MICROS;
+    _stats.writes++;
+}
+
+void LinkScheduler::polled(unsigned long now) {
+    _sent = true;
+    _lastSend = now;
+    _lastPoll = now;
+    _awaitingReply = true;
+    _confirming = false;
+    _busyMicros += LINK_EXCHANGE_MICROS;
+    _stats.polls++;
+}
+
+unsigned int LinkScheduler::utilisation(unsigned long now) {
+    unsigned long elapsed = now - _utilisationSince;
+    unsigned int percent = elapsed > 0 ? (unsigned int) (_busyMicros / 10 / elapsed) : 0;
+    _busyMicros = 0;
+    _utilisationSince = now;
+    return percent > 100 ? 100 : percent;
+}
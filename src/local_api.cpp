@@ -0,0 +1,672 @@
+#include "local_api.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define OPCODE_CONTINUATION 0x0
+#define OPCODE_TEXT 0x1
+#define OPCODE_BINARY 0x2
+#define OPCODE_CLOSE 0x8
+#define OPCODE_PING 0x9
+#define OPCODE_PONG 0xa
+
+#define CLOSE_NORMAL 1000
+#define CLOSE_PROTOCOL_ERROR 1002
+#define CLOSE_UNSUPPORTED 1003
+#define CLOSE_TOO_BIG 1009
+
+const char LocalApi::REFUSED_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static const char RESULT_OK[] = "{\"result\":\"ok\"}";
+static const char RESULT_INVALID[] = "{\"result\":\"invalid\"}";
+
+static inline uint32_t rotateLeft(uint32_t value, int bits) {
+    return value << bits | value >> (32 - bits);
+}
+
+// SHA-1 of one 64 byte block, with a rolling 16 word schedule to keep the
+// stack small
+static void sha1Block(uint32_t* hash, const uint8_t* block) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    uint32_t a = hash[0], b = hash[1], c = hash[2], d = hash[3], e = hash[4];
+    for (int i = 0; i < 80; i++) {
+        if (i >= 16) {
+            w[i & 15] = rotateLeft(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+        }
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rotateLeft(a, 5) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = rotateLeft(b, 30);
+        b = a;
+        a = t;
+    }
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+}
+
+static void sha1(const uint8_t* data, size_t length, uint8_t* digest) {
+    uint32_t hash[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    uint8_t block[64];
+    size_t done = 0;
+    for (; length - done >= 64; done += 64) sha1Block(hash, data + done);
+
+    size_t rest = length - done;
+    memcpy(block, data + done, rest);
+    block[rest++] = 0x80;
+    if (rest > 56) {
+        memset(block + rest, 0, 64 - rest);
+        sha1Block(hash, block);
+        rest = 0;
+    }
+    memset(block + rest, 0, 56 - rest);
+    uint64_t bits = (uint64_t) length * 8;
+    for (int i = 0; i < 8; i++) block[56 + i] = bits >> (56 - 8 * i);
+    sha1Block(hash, block);
+
+    for (int i = 0; i < 20; i++) digest[i] = hash[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static size_t base64(const uint8_t* data, size_t length, char* out) {
+    static const char DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t written = 0;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t group = (uint32_t) data[i] << 16;
+        if (i + 1 < length) group |= data[i + 1] << 8;
+        if (i + 2 < length) group |= data[i + 2];
+        out[written++] = DIGITS[group >> 18];
+        out[written++] = DIGITS[(group >> 12) & 0x3f];
+        out[written++] = i + 1 < length ? DIGITS[(group >> 6) & 0x3f] : '=';
+        out[written++] = i + 2 < length ? DIGITS[group & 0x3f] : '=';
+    }
+    out[written] = '\0';
+    return written;
+}
+
+void LocalApi::acceptKey(const char* key, char* out) {
+    uint8_t input[LOCAL_WEBSOCKET_KEY_LENGTH + sizeof(WEBSOCKET_GUID)];
+    uint8_t digest[20];
+    size_t keyLength = strlen(key);
+    memcpy(input, key, keyLength);
+    memcpy(input + keyLength, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    sha1(input, keyLength + sizeof(WEBSOCKET_GUID) - 1, digest);
+    base64(digest, sizeof(digest), out);
+}
+
+static inline char downcase(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Whether the line is the header `name` (lower case), and if so its value,
+// without surrounding spaces
+static bool headerValue(const char* line, size_t length, const char* name, const char** value, size_t* valueLength) {
+    size_t nameLength = strlen(name);
+    if (length <= nameLength || line[nameLength] != ':') return false;
+    for (size_t i = 0; i < nameLength; i++) {
+        if (downcase(line[i]) != name[i]) return false;
+    }
+    const char* start = line + nameLength + 1;
+    const char* end = line + length;
+    while (start < end && (*start == ' ' || *start == '\t')) start++;
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    *value = start;
+    *valueLength = end - start;
+    return true;
+}
+
+// Whether the comma-separated value has `token` (lower case) in it
+static bool hasToken(const char* value, size_t length, const char* token) {
+    size_t tokenLength = strlen(token);
+    for (size_t i = 0; i + tokenLength <= length; i++) {
+        size_t j = 0;
+        while (j < tokenLength && downcase(value[i + j]) == token[j]) j++;
+        if (j == tokenLength) return true;
+    }
+    return false;
+}
+
+// Whether the value starts with `prefix` (lower case)
+static bool hasPrefix(const char* value, size_t length, const char* prefix) {
+    size_t prefixLength = strlen(prefix);
+    if (length < prefixLength) return false;
+    for (size_t i = 0; i < prefixLength; i++) {
+        if (downcase(value[i]) != prefix[i]) return false;
+    }
+    return true;
+}
+
+LocalApi::LocalApi(LocalApiHost* host, ScratchArena* scratch) : _host(host), _scratch(scratch), _token("") {
+    memset(_clients, 0, sizeof(_clients));
+    memset(&_stats, 0, sizeof(_stats));
+    memset(&_state, 0, sizeof(_state));
+    memset(_room, 0, sizeof(_room));
+}
+
+int LocalApi::connected(unsigned long now) {
+    for (int i = 0; i < LOCAL_API_MAX_CLIENTS; i++) {
+        if (_clients[i].state != LOCAL_FREE) continue;
+        memset(&_clients[i], 0, sizeof(_clients[i]));
+        _clients[i].state = LOCAL_REQUEST;
+        _clients[i].connectedAt = now;
+        _stats.connections++;
+        return i;
+    }
+    _stats.refused++;
+    return -1;
+}
+
+void LocalApi::disconnected(int client) {
+    _clients[client].state = LOCAL_FREE;
+}
+
+int LocalApi::clients() const {
+    int count = 0;
+    for (int i = 0; i < LOCAL_API_MAX_CLIENTS; i++) {
+        if (_clients[i].state != LOCAL_FREE) count++;
+    }
+    return count;
+}
+
+void LocalApi::received(int client, const uint8_t* data, size_t length, unsigned long now) {
+    LocalClient& c = _clients[client];
+    if (c.state == LOCAL_REQUEST || c.state == LOCAL_BODY) {
+        receiveRequest(client, data, length, now);
+        return;
+    }
+    // Frames are taken in as much at a time as the buffer holds
+    while (c.state == LOCAL_WEBSOCKET && length > 0) {
+        size_t room = LOCAL_API_RECEIVE_SIZE - c.received;
+        size_t take = length < room ? length : room;
+        memcpy(c.buffer + c.received, data, take);
+        c.received += take;
+        data += take;
+        length -= take;
+        receiveFrames(client, now);
+    }
+}
+
+// Reads the request a line at a time, keeping only what it needs
+void LocalApi::receiveRequest(int client, const uint8_t* data, size_t length, unsigned long now) {
+    LocalClient& c = _clients[client];
+    for (size_t i = 0; i < length; i++) {
+        char ch = data[i];
+        if (c.state == LOCAL_BODY) {
+            c.buffer[c.received++] = ch;
+            if (c.received < c.contentLength) continue;
+            MessageResult result = _host->command((const char*) c.buffer, c.received);
+            _stats.commands++;
+            if (result == MESSAGE_COMMAND) {
+                respond(client, "200 OK", RESULT_OK, sizeof(RESULT_OK) - 1);
+            } else {
+                _stats.invalid++;
+                respond(client, "400 Bad Request", RESULT_INVALID, sizeof(RESULT_INVALID) - 1);
+            }
+            return;
+        }
+        if (c.state != LOCAL_REQUEST) return;
+
+        if (ch != '\n') {
+            if (c.skipping) continue;
+            if (c.received == LOCAL_API_RECEIVE_SIZE) {
+                if (c.route == LOCAL_ROUTE_NONE) {
+                    respond(client, "414 URI Too Long", NULL, 0);
+                    return;
+                }
+                // Not kept, but an Origin too long to compare mustn't pass
+                // for none
+                headerLine(client, (const char*) c.buffer, c.received, true);
+                c.skipping = true;
+                continue;
+            }
+            c.buffer[c.received++] = ch;
+            continue;
+        }
+
+        size_t lineLength = c.received;
+        if (lineLength > 0 && c.buffer[lineLength - 1] == '\r') lineLength--;
+        c.received = 0;
+        if (c.skipping) {
+            c.skipping = false;
+        } else if (c.route == LOCAL_ROUTE_NONE) {
+            // Blank lines before the request line are allowed
+            if (lineLength > 0) requestLine(client, (const char*) c.buffer, lineLength);
+        } else if (lineLength > 0) {
+            headerLine(client, (const char*) c.buffer, lineLength, false);
+        } else {
+            endOfHeaders(client, now);
+            // Anything that came with the request is the first of the frames
+            if (c.state == LOCAL_WEBSOCKET && i + 1 < length) received(client, data + i + 1, length - i - 1, now);
+            if (c.state != LOCAL_BODY) return;
+        }
+    }
+}
+
+void LocalApi::requestLine(int client, const char* line, size_t length) {
+    LocalClient& c = _clients[client];
+    const char* end = line + length;
+    const char* path = (const char*) memchr(line, ' ', length);
+    c.route = LOCAL_ROUTE_UNKNOWN;
+    if (path == NULL) return;
+    size_t methodLength = path - line;
+    path++;
+    const char* pathEnd = path;
+    while (pathEnd < end && *pathEnd != ' ' && *pathEnd != '?') pathEnd++;
+    size_t pathLength = pathEnd - path;
+
+    if (methodLength == 3 && memcmp(line, "GET", 3) == 0) {
+        if (pathLength == 6 && memcmp(path, "/state", 6) == 0) c.route = LOCAL_ROUTE_STATE;
+        if (pathLength == 3 && memcmp(path, "/ws", 3) == 0) c.route = LOCAL_ROUTE_SOCKET;
+    } else if (methodLength == 4 && memcmp(line, "POST", 4) == 0) {
+        if (pathLength == 4 && memcmp(path, "/set", 4) == 0) c.route = LOCAL_ROUTE_SET;
+    }
+
+    // The token may come as a query parameter, for WebSockets from browsers
+    if (pathEnd == end || *pathEnd != '?') return;
+    const char* query = pathEnd + 1;
+    const char* queryEnd = query;
+    while (queryEnd < end && *queryEnd != ' ') queryEnd++;
+    while (query < queryEnd) {
+        const char* next = (const char*) memchr(query, '&', queryEnd - query);
+        if (next == NULL) next = queryEnd;
+        if (next - query > 6 && memcmp(query, "token=", 6) == 0 && tokenMatches(query + 6, next - query - 6)) {
+            c.authorized = true;
+        }
+        query = next + 1;
+    }
+}
+
+// A header line, or with `truncated` the start of one too long to keep
+void LocalApi::headerLine(int client, const char* line, size_t length, bool truncated) {
+    LocalClient& c = _clients[client];
+    const char* value;
+    size_t valueLength;
+    if (headerValue(line, length, "host", &value, &valueLength)) {
+        sameOrigin(client, value, valueLength, truncated, false);
+    } else if (headerValue(line, length, "origin", &value, &valueLength)) {
+        sameOrigin(client, value, valueLength, truncated, true);
+    } else if (truncated) {
+        return;
+    } else if (headerValue(line, length, "authorization", &value, &valueLength)) {
+        if (!hasPrefix(value, valueLength, "bearer ")) return;
+        const char* token = value + 7;
+        const char* end = value + valueLength;
+        while (token < end && *token == ' ') token++;
+        if (tokenMatches(token, end - token)) c.authorized = true;
+    } else if (headerValue(line, length, "upgrade", &value, &valueLength)) {
+        c.upgrade = hasToken(value, valueLength, "websocket");
+    } else if (headerValue(line, length, "sec-websocket-key", &value, &valueLength)) {
+        if (valueLength != LOCAL_WEBSOCKET_KEY_LENGTH) return;
+        memcpy(c.key, value, valueLength);
+        c.key[valueLength] = '\0';
+    } else if (headerValue(line, length, "content-length", &value, &valueLength)) {
+        c.contentLength = 0;
+        for (size_t i = 0; i < valueLength && value[i] >= '0' && value[i] <= '9' && c.contentLength <= LOCAL_API_RECEIVE_SIZE; i++) {
+            c.contentLength = c.contentLength * 10 + (value[i] - '0');
+        }
+    }
+}
+
+// Takes the request's Host or Origin, whichever this is, and compares it with
+// the other if that has been seen. Only plain HTTP is served, so an Origin
+// with any other scheme, or "null", is some other page's.
+void LocalApi::sameOrigin(int client, const char* value, size_t length, bool truncated, bool origin) {
+    LocalClient& c = _clients[client];
+    bool* seen = origin ? &c.originSeen : &c.hostSeen;
+    bool other = origin ? c.hostSeen : c.originSeen;
+    if (*seen) {
+        // Twice
+        c.foreign = true;
+        return;
+    }
+    *seen = true;
+    if (origin) {
+        if (!hasPrefix(value, length, "http://")) {
+            c.foreign = true;
+            return;
+        }
+        value += 7;
+        length -= 7;
+    }
+    if (truncated || length > LOCAL_API_HOST_SIZE) {
+        c.foreign = true;
+        return;
+    }
+    if (!other) {
+        memcpy(c.seen, value, length);
+        c.seen[length] = '\0';
+        return;
+    }
+    // Host names aren't case sensitive
+    if (strlen(c.seen) != length) c.foreign = true;
+    for (size_t i = 0; i < length && !c.foreign; i++) {
+        if (downcase(c.seen[i]) != downcase(value[i])) c.foreign = true;
+    }
+}
+
+// Whether the value is the token, taking as long wherever they differ
+bool LocalApi::tokenMatches(const char* value, size_t length) const {
+    size_t tokenLength = strlen(_token);
+    if (tokenLength == 0 || length != tokenLength) return false;
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++) difference |= value[i] ^ _token[i];
+    return difference == 0;
+}
+
+void LocalApi::endOfHeaders(int client, unsigned long now) {
+    LocalClient& c = _clients[client];
+    if (c.route != LOCAL_ROUTE_UNKNOWN && !c.authorized) {
+        _stats.forbidden++;
+        respond(client, "401 Unauthorized", NULL, 0);
+        return;
+    }
+    // A page on another origin can't have the browser drive the unit. Asking
+    // for the state is harmless: without CORS headers, it can't read it.
+    bool command = c.route == LOCAL_ROUTE_SET || c.route == LOCAL_ROUTE_SOCKET;
+    if (command && c.originSeen && (c.foreign || !c.hostSeen)) {
+        _stats.forbidden++;
+        respond(client, "403 Forbidden", NULL, 0);
+        return;
+    }
+    switch (c.route) {
+        case LOCAL_ROUTE_STATE: {
+            ScratchScope scope(*_scratch);
+            char* body = _scratch->allocate(LOCAL_API_SEND_SIZE / 2);
+            if (body == NULL) {
+                finish(client);
+                return;
+            }
+            size_t length = formatState(body, LOCAL_API_SEND_SIZE / 2, LOCAL_FIELDS_ALL);
+            respond(client, "200 OK", length > 0 ? body : "{}", length > 0 ? length : 2);
+            return;
+        }
+        case LOCAL_ROUTE_SET:
+            if (c.contentLength == 0 || c.contentLength > LOCAL_API_RECEIVE_SIZE) {
+                respond(client, c.contentLength == 0 ? "411 Length Required" : "413 Payload Too Large", NULL, 0);
+                return;
+            }
+            c.state = LOCAL_BODY;
+            c.received = 0;
+            return;
+        case LOCAL_ROUTE_SOCKET: {
+            if (!c.upgrade || c.key[0] == '\0') {
+                respond(client, "426 Upgrade Required", NULL, 0);
+                return;
+            }
+            ScratchScope scope(*_scratch);
+            char* response = _scratch->allocate(LOCAL_API_SEND_SIZE);
+            if (response == NULL) {
+                finish(client);
+                return;
+            }
+            char accept[29];
+            acceptKey(c.key, accept);
+            int length = snprintf(response, LOCAL_API_SEND_SIZE,
+                                  "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                  "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+            if ((size_t) length > _host->space(client)) {
+                finish(client);
+                return;
+            }
+            _host->send(client, response, length);
+            c.state = LOCAL_WEBSOCKET;
+            c.received = 0;
+            // The whole state to start with
+            c.dirty = LOCAL_FIELDS_ALL;
+            flush(client, now);
+            return;
+        }
+        default:
+            respond(client, "404 Not Found", NULL, 0);
+            return;
+    }
+}
+
+// Takes each whole frame in the buffer
+void LocalApi::receiveFrames(int client, unsigned long now) {
+    LocalClient& c = _clients[client];
+    while (c.state == LOCAL_WEBSOCKET && c.received >= 2) {
+        uint8_t* frame = c.buffer;
+        bool fin = frame[0] & 0x80;
+        uint8_t opcode = frame[0] & 0x0f;
+        size_t length = frame[1] & 0x7f;
+        size_t header = 2;
+        if (!(frame[1] & 0x80)) {
+            // Clients must mask what they send
+            closeSocket(client, CLOSE_PROTOCOL_ERROR);
+            return;
+        }
+        if (length == 127) {
+            closeSocket(client, CLOSE_TOO_BIG);
+            return;
+        }
+        if (length == 126) {
+            if (c.received < 4) return;
+            length = frame[2] << 8 | frame[3];
+            header = 4;
+        }
+        header += 4;
+        if (header + length > LOCAL_API_RECEIVE_SIZE) {
+            closeSocket(client, CLOSE_TOO_BIG);
+            return;
+        }
+        if (c.received < header + length) return;
+
+        uint8_t* payload = frame + header;
+        for (size_t i = 0; i < length; i++) payload[i] ^= frame[header - 4 + (i & 3)];
+
+        switch (opcode) {
+            case OPCODE_TEXT:
+            case OPCODE_BINARY:
+                if (!fin) {
+                    closeSocket(client, CLOSE_UNSUPPORTED);
+                    return;
+                }
+                message(client, (const char*) payload, length, now);
+                break;
+            case OPCODE_PING:
+                // Answered if there's room; a later ping will be otherwise
+                sendFrame(client, OPCODE_PONG, (const char*) payload, length);
+                break;
+            case OPCODE_PONG:
+                break;
+            case OPCODE_CLOSE:
+                closeSocket(client, CLOSE_NORMAL);
+                return;
+            default:
+                closeSocket(client, opcode == OPCODE_CONTINUATION ? CLOSE_UNSUPPORTED : CLOSE_PROTOCOL_ERROR);
+                return;
+        }
+        if (c.state != LOCAL_WEBSOCKET) return;
+        c.received -= header + length;
+        memmove(c.buffer, c.buffer + header + length, c.received);
+    }
+}
+
+void LocalApi::message(int client, const char* payload, size_t length, unsigned long now) {
+    LocalClient& c = _clients[client];
+    MessageResult result = _host->command(payload, length);
+    _stats.commands++;
+    if (result != MESSAGE_COMMAND) _stats.invalid++;
+    c.reply = result == MESSAGE_COMMAND ? LOCAL_REPLY_OK : LOCAL_REPLY_INVALID;
+    flush(client, now);
+}
+
+void LocalApi::acked(int client, unsigned long now) {
+    flush(client, now);
+}
+
+// Sends the client what it's owed, as far as its connection has room
+void LocalApi::flush(int client, unsigned long now) {
+    LocalClient& c = _clients[client];
+    if (c.state != LOCAL_WEBSOCKET) return;
+
+    if (c.reply != LOCAL_REPLY_NONE) {
+        bool ok = c.reply == LOCAL_REPLY_OK;
+        if (!sendFrame(client, OPCODE_TEXT, ok ? RESULT_OK : RESULT_INVALID, ok ? sizeof(RESULT_OK) - 1 : sizeof(RESULT_INVALID) - 1)) {
+            if (!c.blocked) c.blockedAt = now;
+            c.blocked = true;
+            return;
+        }
+        c.reply = LOCAL_REPLY_NONE;
+    }
+
+    if (c.dirty != 0) {
+        ScratchScope scope(*_scratch);
+        char* update = _scratch->allocate(LOCAL_API_SEND_SIZE / 2);
+        if (update == NULL) return;
+        size_t length = formatState(update, LOCAL_API_SEND_SIZE / 2, c.dirty);
+        // Nothing to send for fields that aren't known yet
+        if (length > 0 && !sendFrame(client, OPCODE_TEXT, update, length)) {
+            if (!c.blocked) c.blockedAt = now;
+            c.blocked = true;
+            return;
+        }
+        if (length > 0) _stats.updates++;
+        c.dirty = 0;
+    }
+    c.blocked = false;
+}
+
+void LocalApi::service(unsigned long now) {
+    for (int i = 0; i < LOCAL_API_MAX_CLIENTS; i++) {
+        LocalClient& c = _clients[i];
+        if ((c.state == LOCAL_REQUEST || c.state == LOCAL_BODY) && now - c.connectedAt > LOCAL_API_REQUEST_MS) {
+            finish(i);
+        } else if (c.state == LOCAL_WEBSOCKET) {
+            flush(i, now);
+            if (c.state == LOCAL_WEBSOCKET && c.blocked && now - c.blockedAt > LOCAL_API_STALL_MS) {
+                _stats.stalled++;
+                finish(i);
+            }
+        }
+    }
+}
+
+void LocalApi::settingsChanged(const UnitSettings& settings, unsigned long now) {
+    char temperature[TEMPERATURE_MAX_FORMATTED];
+    const char* mode = strcmp(settings.power, "ON") == 0 ? settings.mode : "OFF";
+    const char* values[5] = { settings.power, mode, temperature, settings.fan, settings.vane };
+    char* state[5] = { _state.power, _state.mode, _state.temperature, _state.fan, _state.vane };
+    formatTemperature(temperature, settings.temperature);
+
+    uint8_t fields = 0;
+    for (int i = 0; i < 5; i++) {
+        if (values[i] == NULL || strncmp(state[i], values[i], MAX_LENGTH_PUBLISHED_VALUE) == 0) continue;
+        strncpy(state[i], values[i], MAX_LENGTH_PUBLISHED_VALUE - 1);
+        state[i][MAX_LENGTH_PUBLISHED_VALUE - 1] = '\0';
+        fields |= 1 << i;
+    }
+    if (fields != 0) changed(fields, now);
+}
+
+void LocalApi::roomTemperature(int tenths, unsigned long now) {
+    char room[TEMPERATURE_MAX_FORMATTED];
+    formatTemperature(room, tenths);
+    if (strcmp(room, _room) == 0) return;
+    memcpy(_room, room, sizeof(_room));
+    changed(LOCAL_FIELD_ROOM, now);
+}
+
+// Marks the fields on every WebSocket client and sends what there's room for
+void LocalApi::changed(uint8_t fields, unsigned long now) {
+    for (int i = 0; i < LOCAL_API_MAX_CLIENTS; i++) {
+        LocalClient& c = _clients[i];
+        if (c.state != LOCAL_WEBSOCKET) continue;
+        if (c.dirty != 0) _stats.merged++;
+        c.dirty |= fields;
+        flush(i, now);
+    }
+}
+
+// The known fields among `fields` as a JSON object. Returns the length, or 0
+// if none is known or it didn't fit.
+size_t LocalApi::formatState(char* out, size_t size, uint8_t fields) const {
+    static const char* const NAMES[] = { "power", "mode", "temperature", "fan", "vane", "current_temperature" };
+    const char* values[] = { _state.power, _state.mode, _state.temperature, _state.fan, _state.vane, _room };
+    size_t length = 1;
+    if (size < 2) return 0;
+    out[0] = '{';
+    for (int i = 0; i < 6; i++) {
+        if (!(fields & (1 << i)) || values[i][0] == '\0') continue;
+        // Temperatures are numbers, the rest strings
+        bool number = (1 << i) == LOCAL_FIELD_TEMPERATURE || (1 << i) == LOCAL_FIELD_ROOM;
+        int written = snprintf(out + length, size - length, number ? "%s\"%s\":%s" : "%s\"%s\":\"%s\"",
+                               length > 1 ? "," : "", NAMES[i], values[i]);
+        if (written < 0 || (size_t) written >= size - length) return 0;
+        length += written;
+    }
+    if (length == 1 || length + 1 >= size) return 0;
+    out[length++] = '}';
+    out[length] = '\0';
+    return length;
+}
+
+// An HTTP response, after which the connection is closed
+void LocalApi::respond(int client, const char* status, const char* body, size_t length) {
+    ScratchScope scope(*_scratch);
+    char* response = _scratch->allocate(LOCAL_API_SEND_SIZE);
+    if (response != NULL) {
+        int written = snprintf(response, LOCAL_API_SEND_SIZE,
+                               "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %u\r\n"
+                               "Connection: close\r\n\r\n%.*s",
+                               status, (unsigned int) length, (int) length, body != NULL ? body : "");
+        if (written > 0 && written < LOCAL_API_SEND_SIZE && (size_t) written <= _host->space(client)) {
+            _host->send(client, response, written);
+        }
+    }
+    finish(client);
+}
+
+// An unmasked frame, if the connection has room for all of it
+bool LocalApi::sendFrame(int client, uint8_t opcode, const char* payload, size_t length) {
+    size_t header = length < 126 ? 2 : 4;
+    if (header + length > LOCAL_API_SEND_SIZE || header + length > _host->space(client)) return false;
+    ScratchScope scope(*_scratch);
+    char* frame = _scratch->allocate(header + length);
+    if (frame == NULL) return false;
+    frame[0] = 0x80 | opcode;
+    if (header == 2) {
+        frame[1] = length;
+    } else {
+        frame[1] = 126;
+        frame[2] = length >> 8;
+        frame[3] = length;
+    }
+    memcpy(frame + header, payload, length);
+    _host->send(client, frame, header + length);
+    return true;
+}
+
+void LocalApi::closeSocket(int client, uint16_t code) {
+    char status[2] = { (char) (code >> 8), (char) code };
+    sendFrame(client, OPCODE_CLOSE, status, sizeof(status));
+    finish(client);
+}
+
+// The host may report the connection closed before close() returns
+void LocalApi::finish(int client) {
+    _clients[client].state = LOCAL_CLOSING;
+    _host->close(client);
+}
@@ -0,0 +1,188 @@
+#include "log.hpp"
+
+#include <stdarg.h>
+#include <string.h>
+
+// Records are stored as [length][priority][text], and may wrap around the end
+// of the buffer. Positions only ever increase; they are reduced modulo the
+// buffer size when used.
+
+typedef struct {
+    uint32_t tail;
+    // How much of the record at tail, and its CRLF, the UART sink has written
+    uint32_t offset;
+    bool active;
+    unsigned long* dropped;
+} LogSink;
+
+static uint8_t logBuffer[LOG_BUFFER_SIZE];
+static uint32_t logHead = 0;
+static LogStats stats;
+
+// Sinks hold on to records from boot until they're configured, but only
+// count what they lose once they are
+static LogSink uartSink = { 0, 0, false, &stats.uartDropped };
+static LogSink syslogSink = { 0, 0, false, &stats.syslogDropped };
+
+static HardwareSerial* uartSerial = NULL;
+
+static UDP* syslogUdp = NULL;
+static const char* syslogHost = NULL;
+static uint16_t syslogPort = 0;
+static const char* syslogHostname = SYSLOG_NILVALUE;
+static const char* syslogAppName = SYSLOG_NILVALUE;
+static uint8_t syslogMask = 0xff;
+static unsigned long syslogLastSend = 0;
+
+static inline uint8_t logByte(uint32_t position) {
+    return logBuffer[position % LOG_BUFFER_SIZE];
+}
+
+static inline uint32_t recordSize(uint32_t position) {
+    return 2 + logByte(position);
+}
+
+// Copies a record's text out of the ring, which may be in two pieces
+static void recordText(uint32_t position, char* text) {
+    uint32_t length = logByte(position);
+    uint32_t start = (position + 2) % LOG_BUFFER_SIZE;
+    uint32_t first = length < LOG_BUFFER_SIZE - start ? length : LOG_BUFFER_SIZE - start;
+    memcpy(text, logBuffer + start, first);
+    memcpy(text + first, logBuffer, length - first);
+    text[length] = '\0';
+}
+
+static void makeRoom(LogSink& sink, uint32_t size) {
+    while (logHead + size - sink.tail > LOG_BUFFER_SIZE) {
+        sink.tail += recordSize(sink.tail);
+        sink.offset = 0;
+        if (sink.active) (*sink.dropped)++;
+    }
+}
+
+static void logAppend(uint8_t pri, const char* text, size_t length) {
+    if (length > LOG_MAX_MESSAGE) {
+        length = LOG_MAX_MESSAGE;
+        stats.truncated++;
+    }
+    uint32_t size = 2 + length;
+    makeRoom(uartSink, size);
+    makeRoom(syslogSink, size);
+
+    logBuffer[logHead % LOG_BUFFER_SIZE] = length;
+    logBuffer[(logHead + 1) % LOG_BUFFER_SIZE] = pri;
+    uint32_t start = (logHead + 2) % LOG_BUFFER_SIZE;
+    size_t first = length < LOG_BUFFER_SIZE - start ? length : LOG_BUFFER_SIZE - start;
+    memcpy(logBuffer + start, text, first);
+    memcpy(logBuffer, text + first, length - first);
+    logHead += size;
+    stats.records++;
+}
+
+void logWrite(uint8_t pri, const char* message) {
+    logAppend(pri, message, strlen(message));
+}
+
+void logWritef(uint8_t pri, const char* format, ...) {
+    char message[LOG_MAX_MESSAGE + 1];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length < 0) return;
+    logAppend(pri, message, length);
+}
+
+void logSetSerial(HardwareSerial* serial) {
+    uartSerial = serial;
+    uartSink.active = serial != NULL;
+}
+
+void logSetSyslog(UDP* udp, const char* host, uint16_t port, const char* hostname, const char* appName, uint8_t mask) {
+    syslogUdp = udp;
+    syslogHost = host;
+    syslogPort = port;
+    syslogHostname = hostname[0] != '\0' ? hostname : SYSLOG_NILVALUE;
+    syslogAppName = appName[0] != '\0' ? appName : SYSLOG_NILVALUE;
+    syslogMask = mask;
+    syslogSink.active = true;
+}
+
+// Writes as much of each record as the TX FIFO has room for, and picks up
+// where it left off next time: a record can be longer than the FIFO
+static void drainUart(bool block) {
+    char text[LOG_MAX_MESSAGE + 2];
+    if (uartSerial == NULL) return;
+    while (uartSink.tail != logHead) {
+        uint32_t size = logByte(uartSink.tail) + 2;
+        uint32_t count = size - uartSink.offset;
+        if (!block) {
+            int room = uartSerial->availableForWrite();
+            if (room <= 0) return;
+            if ((uint32_t) room < count) count = room;
+        }
+        recordText(uartSink.tail, text);
+        text[size - 2] = '\r';
+        text[size - 1] = '\n';
+        uartSerial->write((const uint8_t*) text + uartSink.offset, count);
+        uartSink.offset += count;
+        if (uartSink.offset < size) return;
+        uartSink.tail += size;
+        uartSink.offset = 0;
+    }
+}
+
+// Sends one datagram of records. Returns false once there's nothing left.
+static bool sendSyslogDatagram() {
+    char text[LOG_MAX_MESSAGE + 1];
+    char header[64];
+    size_t used = 0;
+    bool started = false;
+
+    while (syslogSink.tail != logHead) {
+        uint8_t length = logByte(syslogSink.tail);
+        uint8_t pri = logByte(syslogSink.tail + 1);
+        if (LOG_MASK(LOG_PRI(pri)) & syslogMask) {
+            int headerLength = snprintf(header, sizeof(header), "<%d>1 - %s %s - - - ", LOG_LOCAL0 | pri, syslogHostname, syslogAppName);
+            if (headerLength < 0) headerLength = 0;
+            if ((size_t) headerLength >= sizeof(header)) headerLength = sizeof(header) - 1;
+            if (started && used + headerLength + length + 1 > LOG_SYSLOG_MAX_DATAGRAM) break;
+            if (!started) {
+                if (!syslogUdp->beginPacket(syslogHost, syslogPort)) return false;
+                started = true;
+            }
+            recordText(syslogSink.tail, text);
+            syslogUdp->write((const uint8_t*) header, headerLength);
+            syslogUdp->write((const uint8_t*) text, length);
+            syslogUdp->write((uint8_t) '\n');
+            used += headerLength + length + 1;
+        }
+        syslogSink.tail += 2 + length;
+    }
+
+    if (started) {
+        syslogUdp->endPacket();
+        stats.syslogDatagrams++;
+    }
+    return syslogSink.tail != logHead;
+}
+
+void logDrain(unsigned long now) {
+    drainUart(false);
+
+    if (syslogUdp == NULL || syslogSink.tail == logHead) return;
+    if (now - syslogLastSend < LOG_SYSLOG_FLUSH_MS && logHead - syslogSink.tail < LOG_SYSLOG_MAX_DATAGRAM) return;
+    syslogLastSend = now;
+    sendSyslogDatagram();
+}
+
+void logFlush() {
+    drainUart(true);
+    if (syslogUdp != NULL) {
+        while (sendSyslogDatagram()) {}
+    }
+}
+
+const LogStats& logStats() {
+    return stats;
+}
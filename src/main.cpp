@@ -1,6 +1,7 @@
 #include "main.hpp"
 
 #include <Arduino.h>
+#include <coredecls.h>
 #include <FS.h>
 
 #include <ESP8266WiFi.h>
@@ -13,16 +14,146 @@
 
 #include <HeatPump.h>
 
+#include "command_router.hpp"
+#include "config_store.hpp"
+#include "connection_cache.hpp"
+#include "history.hpp"
+#include "local_api.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "packet_capture.hpp"
+#include "payload_assembler.hpp"
+#include "power_save.hpp"
+#include "publish_queue.hpp"
+#include "reconnect_manager.hpp"
+#include "scheduler.hpp"
+#include "scratch.hpp"
+#include "stall_profiler.hpp"
+#include "temperature.hpp"
+#include "topics.hpp"
+#include "trace.hpp"
+#include "unit_bridge.hpp"
+
 bool shouldSaveConfig = false;
 
 WiFiUDP udpClient;
-bool syslogEnabled = false;
-Syslog syslog(udpClient, SYSLOG_PROTO_IETF);
 
 AsyncMqttClient mqttClient;
 
 HeatPump heatpump;
 
+ConfigStore configStore(CONFIG_RECORD_PATH_A, CONFIG_RECORD_PATH_B, SETTINGS_VERSION);
+ConfigStore connectionStore(CONNECTION_RECORD_PATH_A, CONNECTION_RECORD_PATH_B, CONNECTION_CACHE_VERSION);
+ConnectionCache connectionCache;
+#ifdef HISTORY_FLASH
+ConfigStore historyStore(HISTORY_RECORD_PATH_A, HISTORY_RECORD_PATH_B, HISTORY_STATE_VERSION);
+unsigned long historyLastSave = 0;
+#endif
+
+// Set by heatpumpPacketCallback() when a settings reply arrives, for
+// heatpumpTask() to check commands against
+bool settingsReadback = false;
+
+#ifdef PACKET_CAPTURE
+PacketCapture packetCapture;
+// Where the dump in progress, if any, has got to; see publishPacketCapture()
+uint32_t packetCaptureCursor;
+bool packetCaptureDumping = false;
+#endif
+
+Scheduler scheduler;
+
+PowerSave powerSave(POWER_SAVE, POWER_SAVE_MIN_SLEEP_MS, POWER_SAVE_MAX_SLEEP_MS);
+
+
+// Keeps what loop() and the callbacks are doing in RTC memory
+class FirmwareStallHost : public StallProfilerHost {
+    public:
+        bool read(uint32_t offset, uint32_t* words, size_t count) override {
+            return ESP.rtcUserMemoryRead(offset, words, count * 4);
+        }
+        void write(uint32_t offset, const uint32_t* words, size_t count) override {
+            ESP.rtcUserMemoryWrite(offset, (uint32_t*) words, count * 4);
+        }
+};
+
+FirmwareStallHost stallHost;
+StallProfiler stallProfiler(&stallHost);
+// Whether the last boot left a record of what it was doing
+bool stallRestored = false;
+
+Metrics metrics;
+
+ScratchArena scratch;
+
+ReconnectManager mqttReconnect(MQTT_RECONNECT_BASE_MS, MQTT_RECONNECT_CAP_MS);
+
+// Sends what mqttPublish() queued, counting it into the metrics
+class FirmwarePublishHost : public PublishQueueHost {
+    public:
+        uint16_t send(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) override {
+            return mqttSend(topic, qos, retain, payload, length);
+        }
+        void queued(StateTopic topic) override {
+            (void) topic;
+            metrics.increment(metricMqttQueued);
+        }
+        void sent(StateTopic topic, unsigned long waitedMs) override {
+            (void) topic;
+            metrics.observe(metricMqttQueueMillis, waitedMs);
+        }
+        void dropped(StateTopic topic) override {
+            TRACE("publish to %s dropped", topicSuffix(topic));
+            metrics.increment(metricMqttDropped);
+        }
+};
+
+FirmwarePublishHost publishHost;
+PublishQueue publishQueue(&publishHost);
+
+PayloadAssembler payloadAssembler;
+// How far publishTrace() has got through the trace ring
+TraceCursor traceCursor;
+unsigned long traceLastPublish = 0;
+History history;
+// A <prefix>/history/get waiting for historyTask() to answer it
+HistoryRequest historyRequest;
+bool historyRequested = false;
+WiFiEventHandler wifiGotIPHandler;
+WiFiEventHandler wifiDisconnectedHandler;
+
+// The firmware's side of the bridge: publishes through mqttPublish() and
+// hands commands to the HeatPump library
+class FirmwareBridgeHost : public UnitBridgeHost {
+    public:
+        uint16_t publish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) override;
+        void apply(const Command& command) override;
+        void confirmed(const TrackedField& field) override;
+        void retrying(const TrackedField& field) override;
+        void diverged(const TrackedField& field) override;
+};
+
+FirmwareBridgeHost bridgeHost;
+UnitBridge bridge(&bridgeHost, &scratch);
+
+// The local API's side of the TCP stack: a client number is a slot in
+// localClients
+class FirmwareLocalHost : public LocalApiHost {
+    public:
+        size_t space(int client) override;
+        void send(int client, const char* data, size_t length) override;
+        void close(int client) override;
+        MessageResult command(const char* payload, size_t length) override;
+};
+
+FirmwareLocalHost localHost;
+LocalApi localApi(&localHost, &scratch);
+AsyncServer localServer(LOCAL_API_PORT);
+AsyncClient* localClients[LOCAL_API_MAX_CLIENTS];
+// LocalApiStats::stalled as last counted into the metrics
+unsigned long localStalled = 0;
+unsigned long localForbidden = 0;
+
 #ifdef HARDWARE_V02
 // Detects the heatpump by looking for a HIGH signal on HEATPUMP_DETECT_PIN,
 // then configures the system for either condition. If no heatpump is detected,
@@ -31,7 +162,7 @@ HeatPump heatpump;
 bool detectHeatpump() {
     bool detected;
 
-    if (syslogEnabled) syslog.log(LOG_INFO, "Detecting heatpump (HARDWARE_V02)");
+    LOG_PRINT(LOG_INFO, "Detecting heatpump (HARDWARE_V02)");
 
     pinMode(HEATPUMP_DETECT_PIN, INPUT);
     pinMode(HEATPUMP_ENABLE_PIN, OUTPUT);
@@ -39,26 +170,26 @@ bool detectHeatpump() {
     detected = digitalRead(HEATPUMP_DETECT_PIN) == HIGH;
 
     if (detected) {
-        if (syslogEnabled) syslog.log(LOG_INFO, "Heatpump detected? YES.");
+        LOG_PRINT(LOG_INFO, "Heatpump detected? YES.");
         // Output debug info on GPIO2 via UART1
-        if (syslogEnabled) syslog.log(LOG_INFO, "Configuring debug info on UART1");
+        LOG_PRINT(LOG_INFO, "Configuring debug info on UART1");
         DebugSerial = &Serial1;
         Serial1.begin(115200);
         Serial1.setDebugOutput(true);
 
         // Enable the logic level shifter now that we know there's 5V on the far
         // side and that we'll have something to talk to
-        if (syslogEnabled) syslog.log(LOG_INFO, "Enabling logic level shifter");
+        LOG_PRINT(LOG_INFO, "Enabling logic level shifter");
         digitalWrite(HEATPUMP_ENABLE_PIN, HIGH);
     } else {
-        if (syslogEnabled) syslog.log(LOG_INFO, "Heatpump detected? NO.");
+        LOG_PRINT(LOG_INFO, "Heatpump detected? NO.");
         // Make sure the logic level shifter remains disabled, as it won't be
         // getting any 5V power anyway
-        if (syslogEnabled) syslog.log(LOG_INFO, "Disabling logic level shifter");
+        LOG_PRINT(LOG_INFO, "Disabling logic level shifter");
         digitalWrite(HEATPUMP_ENABLE_PIN, LOW);
 
         // Output debug info on the default serial TX/RX pins via UART0
-        if (syslogEnabled) syslog.log(LOG_INFO, "Configuring debug info on default pins of UART0");
+        LOG_PRINT(LOG_INFO, "Configuring debug info on default pins of UART0");
         DebugSerial = &Serial;
         Serial.begin(115200);
         Serial.setDebugOutput(true);
@@ -70,12 +201,12 @@ bool detectHeatpump() {
 
 #ifdef HARDWARE_V01
 bool detectHeatpump() {
-    if (syslogEnabled) syslog.log(LOG_INFO, "Detecting heatpump (HARDWARE_V01)");
+    LOG_PRINT(LOG_INFO, "Detecting heatpump (HARDWARE_V01)");
     DebugSerial = &Serial1;
     Serial1.begin(115200);
     Serial1.setDebugOutput(true);
 
-    if (syslogEnabled) syslog.log(LOG_INFO, "Enabling logic level shifter");
+    LOG_PRINT(LOG_INFO, "Enabling logic level shifter");
     pinMode(HEATPUMP_ENABLE_PIN, OUTPUT);
     digitalWrite(HEATPUMP_ENABLE_PIN, HIGH);
 
@@ -88,228 +219,514 @@ void saveConfigCallback () {
 }
 
 void heatpumpOnConnectCallback() {
+    StallScope stage(&stallProfiler, STALL_STAGE_HEATPUMP_CONNECT);
     #ifdef SWAP_PINS
-    if (syslogEnabled) syslog.log(LOG_INFO, "heatpumpOnConnectCallback: Swapping serial pins");
+    LOG_PRINT(LOG_INFO, "heatpumpOnConnectCallback: Swapping serial pins");
     Serial.swap();
     #else
-    if (syslogEnabled) syslog.log(LOG_INFO, "heatpumpOnConnectCallback: NOT swapping serial pins");
+    LOG_PRINT(LOG_INFO, "heatpumpOnConnectCallback: NOT swapping serial pins");
     #endif
 }
 
 void heatpumpPacketCallback(byte *packet, int length, char* message) {
-    char buffer[256];
-    int offset = 0;
+    StallScope stage(&stallProfiler, STALL_STAGE_HEATPUMP_PACKET);
+    // The library hasn't decoded it yet, so only note that it came
+    if (length > 5 && packet[1] == CN105_INFO_REPLY && packet[5] == CN105_INFO_SETTINGS &&
+        strcmp(message, "packetRecv") == 0) {
+        settingsReadback = true;
+    }
+
+    #ifdef PACKET_CAPTURE
+    uint8_t direction = strcmp(message, "packetSent") == 0 ? PACKET_CAPTURE_SENT : PACKET_CAPTURE_RECEIVED;
+    packetCapture.record(direction, packet, length, micros());
+    #endif
 
-    offset = snprintf(buffer, 256, "%s %d bytes: ", message, length);
-    for (int i = 0; i < length; i++) {
-        offset += snprintf(buffer + offset, 256 - offset, "%02X", *(packet + i));
+    #ifdef PACKET_DEBUG
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(256);
+    if (buffer == NULL) return;
+    int offset = snprintf(buffer, 256, "%s %d bytes: ", message, length);
+    for (int i = 0; i < length && offset < 256 - 3; i++) {
+        buffer[offset++] = HEX_DIGITS[packet[i] >> 4];
+        buffer[offset++] = HEX_DIGITS[packet[i] & 0x0f];
     }
+    buffer[offset] = '\0';
 
-    if (syslogEnabled) syslog.log(LOG_DEBUG, buffer);
-    DebugSerial->println(buffer);
+    LOG_PRINT(LOG_DEBUG, buffer);
+    #endif
 }
 
-void heatpumpSettingsChanged() {
-    char temperature[4];
-    heatpumpSettings settings = heatpump.getSettings();
-    if (syslogEnabled) syslog.log(LOG_INFO, "heatpumpSettingsChanged callback");
-    snprintf(temperature, 4, "%3.0f", settings.temperature);
-    if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB power state %s to %s", settings.power, mqtt_topic_power_state);
-    DebugSerial->printf("PUB power state %s\n", settings.power);
-    mqttClient.publish(mqtt_topic_power_state, 0, true, settings.power);
-    if (heatpump.getPowerSettingBool()) {
-        if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB mode state %s to %s", settings.mode, mqtt_topic_mode_state);
-        DebugSerial->printf("PUB mode state %s\n", settings.mode);
-        mqttClient.publish(mqtt_topic_mode_state, 0, true, settings.mode);
-    } else {
-        if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB mode state OFF to %s", mqtt_topic_mode_state);
-        DebugSerial->printf("PUB mode state OFF\n");
-        mqttClient.publish(mqtt_topic_mode_state, 0, true, "OFF");
+// Composes "<prefix>/<suffix>" in the scratch arena, for the duration of the
+// caller's ScratchScope. Returns NULL if the arena is full.
+const char* scratchTopic(const char* suffix) {
+    size_t size = strlen(settings.mqtt_topic_prefix) + strlen(suffix) + 2;
+    char* topic = scratch.allocate(size);
+    if (topic == NULL || formatTopic(topic, size, settings.mqtt_topic_prefix, suffix) == 0) return NULL;
+    return topic;
+}
+
+// Which of the publish queue's classes a topic goes in, or -1 for trace,
+// capture and history chunks, which go out directly: they are read again
+// from their own cursors when they don't
+int publishPriority(StateTopic topic, bool retain) {
+    switch (topic) {
+        case TOPIC_AVAILABILITY:
+            return PUBLISH_AVAILABILITY;
+        case TOPIC_TRACE:
+        case TOPIC_CAPTURE:
+        case TOPIC_HISTORY:
+            return -1;
+        default:
+            return retain ? PUBLISH_STATE : PUBLISH_INFO;
     }
-    if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB temperature %s to %s", temperature, mqtt_topic_temperature_state);
-    DebugSerial->printf("PUB temperature %s\n", temperature);
-    mqttClient.publish(mqtt_topic_temperature_state, 0, true, temperature);
-    if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB fan state %s to %s", settings.fan, mqtt_topic_fan_state);
-    DebugSerial->printf("PUB fan state %s\n", settings.fan);
-    mqttClient.publish(mqtt_topic_fan_state, 0, true, settings.fan);
-    if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB vane state %s to %s", settings.vane, mqtt_topic_vane_state);
-    DebugSerial->printf("PUB vane state %s\n", settings.vane);
-    mqttClient.publish(mqtt_topic_vane_state, 0, true, settings.vane);
+}
+
+// Every publish goes through here. One that can't go out now is queued; see
+// publish_queue.hpp. Returns the packet id, or 0 if it didn't go out.
+uint16_t mqttPublish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    if (length == 0 && payload != NULL) length = strlen(payload);
+    int priority = publishPriority(topic, retain);
+    if (priority >= 0) {
+        return publishQueue.publish((PublishPriority) priority, topic, qos, retain, payload, length, millis());
+    }
+    uint16_t packetId = mqttSend(topic, qos, retain, payload, length);
+    if (packetId == 0) metrics.increment(metricMqttPublishFailed);
+    return packetId;
+}
+
+// Hands a publish to the client, and counts it if it went
+uint16_t mqttSend(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    ScratchScope scope(scratch);
+    const char* name = scratchTopic(topicSuffix(topic));
+    uint16_t packetId = name != NULL ? mqttClient.publish(name, qos, retain, payload, length) : 0;
+    if (packetId != 0) metrics.increment(metricMqttPublished);
+    if (retain && packetId != 0 && bootPublishMillis == 0) {
+        bootPublishMillis = millis();
+        metrics.set(metricBootPublishMillis, bootPublishMillis);
+        LOG_PRINTF(LOG_INFO, "First retained publish %lu ms after boot", bootPublishMillis);
+    }
+    return packetId;
+}
+
+uint16_t mqttSubscribe(const char* suffix) {
+    ScratchScope scope(scratch);
+    const char* topic = scratchTopic(suffix);
+    return topic != NULL ? mqttClient.subscribe(topic, 0) : 0;
+}
+
+// The HeatPump library's settings, as the bridge takes them
+static UnitSettings unitSettings(const heatpumpSettings& current) {
+    UnitSettings settings;
+    settings.power = current.power;
+    settings.mode = current.mode;
+    settings.temperature = temperatureFromFloat(current.temperature);
+    settings.fan = current.fan;
+    settings.vane = current.vane;
+    return settings;
+}
+
+void heatpumpSettingsChanged() {
+    StallScope stage(&stallProfiler, STALL_STAGE_SETTINGS_CHANGED);
+    heatpumpSettings current = heatpump.getSettings();
+    TRACE("heatpumpSettingsChanged: %s %s %.1f %s %s", current.power, current.mode, current.temperature, current.fan,
+          current.vane);
+    bridge.settingsChanged(unitSettings(current));
+    localApi.settingsChanged(unitSettings(current), millis());
+    history.settings(History::packSettings(current.power, current.mode, temperatureFromFloat(current.temperature),
+                                           current.fan, current.vane), millis());
 }
 
 void heatpumpStatusChanged(heatpumpStatus status) {
-    char temperature[4];
-    if (syslogEnabled) syslog.log(LOG_INFO, "heatpumpStatusChanged callback");
-    snprintf(temperature, 4, "%3.0f", status.roomTemperature);
-    if (syslogEnabled) syslog.logf(LOG_DEBUG, "PUB room temperature %s to %s", temperature, mqtt_topic_current_temperature_state);
-    DebugSerial->printf("PUB temperature %s\n", temperature);
-    mqttClient.publish(mqtt_topic_current_temperature_state, 0, true, temperature);
+    StallScope stage(&stallProfiler, STALL_STAGE_STATUS_CHANGED);
+    TRACE("heatpumpStatusChanged: room %.1f, operating %d", status.roomTemperature, (int) status.operating);
+    unsigned long skipped = bridge.roomTemperatures().suppressed();
+    bridge.roomTemperature(temperatureFromFloat(status.roomTemperature), millis());
+    history.room(temperatureFromFloat(status.roomTemperature), millis());
+    localApi.roomTemperature(temperatureFromFloat(status.roomTemperature), millis());
+    if (bridge.roomTemperatures().suppressed() != skipped) metrics.increment(metricRoomTemperatureSkipped);
 }
 
 void mqttConnect(bool sessionPresent) {
-    if (syslogEnabled) syslog.log(LOG_INFO, "mqttConnect callback");
-    mqttClient.subscribe(mqtt_topic_power_command, 0);
-    mqttClient.subscribe(mqtt_topic_mode_command, 0);
-    mqttClient.subscribe(mqtt_topic_temperature_command, 0);
-    mqttClient.subscribe(mqtt_topic_fan_command, 0);
-    mqttClient.subscribe(mqtt_topic_vane_command, 0);
-    mqttClient.publish(mqtt_topic_availability, 2, true, "online");
+    StallScope stage(&stallProfiler, STALL_STAGE_MQTT_CONNECT);
+    unsigned long now = millis();
+    unsigned long down = mqttReconnect.downFor(now);
+    if (down > 0) {
+        LOG_PRINTF(LOG_INFO, "mqttConnect callback: back after %lu ms", down);
+    } else {
+        LOG_PRINT(LOG_INFO, "mqttConnect callback");
+    }
+    mqttReconnect.connected(now);
+    payloadAssembler.reset();
+    metrics.increment(metricMqttConnects);
+    mqttHasConnected = true;
+    for (int topic = COMMAND_POWER; topic <= COMMAND_VANE; topic++) {
+        mqttSubscribe(CommandRouter::suffix((CommandTopic) topic));
+    }
+    mqttSubscribe(CommandRouter::suffix(COMMAND_SET));
+    mqttSubscribe(CommandRouter::suffix(COMMAND_HISTORY));
+    #ifdef PACKET_CAPTURE
+    mqttSubscribe(CommandRouter::suffix(COMMAND_CAPTURE));
+    #endif
+    mqttPublish(TOPIC_AVAILABILITY, 2, true, "online");
+    // The broker may have lost our retained state, so publish everything
+    // again on the next settings update
+    bridge.mqttConnected();
     publishSystemBootInfo();
+    // What waited out the disconnect, behind anything just queued ahead of it
+    publishQueue.drain(now);
 }
 
-bool validatePowerValue(const char* value) {
-    return
-        strcmp(value, "ON") == 0 ||
-        strcmp(value, "OFF") == 0;
+// Called for a connection that dropped and for an attempt that failed alike
+void mqttDisconnect(AsyncMqttClientDisconnectReason reason) {
+    StallScope stage(&stallProfiler, STALL_STAGE_MQTT_DISCONNECT);
+    LOG_PRINTF(LOG_WARNING, "mqttDisconnect callback: reason %d", (int) reason);
+    if (mqttReconnect.state() == RECONNECT_CONNECTED) metrics.increment(metricMqttDisconnects);
+    mqttReconnect.disconnected(millis());
+    payloadAssembler.reset();
+    // The cached broker address may be stale; mqttTask() goes back to the
+    // hostname
+    if (mqttBrokerCached && !mqttHasConnected) mqttRetryByName = true;
 }
 
-bool validateModeValue(const char* value) {
-    return
-        strcmp(value, "HEAT") == 0 ||
-        strcmp(value, "DRY") == 0 ||
-        strcmp(value, "COOL") == 0 ||
-        strcmp(value, "FAN") == 0 ||
-        strcmp(value, "AUTO") == 0;
+uint16_t FirmwareBridgeHost::publish(StateTopic topic, uint8_t qos, bool retain, const char* payload, size_t length) {
+    TRACE("PUB %u bytes to %s", (unsigned int) length, topicSuffix(topic));
+    return mqttPublish(topic, qos, retain, payload, length);
 }
 
-bool validateTemperatureValue(const char* value) {
-    float f = atof(value);
-    return f > 15.0 && f < 31;
+// Hands a power, mode, temperature, fan or vane command to the HeatPump
+// library, to go out with its next update()
+void FirmwareBridgeHost::apply(const Command& command) {
+    switch (command.topic) {
+        case COMMAND_POWER:
+            TRACE("SET power setting to %s", command.name);
+            heatpump.setPowerSetting(command.name);
+            break;
+        case COMMAND_MODE:
+            TRACE("SET mode setting to %s", command.name);
+            heatpump.setModeSetting(command.name);
+            break;
+        case COMMAND_TEMPERATURE:
+            TRACE("SET temperature to %d.%d", command.temperature / 10, command.temperature % 10);
+            heatpump.setTemperature(command.temperature / 10.0f);
+            break;
+        case COMMAND_FAN:
+            TRACE("SET fan speed to %s", command.name);
+            heatpump.setFanSpeed(command.name);
+            break;
+        case COMMAND_VANE:
+            TRACE("SET vane to %s", command.name);
+            heatpump.setVaneSetting(command.name);
+            break;
+        default:
+            break;
+    }
+}
+
+void FirmwareBridgeHost::confirmed(const TrackedField& field) {
+    metrics.observe(metricConfirmMillis, field.lastConfirmMillis);
+}
+
+void FirmwareBridgeHost::retrying(const TrackedField& field) {
+    LOG_PRINTF(LOG_WARNING, "Unconfirmed %s command, attempt %u", CommandRouter::topicName(field.commanded.topic),
+               field.attempts + 1);
+    metrics.increment(metricConfirmRetries);
+}
+
+void FirmwareBridgeHost::diverged(const TrackedField& field) {
+    LOG_PRINTF(LOG_ERR, "The heatpump didn't take a %s command; see confirmation",
+               CommandRouter::topicName(field.commanded.topic));
+    metrics.increment(metricConfirmDiverged);
 }
 
-bool validateFanValue(const char* value) {
-    return
-        strcmp(value, "AUTO") == 0 ||
-        strcmp(value, "QUIET") == 0 ||
-        strcmp(value, "1") == 0 ||
-        strcmp(value, "2") == 0 ||
-        strcmp(value, "3") == 0 ||
-        strcmp(value, "4") == 0;
+size_t FirmwareLocalHost::space(int client) {
+    return localClients[client] != NULL ? localClients[client]->space() : 0;
+}
+
+void FirmwareLocalHost::send(int client, const char* data, size_t length) {
+    if (localClients[client] == NULL) return;
+    localClients[client]->add(data, length, ASYNC_WRITE_FLAG_COPY);
+    localClients[client]->send();
+}
+
+void FirmwareLocalHost::close(int client) {
+    if (localClients[client] != NULL) localClients[client]->close();
+}
+
+// A <prefix>/set payload from a client of the local API, applied as if it
+// had come from the broker
+MessageResult FirmwareLocalHost::command(const char* payload, size_t length) {
+    Command command;
+    MessageResult result = bridge.set(payload, length, millis(), &command);
+    if (result == MESSAGE_COMMAND) {
+        TRACE("Applying settings 0x%02x from the local API", command.value);
+        metrics.increment(metricCommands);
+        metrics.increment(metricLocalCommands);
+    } else {
+        LOG_PRINTF(LOG_WARNING, "Ignoring invalid local command (%u bytes)", (unsigned int) length);
+    }
+    return result;
 }
 
-bool validateVaneValue(const char* value) {
-    return
-        strcmp(value, "AUTO") == 0 ||
-        strcmp(value, "1") == 0 ||
-        strcmp(value, "2") == 0 ||
-        strcmp(value, "3") == 0 ||
-        strcmp(value, "4") == 0 ||
-        strcmp(value, "5") == 0 ||
-        strcmp(value, "SWING") == 0;
+// A new connection to the local API. The client's slot is its callbacks'
+// argument. The stack has closed it by the time onDisconnect is called, and
+// it is deleted there.
+void localConnect(void* arg, AsyncClient* client) {
+    (void) arg;
+    int slot = localApi.connected(millis());
+    if (slot < 0) {
+        LOG_PRINT(LOG_WARNING, "Refusing a local API connection: all slots taken");
+        client->onDisconnect([](void* arg, AsyncClient* client) { (void) arg; delete client; }, NULL);
+        client->add(LocalApi::REFUSED_RESPONSE, strlen(LocalApi::REFUSED_RESPONSE), ASYNC_WRITE_FLAG_COPY);
+        client->send();
+        client->close();
+        return;
+    }
+    localClients[slot] = client;
+    client->setNoDelay(true);
+    client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+        (void) client;
+        StallScope stage(&stallProfiler, STALL_STAGE_LOCAL_DATA);
+        wakeLoop();
+        localApi.received((int) (intptr_t) arg, (const uint8_t*) data, len, millis());
+    }, (void*) (intptr_t) slot);
+    client->onAck([](void* arg, AsyncClient* client, size_t len, uint32_t time) {
+        (void) client;
+        (void) len;
+        (void) time;
+        StallScope stage(&stallProfiler, STALL_STAGE_LOCAL_ACK);
+        localApi.acked((int) (intptr_t) arg, millis());
+    }, (void*) (intptr_t) slot);
+    client->onDisconnect([](void* arg, AsyncClient* client) {
+        int slot = (int) (intptr_t) arg;
+        localClients[slot] = NULL;
+        localApi.disconnected(slot);
+        delete client;
+    }, (void*) (intptr_t) slot);
 }
 
-void upcase(const char* s, size_t s_len, char* buf, size_t buf_len) {
-    size_t i = s_len;
-    if (buf_len - 1 < i) { i = buf_len - 1; }
-    while (*s && i-- > 0) {
-        *buf++ = toupper(*s++);
+void setupLocalApi() {
+    #if LOCAL_API_PORT != 0
+    if (settings.local_api_token[0] == '\0') {
+        LOG_PRINT(LOG_WARNING, "Not starting the local API: no local API token is set");
+        return;
     }
-    *buf = '\0';
+    localApi.setToken(settings.local_api_token);
+    LOG_PRINTF(LOG_INFO, "Starting the local API on port %d", LOCAL_API_PORT);
+    localServer.onClient(localConnect, NULL);
+    localServer.setNoDelay(true);
+    localServer.begin();
+    #endif
 }
 
+// A payload that spans TCP segments arrives in pieces, which are put back
+// together before it is routed
 void mqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {
-    char buffer[6];
-    size_t buflen = 6;
-
-    if (syslogEnabled) syslog.log(LOG_INFO, "mqttMessage callback");
-
-    if(strcmp(topic, mqtt_topic_power_command) == 0) {
-        upcase(payload, len, buffer, buflen);
-        if (syslogEnabled) syslog.logf(LOG_INFO, "SET power setting to %s", buffer);
-        DebugSerial->printf("SET power setting to %s\n", buffer);
-        if (validatePowerValue(buffer)) {
-            heatpump.setPowerSetting(buffer);
-            updateHeatpump = true;
-            lastHeatpumpSettingsChange = millis();
-        }
-    } else if(strcmp(topic, mqtt_topic_mode_command) == 0) {
-        upcase(payload, len, buffer, buflen);
-        if (syslogEnabled) syslog.logf(LOG_INFO, "SET mode setting to %s", buffer);
-        DebugSerial->printf("SET mode setting to %s\n", buffer);
-        if (validateModeValue(buffer)) {
-            heatpump.setModeSetting(buffer);
-            updateHeatpump = true;
-            lastHeatpumpSettingsChange = millis();
-        }
-    } else if(strcmp(topic, mqtt_topic_temperature_command) == 0) {
-        upcase(payload, len, buffer, buflen);
-        if (syslogEnabled) syslog.logf(LOG_INFO, "SET temperature to %f", atof(buffer));
-        DebugSerial->printf("SET temperature to %f\n", atof(buffer));
-        if (validateTemperatureValue(buffer)) {
-            heatpump.setTemperature(atof(buffer));
-            updateHeatpump = true;
-            lastHeatpumpSettingsChange = millis();
-        }
-    } else if(strcmp(topic, mqtt_topic_fan_command) == 0) {
-        upcase(payload, len, buffer, buflen);
-        if (syslogEnabled) syslog.logf(LOG_INFO, "SET fan speed to %s", buffer);
-        DebugSerial->printf("SET fan speed to %s\n", buffer);
-        if (validateFanValue(buffer)) {
-            heatpump.setFanSpeed(buffer);
-            updateHeatpump = true;
-            lastHeatpumpSettingsChange = millis();
-        }
-    } else if(strcmp(topic, mqtt_topic_vane_command) == 0) {
-        upcase(payload, len, buffer, buflen);
-        if (syslogEnabled) syslog.logf(LOG_INFO, "SET vane to %s", buffer);
-        DebugSerial->printf("SET vane to %s\n", buffer);
-        if (validateVaneValue(buffer)) {
-            heatpump.setVaneSetting(buffer);
-            updateHeatpump = true;
-            lastHeatpumpSettingsChange = millis();
-        }
+    StallScope stage(&stallProfiler, STALL_STAGE_MQTT_MESSAGE);
+    wakeLoop();
+    Command command;
+    const char* message;
+    size_t length;
+
+    TRACE("mqttMessage %s: %u bytes at %u of %u", topic, (unsigned int) len, (unsigned int) index, (unsigned int) total);
+
+    // Counted once per message, not once per piece: the rest of a message
+    // already rejected comes back ASSEMBLY_REJECTED too, and a message that
+    // arrives whole can be what cuts short the one before it
+    unsigned long rejected = payloadAssembler.rejected();
+    AssemblyResult assembly = payloadAssembler.add(topic, payload, len, index, total, &message, &length);
+    if (payloadAssembler.rejected() != rejected) {
+        LOG_PRINTF(LOG_WARNING, "Dropping a message to %s that came in pieces", topic);
+        metrics.increment(metricPayloadRejected, payloadAssembler.rejected() - rejected);
+    }
+    switch (assembly) {
+        case ASSEMBLY_PENDING:
+        case ASSEMBLY_REJECTED:
+            return;
+        default:
+            if (message != payload) metrics.increment(metricPayloadAssembled);
+            break;
+    }
+
+    switch (bridge.message(topic, message, length, millis(), &command)) {
+        case MESSAGE_INVALID:
+            LOG_PRINTF(LOG_WARNING, "Ignoring invalid %s value (%u bytes)", CommandRouter::topicName(command.topic), (unsigned int) length);
+            break;
+        case MESSAGE_COMMAND:
+            if (command.topic == COMMAND_SET) TRACE("Applying settings 0x%02x together", command.value);
+            metrics.increment(metricCommands);
+            break;
+        case MESSAGE_OTHER:
+            if (command.topic == COMMAND_HISTORY) {
+                if (!History::parseRequest(message, length, &historyRequest)) {
+                    LOG_PRINTF(LOG_WARNING, "Ignoring invalid history request (%u bytes)", (unsigned int) length);
+                    break;
+                }
+                historyRequested = true;
+                break;
+            }
+            #ifdef PACKET_CAPTURE
+            if (command.topic != COMMAND_CAPTURE) break;
+            if (command.value == CAPTURE_VALUE_DUMP) {
+                LOG_PRINTF(LOG_INFO, "Dumping %u captured packets", packetCapture.count());
+                packetCaptureCursor = 0;
+                packetCaptureDumping = true;
+            } else {
+                LOG_PRINT(LOG_INFO, "Clearing packet capture");
+                packetCapture.clear();
+                packetCaptureDumping = false;
+            }
+            #endif
+            break;
+        default:
+            break;
     }
 }
 
 void setupClearSettingsButtonHandler() {
     #ifdef CLEAR_SETTINGS_PIN
-    if (syslogEnabled) syslog.logf("Setting up clear-settings pin %d", CLEAR_SETTINGS_PIN);
+    LOG_PRINTF(LOG_INFO, "Setting up clear-settings pin %d", CLEAR_SETTINGS_PIN);
     clearSettingsButton.attach(CLEAR_SETTINGS_PIN, INPUT_PULLUP);
     #endif
 }
 
+// Reads the JSON config file that firmware before binary config records
+// used. Only called to migrate it, as it allocates and parses.
+bool importConfigJson() {
+    if (!SPIFFS.exists(CONFIG_SPIFFS_PATH)) return false;
+    LOG_PRINTF(LOG_INFO, "Importing config from %s", CONFIG_SPIFFS_PATH);
+    File configFile = SPIFFS.open(CONFIG_SPIFFS_PATH, "r");
+    if (!configFile) return false;
+
+    size_t size = configFile.size();
+    std::unique_ptr<char[]> buf(new char[size]);
+    configFile.readBytes(buf.get(), size);
+    configFile.close();
+    const int capacity = JSON_OBJECT_SIZE(12);
+    StaticJsonBuffer<capacity> jsonBuffer;
+    JsonObject& json = jsonBuffer.parseObject(buf.get());
+    if (!json.success()) return false;
+
+    if (json.containsKey("mqtt_host"))
+        strncpy(settings.mqtt_host, json["mqtt_host"], MAX_LENGTH_MQTT_HOST);
+    if (json.containsKey("mqtt_port"))
+        strncpy(settings.mqtt_port, json["mqtt_port"], MAX_LENGTH_MQTT_PORT);
+    if (json.containsKey("mqtt_username"))
+        strncpy(settings.mqtt_username, json["mqtt_username"], MAX_LENGTH_MQTT_USERNAME);
+    if (json.containsKey("mqtt_password"))
+        strncpy(settings.mqtt_password, json["mqtt_password"], MAX_LENGTH_MQTT_PASSWORD);
+    if (json.containsKey("mqtt_topic_prefix"))
+        strncpy(settings.mqtt_topic_prefix, json["mqtt_topic_prefix"], MAX_LENGTH_MQTT_TOPIC_PREFIX);
+    if (json.containsKey("syslog_host"))
+        strncpy(settings.syslog_host, json["syslog_host"], MAX_LENGTH_SYSLOG_HOST);
+    if (json.containsKey("syslog_port"))
+        strncpy(settings.syslog_port, json["syslog_port"], MAX_LENGTH_SYSLOG_PORT);
+    if (json.containsKey("syslog_device_hostname"))
+        strncpy(settings.syslog_device_hostname, json["syslog_device_hostname"], MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME);
+    if (json.containsKey("syslog_app_name"))
+        strncpy(settings.syslog_app_name, json["syslog_app_name"], MAX_LENGTH_SYSLOG_APP_NAME);
+    if (json.containsKey("syslog_log_level"))
+        strncpy(settings.syslog_log_level, json["syslog_log_level"], MAX_LENGTH_SYSLOG_LOG_LEVEL);
+    if (json.containsKey("mqtt_json_state"))
+        strncpy(settings.mqtt_json_state, json["mqtt_json_state"], MAX_LENGTH_MQTT_JSON_STATE);
+    if (json.containsKey("local_api_token")) {
+        strncpy(settings.local_api_token, json["local_api_token"], MAX_LENGTH_LOCAL_API_TOKEN - 1);
+        settings.local_api_token[MAX_LENGTH_LOCAL_API_TOKEN - 1] = '\0';
+    }
+    return true;
+}
+
 void loadConfig() {
-    if (SPIFFS.begin()) {
-        if (SPIFFS.exists(CONFIG_SPIFFS_PATH)) {
-            DebugSerial->printf("Found config at %s", CONFIG_SPIFFS_PATH);
-            File configFile = SPIFFS.open(CONFIG_SPIFFS_PATH, "r");
-            if (configFile) {
-                size_t size = configFile.size();
-                std::unique_ptr<char[]> buf(new char[size]);
-                configFile.readBytes(buf.get(), size);
-                const int capacity = JSON_OBJECT_SIZE(10);
-                StaticJsonBuffer<capacity> jsonBuffer;
-                JsonObject& json = jsonBuffer.parseObject(buf.get());
-                if (json.success()) {
-                    if (json.containsKey("mqtt_host"))
-                        strncpy(settings.mqtt_host, json["mqtt_host"], MAX_LENGTH_MQTT_HOST);
-                    if (json.containsKey("mqtt_port"))
-                        strncpy(settings.mqtt_port, json["mqtt_port"], MAX_LENGTH_MQTT_PORT);
-                    if (json.containsKey("mqtt_username"))
-                        strncpy(settings.mqtt_username, json["mqtt_username"], MAX_LENGTH_MQTT_USERNAME);
-                    if (json.containsKey("mqtt_password"))
-                        strncpy(settings.mqtt_password, json["mqtt_password"], MAX_LENGTH_MQTT_PASSWORD);
-                    if (json.containsKey("mqtt_topic_prefix"))
-                        strncpy(settings.mqtt_topic_prefix, json["mqtt_topic_prefix"], MAX_LENGTH_MQTT_TOPIC_PREFIX);
-                    if (json.containsKey("syslog_host"))
-                        strncpy(settings.syslog_host, json["syslog_host"], MAX_LENGTH_SYSLOG_HOST);
-                    if (json.containsKey("syslog_port"))
-                        strncpy(settings.syslog_port, json["syslog_port"], MAX_LENGTH_SYSLOG_PORT);
-                    if (json.containsKey("syslog_device_hostname"))
-                        strncpy(settings.syslog_device_hostname, json["syslog_device_hostname"], MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME);
-                    if (json.containsKey("syslog_app_name"))
-                        strncpy(settings.syslog_app_name, json["syslog_app_name"], MAX_LENGTH_SYSLOG_APP_NAME);
-                    if (json.containsKey("syslog_log_level"))
-                        strncpy(settings.syslog_log_level, json["syslog_log_level"], MAX_LENGTH_SYSLOG_LOG_LEVEL);
-                } else {
-                    // Failed to load json config
-                }
-                configFile.close();
-            }
+    if (!SPIFFS.begin()) {
+        // Failed to mount FS
+        LOG_PRINT(LOG_ERR, "Error mounting SPIFFS");
+        return;
+    }
+    if (configStore.load(&settings, sizeof(settings))) {
+        LOG_PRINTF(LOG_INFO, "Loaded config record %lu", (unsigned long) configStore.sequence());
+        // Earlier builds could save a token that filled its field
+        settings.local_api_token[MAX_LENGTH_LOCAL_API_TOKEN - 1] = '\0';
+        return;
+    }
+    // A version 1 record is the same but for the local API token, which came
+    // after it. It is saved again as version 2 once setup() is done.
+    settings = Settings();
+    if (configStore.load(&settings, offsetof(Settings, local_api_token), 1)) {
+        LOG_PRINTF(LOG_INFO, "Converting version 1 config record %lu", (unsigned long) configStore.sequence());
+        shouldSaveConfig = true;
+        return;
+    }
+
+    // No usable record, so start from the defaults. A config.json from older
+    // firmware is imported, and saved as a record once setup() has the rest
+    // of the settings.
+    settings = Settings();
+    if (importConfigJson()) shouldSaveConfig = true;
+}
+
+// Tries to rejoin the access point we were last connected to directly, with
+// the BSSID, channel and IP configuration remembered from then, which skips
+// the scan and DHCP. Returns false, with DHCP turned back on for
+// WiFiManager, if there's nothing remembered or it doesn't connect within
+// FAST_CONNECT_TIMEOUT_MS.
+bool fastConnectWifi() {
+    if (!connectionStore.load(&connectionCache, sizeof(connectionCache))) {
+        memset(&connectionCache, 0, sizeof(connectionCache));
+        return false;
+    }
+    // The SDK keeps the credentials of the last network we joined
+    String ssid = WiFi.SSID();
+    String psk = WiFi.psk();
+    if (ssid.length() == 0) return false;
+
+    const uint8_t* bssid = connectionCache.bssid;
+    LOG_PRINTF(LOG_INFO, "Connecting directly to %s (%02x:%02x:%02x:%02x:%02x:%02x, channel %d)",
+               ssid.c_str(), bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5], connectionCache.channel);
+    WiFi.mode(WIFI_STA);
+    WiFi.config(IPAddress(connectionCache.ip), IPAddress(connectionCache.gateway),
+                IPAddress(connectionCache.subnet), IPAddress(connectionCache.dns));
+    WiFi.begin(ssid.c_str(), psk.c_str(), connectionCache.channel, connectionCache.bssid);
+
+    unsigned long start = millis();
+    while (WiFi.status() != WL_CONNECTED) {
+        if (millis() - start > FAST_CONNECT_TIMEOUT_MS) {
+            LOG_PRINT(LOG_WARNING, "Direct connect timed out");
+            WiFi.config(IPAddress(), IPAddress(), IPAddress());
+            WiFi.disconnect();
+            return false;
         }
+        delay(10);
+    }
+    return true;
+}
+
+// Saves what the fast path needs for next boot, once we've reached the
+// broker, unless it is what we already have
+void rememberConnection() {
+    ConnectionCache current;
+    memset(&current, 0, sizeof(current));
+    memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+    current.channel = WiFi.channel();
+    current.ip = WiFi.localIP();
+    current.gateway = WiFi.gatewayIP();
+    current.subnet = WiFi.subnetMask();
+    current.dns = WiFi.dnsIP();
+
+    IPAddress broker;
+    if (mqttBrokerCached) {
+        broker = IPAddress(connectionCache.broker);
+    } else if (!WiFi.hostByName(settings.mqtt_host, broker)) {
+        broker = IPAddress();
+    }
+    current.broker = broker;
+    current.brokerHostCrc = ConfigStore::crc32(settings.mqtt_host, strlen(settings.mqtt_host));
+
+    if (memcmp(&current, &connectionCache, sizeof(current)) == 0) return;
+    connectionCache = current;
+    if (connectionStore.save(&connectionCache, sizeof(connectionCache))) {
+        LOG_PRINT(LOG_INFO, "Saved connection details for the next boot");
     } else {
-        // Failed to mount FS
-        DebugSerial->printf("Error mounting SPIFFS");
+        LOG_PRINT(LOG_ERR, "Error saving connection details");
     }
 }
 
@@ -320,12 +737,14 @@ void setupWifiManager() {
     custom_mqtt_port = new WiFiManagerParameter("mqtt_port", "MQTT Port", settings.mqtt_port, MAX_LENGTH_MQTT_PORT);
     custom_mqtt_username = new WiFiManagerParameter("mqtt_username", "MQTT Username", settings.mqtt_username, MAX_LENGTH_MQTT_USERNAME);
     custom_mqtt_password = new WiFiManagerParameter("mqtt_password", "MQTT Password", settings.mqtt_password, MAX_LENGTH_MQTT_PASSWORD);
+    custom_local_api_token = new WiFiManagerParameter("local_api_token", "Local API Token (empty = off)", settings.local_api_token, MAX_LENGTH_LOCAL_API_TOKEN - 1);
     custom_mqtt_topic_prefix = new WiFiManagerParameter("mqtt_topic_prefis", "MQTT Topic Prefix", settings.mqtt_topic_prefix, MAX_LENGTH_MQTT_TOPIC_PREFIX);
     custom_syslog_host = new WiFiManagerParameter("syslog_host", "SYSLOG Host", settings.syslog_host, MAX_LENGTH_SYSLOG_HOST);
     custom_syslog_port = new WiFiManagerParameter("syslog_port", "SYSLOG Port", settings.syslog_port, MAX_LENGTH_SYSLOG_PORT);
     custom_syslog_device_hostname = new WiFiManagerParameter("syslog_device_hostname", "Syslog Device Hostname", settings.syslog_device_hostname, MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME);
     custom_syslog_app_name = new WiFiManagerParameter("syslog_app_name", "Syslog App Name", settings.syslog_app_name, MAX_LENGTH_SYSLOG_APP_NAME);
     custom_syslog_log_level = new WiFiManagerParameter("syslog_log_level", "Syslog Log Level", settings.syslog_log_level, MAX_LENGTH_SYSLOG_LOG_LEVEL);
+    custom_mqtt_json_state = new WiFiManagerParameter("mqtt_json_state", "MQTT JSON state topic (1 = on)", settings.mqtt_json_state, MAX_LENGTH_MQTT_JSON_STATE);
 
     // Configure custom parameters for wifimanager to collect in the
     // configuration page
@@ -333,12 +752,14 @@ void setupWifiManager() {
     wifiManager->addParameter(custom_mqtt_port);
     wifiManager->addParameter(custom_mqtt_username);
     wifiManager->addParameter(custom_mqtt_password);
+    wifiManager->addParameter(custom_local_api_token);
     wifiManager->addParameter(custom_mqtt_topic_prefix);
     wifiManager->addParameter(custom_syslog_host);
     wifiManager->addParameter(custom_syslog_port);
     wifiManager->addParameter(custom_syslog_device_hostname);
     wifiManager->addParameter(custom_syslog_app_name);
     wifiManager->addParameter(custom_syslog_log_level);
+    wifiManager->addParameter(custom_mqtt_json_state);
     wifiManager->setSaveParamsCallback(saveConfigCallback);
 
     // Timeout after 5 minutes so that a "blip" in the wifi doesn't leave the
@@ -358,15 +779,56 @@ void setupWifiManager() {
     wifiManager->setClass("invert");
 }
 
+// Copies the values from the portal into the settings. They were filled in
+// from the settings to begin with, so this only changes anything if they
+// were edited in the portal.
+void readWifiManagerParameters() {
+    strncpy(settings.mqtt_host, custom_mqtt_host->getValue(), MAX_LENGTH_MQTT_HOST);
+    strncpy(settings.mqtt_port, custom_mqtt_port->getValue(), MAX_LENGTH_MQTT_PORT);
+    strncpy(settings.mqtt_username, custom_mqtt_username->getValue(), MAX_LENGTH_MQTT_USERNAME);
+    strncpy(settings.mqtt_password, custom_mqtt_password->getValue(), MAX_LENGTH_MQTT_PASSWORD);
+    strncpy(settings.local_api_token, custom_local_api_token->getValue(), MAX_LENGTH_LOCAL_API_TOKEN - 1);
+    settings.local_api_token[MAX_LENGTH_LOCAL_API_TOKEN - 1] = '\0';
+    strncpy(settings.mqtt_topic_prefix, custom_mqtt_topic_prefix->getValue(), MAX_LENGTH_MQTT_TOPIC_PREFIX);
+    strncpy(settings.syslog_host, custom_syslog_host->getValue(), MAX_LENGTH_SYSLOG_HOST);
+    strncpy(settings.syslog_port, custom_syslog_port->getValue(), MAX_LENGTH_SYSLOG_PORT);
+    strncpy(settings.syslog_device_hostname, custom_syslog_device_hostname->getValue(), MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME);
+    strncpy(settings.syslog_app_name, custom_syslog_app_name->getValue(), MAX_LENGTH_SYSLOG_APP_NAME);
+    strncpy(settings.syslog_log_level, custom_syslog_log_level->getValue(), MAX_LENGTH_SYSLOG_LOG_LEVEL);
+    strncpy(settings.mqtt_json_state, custom_mqtt_json_state->getValue(), MAX_LENGTH_MQTT_JSON_STATE);
+}
+
+// The portal is only needed until we're connected, so give its memory back
+void teardownWifiManager() {
+    delete wifiManager;
+    wifiManager = NULL;
+    delete custom_mqtt_host;
+    delete custom_mqtt_port;
+    delete custom_mqtt_username;
+    delete custom_mqtt_password;
+    delete custom_local_api_token;
+    delete custom_mqtt_topic_prefix;
+    delete custom_syslog_host;
+    delete custom_syslog_port;
+    delete custom_syslog_device_hostname;
+    delete custom_syslog_app_name;
+    delete custom_syslog_log_level;
+    delete custom_mqtt_json_state;
+}
+
 bool startWifiManager() {
     char config_ap_name[17];
     snprintf(config_ap_name, 17, "ESP8266 %08x", ESP.getChipId());
-    DebugSerial->printf("Starting wifimanager with AP %s", config_ap_name);
+    LOG_PRINTF(LOG_INFO, "Starting wifimanager with AP %s", config_ap_name);
+    // WiFiManager writes to the debug port directly, and blocks
+    logFlush();
 
     return wifiManager->autoConnect(config_ap_name, WIFIMANAGER_AP_PASSWORD);
 }
 
-void saveConfig() {
+#ifdef CONFIG_JSON_EXPORT
+// Writes the settings out as config.json too, for debugging
+void exportConfigJson() {
     DynamicJsonBuffer jsonBuffer;
     JsonObject& json = jsonBuffer.createObject();
     json["mqtt_host"] = settings.mqtt_host;
@@ -379,6 +841,8 @@ void saveConfig() {
     json["syslog_device_hostname"] = settings.syslog_device_hostname;
     json["syslog_app_name"] = settings.syslog_app_name;
     json["syslog_log_level"] = settings.syslog_log_level;
+    json["mqtt_json_state"] = settings.mqtt_json_state;
+    json["local_api_token"] = settings.local_api_token;
 
     File configFile = SPIFFS.open(CONFIG_SPIFFS_PATH, "w");
     if (!configFile) {
@@ -386,243 +850,739 @@ void saveConfig() {
     }
 
     json.printTo(configFile);
-    json.printTo(*DebugSerial);
+    LOG_PRINT(LOG_INFO, "Exported configuration to " CONFIG_SPIFFS_PATH);
     configFile.close();
 }
+#endif
+
+void saveConfig() {
+    if (configStore.save(&settings, sizeof(settings))) {
+        LOG_PRINTF(LOG_INFO, "Saved config record %lu", (unsigned long) configStore.sequence());
+    } else {
+        LOG_PRINT(LOG_ERR, "Error saving config record");
+    }
+    #ifdef CONFIG_JSON_EXPORT
+    exportConfigJson();
+    #endif
+}
 
 void handleClearSettingsButton() {
     clearSettingsButton.update();
     if (clearSettingsButton.read() == LOW && clearSettingsButton.duration() > 3000) {
-        if (syslogEnabled) syslog.log(LOG_WARNING, "Resetting to factory settings");
-        DebugSerial->println("Resetting to factory settings");
+        LOG_PRINT(LOG_WARNING, "Resetting to factory settings");
+        if (wifiManager == NULL) setupWifiManager();
         wifiManager->resetSettings();
+        configStore.clear();
+        connectionStore.clear();
+        #ifdef HISTORY_FLASH
+        historyStore.clear();
+        #endif
         SPIFFS.remove(CONFIG_SPIFFS_PATH);
-        if (syslogEnabled) syslog.log(LOG_WARNING, "Restarting...");
-        DebugSerial->println("Restarting...");
+        LOG_PRINT(LOG_WARNING, "Restarting...");
+        logFlush();
         ESP.restart();
         delay(5000);
     }
 }
 
+// The names that ESP.getResetReason() gives each rst_reason
+static const char* const RESET_REASONS[] = {
+    "Power on",
+    "Hardware Watchdog",
+    "Exception",
+    "Software Watchdog",
+    "Software/System restart",
+    "Deep-Sleep Wake",
+    "External System",
+};
+
+void readSystemBootInfo() {
+    strncpy(systemCoreVersion, ESP.getCoreVersion().c_str(), MAX_LENGTH_CORE_VERSION - 1);
+    strncpy(systemSketchMD5, ESP.getSketchMD5().c_str(), MAX_LENGTH_SKETCH_MD5 - 1);
+}
+
 void publishSystemBootInfo() {
-    char buffer[256];
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(256);
+    if (buffer == NULL) return;
     rst_info *reset_info = ESP.getResetInfoPtr();
-    snprintf(buffer, 256, "Reset reason: %s", ESP.getResetReason().c_str());
-    mqttClient.publish(mqtt_topic_info, 0, false, buffer);
+    snprintf(buffer, 256, "Reset reason: %s",
+             reset_info->reason <= REASON_EXT_SYS_RST ? RESET_REASONS[reset_info->reason] : "Unknown");
+    mqttPublish(TOPIC_INFO, 0, false, buffer);
     if (reset_info->reason == REASON_EXCEPTION_RST) {
         snprintf(buffer, 256, "Fatal exception: (%d):\n", reset_info->exccause);
-        if (syslogEnabled) syslog.log(LOG_INFO, buffer);
-        mqttClient.publish(mqtt_topic_info, 0, false, buffer);
+        LOG_PRINT(LOG_INFO, buffer);
+        mqttPublish(TOPIC_INFO, 0, false, buffer);
         snprintf(buffer, 256, "epc1=0x%08x, epc2=0x%08x, epc3=0x%08x, excvaddr=0x%08x, depc=0x%08x",
                  reset_info->epc1,
                  reset_info->epc2,
                  reset_info->epc3,
                  reset_info->excvaddr,
                  reset_info->depc);
-        if (syslogEnabled) syslog.log(LOG_INFO, buffer);
-        mqttClient.publish(mqtt_topic_info, 0, false, buffer);
+        LOG_PRINT(LOG_INFO, buffer);
+        mqttPublish(TOPIC_INFO, 0, false, buffer);
+    }
+    if (stallRestored) {
+        publishStallRecord(reset_info->reason <= REASON_EXT_SYS_RST ? RESET_REASONS[reset_info->reason] : "Unknown");
     }
     snprintf(buffer, 256, "Chip ID: %08x", ESP.getChipId());
-    if (syslogEnabled) syslog.log(LOG_INFO, buffer);
-    mqttClient.publish(mqtt_topic_info, 0, false, buffer);
-    snprintf(buffer, 256, "Core: %s\nSDK: %s\nCPU Frequency: %d MHz", ESP.getCoreVersion().c_str(), ESP.getSdkVersion(), ESP.getCpuFreqMHz());
-    if (syslogEnabled) syslog.log(LOG_INFO, buffer);
-    mqttClient.publish(mqtt_topic_info, 0, false, buffer);
-    snprintf(buffer, 256, "Sketch size: %d\nSketch free: %d\nSketch MD5: %s", ESP.getSketchSize(), ESP.getFreeSketchSpace(), ESP.getSketchMD5().c_str());
-    if (syslogEnabled) syslog.log(LOG_INFO, buffer);
-    mqttClient.publish(mqtt_topic_info, 0, false, buffer);
+    LOG_PRINT(LOG_INFO, buffer);
+    mqttPublish(TOPIC_INFO, 0, false, buffer);
+    snprintf(buffer, 256, "Core: %s\nSDK: %s\nCPU Frequency: %d MHz", systemCoreVersion, ESP.getSdkVersion(), ESP.getCpuFreqMHz());
+    LOG_PRINT(LOG_INFO, buffer);
+    mqttPublish(TOPIC_INFO, 0, false, buffer);
+    snprintf(buffer, 256, "Sketch size: %d\nSketch free: %d\nSketch MD5: %s", ESP.getSketchSize(), ESP.getFreeSketchSpace(), systemSketchMD5);
+    LOG_PRINT(LOG_INFO, buffer);
+    mqttPublish(TOPIC_INFO, 0, false, buffer);
 }
 
 void publishSystemStatus() {
-    char buffer[256];
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(256);
+    if (buffer == NULL) return;
     snprintf(buffer, 256, "Uptime: %d mins\nFree heap: %d", (int) (millis() / 60000), ESP.getFreeHeap());
-    if (syslogEnabled) syslog.log(LOG_INFO, buffer);
-    mqttClient.publish(mqtt_topic_info, 0, false, buffer);
+    LOG_PRINT(LOG_INFO, buffer);
+    mqttPublish(TOPIC_INFO, 0, false, buffer);
+}
+
+void publishCoalescerStats() {
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(256);
+    if (buffer == NULL) return;
+    const CoalescerStats& stats = bridge.coalescer().stats();
+    snprintf(buffer, 256, "{\"writes\":%lu,\"commands\":%lu,\"max_merged\":%lu,\"merged\":{\"1\":%lu,\"2\":%lu,\"3-4\":%lu,\"5-8\":%lu,\"9+\":%lu},\"window_ms\":%lu}",
+             stats.writes, stats.commands, stats.maxMerged,
+             stats.merged[0], stats.merged[1], stats.merged[2], stats.merged[3], stats.merged[4],
+             bridge.coalescer().window());
+    LOG_PRINT(LOG_INFO, buffer);
+    mqttPublish(TOPIC_COALESCER, 0, false, buffer);
+}
+
+void publishTaskStats() {
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(TASK_STATS_PAYLOAD_SIZE);
+    if (buffer == NULL) return;
+    int offset = 0;
+
+    offset += snprintf(buffer + offset, TASK_STATS_PAYLOAD_SIZE - offset, "{");
+    for (int i = 0; i < scheduler.taskCount() && offset < TASK_STATS_PAYLOAD_SIZE; i++) {
+        const Task& task = scheduler.task(i);
+        offset += snprintf(buffer + offset, TASK_STATS_PAYLOAD_SIZE - offset,
+                           "%s\"%s\":{\"runs\":%lu,\"misses\":%lu,\"avg_us\":%lu,\"max_us\":%lu}",
+                           i > 0 ? "," : "", task.name, task.runs, task.misses,
+                           task.runs > 0 ? (unsigned long) (task.totalMicros / task.runs) : 0UL, task.maxMicros);
+    }
+    if (offset < TASK_STATS_PAYLOAD_SIZE) offset += snprintf(buffer + offset, TASK_STATS_PAYLOAD_SIZE - offset, "}");
+    // A payload that doesn't fit is not sent, rather than sent truncated
+    if (offset >= TASK_STATS_PAYLOAD_SIZE) return;
+    LOG_PRINT(LOG_DEBUG, buffer);
+    mqttPublish(TOPIC_TASKS, 0, false, buffer);
+}
+
+// A stall stage's name: a task's, or a callback's
+const char* stallStageName(uint8_t stage) {
+    if (stage < scheduler.taskCount()) return scheduler.task(stage).name;
+    const char* name = StallProfiler::stageName(stage);
+    return name != NULL ? name : "?";
+}
+
+// The slowest passes through loop() and callbacks since boot, each with the
+// stage that took most of it
+void publishStalls() {
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(STALLS_PAYLOAD_SIZE);
+    if (buffer == NULL) return;
+    const StallStats& stats = stallProfiler.stats();
+    int offset = snprintf(buffer, STALLS_PAYLOAD_SIZE, "{\"spans\":%lu,\"slow\":%lu,\"too_deep\":%lu,\"slowest\":[",
+                          stats.spans, stats.slow, stats.tooDeep);
+    for (int i = 0; i < stallProfiler.slowestCount() && offset < STALLS_PAYLOAD_SIZE; i++) {
+        const StallSpan& span = stallProfiler.slowest(i);
+        offset += snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset,
+                           "%s{\"stage\":\"%s\",\"us\":%u,\"culprit\":\"%s\",\"culprit_us\":%u,\"at\":%u}",
+                           i > 0 ? "," : "", stallStageName(span.stage), span.micros, stallStageName(span.culprit),
+                           span.culpritMicros, span.endedAt / 1000);
+    }
+    if (offset < STALLS_PAYLOAD_SIZE) offset += snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, "]}");
+    if (offset >= STALLS_PAYLOAD_SIZE) return;
+    mqttPublish(TOPIC_STALLS, 0, false, buffer, offset);
+}
+
+// What the last boot was doing when it ended: the stages open, on
+// <prefix>/info, and those and the slow stages before them on
+// <prefix>/stalls, newest first, as many as fit
+void publishStallRecord(const char* resetReason) {
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(STALLS_PAYLOAD_SIZE);
+    if (buffer == NULL) return;
+    const StallRecord& record = stallProfiler.previous();
+
+    int offset = snprintf(buffer, STALLS_PAYLOAD_SIZE, "Running at the reset:");
+    for (int i = 0; i < STALL_MAX_DEPTH && record.open[i] != STALL_NONE; i++) {
+        offset += snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, "%s%s", i > 0 ? " > " : " ",
+                           stallStageName(record.open[i]));
+    }
+    if (record.open[0] != STALL_NONE) {
+        snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, ", entered %u ms after boot", record.openedAt);
+        LOG_PRINT(LOG_WARNING, buffer);
+        mqttPublish(TOPIC_INFO, 0, false, buffer);
+    }
+
+    offset = snprintf(buffer, STALLS_PAYLOAD_SIZE, "{\"reset\":\"%s\",\"open\":[", resetReason);
+    for (int i = 0; i < STALL_MAX_DEPTH && record.open[i] != STALL_NONE; i++) {
+        offset += snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, "%s\"%s\"", i > 0 ? "," : "",
+                           stallStageName(record.open[i]));
+    }
+    offset += snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, "],\"opened_at\":%u,\"crumbs\":[", record.openedAt);
+    uint32_t crumbs = record.count < STALL_BREADCRUMBS ? record.count : STALL_BREADCRUMBS;
+    for (uint32_t i = 0; i < crumbs && offset < STALLS_PAYLOAD_SIZE; i++) {
+        const StallBreadcrumb& crumb = record.crumbs[(record.count - 1 - i) % STALL_BREADCRUMBS];
+        int length = snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, "%s[\"%s\",\"%s\",%u,%u]",
+                              i > 0 ? "," : "", stallStageName(crumb.stage),
+                              crumb.parent != STALL_NONE ? stallStageName(crumb.parent) : "", crumb.millis, crumb.endedAt);
+        // Leaving room for the closing brackets
+        if (offset + length + 2 >= STALLS_PAYLOAD_SIZE) break;
+        offset += length;
+    }
+    if (offset + 2 >= STALLS_PAYLOAD_SIZE) return;
+    offset += snprintf(buffer + offset, STALLS_PAYLOAD_SIZE - offset, "]}");
+    mqttPublish(TOPIC_STALLS, 0, false, buffer, offset);
+}
+
+// The payload is formatted in the scratch arena and, if it has to wait, copied
+// into the publish queue's pool; the topic is composed in the arena after it
+static_assert(METRICS_PAYLOAD_SIZE + MAX_LENGTH_MQTT_TOPIC_PREFIX + TOPIC_MAX_SUFFIX + 2 + SCRATCH_ALIGNMENT
+              <= SCRATCH_ARENA_SIZE, "the metrics payload and its topic fit in the scratch arena");
+static_assert(METRICS_PAYLOAD_SIZE <= PUBLISH_QUEUE_BYTES, "the metrics payload fits in the publish queue");
+
+void publishMetrics() {
+    ScratchScope scope(scratch);
+    char* buffer = scratch.allocate(METRICS_PAYLOAD_SIZE);
+    if (buffer == NULL) return;
+    metrics.set(metricHeapFree, ESP.getFreeHeap());
+    metrics.set(metricHeapMaxBlock, ESP.getMaxFreeBlockSize());
+    metrics.set(metricHeapFragmentation, ESP.getHeapFragmentation());
+    metrics.set(metricScratchPeak, scratch.highWater());
+    metrics.set(metricLinkUtilisation, bridge.link().utilisation(millis()));
+    metrics.set(metricMqttDownMillis, mqttReconnect.stats().downMillis);
+    metrics.set(metricMqttLongestDownMillis, mqttReconnect.stats().longestDownMillis);
+    metrics.set(metricLocalClients, localApi.clients());
+    metrics.set(metricMqttQueuePeak, publishQueue.stats().peakBytes);
+    metrics.set(metricAwakePercent, powerSave.dutyCycle(micros()));
+    unsigned long uptime = millis() / 1000;
+    size_t length = metrics.format(buffer, METRICS_PAYLOAD_SIZE, uptime);
+    if (length == 0) {
+        LOG_PRINT(LOG_WARNING, "Metrics don't fit in METRICS_PAYLOAD_SIZE");
+        return;
+    }
+    mqttPublish(TOPIC_METRICS, 0, false, buffer, length);
+    for (int i = 0; i < metrics.histograms(); i++) {
+        length = metrics.formatHistogram(i, buffer, METRICS_PAYLOAD_SIZE, uptime);
+        if (length > 0) mqttPublish(TOPIC_METRICS, 0, false, buffer, length);
+    }
+}
+
+#ifdef PACKET_CAPTURE
+// Publishes the next chunk of the packet capture. One chunk goes out per call
+// so that a dump doesn't fill the TCP send buffer; a chunk that can't be
+// published is tried again next time.
+void publishPacketCapture() {
+    static uint8_t chunk[PACKET_CAPTURE_CHUNK];
+    uint32_t cursor = packetCaptureCursor;
+    size_t length = packetCapture.read(&cursor, chunk, PACKET_CAPTURE_CHUNK);
+
+    if (length == 0) {
+        LOG_PRINTF(LOG_INFO, "Packet capture dumped; %u captured, %u overwritten",
+                   (unsigned int) packetCapture.captured(), (unsigned int) packetCapture.overwritten());
+        packetCaptureDumping = false;
+        return;
+    }
+    if (mqttPublish(TOPIC_CAPTURE, 0, false, (const char*) chunk, length) != 0) {
+        packetCaptureCursor = cursor;
+    }
+}
+#endif
+
+// Publishes the trace records written since the last chunk: as soon as a
+// chunk's worth is waiting, and otherwise once every TRACE_FLUSH_MS. A chunk
+// that can't be published is read again next time, from the same cursor.
+void publishTrace(unsigned long now) {
+    static uint8_t chunk[TRACE_CHUNK];
+    if (!mqttClient.connected()) return;
+    uint32_t pending = tracePending(traceCursor);
+    if (pending == 0) return;
+    if (pending < TRACE_CHUNK && now - traceLastPublish < TRACE_FLUSH_MS) return;
+
+    TraceCursor cursor = traceCursor;
+    size_t length = traceRead(&cursor, chunk, TRACE_CHUNK);
+    if (length == 0) return;
+    traceLastPublish = now;
+    if (mqttPublish(TOPIC_TRACE, 0, false, (const char*) chunk, length) == 0) return;
+    metrics.increment(metricTracePublished, cursor.sequence - traceCursor.sequence);
+    metrics.increment(metricTraceDropped, cursor.dropped - traceCursor.dropped);
+    traceCursor = cursor;
+}
+
+// Answers the last <prefix>/history/get with the range it asked for, in one
+// message
+void publishHistory(unsigned long now) {
+    static uint8_t batch[HISTORY_RESPONSE_SIZE];
+    size_t length = history.query(historyRequest, now, batch, sizeof(batch));
+    LOG_PRINTF(LOG_INFO, "Sending %u bytes of %s history", (unsigned int) length, History::tierName(historyRequest.tier));
+    mqttPublish(TOPIC_HISTORY, 0, false, (const char*) batch, length);
+}
+
+#ifdef HISTORY_FLASH
+void loadHistory() {
+    if (historyStore.load(history.state(), sizeof(HistoryState))) {
+        history.restored(millis());
+        LOG_PRINTF(LOG_INFO, "Loaded history record %lu", (unsigned long) historyStore.sequence());
+    } else {
+        history.clear();
+    }
+}
+#endif
+
+void setupMetrics() {
+    metricMqttPublished = metrics.addCounter("mqtt_pub");
+    metricMqttPublishFailed = metrics.addCounter("mqtt_pub_fail");
+    metricMqttQueued = metrics.addCounter("mqtt_queued");
+    metricMqttDropped = metrics.addCounter("mqtt_dropped");
+    metricMqttConnects = metrics.addCounter("mqtt_connects");
+    metricMqttDisconnects = metrics.addCounter("mqtt_disconnects");
+    metricMqttAttempts = metrics.addCounter("mqtt_attempts");
+    metricPayloadAssembled = metrics.addCounter("mqtt_assembled");
+    metricPayloadRejected = metrics.addCounter("mqtt_rejected");
+    metricTracePublished = metrics.addCounter("trace_pub");
+    metricTraceDropped = metrics.addCounter("trace_dropped");
+    metricCommands = metrics.addCounter("commands");
+    metricRoomTemperatureSkipped = metrics.addCounter("room_temp_skipped");
+    metricLinkWrites = metrics.addCounter("link_writes");
+    metricLinkPolls = metrics.addCounter("link_polls");
+    metricLinkThrottled = metrics.addCounter("link_throttled");
+    metricConfirmRetries = metrics.addCounter("confirm_retries");
+    metricConfirmDiverged = metrics.addCounter("confirm_diverged");
+    metricLocalCommands = metrics.addCounter("local_cmd");
+    metricLocalStalled = metrics.addCounter("local_stalled");
+    metricLocalForbidden = metrics.addCounter("local_forbidden");
+    metricHeapFree = metrics.addGauge("heap_free");
+    metricHeapMaxBlock = metrics.addGauge("heap_max_block");
+    metricHeapFragmentation = metrics.addGauge("heap_frag_pct");
+    metricBootFastConnect = metrics.addGauge("boot_fast");
+    metricBootPublishMillis = metrics.addGauge("boot_publish_ms");
+    metricScratchPeak = metrics.addGauge("scratch_peak");
+    metricLinkUtilisation = metrics.addGauge("link_util_pct");
+    metricMqttDownMillis = metrics.addGauge("mqtt_down_ms");
+    metricMqttLongestDownMillis = metrics.addGauge("mqtt_down_max_ms");
+    metricLocalClients = metrics.addGauge("local_clients");
+    metricMqttQueuePeak = metrics.addGauge("mqtt_queue_peak");
+    metricAwakePercent = metrics.addGauge("awake_pct");
+    metricLoopMicros = metrics.addHistogram("loop_us");
+    metricSyncMicros = metrics.addHistogram("sync_us");
+    metricUpdateMicros = metrics.addHistogram("update_us");
+    metricCommandMillis = metrics.addHistogram("command_ms");
+    metricLinkQueueMillis = metrics.addHistogram("link_queue_ms");
+    metricConfirmMillis = metrics.addHistogram("confirm_ms");
+    metricMqttQueueMillis = metrics.addHistogram("mqtt_queue_ms");
+    metricWakeLateMicros = metrics.addHistogram("wake_late_us");
+    // A metric that was refused records nothing, and would simply be missing
+    if (metrics.refused() > 0) {
+        LOG_PRINTF(LOG_ERR, "%d metrics don't fit in the registry; raise METRICS_MAX_*", metrics.refused());
+    }
 }
 
 void setup() {
+    stallRestored = stallProfiler.restore();
+    setupMetrics();
     heatPumpDetected = detectHeatpump();
+    logSetSerial(DebugSerial);
 
-    DebugSerial->println("\n Starting up...");
+    LOG_PRINT(LOG_INFO, "Starting up...");
     if (heatPumpDetected) {
-        DebugSerial->println("Heatpump DETECTED");
+        LOG_PRINT(LOG_INFO, "Heatpump DETECTED");
     } else {
-        DebugSerial->println("Heatpump NOT DETECTED");
+        LOG_PRINT(LOG_INFO, "Heatpump NOT DETECTED");
     }
 
-    DebugSerial->println("Configuring debounce handler for CLEAR button");
+    LOG_PRINT(LOG_INFO, "Configuring debounce handler for CLEAR button");
     setupClearSettingsButtonHandler();
-    DebugSerial->println("Loading configuration");
+    LOG_PRINT(LOG_INFO, "Loading configuration");
     loadConfig();
-    DebugSerial->println("Setting up the wifi manager");
-    setupWifiManager();
+    #ifdef HISTORY_FLASH
+    loadHistory();
+    #endif
 
-    if (!startWifiManager()) {
-        DebugSerial->println("Failed to connect or timed out. Restarting in 3s...");
-        delay(3000);
-        ESP.restart();
-        delay(5000);
+    bootFastConnect = fastConnectWifi();
+    metrics.set(metricBootFastConnect, bootFastConnect);
+    if (bootFastConnect) {
+        LOG_PRINT(LOG_INFO, "Connected to wifi directly");
     } else {
-        DebugSerial->println("Connected to wifi");
+        LOG_PRINT(LOG_INFO, "Setting up the wifi manager");
+        setupWifiManager();
+
+        if (!startWifiManager()) {
+            LOG_PRINT(LOG_ERR, "Failed to connect or timed out. Restarting in 3s...");
+            logFlush();
+            delay(3000);
+            ESP.restart();
+            delay(5000);
+        } else {
+            LOG_PRINT(LOG_INFO, "Connected to wifi");
+        }
+        readWifiManagerParameters();
+        teardownWifiManager();
     }
 
     // Successfully connected to wifi
 
-    ArduinoOTA.onStart([]() {
-        String type;
-        if (ArduinoOTA.getCommand() == U_FLASH) {
-            type = "sketch";
-        } else {
-            type = "filesystem";
-        }
+    if (powerSave.enabled()) {
+        bool light = powerSave.policy() == POWER_SAVE_LIGHT;
+        LOG_PRINTF(LOG_INFO, "Power save: loop() sleeps between deadlines, WiFi in %s sleep", light ? "light" : "modem");
+        WiFi.setSleepMode(light ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+    }
 
-        if (syslogEnabled) syslog.logf(LOG_WARNING, "OTA Update starting (%s)", type.c_str());
-        DebugSerial->println("Start updating " + type);
+    ArduinoOTA.onStart([]() {
+        StallScope stage(&stallProfiler, STALL_STAGE_OTA_START);
+        const char* type = ArduinoOTA.getCommand() == U_FLASH ? "sketch" : "filesystem";
+        LOG_PRINTF(LOG_WARNING, "OTA Update starting (%s)", type);
     });
     ArduinoOTA.onEnd([]() {
-        if (syslogEnabled) syslog.log(LOG_WARNING, "OTA Update: COMPLETE");
-        DebugSerial->println("\nEnd updating");
-        delay(500);
+        StallScope stage(&stallProfiler, STALL_STAGE_OTA_END);
+        LOG_PRINT(LOG_WARNING, "OTA Update: COMPLETE");
+        logFlush();
     });
     ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+        StallScope stage(&stallProfiler, STALL_STAGE_OTA_PROGRESS);
         if (progress > 0 && total > 0) {
-            if (syslogEnabled) syslog.logf(LOG_WARNING, "OTA Update Progress: %u%%", (progress / (total / 100)));
-            DebugSerial->printf("Progress: %u%%\r", (progress / (total / 100)));
+            TRACE("OTA Update Progress: %u%%", (progress / (total / 100)));
         }
     });
     ArduinoOTA.onError([](ota_error_t error) {
-        DebugSerial->printf("Error[%u]: ", error);
+        StallScope stage(&stallProfiler, STALL_STAGE_OTA_ERROR);
         if (error == OTA_AUTH_ERROR) {
-            if (syslogEnabled) syslog.log(LOG_ERR, "OTA Update Error: Auth Failed");
-            DebugSerial->println("Auth Failed");
+            LOG_PRINT(LOG_ERR, "OTA Update Error: Auth Failed");
         } else if (error == OTA_BEGIN_ERROR) {
-            if (syslogEnabled) syslog.log(LOG_ERR, "OTA Update Error: Begin Failed");
-            DebugSerial->println("Begin Failed");
+            LOG_PRINT(LOG_ERR, "OTA Update Error: Begin Failed");
         } else if (error == OTA_CONNECT_ERROR) {
-            if (syslogEnabled) syslog.log(LOG_ERR, "OTA Update Error: Connect Failed");
-            DebugSerial->println("Connect Failed");
+            LOG_PRINT(LOG_ERR, "OTA Update Error: Connect Failed");
         } else if (error == OTA_RECEIVE_ERROR) {
-            if (syslogEnabled) syslog.log(LOG_ERR, "OTA Update Error: Receive Failed");
-            DebugSerial->println("Receive Failed");
+            LOG_PRINT(LOG_ERR, "OTA Update Error: Receive Failed");
         } else if (error == OTA_END_ERROR) {
-            if (syslogEnabled) syslog.log(LOG_ERR, "OTA Update Error: End Failed");
-            DebugSerial->println("End Failed");
+            LOG_PRINT(LOG_ERR, "OTA Update Error: End Failed");
         }
     });
     ArduinoOTA.setPassword(otaPassword);
     ArduinoOTA.begin();
-
-    if (syslogEnabled) syslog.log(LOG_INFO, "Loading config");
-
-    strncpy(settings.mqtt_host, custom_mqtt_host->getValue(), MAX_LENGTH_MQTT_HOST);
-    strncpy(settings.mqtt_port, custom_mqtt_port->getValue(), MAX_LENGTH_MQTT_PORT);
-    strncpy(settings.mqtt_username, custom_mqtt_username->getValue(), MAX_LENGTH_MQTT_USERNAME);
-    strncpy(settings.mqtt_password, custom_mqtt_password->getValue(), MAX_LENGTH_MQTT_PASSWORD);
-    strncpy(settings.mqtt_topic_prefix, custom_mqtt_topic_prefix->getValue(), MAX_LENGTH_MQTT_TOPIC_PREFIX);
-    strncpy(settings.syslog_host, custom_syslog_host->getValue(), MAX_LENGTH_SYSLOG_HOST);
-    strncpy(settings.syslog_port, custom_syslog_port->getValue(), MAX_LENGTH_SYSLOG_PORT);
-    strncpy(settings.syslog_device_hostname, custom_syslog_device_hostname->getValue(), MAX_LENGTH_SYSLOG_DEVICE_HOSTNAME);
-    strncpy(settings.syslog_app_name, custom_syslog_app_name->getValue(), MAX_LENGTH_SYSLOG_APP_NAME);
-    strncpy(settings.syslog_log_level, custom_syslog_log_level->getValue(), MAX_LENGTH_SYSLOG_LOG_LEVEL);
+    setupLocalApi();
 
     // Fire up syslog if configured
     if (strncmp(settings.syslog_host, "", MAX_LENGTH_SYSLOG_HOST) != 0) {
-        syslogEnabled = true;
-        syslog.server(settings.syslog_host, atoi(settings.syslog_port));
-        syslog.deviceHostname(settings.syslog_device_hostname);
-        syslog.appName(settings.syslog_app_name);
-        syslog.defaultPriority(LOG_LOCAL0);
+        uint8_t mask;
         if (strncmp(settings.syslog_log_level, "EMERG", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_EMERG));
+            mask = LOG_UPTO(LOG_EMERG);
         } else if (strncmp(settings.syslog_log_level, "ALERT", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_ALERT));
+            mask = LOG_UPTO(LOG_ALERT);
         } else if (strncmp(settings.syslog_log_level, "CRIT", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_CRIT));
-        } else if (strncmp(settings.syslog_log_level, "ERR", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_ERR));
+            mask = LOG_UPTO(LOG_CRIT);
         } else if (strncmp(settings.syslog_log_level, "ERR", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_ERR));
+            mask = LOG_UPTO(LOG_ERR);
         } else if (strncmp(settings.syslog_log_level, "WARNING", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_WARNING));
+            mask = LOG_UPTO(LOG_WARNING);
         } else if (strncmp(settings.syslog_log_level, "NOTICE", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_NOTICE));
+            mask = LOG_UPTO(LOG_NOTICE);
         } else if (strncmp(settings.syslog_log_level, "INFO", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_INFO));
+            mask = LOG_UPTO(LOG_INFO);
         } else if (strncmp(settings.syslog_log_level, "DEBUG", MAX_LENGTH_SYSLOG_LOG_LEVEL) == 0) {
-            syslog.logMask(LOG_UPTO(LOG_DEBUG));
+            mask = LOG_UPTO(LOG_DEBUG);
         } else {
-            syslog.logMask(LOG_UPTO(LOG_WARNING));
+            mask = LOG_UPTO(LOG_WARNING);
         }
+        logSetSyslog(&udpClient, settings.syslog_host, atoi(settings.syslog_port),
+                     settings.syslog_device_hostname, settings.syslog_app_name, mask);
     }
 
     if (shouldSaveConfig) {
         saveConfig();
     }
 
-    snprintf(mqtt_topic_info, 128, "%s/info", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_availability, 128, "%s/availability", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_power_state, 128, "%s/power/state", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_mode_state, 128, "%s/mode/state", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_temperature_state, 128, "%s/temperature/state", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_fan_state, 128, "%s/fan/state", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_vane_state, 128, "%s/vane/state", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_current_temperature_state, 128, "%s/current_temperature/state", settings.mqtt_topic_prefix);
+    formatTopic(mqtt_topic_will, sizeof(mqtt_topic_will), settings.mqtt_topic_prefix, topicSuffix(TOPIC_AVAILABILITY));
+    readSystemBootInfo();
 
-    snprintf(mqtt_topic_power_command, 128, "%s/power/set", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_mode_command, 128, "%s/mode/set", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_temperature_command, 128, "%s/temperature/set", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_fan_command, 128, "%s/fan/set", settings.mqtt_topic_prefix);
-    snprintf(mqtt_topic_vane_command, 128, "%s/vane/set", settings.mqtt_topic_prefix);
+    bridge.begin(settings.mqtt_topic_prefix, settings.mqtt_json_state[0] == '1');
 
-    if (syslogEnabled) syslog.logf(LOG_INFO, "mqttClient.setServer: %s %d", settings.mqtt_host, atoi(settings.mqtt_port));
-    mqttClient.setServer(settings.mqtt_host, atoi(settings.mqtt_port));
+    // On the fast path, go straight to the broker address we resolved last
+    // time; the hostname is used again if that doesn't connect
+    uint32_t brokerHostCrc = ConfigStore::crc32(settings.mqtt_host, strlen(settings.mqtt_host));
+    if (bootFastConnect && connectionCache.broker != 0 && connectionCache.brokerHostCrc == brokerHostCrc) {
+        IPAddress broker(connectionCache.broker);
+        LOG_PRINTF(LOG_INFO, "mqttClient.setServer: %d.%d.%d.%d %d (cached for %s)",
+                   broker[0], broker[1], broker[2], broker[3], atoi(settings.mqtt_port), settings.mqtt_host);
+        mqttClient.setServer(broker, atoi(settings.mqtt_port));
+        mqttBrokerCached = true;
+    } else {
+        LOG_PRINTF(LOG_INFO, "mqttClient.setServer: %s %d", settings.mqtt_host, atoi(settings.mqtt_port));
+        mqttClient.setServer(settings.mqtt_host, atoi(settings.mqtt_port));
+    }
     if (strlen(settings.mqtt_username) > 0) {
-        if (syslogEnabled) syslog.log(LOG_INFO, "mqttClient.setCredentials: xxx xxx");
+        LOG_PRINT(LOG_INFO, "mqttClient.setCredentials: xxx xxx");
         mqttClient.setCredentials(settings.mqtt_username, settings.mqtt_password);
     }
     mqttClient.onMessage(mqttMessage);
     mqttClient.onConnect(mqttConnect);
-    mqttClient.setWill(mqtt_topic_availability, 2, true, "offline");
-    if (syslogEnabled) syslog.log(LOG_INFO, "mqttClient.connect()");
-    mqttClient.connect();
+    mqttClient.onDisconnect(mqttDisconnect);
+    mqttClient.setWill(mqtt_topic_will, 2, true, "offline");
+
+    // From here on mqttTask() connects, and reconnects, to the broker
+    wifiGotIPHandler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP& event) {
+        (void) event;
+        wifiCameUp = true;
+    });
+    wifiDisconnectedHandler = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected& event) {
+        (void) event;
+        wifiWentDown = true;
+    });
+    mqttReconnect.seed(ESP.getChipId() ^ micros());
+    mqttReconnect.networkUp(millis());
+    // Before the first connect, whose boot info names tasks from the stall
+    // record
+    setupScheduler();
+    mqttTask();
 
     heatpump.setOnConnectCallback(heatpumpOnConnectCallback);
-    #ifdef PACKET_DEBUG
     heatpump.setPacketCallback(heatpumpPacketCallback);
-    #endif
     heatpump.setSettingsChangedCallback(heatpumpSettingsChanged);
     heatpump.setStatusChangedCallback(heatpumpStatusChanged);
 
     if (heatPumpDetected) {
-        if (syslogEnabled) syslog.log(LOG_INFO, "Heatpump: DETECTED. Connecting!");
+        LOG_PRINT(LOG_INFO, "Heatpump: DETECTED. Connecting!");
         heatpump.connect(&Serial);
     }
 }
 
-unsigned long lastSystemStatusTime = 0;
+void logTask() {
+    logDrain(millis());
+}
 
-void loop() {
-    if (syslogEnabled) syslog.log(LOG_DEBUG, "ArduinoOTA.handle()");
+void historyTask() {
+    unsigned long now = millis();
+    history.tick(now);
+    if (historyRequested) {
+        historyRequested = false;
+        publishHistory(now);
+    }
+    #ifdef HISTORY_FLASH
+    if (now - historyLastSave >= HISTORY_FLASH_PERIOD_MS) {
+        historyLastSave = now;
+        if (!historyStore.save(history.state(), sizeof(HistoryState))) LOG_PRINT(LOG_ERR, "Error saving history record");
+    }
+    #endif
+}
+
+void localApiTask() {
+    localApi.service(millis());
+    unsigned long stalled = localApi.stats().stalled;
+    if (stalled != localStalled) {
+        LOG_PRINTF(LOG_WARNING, "Dropped %lu stalled local API clients", stalled - localStalled);
+        metrics.increment(metricLocalStalled, stalled - localStalled);
+        localStalled = stalled;
+    }
+    unsigned long forbidden = localApi.stats().forbidden;
+    if (forbidden != localForbidden) {
+        LOG_PRINTF(LOG_WARNING, "Turned away %lu local API requests without the token or from another origin",
+                   forbidden - localForbidden);
+        metrics.increment(metricLocalForbidden, forbidden - localForbidden);
+        localForbidden = forbidden;
+    }
+}
+
+void traceTask() {
+    publishTrace(millis());
+}
+
+void otaTask() {
+    LOG_PRINT(LOG_DEBUG, "ArduinoOTA.handle()");
     ArduinoOTA.handle();
+}
 
-    if (heatPumpDetected) {
-        if (updateHeatpump && millis() - lastHeatpumpSettingsChange > 500) {
-            updateHeatpump = false;
-            if (syslogEnabled) syslog.log(LOG_DEBUG, "heatpump.update()");
+// Checks the commands awaiting confirmation against the unit's settings, as
+// the library has just decoded them
+void checkSettingsReadback(unsigned long now) {
+    settingsReadback = false;
+    bridge.settingsReadback(unitSettings(heatpump.getSettings()), now);
+}
+
+void heatpumpTask() {
+    unsigned long now = millis();
+    unsigned long start = micros();
+    unsigned long firstCommandAt;
+    bool commanded;
+    LinkScheduler& link = bridge.link();
+    unsigned long throttled = link.stats().throttled;
+
+    LinkAction action = bridge.next(now);
+    if (link.stats().throttled != throttled) metrics.increment(metricLinkThrottled);
+    switch (action) {
+        case LINK_WRITE:
+            commanded = bridge.coalescer().pending();
+            firstCommandAt = bridge.coalescer().firstCommandAt();
+            bridge.writing();
+            LOG_PRINT(LOG_DEBUG, "heatpump.update()");
             heatpump.update();
-            delay(100);
-        }
-        if (syslogEnabled) syslog.log(LOG_DEBUG, "heatpump.sync()");
-        heatpump.sync();
+            // Anything read back while update() drained the link predates
+            // the write
+            if (settingsReadback) checkSettingsReadback(now);
+            bridge.wrote(now);
+            metrics.observe(metricUpdateMicros, micros() - start);
+            if (commanded) metrics.observe(metricCommandMillis, millis() - firstCommandAt);
+            metrics.observe(metricLinkQueueMillis, link.lastQueueMillis());
+            metrics.increment(metricLinkWrites);
+            break;
+        case LINK_POLL:
+            LOG_PRINT(LOG_DEBUG, "heatpump.sync() poll");
+            heatpump.sync(bridge.confirming() ? RQST_PKT_SETTINGS : PACKET_TYPE_DEFAULT);
+            bridge.polled(now);
+            metrics.observe(metricSyncMicros, micros() - start);
+            metrics.increment(metricLinkPolls);
+            break;
+        case LINK_READ:
+            heatpump.sync();
+            metrics.observe(metricSyncMicros, micros() - start);
+            break;
+        case LINK_IDLE:
+            break;
+    }
+    if (settingsReadback) checkSettingsReadback(millis());
+    bridge.service(millis());
+}
+
+void statusTask() {
+    LOG_PRINT(LOG_DEBUG, "publishSystemStatus()");
+    publishSystemStatus();
+    publishCoalescerStats();
+    publishTaskStats();
+    publishStalls();
+    publishMetrics();
+}
+
+// Connects to the broker whenever mqttReconnect says to, falling back from a
+// cached broker address that didn't connect to the hostname
+void mqttTask() {
+    unsigned long now = millis();
+    if (wifiWentDown) {
+        wifiWentDown = false;
+        LOG_PRINT(LOG_WARNING, "WiFi disconnected");
+        mqttReconnect.networkDown(now);
     }
+    if (wifiCameUp) {
+        wifiCameUp = false;
+        LOG_PRINT(LOG_INFO, "WiFi connected");
+        mqttReconnect.networkUp(now);
+    }
+    if (!mqttReconnect.shouldConnect(now)) return;
 
-    if (millis() - lastSystemStatusTime > 60000) {
-        lastSystemStatusTime = millis();
-        if (syslogEnabled) syslog.log(LOG_DEBUG, "publishSystemStatus()");
-        publishSystemStatus();
+    if (mqttRetryByName) {
+        LOG_PRINTF(LOG_WARNING, "Cached broker address failed; connecting to %s", settings.mqtt_host);
+        mqttRetryByName = false;
+        mqttBrokerCached = false;
+        mqttClient.setServer(settings.mqtt_host, atoi(settings.mqtt_port));
     }
+    LOG_PRINTF(LOG_INFO, "mqttClient.connect() (attempt %lu)", mqttReconnect.stats().attempts);
+    metrics.increment(metricMqttAttempts);
+    mqttClient.connect();
+}
 
-    #ifdef CLEAR_SETTINGS_PIN
+// Sends what mqttPublish() queued, as the TCP send buffer frees up
+void publishTask() {
+    if (publishQueue.empty() || !mqttClient.connected()) return;
+    publishQueue.drain(millis());
+}
+
+// Finishes off the boot: remembers how we connected once we have
+void connectionTask() {
+    if (mqttHasConnected && !connectionRemembered) {
+        rememberConnection();
+        connectionRemembered = true;
+    }
+}
+
+#ifdef PACKET_CAPTURE
+void captureTask() {
+    if (packetCaptureDumping) publishPacketCapture();
+}
+#endif
+
+#ifdef CLEAR_SETTINGS_PIN
+void clearSettingsButtonTask() {
     handleClearSettingsButton();
+}
+#endif
+
+// Under power save, a task that only looks for work needn't wake loop() more
+// often than POWER_SAVE_POLL_MS
+unsigned long pollPeriod(unsigned long period) {
+    return powerSave.enabled() && period < POWER_SAVE_POLL_MS ? POWER_SAVE_POLL_MS : period;
+}
+
+// A task the scheduler has no room for would never run
+void addTask(const char* name, TaskFunction run, unsigned long period, unsigned long deadline, bool critical) {
+    if (scheduler.add(name, run, period, deadline, critical) < 0) {
+        LOG_PRINTF(LOG_ERR, "No room for the %s task; raise SCHEDULER_MAX_TASKS", name);
+    }
+}
+
+void setupScheduler() {
+    scheduler.setProfiler(&stallProfiler);
+    if (heatPumpDetected) {
+        addTask("heatpump", heatpumpTask, 0, HEATPUMP_TASK_DEADLINE_MS, true);
+    }
+    addTask("log", logTask, 0, LOG_TASK_DEADLINE_MS);
+    addTask("publish", publishTask, pollPeriod(PUBLISH_TASK_PERIOD_MS), PUBLISH_TASK_PERIOD_MS * 10);
+    addTask("trace", traceTask, pollPeriod(TRACE_TASK_PERIOD_MS), 1000);
+    addTask("history", historyTask, HISTORY_TASK_PERIOD_MS, 1000);
+    addTask("ota", otaTask, pollPeriod(OTA_TASK_PERIOD_MS), OTA_TASK_PERIOD_MS * 10);
+    addTask("status", statusTask, STATUS_TASK_PERIOD_MS, 1000);
+    addTask("connection", connectionTask, CONNECTION_TASK_PERIOD_MS, 1000);
+    addTask("mqtt", mqttTask, pollPeriod(MQTT_TASK_PERIOD_MS), 1000);
+    #if LOCAL_API_PORT != 0
+    addTask("local", localApiTask, pollPeriod(LOCAL_API_TASK_PERIOD_MS), 1000);
+    #endif
+    #ifdef PACKET_CAPTURE
+    addTask("capture", captureTask, pollPeriod(CAPTURE_TASK_PERIOD_MS), 1000);
+    #endif
+    #ifdef CLEAR_SETTINGS_PIN
+    addTask("button", clearSettingsButtonTask, pollPeriod(BUTTON_TASK_PERIOD_MS), BUTTON_TASK_PERIOD_MS * 10);
     #endif
 }
+
+// A callback has brought in work: ends the sleep loop() is in, if any
+void wakeLoop() {
+    if (powerSave.wake(micros())) esp_schedule();
+}
+
+// Sleeps until the soonest of the next task, the next thing the CN105 link
+// has to do and the coalesced command flush, unless wakeLoop() ends it sooner
+void sleepUntilDue() {
+    unsigned long now = millis();
+    unsigned long idle = scheduler.idleFor(now);
+    if (heatPumpDetected) {
+        unsigned long link = bridge.idleFor(now);
+        if (link < idle) idle = link;
+    }
+    unsigned long ms = powerSave.sleepFor(idle);
+    if (ms == 0) return;
+    powerSave.sleeping(micros(), ms);
+    esp_delay(ms, []() { return !powerSave.woken(); });
+    powerSave.awake(micros());
+    scheduler.slept(millis());
+    metrics.observe(metricWakeLateMicros, powerSave.stats().lastLateMicros);
+}
+
+void loop() {
+    {
+        StallScope stage(&stallProfiler, STALL_STAGE_LOOP);
+        unsigned long start = micros();
+        scheduler.run();
+        metrics.observe(metricLoopMicros, micros() - start);
+    }
+    // Outside the stage, which would otherwise count the sleep as a stall
+    if (powerSave.enabled()) sleepUntilDue();
+}
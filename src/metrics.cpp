@@ -0,0 +1,115 @@
+#include "metrics.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+// Not every printf that the firmware may be built against handles %llu
+static const char* formatUint64(char* buffer, size_t size, uint64_t value) {
+    char* p = buffer + size - 1;
+    *p = '\0';
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value > 0 && p > buffer);
+    return p;
+}
+
+Metrics::Metrics() : _counterCount(0), _gaugeCount(0), _histogramCount(0), _refused(0) {
+    memset(_counters, 0, sizeof(_counters));
+    memset(_gauges, 0, sizeof(_gauges));
+    memset(_histograms, 0, sizeof(_histograms));
+}
+
+int Metrics::addCounter(const char* name) {
+    if (_counterCount >= METRICS_MAX_COUNTERS || strlen(name) > METRICS_MAX_NAME) {
+        _refused++;
+        return -1;
+    }
+    _counters[_counterCount].name = name;
+    return _counterCount++;
+}
+
+int Metrics::addGauge(const char* name) {
+    if (_gaugeCount >= METRICS_MAX_GAUGES || strlen(name) > METRICS_MAX_NAME) {
+        _refused++;
+        return -1;
+    }
+    _gauges[_gaugeCount].name = name;
+    return _gaugeCount++;
+}
+
+int Metrics::addHistogram(const char* name) {
+    if (_histogramCount >= METRICS_MAX_HISTOGRAMS || strlen(name) > METRICS_MAX_NAME) {
+        _refused++;
+        return -1;
+    }
+    _histograms[_histogramCount].name = name;
+    return _histogramCount++;
+}
+
+void Metrics::increment(int counter, uint32_t by) {
+    if (counter < 0 || counter >= _counterCount) return;
+    _counters[counter].value += by;
+}
+
+void Metrics::set(int gauge, int32_t value) {
+    if (gauge < 0 || gauge >= _gaugeCount) return;
+    _gauges[gauge].value = value;
+}
+
+int Metrics::bucket(uint32_t value) {
+    if (value == 0) return 0;
+    int bucket = 32 - __builtin_clz(value);
+    return bucket < METRICS_HISTOGRAM_BUCKETS ? bucket : METRICS_HISTOGRAM_BUCKETS - 1;
+}
+
+void Metrics::observe(int histogram, uint32_t value) {
+    if (histogram < 0 || histogram >= _histogramCount) return;
+    Histogram& h = _histograms[histogram];
+    h.count++;
+    h.sum += value;
+    if (value > h.max) h.max = value;
+    h.buckets[bucket(value)]++;
+}
+
+// Appends to out at offset, returning 0 from the caller if it doesn't fit
+#define METRICS_APPEND(...) \
+    do { \
+        n = snprintf(out + offset, size - offset, __VA_ARGS__); \
+        if (n < 0 || (size_t) n >= size - offset) return 0; \
+        offset += n; \
+    } while (0)
+
+size_t Metrics::format(char* out, size_t size, unsigned long uptimeSeconds) const {
+    size_t offset = 0;
+    int n;
+
+    METRICS_APPEND("{\"up\":%lu,\"c\":{", uptimeSeconds);
+    for (int i = 0; i < _counterCount; i++) {
+        METRICS_APPEND("%s\"%s\":%lu", i > 0 ? "," : "", _counters[i].name, (unsigned long) _counters[i].value);
+    }
+    METRICS_APPEND("},\"g\":{");
+    for (int i = 0; i < _gaugeCount; i++) {
+        METRICS_APPEND("%s\"%s\":%ld", i > 0 ? "," : "", _gauges[i].name, (long) _gauges[i].value);
+    }
+    METRICS_APPEND("}}");
+    return offset;
+}
+
+size_t Metrics::formatHistogram(int histogram, char* out, size_t size, unsigned long uptimeSeconds) const {
+    if (histogram < 0 || histogram >= _histogramCount) return 0;
+    const Histogram& h = _histograms[histogram];
+    size_t offset = 0;
+    int n;
+    char sum[21];
+
+    METRICS_APPEND("{\"up\":%lu,\"h\":{\"%s\":[%lu,%s,%lu", uptimeSeconds, h.name, (unsigned long) h.count,
+                   formatUint64(sum, sizeof(sum), h.sum), (unsigned long) h.max);
+    int used = METRICS_HISTOGRAM_BUCKETS;
+    while (used > 0 && h.buckets[used - 1] == 0) used--;
+    for (int b = 0; b < used; b++) METRICS_APPEND(",%lu", (unsigned long) h.buckets[b]);
+    METRICS_APPEND("]}}");
+    return offset;
+}
+
+#undef METRICS_APPEND
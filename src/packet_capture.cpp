@@ -0,0 +1,90 @@
+#include "packet_capture.hpp"
+
+#include <string.h>
+
+// pcap is written in little-endian byte order; readers use the magic number
+// to tell which order the file is in
+static inline uint8_t* putUint16(uint8_t* out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static inline uint8_t* putUint32(uint8_t* out, uint32_t value) {
+    out[0] = value & 0xff;
+    out[1] = (value >> 8) & 0xff;
+    out[2] = (value >> 16) & 0xff;
+    out[3] = value >> 24;
+    return out + 4;
+}
+
+PacketCapture::PacketCapture() {
+    clear();
+}
+
+void PacketCapture::record(uint8_t direction, const uint8_t* packet, unsigned int length, unsigned long micros) {
+    CapturedPacket& record = _records[_next];
+    unsigned int kept = length < PACKET_CAPTURE_MAX_PACKET ? length : PACKET_CAPTURE_MAX_PACKET;
+
+    record.micros = micros;
+    record.direction = direction;
+    record.length = length > 0xff ? 0xff : length;
+    memcpy(record.data, packet, kept);
+
+    _next = (_next + 1) % PACKET_CAPTURE_RECORDS;
+    if (_count < PACKET_CAPTURE_RECORDS) {
+        _count++;
+    } else {
+        _overwritten++;
+    }
+    _captured++;
+}
+
+void PacketCapture::clear() {
+    _next = 0;
+    _count = 0;
+    _captured = 0;
+    _overwritten = 0;
+}
+
+// The cursor is 0 before the file header has been written, then one more
+// than the sequence number of the next record to read. Records that were
+// overwritten between chunks are skipped, and records captured since the
+// first chunk are included.
+size_t PacketCapture::read(uint32_t* cursor, uint8_t* out, size_t size) const {
+    uint8_t* p = out;
+    uint8_t* end = out + size;
+    uint32_t oldest = _captured - _count;
+
+    if (size < PCAP_MIN_CHUNK) return 0;
+
+    if (*cursor == 0) {
+        p = putUint32(p, PCAP_MAGIC);
+        p = putUint16(p, PCAP_VERSION_MAJOR);
+        p = putUint16(p, PCAP_VERSION_MINOR);
+        p = putUint32(p, 0);  // thiszone
+        p = putUint32(p, 0);  // sigfigs
+        p = putUint32(p, 1 + PACKET_CAPTURE_MAX_PACKET);  // snaplen
+        p = putUint32(p, PCAP_LINKTYPE_USER0);
+        *cursor = oldest + 1;
+    }
+
+    uint32_t sequence = *cursor - 1 < oldest ? oldest : *cursor - 1;
+    while (sequence < _captured) {
+        // The newest record is at _next - 1
+        const CapturedPacket& record = _records[(_next + PACKET_CAPTURE_RECORDS - (_captured - sequence)) % PACKET_CAPTURE_RECORDS];
+        unsigned int kept = record.length < PACKET_CAPTURE_MAX_PACKET ? record.length : PACKET_CAPTURE_MAX_PACKET;
+        if (p + PCAP_RECORD_HEADER_SIZE + 1 + kept > end) break;
+
+        p = putUint32(p, record.micros / 1000000UL);
+        p = putUint32(p, record.micros % 1000000UL);
+        p = putUint32(p, 1 + kept);
+        p = putUint32(p, 1 + record.length);
+        *p++ = record.direction;
+        memcpy(p, record.data, kept);
+        p += kept;
+        sequence++;
+    }
+    *cursor = sequence + 1;
+    return p - out;
+}
@@ -0,0 +1,103 @@
+#include "payload_assembler.hpp"
+
+#include <string.h>
+
+// FNV-1a: slots are told apart by their topic's hash
+static uint32_t topicHash(const char* topic) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = topic; *c != '\0'; c++) hash = (hash ^ (uint8_t) *c) * 16777619u;
+    return hash;
+}
+
+PayloadAssembler::PayloadAssembler() {
+    memset(_slots, 0, sizeof(_slots));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void PayloadAssembler::reset() {
+    for (int i = 0; i < PAYLOAD_ASSEMBLER_SLOTS; i++) _slots[i].used = false;
+}
+
+PayloadAssembler::Slot* PayloadAssembler::find(uint32_t hash) {
+    for (int i = 0; i < PAYLOAD_ASSEMBLER_SLOTS; i++) {
+        if (_slots[i].used && _slots[i].topicHash == hash) return &_slots[i];
+    }
+    return NULL;
+}
+
+PayloadAssembler::Slot* PayloadAssembler::claim(uint32_t hash, size_t total, bool discarding) {
+    for (int i = 0; i < PAYLOAD_ASSEMBLER_SLOTS; i++) {
+        Slot& slot = _slots[i];
+        if (slot.used) continue;
+        slot.used = true;
+        slot.discarding = discarding;
+        slot.topicHash = hash;
+        slot.total = total;
+        slot.received = 0;
+        return &slot;
+    }
+    return NULL;
+}
+
+AssemblyResult PayloadAssembler::add(const char* topic, const char* payload, size_t len, size_t index, size_t total,
+                                     const char** message, size_t* length) {
+    if (index == 0 && len == total) {
+        // Whole already, which is nearly always: no copy, and no slot. It
+        // still interrupts any message on its topic that wasn't finished,
+        // though the topic is only hashed if one is in progress at all.
+        for (int i = 0; i < PAYLOAD_ASSEMBLER_SLOTS; i++) {
+            if (!_slots[i].used) continue;
+            Slot* stale = find(topicHash(topic));
+            if (stale != NULL) {
+                if (!stale->discarding) _stats.interleaved++;
+                stale->used = false;
+            }
+            break;
+        }
+        _stats.whole++;
+        *message = payload;
+        *length = len;
+        return ASSEMBLY_COMPLETE;
+    }
+
+    uint32_t hash = topicHash(topic);
+    Slot* slot = find(hash);
+    if (index == 0) {
+        if (slot != NULL) {
+            if (!slot->discarding) _stats.interleaved++;
+            slot->used = false;
+        }
+        bool oversize = total > PAYLOAD_ASSEMBLER_SIZE || len > total;
+        if (oversize) _stats.oversize++;
+        slot = claim(hash, total, oversize);
+        if (slot == NULL) {
+            if (!oversize) _stats.noSlot++;
+            return ASSEMBLY_REJECTED;
+        }
+        if (oversize) return ASSEMBLY_REJECTED;
+    } else if (slot == NULL) {
+        // The rest of a message already rejected and counted, or of one
+        // that reset() dropped
+        return ASSEMBLY_REJECTED;
+    }
+
+    if (slot->discarding) {
+        if (index + len >= slot->total) slot->used = false;
+        return ASSEMBLY_REJECTED;
+    }
+    if (index != slot->received || total != slot->total || len > total - index) {
+        _stats.interleaved++;
+        slot->used = false;
+        return ASSEMBLY_REJECTED;
+    }
+
+    memcpy(slot->buffer + index, payload, len);
+    slot->received += len;
+    if (slot->received < slot->total) return ASSEMBLY_PENDING;
+
+    slot->used = false;
+    _stats.assembled++;
+    *message = slot->buffer;
+    *length = slot->total;
+    return ASSEMBLY_COMPLETE;
+}
@@ -0,0 +1,61 @@
+#include "power_save.hpp"
+
+#include <string.h>
+
+PowerSave::PowerSave(PowerSavePolicy policy, unsigned long minSleepMs, unsigned long maxSleepMs) :
+    _policy(policy),
+    _minSleepMs(minSleepMs),
+    _maxSleepMs(maxSleepMs < minSleepMs ? minSleepMs : maxSleepMs),
+    _sleeping(false),
+    _woken(false),
+    _wokenAt(0),
+    _sleptAt(0),
+    _sleepMs(0),
+    _asleepMicros(0),
+    _dutySince(0) {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+unsigned long PowerSave::sleepFor(unsigned long idleMs) const {
+    if (!enabled() || idleMs < _minSleepMs) return 0;
+    return idleMs < _maxSleepMs ? idleMs : _maxSleepMs;
+}
+
+void PowerSave::sleeping(unsigned long nowMicros, unsigned long ms) {
+    _sleptAt = nowMicros;
+    _sleepMs = ms;
+    _woken = false;
+    _sleeping = true;
+}
+
+void PowerSave::awake(unsigned long nowMicros) {
+    if (!_sleeping) return;
+    _sleeping = false;
+    unsigned long slept = nowMicros - _sleptAt;
+    // From when the sleep began to when it should have ended
+    unsigned long due = _woken ? _wokenAt - _sleptAt : _sleepMs * 1000;
+    unsigned long late = slept > due ? slept - due : 0;
+
+    _stats.sleeps++;
+    if (_woken) _stats.woken++;
+    _stats.sleptMicros += slept;
+    _stats.lastLateMicros = late;
+    if (late > _stats.maxLateMicros) _stats.maxLateMicros = late;
+    _asleepMicros += slept;
+}
+
+bool PowerSave::wake(unsigned long nowMicros) {
+    if (!_sleeping || _woken) return false;
+    _wokenAt = nowMicros;
+    _woken = true;
+    return true;
+}
+
+unsigned int PowerSave::dutyCycle(unsigned long nowMicros) {
+    unsigned long elapsed = nowMicros - _dutySince;
+    uint64_t asleep = _asleepMicros < elapsed ? _asleepMicros : elapsed;
+    unsigned int percent = elapsed > 0 ? (unsigned int) (100 - asleep * 100 / elapsed) : 100;
+    _asleepMicros = 0;
+    _dutySince = nowMicros;
+    return percent;
+}
@@ -0,0 +1,116 @@
+#include "publish_queue.hpp"
+
+#include <string.h>
+
+static_assert(PUBLISH_QUEUE_BYTES <= 0xffff, "payload offsets are 16-bit");
+
+PublishQueue::PublishQueue(PublishQueueHost* host) :
+    _host(host),
+    _count(0),
+    _used(0) {
+    memset(_entries, 0, sizeof(_entries));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+uint16_t PublishQueue::publish(PublishPriority priority, StateTopic topic, uint8_t qos, bool retain,
+                               const char* payload, size_t length, unsigned long now) {
+    if (waiting(priority)) drain(now, priority);
+    if (!waiting(priority)) {
+        uint16_t packetId = _host->send(topic, qos, retain, payload, length);
+        if (packetId != 0) return packetId;
+    }
+
+    if (retain) {
+        for (int i = 0; i < _count; i++) {
+            if (_entries[i].topic == topic && _entries[i].retain) {
+                remove(i);
+                _stats.replaced++;
+                break;
+            }
+        }
+    }
+    _stats.queued++;
+    _host->queued(topic);
+    if (!makeRoom(priority, length)) {
+        _stats.dropped++;
+        _host->dropped(topic);
+        return 0;
+    }
+
+    Entry& entry = _entries[_count++];
+    entry.topic = topic;
+    entry.priority = priority;
+    entry.qos = qos;
+    entry.retain = retain;
+    entry.offset = _used;
+    entry.length = length;
+    entry.queuedAt = now;
+    memcpy(_pool + _used, payload, length);
+    _used += length;
+    if (_used > _stats.peakBytes) _stats.peakBytes = _used;
+    return 0;
+}
+
+int PublishQueue::drain(unsigned long now, PublishPriority lowest) {
+    int sent = 0;
+    for (int priority = PUBLISH_STATE; priority <= lowest; priority++) {
+        int i = 0;
+        while (i < _count) {
+            const Entry& entry = _entries[i];
+            if (entry.priority != priority) {
+                i++;
+                continue;
+            }
+            if (_host->send((StateTopic) entry.topic, entry.qos, entry.retain, (const char*) _pool + entry.offset,
+                            entry.length) == 0) {
+                return sent;
+            }
+            StateTopic topic = (StateTopic) entry.topic;
+            unsigned long waited = now - entry.queuedAt;
+            remove(i);
+            sent++;
+            _host->sent(topic, waited);
+        }
+    }
+    return sent;
+}
+
+// Whether anything of this priority or a higher one is queued
+bool PublishQueue::waiting(PublishPriority priority) const {
+    for (int i = 0; i < _count; i++) {
+        if (_entries[i].priority <= priority) return true;
+    }
+    return false;
+}
+
+// Drops publishes until there is an entry and `length` bytes free, oldest
+// and least important first, but none more important than `priority`.
+// Returns false if that isn't enough.
+bool PublishQueue::makeRoom(PublishPriority priority, size_t length) {
+    if (length > PUBLISH_QUEUE_BYTES) return false;
+    while (_count == PUBLISH_QUEUE_ENTRIES || _used + length > PUBLISH_QUEUE_BYTES) {
+        int victim = 0;
+        for (int i = 1; i < _count; i++) {
+            if (_entries[i].priority > _entries[victim].priority) victim = i;
+        }
+        if (_entries[victim].priority < priority) return false;
+        StateTopic topic = (StateTopic) _entries[victim].topic;
+        remove(victim);
+        _stats.dropped++;
+        _host->dropped(topic);
+    }
+    return true;
+}
+
+// Closes up the entry's payload in the pool, and the entry in the table
+void PublishQueue::remove(int index) {
+    size_t offset = _entries[index].offset;
+    size_t length = _entries[index].length;
+    memmove(_pool + offset, _pool + offset + length, _used - offset - length);
+    _used -= length;
+    for (int i = index + 1; i < _count; i++) {
+        _entries[i].offset -= length;
+    }
+    memmove(&_entries[index], &_entries[index + 1], (_count - index - 1) * sizeof(Entry));
+    _count--;
+}
@@ -0,0 +1,109 @@
+#include "reconnect_manager.hpp"
+
+#include <string.h>
+
+ReconnectManager::ReconnectManager(unsigned long baseMs, unsigned long capMs, bool jitter) :
+    _baseMs(baseMs > 0 ? baseMs : 1),
+    _capMs(capMs > baseMs ? capMs : baseMs),
+    _jitter(jitter),
+    _state(RECONNECT_OFFLINE),
+    _networkUp(false),
+    _hasConnected(false),
+    _down(false),
+    _failures(0),
+    _waitStart(0),
+    _wait(0),
+    _downSince(0),
+    _random(0x2545f491) {
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void ReconnectManager::seed(uint32_t seed) {
+    // xorshift never leaves zero
+    _random = seed != 0 ? seed : 0x2545f491;
+}
+
+uint32_t ReconnectManager::random() {
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random;
+}
+
+// Waits a random time within the window for the number of failures so far
+void ReconnectManager::schedule(unsigned long now) {
+    unsigned long window = _baseMs;
+    for (unsigned int i = 0; i < _failures && window < _capMs; i++) window *= 2;
+    if (window > _capMs) window = _capMs;
+    _wait = _jitter ? random() % (window + 1) : window;
+    _waitStart = now;
+    _state = RECONNECT_WAITING;
+}
+
+void ReconnectManager::wentDown(unsigned long now) {
+    if (_down) return;
+    _down = true;
+    _downSince = now;
+    _stats.disconnects++;
+}
+
+void ReconnectManager::networkUp(unsigned long now) {
+    if (_networkUp) return;
+    _networkUp = true;
+    _failures = 0;
+    if (!_hasConnected && _stats.attempts == 0) {
+        // Boot: nothing to spread out from yet
+        _state = RECONNECT_WAITING;
+        _waitStart = now;
+        _wait = 0;
+    } else {
+        schedule(now);
+    }
+}
+
+void ReconnectManager::networkDown(unsigned long now) {
+    _networkUp = false;
+    if (_state == RECONNECT_CONNECTED) wentDown(now);
+    _state = RECONNECT_OFFLINE;
+}
+
+void ReconnectManager::connected(unsigned long now) {
+    if (_down) {
+        unsigned long down = now - _downSince;
+        _stats.downMillis += down;
+        if (down > _stats.longestDownMillis) _stats.longestDownMillis = down;
+        _stats.reconnects++;
+        _down = false;
+    }
+    _hasConnected = true;
+    _failures = 0;
+    _state = RECONNECT_CONNECTED;
+}
+
+void ReconnectManager::disconnected(unsigned long now) {
+    switch (_state) {
+        case RECONNECT_CONNECTED:
+            wentDown(now);
+            _failures = 0;
+            schedule(now);
+            break;
+        case RECONNECT_CONNECTING:
+            _failures++;
+            schedule(now);
+            break;
+        default:
+            // Already waiting, or offline until the network is back
+            break;
+    }
+}
+
+bool ReconnectManager::shouldConnect(unsigned long now) {
+    if (_state != RECONNECT_WAITING || now - _waitStart < _wait) return false;
+    _state = RECONNECT_CONNECTING;
+    _stats.attempts++;
+    return true;
+}
+
+unsigned long ReconnectManager::downFor(unsigned long now) const {
+    return _down ? now - _downSince : 0;
+}
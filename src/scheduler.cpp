@@ -0,0 +1,81 @@
+#include "scheduler.hpp"
+
+#include <Arduino.h>
+#include <string.h>
+
+Scheduler::Scheduler() : _taskCount(0), _profiler(NULL) {
+    memset(_tasks, 0, sizeof(_tasks));
+}
+
+int Scheduler::add(const char* name, TaskFunction run, unsigned long period, unsigned long deadline, bool critical) {
+    if (_taskCount >= SCHEDULER_MAX_TASKS) return -1;
+
+    Task& task = _tasks[_taskCount];
+    memset(&task, 0, sizeof(task));
+    task.name = name;
+    task.run = run;
+    task.period = period;
+    task.deadline = deadline;
+    task.critical = critical;
+    task.nextRun = millis() + period;
+    return _taskCount++;
+}
+
+bool Scheduler::due(const Task& task, unsigned long now) const {
+    return (long) (now - task.nextRun) >= 0;
+}
+
+void Scheduler::runTask(Task& task, unsigned long now) {
+    if ((long) (now - task.nextRun) > (long) task.deadline) task.misses++;
+
+    unsigned long start = micros();
+    {
+        StallScope stage(_profiler, &task - _tasks);
+        task.run();
+    }
+    unsigned long elapsed = micros() - start;
+
+    task.runs++;
+    task.lastMicros = elapsed;
+    task.totalMicros += elapsed;
+    if (elapsed > task.maxMicros) task.maxMicros = elapsed;
+
+    // Stay on the original cadence unless we've fallen a whole period behind
+    task.nextRun += task.period;
+    if ((long) (now - task.nextRun) >= 0) task.nextRun = now + task.period;
+}
+
+void Scheduler::runCritical(int except) {
+    for (int i = 0; i < _taskCount; i++) {
+        if (i == except || !_tasks[i].critical) continue;
+        unsigned long now = millis();
+        if (due(_tasks[i], now)) runTask(_tasks[i], now);
+    }
+}
+
+void Scheduler::run() {
+    for (int i = 0; i < _taskCount; i++) {
+        Task& task = _tasks[i];
+        unsigned long now = millis();
+        if (!due(task, now)) continue;
+        runTask(task, now);
+        if (!task.critical) runCritical(i);
+    }
+}
+
+void Scheduler::slept(unsigned long now) {
+    for (int i = 0; i < _taskCount; i++) {
+        if (_tasks[i].period == 0) _tasks[i].nextRun = now;
+    }
+}
+
+unsigned long Scheduler::idleFor(unsigned long now) const {
+    unsigned long idle = (unsigned long) -1;
+    for (int i = 0; i < _taskCount; i++) {
+        if (_tasks[i].period == 0) continue;
+        long wait = (long) (_tasks[i].nextRun - now);
+        if (wait <= 0) return 0;
+        if ((unsigned long) wait < idle) idle = wait;
+    }
+    return idle;
+}
@@ -0,0 +1,14 @@
+#include "scratch.hpp"
+
+ScratchArena::ScratchArena() : _used(0), _highWater(0), _overflows(0) {}
+
+char* ScratchArena::allocate(size_t size) {
+    size_t start = (_used + SCRATCH_ALIGNMENT - 1) & ~(size_t) (SCRATCH_ALIGNMENT - 1);
+    if (start > SCRATCH_ARENA_SIZE || size > SCRATCH_ARENA_SIZE - start) {
+        _overflows++;
+        return NULL;
+    }
+    _used = start + size;
+    if (_used > _highWater) _highWater = _used;
+    return _buffer + start;
+}
@@ -0,0 +1,141 @@
+#include "stall_profiler.hpp"
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <string.h>
+
+static_assert(sizeof(StallRecord) % 4 == 0, "the record is whole RTC blocks");
+static_assert(sizeof(StallBreadcrumb) == 8, "a breadcrumb is two RTC blocks");
+
+#define WORDS(bytes) ((bytes) / 4)
+#define WORD_OFFSET(field) (STALL_RTC_OFFSET + WORDS(offsetof(StallRecord, field)))
+
+static const char* const STAGE_NAMES[STALL_STAGE_END - STALL_STAGE_LOOP] = {
+    "loop",
+    "mqttConnect",
+    "mqttDisconnect",
+    "mqttMessage",
+    "heatpumpOnConnect",
+    "heatpumpPacket",
+    "heatpumpSettingsChanged",
+    "heatpumpStatusChanged",
+    "otaStart",
+    "otaProgress",
+    "otaEnd",
+    "otaError",
+    "localData",
+    "localAck"
+};
+
+StallProfiler::StallProfiler(StallProfilerHost* host) :
+    _host(host),
+    _depth(0),
+    _culprit(STALL_NONE),
+    _culpritMicros(0),
+    _slowestCount(0) {
+    memset(&_record, 0, sizeof(_record));
+    memset(&_previous, 0, sizeof(_previous));
+    memset(_frames, 0, sizeof(_frames));
+    memset(_slowest, 0, sizeof(_slowest));
+    memset(&_stats, 0, sizeof(_stats));
+    _record.magic = STALL_RECORD_MAGIC;
+    memset(_record.open, STALL_NONE, sizeof(_record.open));
+    memset(_previous.open, STALL_NONE, sizeof(_previous.open));
+}
+
+bool StallProfiler::restore() {
+    bool restored = _host->read(STALL_RTC_OFFSET, (uint32_t*) &_previous, WORDS(sizeof(_previous))) &&
+                    _previous.magic == STALL_RECORD_MAGIC;
+    if (!restored) {
+        memset(&_previous, 0, sizeof(_previous));
+        memset(_previous.open, STALL_NONE, sizeof(_previous.open));
+    }
+    _host->write(STALL_RTC_OFFSET, (const uint32_t*) &_record, WORDS(sizeof(_record)));
+    return restored;
+}
+
+const char* StallProfiler::stageName(uint8_t stage) {
+    if (stage < STALL_STAGE_LOOP || stage >= STALL_STAGE_END) return NULL;
+    return STAGE_NAMES[stage - STALL_STAGE_LOOP];
+}
+
+// The open stages and when the innermost was entered, two words together
+void StallProfiler::writeOpen() {
+    _host->write(WORD_OFFSET(open), (const uint32_t*) _record.open, 2);
+}
+
+void StallProfiler::enter(uint8_t stage) {
+    if (_depth >= STALL_MAX_DEPTH) {
+        _depth++;
+        _stats.tooDeep++;
+        return;
+    }
+    Frame& frame = _frames[_depth];
+    frame.stage = stage;
+    frame.enteredMicros = micros();
+    frame.enteredMillis = millis();
+    frame.nestedMicros = 0;
+    _record.open[_depth] = stage;
+    _record.openedAt = frame.enteredMillis;
+    _depth++;
+    writeOpen();
+}
+
+void StallProfiler::exit() {
+    if (_depth == 0) return;
+    _depth--;
+    if (_depth >= STALL_MAX_DEPTH) return;
+
+    Frame& frame = _frames[_depth];
+    unsigned long elapsed = micros() - frame.enteredMicros;
+    unsigned long own = elapsed > frame.nestedMicros ? elapsed - frame.nestedMicros : 0;
+    uint8_t parent = _depth > 0 ? _frames[_depth - 1].stage : STALL_NONE;
+    if (_depth > 0) _frames[_depth - 1].nestedMicros += elapsed;
+
+    _record.open[_depth] = STALL_NONE;
+    _record.openedAt = _depth > 0 ? _frames[_depth - 1].enteredMillis : 0;
+    writeOpen();
+
+    if (own > _culpritMicros || _culprit == STALL_NONE) {
+        _culprit = frame.stage;
+        _culpritMicros = own;
+    }
+    uint32_t now = millis();
+    if (own >= STALL_SLOW_US) breadcrumb(frame.stage, parent, own, now);
+    if (_depth == 0) endSpan(frame.stage, elapsed, now);
+}
+
+void StallProfiler::breadcrumb(uint8_t stage, uint8_t parent, unsigned long micros, uint32_t now) {
+    int index = _record.count % STALL_BREADCRUMBS;
+    StallBreadcrumb& crumb = _record.crumbs[index];
+    crumb.endedAt = now;
+    crumb.stage = stage;
+    crumb.parent = parent;
+    crumb.millis = micros / 1000 > 0xffff ? 0xffff : micros / 1000;
+    _record.count++;
+    _host->write(WORD_OFFSET(crumbs) + index * WORDS(sizeof(StallBreadcrumb)), (const uint32_t*) &crumb,
+                 WORDS(sizeof(StallBreadcrumb)));
+    _host->write(WORD_OFFSET(count), &_record.count, 1);
+}
+
+// Keeps the span if it is among the slowest, which stay sorted
+void StallProfiler::endSpan(uint8_t stage, unsigned long micros, uint32_t now) {
+    _stats.spans++;
+    if (micros >= STALL_SLOW_US) _stats.slow++;
+
+    int at = _slowestCount;
+    while (at > 0 && _slowest[at - 1].micros < micros) at--;
+    if (at < STALL_SLOWEST) {
+        int last = _slowestCount < STALL_SLOWEST ? _slowestCount : STALL_SLOWEST - 1;
+        memmove(&_slowest[at + 1], &_slowest[at], (last - at) * sizeof(StallSpan));
+        StallSpan& span = _slowest[at];
+        span.stage = stage;
+        span.micros = micros;
+        span.culprit = _culprit;
+        span.culpritMicros = _culpritMicros;
+        span.endedAt = now;
+        if (_slowestCount < STALL_SLOWEST) _slowestCount++;
+    }
+    _culprit = STALL_NONE;
+    _culpritMicros = 0;
+}
@@ -0,0 +1,90 @@
+#include "temperature.hpp"
+
+int temperatureFromFloat(float degrees) {
+    return (int) (degrees * 10 + (degrees < 0 ? -0.5f : 0.5f));
+}
+
+bool parseTemperature(const char* text, size_t length, int* tenths) {
+    size_t i = 0;
+    bool negative = false;
+    int whole = 0;
+    int fraction = 0;
+    size_t digits = 0;
+
+    if (i < length && text[i] == '-') {
+        negative = true;
+        i++;
+    }
+    while (i < length && text[i] >= '0' && text[i] <= '9' && digits < 3) {
+        whole = whole * 10 + (text[i++] - '0');
+        digits++;
+    }
+    if (digits == 0) return false;
+    if (i < length && text[i] == '.') {
+        i++;
+        if (i < length && text[i] >= '0' && text[i] <= '9') fraction = text[i++] - '0';
+        while (i < length && text[i] >= '0' && text[i] <= '9') i++;
+    }
+    if (i != length) return false;
+
+    *tenths = negative ? -(whole * 10 + fraction) : whole * 10 + fraction;
+    return true;
+}
+
+size_t formatTemperature(char* out, int tenths) {
+    char digits[TEMPERATURE_MAX_FORMATTED];
+    size_t length = 0;
+    unsigned int value = tenths < 0 ? -tenths : tenths;
+    unsigned int whole = value / 10;
+    unsigned int fraction = value % 10;
+
+    // Whole degrees, backwards
+    char* p = digits + sizeof(digits);
+    do {
+        *--p = '0' + whole % 10;
+        whole /= 10;
+    } while (whole > 0 && p > digits + 1);
+    if (tenths < 0 && p > digits) *--p = '-';
+
+    while (p < digits + sizeof(digits)) out[length++] = *p++;
+    if (fraction != 0 && length + 2 < TEMPERATURE_MAX_FORMATTED) {
+        out[length++] = '.';
+        out[length++] = '0' + fraction;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+TemperatureHysteresis::TemperatureHysteresis(int hysteresis, unsigned long minIntervalMs, unsigned long smallChangeMs) :
+    _hysteresis(hysteresis),
+    _minIntervalMs(minIntervalMs),
+    _smallChangeMs(smallChangeMs),
+    _hasReading(false),
+    _hasPublished(false),
+    _current(0),
+    _published(0),
+    _publishedAt(0),
+    _suppressed(0) {}
+
+void TemperatureHysteresis::reading(int tenths) {
+    if (_hasReading && _hasPublished && _current != _published && tenths != _current) _suppressed++;
+    _current = tenths;
+    _hasReading = true;
+}
+
+bool TemperatureHysteresis::shouldPublish(unsigned long now) const {
+    if (!_hasReading) return false;
+    if (!_hasPublished) return true;
+    if (_current == _published) return false;
+
+    unsigned long elapsed = now - _publishedAt;
+    if (elapsed < _minIntervalMs) return false;
+    int change = _current > _published ? _current - _published : _published - _current;
+    return change >= _hysteresis || elapsed >= _smallChangeMs;
+}
+
+void TemperatureHysteresis::published(unsigned long now) {
+    _published = _current;
+    _publishedAt = now;
+    _hasPublished = true;
+}
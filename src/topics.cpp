@@ -0,0 +1,40 @@
+#include "topics.hpp"
+
+#include <string.h>
+
+// Indexed by StateTopic
+static const char* const SUFFIXES[] = {
+    "info",
+    "coalescer",
+    "tasks",
+    "capture",
+    "trace",
+    "history",
+    "stalls",
+    "metrics",
+    "confirmation",
+    "availability",
+    "state",
+    "power/state",
+    "mode/state",
+    "temperature/state",
+    "fan/state",
+    "vane/state",
+    "current_temperature/state",
+};
+static_assert(sizeof(SUFFIXES) / sizeof(SUFFIXES[0]) == TOPIC_COUNT, "one suffix per StateTopic");
+
+const char* topicSuffix(StateTopic topic) {
+    return topic < TOPIC_COUNT ? SUFFIXES[topic] : "";
+}
+
+size_t formatTopic(char* out, size_t size, const char* prefix, const char* suffix) {
+    size_t prefixLength = strlen(prefix);
+    size_t suffixLength = strlen(suffix);
+    size_t length = prefixLength + 1 + suffixLength;
+    if (length >= size) return 0;
+    memcpy(out, prefix, prefixLength);
+    out[prefixLength] = '/';
+    memcpy(out + prefixLength + 1, suffix, suffixLength + 1);
+    return length;
+}
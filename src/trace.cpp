@@ -0,0 +1,119 @@
+#include "trace.hpp"
+
+#include <Arduino.h>
+
+// Records are stored back to back and may wrap around the end of the
+// buffer. Positions only ever increase; they are reduced modulo the buffer
+// size when used. The tail is the oldest record still in the buffer, and
+// sequence numbers count records from boot.
+
+static uint8_t traceBuffer[TRACE_BUFFER_SIZE];
+static uint32_t traceHead = 0;
+static uint32_t traceTail = 0;
+static uint32_t headSequence = 0;
+static uint32_t tailSequence = 0;
+static TraceStats stats;
+
+static inline void putWord(uint8_t* out, uint32_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+void traceBegin(TraceRecord& record, uint32_t id) {
+    putWord(record.bytes + 1, micros());
+    putWord(record.bytes + 5, id);
+    record.size = TRACE_HEADER_SIZE;
+    record.truncated = false;
+}
+
+void tracePut(TraceRecord& record, uint32_t value) {
+    if (record.size + 4 > TRACE_MAX_RECORD) {
+        record.truncated = true;
+        return;
+    }
+    putWord(record.bytes + record.size, value);
+    record.size += 4;
+}
+
+void tracePutString(TraceRecord& record, const char* value) {
+    if (record.size + 1 > TRACE_MAX_RECORD) {
+        record.truncated = true;
+        return;
+    }
+    size_t length = value != NULL ? strnlen(value, TRACE_MAX_STRING) : 0;
+    size_t room = TRACE_MAX_RECORD - record.size - 1;
+    if (length > room) {
+        length = room;
+        record.truncated = true;
+    }
+    record.bytes[record.size] = length;
+    memcpy(record.bytes + record.size + 1, value, length);
+    record.size += 1 + length;
+}
+
+void traceCommit(TraceRecord& record) {
+    uint32_t size = record.size;
+    record.bytes[0] = size;
+    while (traceHead + size - traceTail > TRACE_BUFFER_SIZE) {
+        traceTail += traceBuffer[traceTail % TRACE_BUFFER_SIZE];
+        tailSequence++;
+        stats.overwritten++;
+    }
+
+    uint32_t start = traceHead % TRACE_BUFFER_SIZE;
+    uint32_t first = size < TRACE_BUFFER_SIZE - start ? size : TRACE_BUFFER_SIZE - start;
+    memcpy(traceBuffer + start, record.bytes, first);
+    memcpy(traceBuffer, record.bytes + first, size - first);
+    traceHead += size;
+    headSequence++;
+    stats.records++;
+    if (record.truncated) stats.truncated++;
+}
+
+// Copies length bytes out of the ring, which may be in two pieces
+static void copyOut(uint32_t position, uint8_t* out, uint32_t length) {
+    uint32_t start = position % TRACE_BUFFER_SIZE;
+    uint32_t first = length < TRACE_BUFFER_SIZE - start ? length : TRACE_BUFFER_SIZE - start;
+    memcpy(out, traceBuffer + start, first);
+    memcpy(out + first, traceBuffer, length - first);
+}
+
+size_t traceRead(TraceCursor* cursor, uint8_t* out, size_t size) {
+    uint32_t dropped = 0;
+    if ((int32_t) (tailSequence - cursor->sequence) > 0) {
+        dropped = tailSequence - cursor->sequence;
+        cursor->position = traceTail;
+        cursor->sequence = tailSequence;
+    }
+    if (cursor->position == traceHead || size < TRACE_MIN_CHUNK) return 0;
+
+    TraceRecord chunk;
+    traceBegin(chunk, TRACE_ID_CHUNK);
+    tracePut(chunk, cursor->sequence);
+    tracePut(chunk, dropped);
+    chunk.bytes[0] = chunk.size;
+    memcpy(out, chunk.bytes, chunk.size);
+    size_t used = chunk.size;
+
+    while (cursor->position != traceHead) {
+        uint32_t length = traceBuffer[cursor->position % TRACE_BUFFER_SIZE];
+        if (used + length > size) break;
+        copyOut(cursor->position, out + used, length);
+        used += length;
+        cursor->position += length;
+        cursor->sequence++;
+    }
+    cursor->dropped += dropped;
+    return used;
+}
+
+uint32_t tracePending(const TraceCursor& cursor) {
+    if ((int32_t) (tailSequence - cursor.sequence) > 0) return traceHead - traceTail;
+    return traceHead - cursor.position;
+}
+
+const TraceStats& traceStats() {
+    return stats;
+}
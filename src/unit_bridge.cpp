@@ -0,0 +1,235 @@
+#include "unit_bridge.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+UnitBridge::UnitBridge(UnitBridgeHost* host, ScratchArena* scratch) :
+    _host(host),
+    _scratch(scratch),
+    _prefix(""),
+    _jsonState(false),
+    _retryPending(false),
+    _coalescer(COALESCE_MIN_MS, COALESCE_MAX_MS, COALESCE_IDLE_MS),
+    _link(LINK_POLL_IDLE_MS, LINK_POLL_FAST_MS, LINK_POLL_BOOST_MS, LINK_WRITE_BURST, LINK_WRITE_REFILL_MS),
+    _tracker(COMMAND_CONFIRM_TIMEOUT_MS, COMMAND_CONFIRM_ATTEMPTS),
+    _roomTemperature(ROOM_TEMPERATURE_HYSTERESIS, ROOM_TEMPERATURE_MIN_INTERVAL_MS, ROOM_TEMPERATURE_SMALL_CHANGE_MS) {
+    memset(&_published, 0, sizeof(_published));
+}
+
+void UnitBridge::begin(const char* prefix, bool jsonState) {
+    _prefix = prefix;
+    _jsonState = jsonState;
+    _router.begin(prefix);
+}
+
+MessageResult UnitBridge::message(const char* topic, const char* payload, size_t len, unsigned long now, Command* command) {
+    CommandTopic routed = _router.route(topic);
+    if (routed == COMMAND_SET) return batch(payload, len, now, command);
+    if (routed == COMMAND_HISTORY) {
+        command->topic = routed;
+        command->name = NULL;
+        command->value = 0;
+        return MESSAGE_OTHER;
+    }
+    if (!CommandRouter::parseValue(routed, payload, len, command)) {
+        return command->topic == COMMAND_NONE ? MESSAGE_IGNORED : MESSAGE_INVALID;
+    }
+    if (command->topic < COMMAND_POWER || command->topic > COMMAND_VANE) return MESSAGE_OTHER;
+
+    _host->apply(*command);
+    _tracker.commanded(*command, now);
+    _coalescer.commandReceived(now);
+    return MESSAGE_COMMAND;
+}
+
+// Every field is validated before any is applied, and the batch counts as
+// one command to the coalescer, so the fields go out in the same write
+MessageResult UnitBridge::batch(const char* payload, size_t len, unsigned long now, Command* command) {
+    CommandBatch batch;
+    command->topic = COMMAND_SET;
+    command->name = NULL;
+    command->value = 0;
+    if (!CommandRouter::parseBatch(payload, len, &batch)) return MESSAGE_INVALID;
+
+    for (int i = 0; i < COMMAND_BATCH_FIELDS; i++) {
+        if (!(batch.fields & (1 << i))) continue;
+        _host->apply(batch.commands[i]);
+        _tracker.commanded(batch.commands[i], now);
+    }
+    _coalescer.commandReceived(now);
+    command->value = batch.fields;
+    return MESSAGE_COMMAND;
+}
+
+void UnitBridge::mqttConnected() {
+    memset(&_published, 0, sizeof(_published));
+    _roomTemperature.reset();
+    publishConfirmation();
+}
+
+// Publishes a retained state value, unless it's the value we last published
+// to that topic. Returns true if the value changed; only tracks it if publish
+// is false.
+bool UnitBridge::publishStateIfChanged(StateTopic topic, bool publish, char* published, const char* value) {
+    if (strncmp(published, value, MAX_LENGTH_PUBLISHED_VALUE) == 0) return false;
+    strncpy(published, value, MAX_LENGTH_PUBLISHED_VALUE - 1);
+    published[MAX_LENGTH_PUBLISHED_VALUE - 1] = '\0';
+    if (publish) _host->publish(topic, 0, true, value, strlen(value));
+    return true;
+}
+
+void UnitBridge::settingsChanged(const UnitSettings& settings) {
+    char temperature[TEMPERATURE_MAX_FORMATTED];
+    bool changed = false;
+    const char* mode = strcmp(settings.power, "ON") == 0 ? settings.mode : "OFF";
+    formatTemperature(temperature, settings.temperature);
+
+    // In JSON mode the per-field values are only tracked, and one snapshot of
+    // all of them goes out if any changed
+    changed |= publishStateIfChanged(TOPIC_POWER_STATE, !_jsonState, _published.power, settings.power);
+    changed |= publishStateIfChanged(TOPIC_MODE_STATE, !_jsonState, _published.mode, mode);
+    changed |= publishStateIfChanged(TOPIC_TEMPERATURE_STATE, !_jsonState, _published.temperature, temperature);
+    changed |= publishStateIfChanged(TOPIC_FAN_STATE, !_jsonState, _published.fan, settings.fan);
+    changed |= publishStateIfChanged(TOPIC_VANE_STATE, !_jsonState, _published.vane, settings.vane);
+
+    if (_jsonState && changed) {
+        ScratchScope scope(*_scratch);
+        char* buffer = _scratch->allocate(STATE_PAYLOAD_SIZE);
+        if (buffer == NULL) return;
+        int length = snprintf(buffer, STATE_PAYLOAD_SIZE,
+                              "{\"power\":\"%s\",\"mode\":\"%s\",\"temperature\":%s,\"fan\":\"%s\",\"vane\":\"%s\"}",
+                              settings.power, mode, temperature, settings.fan, settings.vane);
+        if (length >= STATE_PAYLOAD_SIZE) return;
+        _host->publish(TOPIC_STATE, 0, true, buffer, length);
+    }
+}
+
+void UnitBridge::settingsReadback(const UnitSettings& settings, unsigned long now) {
+    Command actual[TRACKED_FIELDS];
+    const char* values[TRACKED_FIELDS] = { settings.power, settings.mode, NULL, settings.fan, settings.vane };
+
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        CommandTopic topic = (CommandTopic) (COMMAND_POWER + i);
+        if (topic == COMMAND_TEMPERATURE) {
+            actual[i].topic = topic;
+            actual[i].value = 0;
+            actual[i].name = NULL;
+            actual[i].temperature = settings.temperature;
+        } else if (values[i] == NULL || !CommandRouter::parseValue(topic, values[i], strlen(values[i]), &actual[i])) {
+            actual[i].topic = COMMAND_NONE;
+        }
+    }
+
+    unsigned int confirmed = _tracker.readback(actual, now);
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        if (confirmed & (1 << i)) _host->confirmed(_tracker.field(i));
+    }
+}
+
+void UnitBridge::roomTemperature(int tenths, unsigned long now) {
+    _roomTemperature.reading(tenths);
+    publishRoomTemperature(now);
+}
+
+// Publishes the room temperature if TemperatureHysteresis says it's worth it.
+// Called on every reading and from service(), which picks up a small change
+// once it has waited long enough.
+void UnitBridge::publishRoomTemperature(unsigned long now) {
+    if (!_roomTemperature.shouldPublish(now)) return;
+    char temperature[TEMPERATURE_MAX_FORMATTED];
+    size_t length = formatTemperature(temperature, _roomTemperature.current());
+    _host->publish(TOPIC_CURRENT_TEMPERATURE_STATE, 0, true, temperature, length);
+    // Even if that failed: mqttConnected() resets the hysteresis
+    _roomTemperature.published(now);
+}
+
+// Retries go out as soon as the link allows, without coalescing
+LinkAction UnitBridge::next(unsigned long now) {
+    return _link.next(now, _coalescer.pending() || _retryPending, _coalescer.shouldFlush(now) || _retryPending);
+}
+
+// Once the commands are ready, it's up to the link when they go
+unsigned long UnitBridge::idleFor(unsigned long now) const {
+    bool ready = _coalescer.shouldFlush(now) || _retryPending;
+    unsigned long idle = _link.idleFor(now, _coalescer.pending() || _retryPending, ready);
+    unsigned long flush = ready ? (unsigned long) -1 : _coalescer.flushIn(now);
+    return flush < idle ? flush : idle;
+}
+
+void UnitBridge::writing() {
+    _coalescer.flushed();
+    _retryPending = false;
+}
+
+void UnitBridge::wrote(unsigned long now) {
+    _tracker.wrote(now);
+    _link.wrote(now);
+}
+
+void UnitBridge::polled(unsigned long now) {
+    _link.polled(now);
+}
+
+void UnitBridge::service(unsigned long now) {
+    retryUnconfirmed(now);
+    if (_tracker.takeChanged()) publishConfirmation();
+    publishRoomTemperature(now);
+}
+
+// Hands unconfirmed commands to the link again once their confirmation is
+// overdue
+void UnitBridge::retryUnconfirmed(unsigned long now) {
+    unsigned int diverged;
+    unsigned int due = _tracker.retriesDue(now, &diverged);
+    for (int i = 0; i < TRACKED_FIELDS; i++) {
+        const TrackedField& field = _tracker.field(i);
+        if (due & (1 << i)) {
+            _host->retrying(field);
+            _host->apply(field.commanded);
+            _retryPending = true;
+        }
+        if (diverged & (1 << i)) _host->diverged(field);
+    }
+}
+
+// Formats a tracked command value as JSON: "ON", 22.5..., or null if there
+// isn't one. Temperatures are numbers, as in the JSON state.
+static void formatTrackedValue(char* out, size_t size, const Command& command) {
+    char temperature[TEMPERATURE_MAX_FORMATTED];
+    if (command.topic == COMMAND_TEMPERATURE) {
+        formatTemperature(temperature, command.temperature);
+        snprintf(out, size, "%s", temperature);
+    } else if (command.topic != COMMAND_NONE && command.name != NULL) {
+        snprintf(out, size, "\"%s\"", command.name);
+    } else {
+        snprintf(out, size, "null");
+    }
+}
+
+// Publishes, retained, what each field was last commanded to against what
+// the unit last reported, and how long confirmations took
+void UnitBridge::publishConfirmation() {
+    ScratchScope scope(*_scratch);
+    char* buffer = _scratch->allocate(CONFIRMATION_PAYLOAD_SIZE);
+    if (buffer == NULL) return;
+    char commanded[TEMPERATURE_MAX_FORMATTED + 2];
+    char actual[TEMPERATURE_MAX_FORMATTED + 2];
+    int offset = snprintf(buffer, CONFIRMATION_PAYLOAD_SIZE, "{");
+
+    for (int i = 0; i < TRACKED_FIELDS && offset < CONFIRMATION_PAYLOAD_SIZE; i++) {
+        const TrackedField& field = _tracker.field(i);
+        formatTrackedValue(commanded, sizeof(commanded), field.state == TRACK_IDLE ? Command() : field.commanded);
+        formatTrackedValue(actual, sizeof(actual), field.actual);
+        offset += snprintf(buffer + offset, CONFIRMATION_PAYLOAD_SIZE - offset,
+                           "\"%s\":{\"state\":\"%s\",\"commanded\":%s,\"actual\":%s,\"attempts\":%u,\"last_ms\":%lu,\"max_ms\":%lu},",
+                           CommandRouter::topicName((CommandTopic) (COMMAND_POWER + i)), CommandTracker::stateName(field.state),
+                           commanded, actual, field.attempts, field.lastConfirmMillis, field.maxConfirmMillis);
+    }
+    const TrackerStats& stats = _tracker.stats();
+    if (offset < CONFIRMATION_PAYLOAD_SIZE) {
+        offset += snprintf(buffer + offset, CONFIRMATION_PAYLOAD_SIZE - offset, "\"confirmed\":%lu,\"retries\":%lu,\"diverged\":%lu}",
+                           stats.confirmed, stats.retries, stats.diverged);
+    }
+    if (offset >= CONFIRMATION_PAYLOAD_SIZE) return;
+    _host->publish(TOPIC_CONFIRMATION, 0, true, buffer, offset);
+}
@@ -0,0 +1,329 @@
+// Decodes CN105 frames from a packet capture or a serial tap.
+//
+//   cn105dump capture.pcap     pcap written by the firmware's PACKET_CAPTURE
+//                              mode, i.e. the payloads of <prefix>/capture
+//   cn105dump tap.bin          raw bytes read from the link at 2400 8E1
+//   cn105dump tap.txt          the output of bin/monitor_heatpump.sh (od -t x1)
+//   cn105dump -                any of the above, on stdin
+//
+// The input format is detected from its first bytes. Each frame is printed
+// with its timestamp and the gap since the previous frame (pcap only), its
+// direction, command, length and checksum status, then the fields we know how
+// to decode. Bytes that don't start a valid frame are skipped and counted, so
+// a tap that was started mid-frame or picked up line noise resyncs on the next
+// 0xFC header.
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet_capture.hpp"
+
+#define FRAME_HEADER_LEN 5
+#define FRAME_MAX_DATA 16
+
+enum Direction { DIRECTION_UNKNOWN, DIRECTION_SENT, DIRECTION_RECEIVED };
+
+typedef struct {
+    unsigned long frames;
+    unsigned long badChecksums;
+    unsigned long skippedBytes;
+    unsigned long truncated;
+    unsigned long byCommand[256];
+    double maxGap;
+    double lastTime;
+    bool haveTime;
+} DumpStats;
+
+static DumpStats stats;
+
+static uint8_t checkSum(const uint8_t* bytes, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) sum += bytes[i];
+    return (0xfc - sum) & 0xff;
+}
+
+static const char* commandName(uint8_t command) {
+    switch (command) {
+        case 0x5a: return "connect";
+        case 0x7a: return "connect-ack";
+        case 0x5b: return "connect2";
+        case 0x7b: return "connect2-ack";
+        case 0x41: return "set";
+        case 0x61: return "set-ack";
+        case 0x42: return "info";
+        case 0x62: return "info-reply";
+        default: return "?";
+    }
+}
+
+// Frames the ESP sends have bit 5 of the command clear; the unit's replies
+// have it set
+static Direction inferDirection(uint8_t command) {
+    switch (command) {
+        case 0x5a: case 0x5b: case 0x41: case 0x42: return DIRECTION_SENT;
+        case 0x7a: case 0x7b: case 0x61: case 0x62: return DIRECTION_RECEIVED;
+        default: return DIRECTION_UNKNOWN;
+    }
+}
+
+static const char* lookup(const uint8_t* bytes, const char* const* names, int count, uint8_t value) {
+    for (int i = 0; i < count; i++) {
+        if (bytes[i] == value) return names[i];
+    }
+    return "?";
+}
+
+static const uint8_t POWER[] = {0x00, 0x01};
+static const char* const POWER_NAMES[] = {"OFF", "ON"};
+static const uint8_t MODE[] = {0x01, 0x02, 0x03, 0x07, 0x08};
+static const char* const MODE_NAMES[] = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
+static const uint8_t FAN[] = {0x00, 0x01, 0x02, 0x03, 0x05, 0x06};
+static const char* const FAN_NAMES[] = {"AUTO", "QUIET", "1", "2", "3", "4"};
+static const uint8_t VANE[] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x07};
+static const char* const VANE_NAMES[] = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
+static const uint8_t WIDEVANE[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x08, 0x0c};
+static const char* const WIDEVANE_NAMES[] = {"<<", "<", "|", ">", ">>", "<>", "SWING"};
+
+// Setpoints 0x00..0x0F are 31..16 degrees, room temperatures 0x00..0x1F are
+// 10..41 degrees
+static int setpoint(uint8_t value) {
+    return value <= 0x0f ? 31 - value : -1;
+}
+
+static int roomTemperature(uint8_t value) {
+    return value <= 0x1f ? 10 + value : -1;
+}
+
+static const char* infoName(uint8_t code) {
+    switch (code) {
+        case 0x02: return "settings";
+        case 0x03: return "room-temp";
+        case 0x04: return "unknown-04";
+        case 0x05: return "timers";
+        case 0x06: return "status";
+        case 0x09: return "standby";
+        default: return "?";
+    }
+}
+
+static void printFields(const uint8_t* frame, size_t dataLength) {
+    const uint8_t* data = frame + FRAME_HEADER_LEN;
+    if (dataLength == 0) return;
+
+    switch (frame[1]) {
+        case 0x41:
+            if (data[0] != 0x01 || dataLength < 14) break;
+            if (data[1] & 0x01) printf(" power=%s", lookup(POWER, POWER_NAMES, 2, data[3]));
+            if (data[1] & 0x02) printf(" mode=%s", lookup(MODE, MODE_NAMES, 5, data[4]));
+            if (data[1] & 0x04) printf(" temp=%d", setpoint(data[5]));
+            if (data[1] & 0x08) printf(" fan=%s", lookup(FAN, FAN_NAMES, 6, data[6]));
+            if (data[1] & 0x10) printf(" vane=%s", lookup(VANE, VANE_NAMES, 7, data[7]));
+            if (data[2] & 0x01) printf(" widevane=%s", lookup(WIDEVANE, WIDEVANE_NAMES, 7, data[13]));
+            break;
+        case 0x42:
+            printf(" %s", infoName(data[0]));
+            break;
+        case 0x62:
+            printf(" %s", infoName(data[0]));
+            if (data[0] == 0x02 && dataLength >= 11) {
+                bool iSee = data[4] > 0x08;
+                printf(" power=%s mode=%s%s temp=%d fan=%s vane=%s widevane=%s",
+                       lookup(POWER, POWER_NAMES, 2, data[3]),
+                       lookup(MODE, MODE_NAMES, 5, iSee ? data[4] - 0x08 : data[4]), iSee ? " isee" : "",
+                       setpoint(data[5]),
+                       lookup(FAN, FAN_NAMES, 6, data[6]),
+                       lookup(VANE, VANE_NAMES, 7, data[7]),
+                       lookup(WIDEVANE, WIDEVANE_NAMES, 7, data[10] & 0x0f));
+            } else if (data[0] == 0x03 && dataLength >= 4) {
+                printf(" room=%d", roomTemperature(data[3]));
+            }
+            break;
+    }
+}
+
+static void printFrame(const uint8_t* frame, size_t length, Direction direction, double time, bool haveTime) {
+    size_t dataLength = frame[4];
+    bool checksumOk = frame[length - 1] == checkSum(frame, length - 1);
+
+    if (haveTime) {
+        double gap = stats.haveTime ? time - stats.lastTime : 0;
+        if (gap > stats.maxGap) stats.maxGap = gap;
+        printf("%12.6f %+10.1fms ", time, gap * 1000);
+        stats.lastTime = time;
+        stats.haveTime = true;
+    }
+    if (direction == DIRECTION_UNKNOWN) direction = inferDirection(frame[1]);
+    printf("%s %02X %-12s %2u %s ",
+           direction == DIRECTION_SENT ? "->" : direction == DIRECTION_RECEIVED ? "<-" : "??",
+           frame[1], commandName(frame[1]), (unsigned int) dataLength, checksumOk ? "ok " : "BAD");
+    for (size_t i = 0; i < length; i++) printf("%02X", frame[i]);
+    if (checksumOk) printFields(frame, dataLength);
+    printf("\n");
+
+    stats.frames++;
+    stats.byCommand[frame[1]]++;
+    if (!checksumOk) stats.badChecksums++;
+}
+
+// Returns the length of the frame at bytes, 0 if it isn't the start of a
+// frame, or -1 if it might be but more bytes are needed
+static long frameLength(const uint8_t* bytes, size_t available) {
+    if (bytes[0] != 0xfc) return 0;
+    if (available < FRAME_HEADER_LEN) return -1;
+    if (bytes[2] != 0x01 || bytes[3] != 0x30 || bytes[4] > FRAME_MAX_DATA) return 0;
+    size_t length = FRAME_HEADER_LEN + bytes[4] + 1;
+    return available < length ? -1 : (long) length;
+}
+
+// A byte stream from a tap: frames back to back, possibly with garbage between
+static void decodeStream(const uint8_t* bytes, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        long frame = frameLength(bytes + i, length - i);
+        if (frame < 0) {
+            stats.truncated++;
+            break;
+        }
+        if (frame == 0 || bytes[i + frame - 1] != checkSum(bytes + i, frame - 1)) {
+            // Not a frame, or a corrupt one; resync on the next header
+            if (frame > 0) stats.badChecksums++;
+            stats.skippedBytes++;
+            i++;
+            continue;
+        }
+        printFrame(bytes + i, frame, DIRECTION_UNKNOWN, 0, false);
+        i += frame;
+    }
+}
+
+static uint32_t getUint32(const uint8_t* bytes, bool swap) {
+    if (swap) return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+    return (uint32_t) bytes[3] << 24 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[1] << 8 | bytes[0];
+}
+
+// Each record in the firmware's captures is one frame exactly as it was sent
+// or received, so frames are not resynced; a bad one is printed as such
+static bool decodePcap(const uint8_t* bytes, size_t length) {
+    bool swap = getUint32(bytes, false) != PCAP_MAGIC;
+    if (getUint32(bytes + 20, swap) != PCAP_LINKTYPE_USER0) {
+        fprintf(stderr, "not a CN105 capture (link type %u)\n", getUint32(bytes + 20, swap));
+        return false;
+    }
+
+    size_t i = PCAP_HEADER_SIZE;
+    while (i + PCAP_RECORD_HEADER_SIZE <= length) {
+        double time = getUint32(bytes + i, swap) + getUint32(bytes + i + 4, swap) / 1e6;
+        uint32_t captured = getUint32(bytes + i + 8, swap);
+        uint32_t original = getUint32(bytes + i + 12, swap);
+        i += PCAP_RECORD_HEADER_SIZE;
+        if (captured == 0 || i + captured > length) {
+            stats.truncated++;
+            break;
+        }
+
+        Direction direction = bytes[i] == PACKET_CAPTURE_SENT ? DIRECTION_SENT : DIRECTION_RECEIVED;
+        const uint8_t* frame = bytes + i + 1;
+        size_t frameLength = captured - 1;
+        if (captured < original) stats.truncated++;
+        if (frameLength > FRAME_HEADER_LEN && frame[0] == 0xfc && FRAME_HEADER_LEN + frame[4] + 1u == frameLength) {
+            printFrame(frame, frameLength, direction, time, true);
+        } else {
+            printf("%12.6f %s not a frame: ", time, direction == DIRECTION_SENT ? "->" : "<-");
+            for (size_t j = 0; j < frameLength; j++) printf("%02X", frame[j]);
+            printf("\n");
+            stats.skippedBytes += frameLength;
+        }
+        i += captured;
+    }
+    return true;
+}
+
+// od -v -t x1 output: an octal offset, then up to 16 hex bytes, per line
+static size_t parseOd(const uint8_t* text, size_t length, uint8_t* out) {
+    size_t count = 0;
+    size_t i = 0;
+    while (i < length) {
+        // Skip the offset column
+        while (i < length && text[i] != ' ' && text[i] != '\n') i++;
+        while (i < length && text[i] != '\n') {
+            while (i < length && text[i] == ' ') i++;
+            if (i + 1 < length && isxdigit(text[i]) && isxdigit(text[i + 1])) {
+                char hex[3] = { (char) text[i], (char) text[i + 1], 0 };
+                out[count++] = (uint8_t) strtoul(hex, NULL, 16);
+                i += 2;
+            } else if (i < length && text[i] != '\n') {
+                i++;
+            }
+        }
+        i++;
+    }
+    return count;
+}
+
+static bool looksLikeOd(const uint8_t* bytes, size_t length) {
+    // "0000000 fc 41 ..."
+    if (length < 8) return false;
+    for (int i = 0; i < 7; i++) {
+        if (bytes[i] < '0' || bytes[i] > '7') return false;
+    }
+    return bytes[7] == ' ' || bytes[7] == '\n';
+}
+
+static uint8_t* readAll(FILE* file, size_t* length) {
+    size_t capacity = 65536;
+    uint8_t* buffer = (uint8_t*) malloc(capacity);
+    *length = 0;
+    size_t n;
+    while (buffer && (n = fread(buffer + *length, 1, capacity - *length, file)) > 0) {
+        *length += n;
+        if (*length == capacity) {
+            capacity *= 2;
+            buffer = (uint8_t*) realloc(buffer, capacity);
+        }
+    }
+    return buffer;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <capture.pcap | tap.bin | tap.txt | ->\n", argv[0]);
+        return 2;
+    }
+
+    FILE* file = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    size_t length;
+    uint8_t* bytes = readAll(file, &length);
+    if (file != stdin) fclose(file);
+    if (bytes == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if (length >= PCAP_HEADER_SIZE && (getUint32(bytes, false) == PCAP_MAGIC || getUint32(bytes, true) == PCAP_MAGIC)) {
+        if (!decodePcap(bytes, length)) return 1;
+    } else if (looksLikeOd(bytes, length)) {
+        uint8_t* decoded = (uint8_t*) malloc(length / 3 + 1);
+        decodeStream(decoded, parseOd(bytes, length, decoded));
+        free(decoded);
+    } else {
+        decodeStream(bytes, length);
+    }
+    free(bytes);
+
+    printf("\n%lu frames, %lu bad checksums, %lu bytes skipped, %lu truncated\n",
+           stats.frames, stats.badChecksums, stats.skippedBytes, stats.truncated);
+    for (int command = 0; command < 256; command++) {
+        if (stats.byCommand[command] > 0) {
+            printf("  %02X %-12s %lu\n", command, commandName(command), stats.byCommand[command]);
+        }
+    }
+    if (stats.haveTime) printf("longest gap between frames: %.1f ms\n", stats.maxGap * 1000);
+    return 0;
+}
@@ -0,0 +1,428 @@
+// Simulates a Mitsubishi indoor unit on the far end of a CN105 link, served on
+// a pseudo-terminal so that the firmware's heatpump path can be run and timed
+// without hardware.
+//
+//   cn105sim [-l link] [-d ms] [-j ms] [-D rate] [-c rate] [-s rate]
+//            [-S seed] [-f] [-v]
+//
+//   -l link    also make a symlink to the pty at this path
+//   -d ms      extra delay before each reply starts (default 0)
+//   -j ms      random extra delay of up to this much on top of -d
+//   -D rate    probability that each reply byte is dropped, e.g. 0.01
+//   -c rate    probability that a reply's checksum is corrupted
+//   -s rate    probability that a request gets no reply at all
+//   -S seed    seed for the fault injection, so that a run can be repeated
+//   -f         don't pace replies at 2400 baud 8E1
+//   -v         print every frame
+//
+// It answers the connect handshake, set-settings requests and the settings,
+// room temperature, timers, status and standby info requests, like a unit
+// does. Bytes are paced at 2400 baud and replies can only start once the
+// request would have been fully on the wire. Lines on stdin change the unit
+// or the faults while it runs:
+//
+//   room 24       the room warms up, as the next room-temp reply will show
+//   power ON      someone used the IR remote (also mode, temp, fan, vane)
+//   delay 200     same as -d; also jitter, drop, corrupt and silent
+//   stats         print the counters, as is done on exit
+//
+// Point the native firmware at it with CN105_PORT:
+//
+//   .pio/build/cn105sim/program -l /tmp/cn105 &
+//   CN105_PORT=/tmp/cn105 .pio/build/native/program
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_HEADER_LEN 5
+#define FRAME_MAX_DATA 16
+#define PACKET_LEN 22
+
+// One byte on the wire is start + 8 data + parity + stop bits
+#define CN105_BAUD 2400
+#define CN105_BYTE_MICROS (11UL * 1000000UL / CN105_BAUD)
+
+typedef struct {
+    unsigned long replyDelayMs;
+    unsigned long jitterMs;
+    double dropRate;
+    double corruptRate;
+    double silentRate;
+    bool paced;
+    bool verbose;
+} SimOptions;
+
+typedef struct {
+    uint8_t power;
+    uint8_t mode;
+    uint8_t temperature;
+    uint8_t fan;
+    uint8_t vane;
+    uint8_t wideVane;
+    uint8_t roomTemperature;
+    bool connected;
+} UnitState;
+
+typedef struct {
+    unsigned long requests;
+    unsigned long badRequests;
+    unsigned long skippedBytes;
+    unsigned long replies;
+    unsigned long silenced;
+    unsigned long droppedBytes;
+    unsigned long corrupted;
+    unsigned long connects;
+    unsigned long sets;
+    unsigned long byInfo[256];
+} SimStats;
+
+static SimOptions options = { 0, 0, 0, 0, 0, true, false };
+static UnitState unit = { 0x00, 0x03, 0x08, 0x00, 0x00, 0x03, 0x0c, false };
+static SimStats stats;
+static volatile sig_atomic_t stopping = 0;
+
+static uint8_t checkSum(const uint8_t* bytes, size_t length) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) sum += bytes[i];
+    return (0xfc - sum) & 0xff;
+}
+
+static bool chance(double rate) {
+    return rate > 0 && drand48() < rate;
+}
+
+static void sleepMicros(unsigned long us) {
+    struct timespec ts = { (time_t) (us / 1000000UL), (long) (us % 1000000UL) * 1000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR && !stopping) {}
+}
+
+static void printFrame(const char* direction, const uint8_t* frame, size_t length, const char* note) {
+    if (!options.verbose) return;
+    printf("%s ", direction);
+    for (size_t i = 0; i < length; i++) printf("%02X", frame[i]);
+    printf("%s%s\n", note[0] ? " " : "", note);
+    fflush(stdout);
+}
+
+static void printStats() {
+    printf("%lu requests (%lu connect, %lu set), %lu bad, %lu bytes skipped\n",
+           stats.requests, stats.connects, stats.sets, stats.badRequests, stats.skippedBytes);
+    printf("%lu replies, %lu silenced, %lu bytes dropped, %lu checksums corrupted\n",
+           stats.replies, stats.silenced, stats.droppedBytes, stats.corrupted);
+    for (int code = 0; code < 256; code++) {
+        if (stats.byInfo[code] > 0) printf("  info %02X %lu\n", code, stats.byInfo[code]);
+    }
+    fflush(stdout);
+}
+
+// Builds the unit's reply to a valid request; returns its length, or 0 if the
+// unit wouldn't answer it
+static size_t respond(const uint8_t* request, uint8_t* reply) {
+    const uint8_t* data = request + FRAME_HEADER_LEN;
+    memset(reply, 0, PACKET_LEN);
+
+    switch (request[1]) {
+        case 0x5a: {
+            static const uint8_t CONNECT_ACK[7] = {0xfc, 0x7a, 0x01, 0x30, 0x01, 0x00, 0x54};
+            unit.connected = true;
+            stats.connects++;
+            memcpy(reply, CONNECT_ACK, 7);
+            return 7;
+        }
+        case 0x41:
+            if (!unit.connected) return 0;
+            if (data[0] == 0x01) {
+                if (data[1] & 0x01) unit.power = data[3];
+                if (data[1] & 0x02) unit.mode = data[4];
+                if (data[1] & 0x04) unit.temperature = data[5];
+                if (data[1] & 0x08) unit.fan = data[6];
+                if (data[1] & 0x10) unit.vane = data[7];
+                if (data[2] & 0x01) unit.wideVane = data[13];
+            }
+            stats.sets++;
+            reply[1] = 0x61;
+            break;
+        case 0x42:
+            if (!unit.connected) return 0;
+            stats.byInfo[data[0]]++;
+            reply[1] = 0x62;
+            reply[5] = data[0];
+            switch (data[0]) {
+                case 0x02:
+                    reply[8] = unit.power;
+                    reply[9] = unit.mode;
+                    reply[10] = unit.temperature;
+                    reply[11] = unit.fan;
+                    reply[12] = unit.vane;
+                    reply[15] = unit.wideVane;
+                    break;
+                case 0x03:
+                    reply[8] = unit.roomTemperature;
+                    break;
+                case 0x06:
+                    // Compressor frequency, and whether it is operating
+                    reply[8] = unit.power ? 0x20 : 0x00;
+                    reply[9] = unit.power;
+                    break;
+            }
+            break;
+        default:
+            return 0;
+    }
+    reply[0] = 0xfc;
+    reply[2] = 0x01;
+    reply[3] = 0x30;
+    reply[4] = FRAME_MAX_DATA;
+    reply[PACKET_LEN - 1] = checkSum(reply, PACKET_LEN - 1);
+    return PACKET_LEN;
+}
+
+static void sendReply(int fd, const uint8_t* request, size_t requestLength) {
+    uint8_t reply[PACKET_LEN];
+    size_t length = respond(request, reply);
+    if (length == 0) return;
+    if (chance(options.silentRate)) {
+        stats.silenced++;
+        printFrame("<-", reply, length, "(silenced)");
+        return;
+    }
+    if (chance(options.corruptRate)) {
+        reply[length - 1] ^= 0x5a;
+        stats.corrupted++;
+    }
+
+    // The reply can't start until the request has been fully received
+    unsigned long wait = options.replyDelayMs * 1000;
+    if (options.jitterMs > 0) wait += (unsigned long) (drand48() * options.jitterMs * 1000);
+    if (options.paced) wait += requestLength * CN105_BYTE_MICROS;
+    sleepMicros(wait);
+
+    uint8_t sent[PACKET_LEN];
+    size_t sentLength = 0;
+    for (size_t i = 0; i < length && !stopping; i++) {
+        if (chance(options.dropRate)) {
+            stats.droppedBytes++;
+        } else {
+            sent[sentLength++] = reply[i];
+            if (write(fd, reply + i, 1) != 1) break;
+        }
+        if (options.paced) sleepMicros(CN105_BYTE_MICROS);
+    }
+    stats.replies++;
+    printFrame("<-", sent, sentLength, sentLength != length ? "(bytes dropped)" : "");
+}
+
+// Frames requests out of whatever has arrived, resyncing on the next 0xfc
+// header after anything that isn't one. Returns how many bytes were used.
+static size_t handleInput(int fd, const uint8_t* bytes, size_t length) {
+    size_t i = 0;
+    while (i < length) {
+        if (bytes[i] != 0xfc) {
+            stats.skippedBytes++;
+            i++;
+            continue;
+        }
+        if (length - i < FRAME_HEADER_LEN) break;
+        const uint8_t* frame = bytes + i;
+        if (frame[2] != 0x01 || frame[3] != 0x30 || frame[4] > FRAME_MAX_DATA) {
+            stats.skippedBytes++;
+            i++;
+            continue;
+        }
+        size_t frameLength = FRAME_HEADER_LEN + frame[4] + 1;
+        if (length - i < frameLength) break;
+        if (frame[frameLength - 1] != checkSum(frame, frameLength - 1)) {
+            stats.badRequests++;
+            printFrame("->", frame, frameLength, "(bad checksum)");
+            stats.skippedBytes++;
+            i++;
+            continue;
+        }
+        stats.requests++;
+        printFrame("->", frame, frameLength, "");
+        sendReply(fd, frame, frameLength);
+        i += frameLength;
+    }
+    return i;
+}
+
+static const uint8_t MODE[5] = {0x01, 0x02, 0x03, 0x07, 0x08};
+static const char* const MODE_NAMES[5] = {"HEAT", "DRY", "COOL", "FAN", "AUTO"};
+static const uint8_t FAN[6] = {0x00, 0x01, 0x02, 0x03, 0x05, 0x06};
+static const char* const FAN_NAMES[6] = {"AUTO", "QUIET", "1", "2", "3", "4"};
+static const uint8_t VANE[7] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x07};
+static const char* const VANE_NAMES[7] = {"AUTO", "1", "2", "3", "4", "5", "SWING"};
+
+static bool lookup(const char* const* names, const uint8_t* bytes, int count, const char* value, uint8_t* out) {
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(names[i], value) == 0) {
+            *out = bytes[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void handleCommand(char* line) {
+    char name[16];
+    char value[16];
+    int fields = sscanf(line, "%15s %15s", name, value);
+    if (fields < 1) return;
+    bool ok = true;
+
+    if (strcmp(name, "stats") == 0) {
+        printStats();
+        return;
+    } else if (fields < 2) {
+        ok = false;
+    } else if (strcmp(name, "room") == 0) {
+        int t = atoi(value);
+        ok = t >= 10 && t <= 41;
+        if (ok) unit.roomTemperature = t - 10;
+    } else if (strcmp(name, "power") == 0) {
+        ok = strcasecmp(value, "ON") == 0 || strcasecmp(value, "OFF") == 0;
+        if (ok) unit.power = strcasecmp(value, "ON") == 0;
+    } else if (strcmp(name, "mode") == 0) {
+        ok = lookup(MODE_NAMES, MODE, 5, value, &unit.mode);
+    } else if (strcmp(name, "temp") == 0) {
+        int t = atoi(value);
+        ok = t >= 16 && t <= 31;
+        if (ok) unit.temperature = 31 - t;
+    } else if (strcmp(name, "fan") == 0) {
+        ok = lookup(FAN_NAMES, FAN, 6, value, &unit.fan);
+    } else if (strcmp(name, "vane") == 0) {
+        ok = lookup(VANE_NAMES, VANE, 7, value, &unit.vane);
+    } else if (strcmp(name, "delay") == 0) {
+        options.replyDelayMs = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "jitter") == 0) {
+        options.jitterMs = strtoul(value, NULL, 10);
+    } else if (strcmp(name, "drop") == 0) {
+        options.dropRate = atof(value);
+    } else if (strcmp(name, "corrupt") == 0) {
+        options.corruptRate = atof(value);
+    } else if (strcmp(name, "silent") == 0) {
+        options.silentRate = atof(value);
+    } else {
+        ok = false;
+    }
+    if (!ok) fprintf(stderr, "can't do \"%s %s\"\n", name, fields > 1 ? value : "");
+}
+
+static void onSignal(int signal) {
+    (void) signal;
+    stopping = 1;
+}
+
+// Opens a pty whose slave end looks like the unit's serial port. We keep the
+// slave open ourselves, so that the master doesn't see a hangup each time the
+// firmware closes and reopens it.
+static int openPty(int* slave, char* path, size_t pathLength) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+    snprintf(path, pathLength, "%s", ptsname(master));
+    *slave = open(path, O_RDWR | O_NOCTTY);
+    if (*slave < 0) {
+        perror(path);
+        return -1;
+    }
+    struct termios tio;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B2400);
+    tio.c_cflag |= PARENB;
+    tcsetattr(*slave, TCSANOW, &tio);
+    return master;
+}
+
+int main(int argc, char** argv) {
+    const char* link = NULL;
+    long seed = time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "l:d:j:D:c:s:S:fv")) != -1) {
+        switch (opt) {
+            case 'l': link = optarg; break;
+            case 'd': options.replyDelayMs = strtoul(optarg, NULL, 10); break;
+            case 'j': options.jitterMs = strtoul(optarg, NULL, 10); break;
+            case 'D': options.dropRate = atof(optarg); break;
+            case 'c': options.corruptRate = atof(optarg); break;
+            case 's': options.silentRate = atof(optarg); break;
+            case 'S': seed = strtol(optarg, NULL, 10); break;
+            case 'f': options.paced = false; break;
+            case 'v': options.verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-l link] [-d ms] [-j ms] [-D rate] [-c rate] [-s rate] [-S seed] [-f] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    srand48(seed);
+
+    char path[64];
+    int slave;
+    int master = openPty(&slave, path, sizeof(path));
+    if (master < 0) return 1;
+    if (link != NULL) {
+        unlink(link);
+        if (symlink(path, link) != 0) {
+            perror(link);
+            return 1;
+        }
+    }
+    printf("serving CN105 on %s%s%s (seed %ld)\n", path, link ? " -> " : "", link ? link : "", seed);
+    fflush(stdout);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    uint8_t input[256];
+    size_t inputLength = 0;
+    char line[128];
+    struct pollfd fds[2] = { { master, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+    int nfds = 2;
+
+    while (!stopping) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            ssize_t n = read(master, input + inputLength, sizeof(input) - inputLength);
+            if (n > 0) {
+                inputLength += n;
+                size_t used = handleInput(master, input, inputLength);
+                memmove(input, input + used, inputLength - used);
+                inputLength -= used;
+                // Never let a stuck partial frame fill the buffer
+                if (inputLength == sizeof(input)) inputLength = 0;
+            }
+        }
+        if (nfds > 1 && (fds[1].revents & (POLLIN | POLLHUP))) {
+            if (fgets(line, sizeof(line), stdin) != NULL) {
+                handleCommand(line);
+            } else {
+                nfds = 1;
+            }
+        }
+    }
+
+    printStats();
+    if (link != NULL) unlink(link);
+    close(slave);
+    close(master);
+    return 0;
+}
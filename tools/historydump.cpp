@@ -0,0 +1,107 @@
+// Prints a batch published to <prefix>/history in answer to
+// <prefix>/history/get, one sample a line.
+//
+//   historydump history.bin [received]   received is when the batch arrived,
+//   historydump - [received]             as a Unix time; without it, samples
+//                                        are shown by age
+//
+// e.g. mosquitto_sub -C 1 -N -t aircon/history > history.bin, after
+// mosquitto_pub -t aircon/history/get -m "tier=minute since=86400".
+// Samples from before the unit's last boot are marked, as their times don't
+// count the time it was off.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "command_router.hpp"
+#include "history.hpp"
+
+static uint8_t* readAll(FILE* file, size_t* length) {
+    size_t capacity = 65536;
+    uint8_t* buffer = (uint8_t*) malloc(capacity);
+    *length = 0;
+    size_t n;
+    while (buffer && (n = fread(buffer + *length, 1, capacity - *length, file)) > 0) {
+        *length += n;
+        if (*length == capacity) {
+            capacity *= 2;
+            buffer = (uint8_t*) realloc(buffer, capacity);
+        }
+    }
+    return buffer;
+}
+
+static const char* valueName(CommandTopic topic, uint16_t settings, int shift) {
+    const char* name = CommandRouter::valueName(topic, (settings >> shift) & 0x07);
+    return name != NULL ? name : "?";
+}
+
+static void printSettings(uint16_t settings) {
+    if (settings == HISTORY_SETTINGS_UNKNOWN) {
+        printf("settings unknown");
+        return;
+    }
+    int setpoint = HISTORY_SETPOINT_BASE + ((settings >> 10) & 0x3f) * 5;
+    printf("%-3s %-4s %2d.%d  fan %-5s vane %s", settings & 0x01 ? "ON" : "OFF", valueName(COMMAND_MODE, settings, 1),
+           setpoint / 10, setpoint % 10, valueName(COMMAND_FAN, settings, 4), valueName(COMMAND_VANE, settings, 7));
+}
+
+static void printWhen(uint32_t age, long received) {
+    if (received > 0) {
+        time_t when = (time_t) (received - age);
+        char text[32];
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("%s", text);
+    } else {
+        printf("-%3uh%02um%02us", age / 3600, age / 60 % 60, age % 60);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s history.bin|- [received]\n", argv[0]);
+        return 2;
+    }
+    FILE* file = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    size_t length;
+    uint8_t* bytes = readAll(file, &length);
+    if (file != stdin) fclose(file);
+    long received = argc > 2 ? atol(argv[2]) : 0;
+
+    HistoryReader reader(bytes, length);
+    if (!reader.valid()) {
+        fprintf(stderr, "%s: not a history batch\n", argv[1]);
+        return 1;
+    }
+    printf("# %s tier, %u seconds of history, this boot from %u\n", History::tierName(reader.tier()), reader.now(),
+           reader.boot());
+
+    HistorySample sample;
+    unsigned long count = 0;
+    bool earlierBoot = false;
+    while (reader.next(&sample)) {
+        if (sample.seconds < reader.boot()) {
+            earlierBoot = true;
+        } else if (earlierBoot) {
+            printf("# boot\n");
+            earlierBoot = false;
+        }
+        printWhen(reader.now() - sample.seconds, sample.seconds < reader.boot() ? 0 : received);
+        printf("  %c%2d.%d  ", sample.room < 0 ? '-' : ' ', abs(sample.room) / 10, abs(sample.room) % 10);
+        printSettings(sample.settings);
+        printf("%s\n", sample.seconds < reader.boot() ? "  (earlier boot)" : "");
+        count++;
+    }
+    printf("# %lu samples\n", count);
+    // Batches run oldest first, so what didn't fit is the newest
+    if (reader.more() && count > 0) printf("# more: ask again with since=%u\n", reader.now() - sample.seconds);
+    free(bytes);
+    return 0;
+}
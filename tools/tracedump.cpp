@@ -0,0 +1,389 @@
+// Turns the firmware's binary trace back into text.
+//
+//   tracedump firmware.elf trace.bin   chunks published to <prefix>/trace,
+//                                      concatenated, e.g. by mosquitto_sub -N
+//   tracedump firmware.elf -           the same, on stdin
+//   tracedump firmware.elf             lists the formats in the ELF
+//
+// The ELF must be the one the trace came from: formats are looked up by ID
+// in its .trace_formats section, which holds the text of every TRACE() call
+// site (see trace.hpp). Each record is printed with its time since boot and
+// the gap since the previous record. Records whose ID isn't in the ELF are
+// printed raw, and records lost on the device, or chunks lost on the way,
+// are noted where they were.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.hpp"
+
+typedef struct {
+    uint32_t id;
+    const char* format;
+} Format;
+
+typedef struct {
+    Format* formats;
+    size_t count;
+} FormatTable;
+
+typedef struct {
+    unsigned long records;
+    unsigned long chunks;
+    unsigned long unknown;
+    unsigned long truncated;
+    unsigned long dropped;
+    unsigned long missing;
+} DumpStats;
+
+static DumpStats stats;
+
+static uint8_t* readAll(FILE* file, size_t* length) {
+    size_t capacity = 65536;
+    uint8_t* buffer = (uint8_t*) malloc(capacity);
+    *length = 0;
+    size_t n;
+    while (buffer && (n = fread(buffer + *length, 1, capacity - *length, file)) > 0) {
+        *length += n;
+        if (*length == capacity) {
+            capacity *= 2;
+            buffer = (uint8_t*) realloc(buffer, capacity);
+        }
+    }
+    return buffer;
+}
+
+static uint8_t* readFile(const char* path, size_t* length) {
+    FILE* file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return NULL;
+    }
+    uint8_t* bytes = readAll(file, length);
+    if (file != stdin) fclose(file);
+    if (bytes == NULL) fprintf(stderr, "out of memory\n");
+    return bytes;
+}
+
+static uint64_t getUint(const uint8_t* bytes, int size, bool bigEndian) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint64_t) bytes[bigEndian ? size - 1 - i : i] << (8 * i);
+    }
+    return value;
+}
+
+static uint32_t getWord(const uint8_t* bytes) {
+    return getUint(bytes, 4, false);
+}
+
+// Finds a section by name in a 32 or 64-bit ELF file
+static bool findSection(const uint8_t* elf, size_t length, const char* name, size_t* offset, size_t* size) {
+    if (length < 64 || memcmp(elf, "\x7f" "ELF", 4) != 0) {
+        fprintf(stderr, "not an ELF file\n");
+        return false;
+    }
+    bool wide = elf[4] == 2;
+    bool bigEndian = elf[5] == 2;
+    uint64_t sectionHeaders = wide ? getUint(elf + 0x28, 8, bigEndian) : getUint(elf + 0x20, 4, bigEndian);
+    unsigned int entrySize = getUint(elf + (wide ? 0x3a : 0x2e), 2, bigEndian);
+    unsigned int count = getUint(elf + (wide ? 0x3c : 0x30), 2, bigEndian);
+    unsigned int names = getUint(elf + (wide ? 0x3e : 0x32), 2, bigEndian);
+    if (names >= count || sectionHeaders + (uint64_t) count * entrySize > length) {
+        fprintf(stderr, "bad section headers\n");
+        return false;
+    }
+
+    const uint8_t* nameHeader = elf + sectionHeaders + names * entrySize;
+    uint64_t nameOffset = wide ? getUint(nameHeader + 0x18, 8, bigEndian) : getUint(nameHeader + 0x10, 4, bigEndian);
+    for (unsigned int i = 0; i < count; i++) {
+        const uint8_t* header = elf + sectionHeaders + i * entrySize;
+        uint64_t at = nameOffset + getUint(header, 4, bigEndian);
+        if (at >= length || strncmp((const char*) elf + at, name, length - at) != 0) continue;
+        *offset = wide ? getUint(header + 0x18, 8, bigEndian) : getUint(header + 0x10, 4, bigEndian);
+        *size = wide ? getUint(header + 0x20, 8, bigEndian) : getUint(header + 0x14, 4, bigEndian);
+        if (*offset + *size > length) break;
+        return true;
+    }
+    fprintf(stderr, "no %s section; was the firmware built with trace.hpp?\n", name);
+    return false;
+}
+
+static int compareFormats(const void* a, const void* b) {
+    uint32_t x = ((const Format*) a)->id;
+    uint32_t y = ((const Format*) b)->id;
+    return x < y ? -1 : x > y;
+}
+
+// Collects the NUL-terminated formats in the section, once each. Call sites
+// with the same format share an ID, and so do inline functions emitted more
+// than once; two different formats with the same ID are reported.
+static bool loadFormats(const uint8_t* elf, size_t length, FormatTable* table) {
+    size_t offset, size;
+    if (!findSection(elf, length, TRACE_SECTION, &offset, &size)) return false;
+
+    const char* section = (const char*) elf + offset;
+    table->formats = (Format*) malloc((size + 1) * sizeof(Format));
+    table->count = 0;
+    for (size_t at = 0; at < size;) {
+        const char* format = section + at;
+        size_t formatLength = strnlen(format, size - at);
+        at += formatLength + 1;
+        if (formatLength == 0) continue;
+        table->formats[table->count].id = traceId(format);
+        table->formats[table->count].format = format;
+        table->count++;
+    }
+    qsort(table->formats, table->count, sizeof(Format), compareFormats);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        if (kept > 0 && table->formats[kept - 1].id == table->formats[i].id) {
+            if (strcmp(table->formats[kept - 1].format, table->formats[i].format) != 0) {
+                fprintf(stderr, "warning: \"%s\" and \"%s\" have the same ID %08x\n",
+                        table->formats[kept - 1].format, table->formats[i].format, table->formats[i].id);
+            }
+            continue;
+        }
+        table->formats[kept++] = table->formats[i];
+    }
+    table->count = kept;
+    return true;
+}
+
+static const char* lookupFormat(const FormatTable& table, uint32_t id) {
+    Format key = { id, NULL };
+    const Format* found = (const Format*) bsearch(&key, table.formats, table.count, sizeof(Format), compareFormats);
+    return found != NULL ? found->format : NULL;
+}
+
+typedef struct {
+    const uint8_t* bytes;
+    size_t size;
+    size_t used;
+    bool exhausted;
+} Arguments;
+
+static bool nextWord(Arguments& arguments, uint32_t* value) {
+    if (arguments.used + 4 > arguments.size) {
+        arguments.exhausted = true;
+        return false;
+    }
+    *value = getWord(arguments.bytes + arguments.used);
+    arguments.used += 4;
+    return true;
+}
+
+static bool nextString(Arguments& arguments, char* out) {
+    if (arguments.used + 1 > arguments.size) {
+        arguments.exhausted = true;
+        return false;
+    }
+    size_t length = arguments.bytes[arguments.used];
+    if (arguments.used + 1 + length > arguments.size) length = arguments.size - arguments.used - 1;
+    memcpy(out, arguments.bytes + arguments.used + 1, length);
+    out[length] = '\0';
+    arguments.used += 1 + length;
+    return true;
+}
+
+// printf()s the format with arguments taken from the record, one conversion
+// at a time. Length modifiers are dropped, since every argument was stored
+// as 32 bits. Arguments missing from a truncated record print as "?".
+static void printRecord(const char* format, Arguments& arguments) {
+    char spec[32];
+    char text[TRACE_MAX_STRING + 1];
+    for (const char* c = format; *c != '\0';) {
+        if (*c != '%') {
+            putchar(*c++);
+            continue;
+        }
+        if (c[1] == '%') {
+            putchar('%');
+            c += 2;
+            continue;
+        }
+
+        size_t used = 0;
+        spec[used++] = *c++;
+        int stars[2];
+        int starCount = 0;
+        while (*c != '\0' && strchr("-+ #0123456789.*hlLqjzt", *c) != NULL) {
+            if (*c == '*') {
+                uint32_t value = 0;
+                nextWord(arguments, &value);
+                if (starCount < 2) stars[starCount++] = (int32_t) value;
+            }
+            if (strchr("hlLqjzt", *c) == NULL && used < sizeof(spec) - 2) spec[used++] = *c;
+            c++;
+        }
+        char conversion = *c;
+        if (conversion == '\0') break;
+        c++;
+        spec[used++] = conversion;
+        spec[used] = '\0';
+        if (arguments.exhausted) {
+            putchar('?');
+            continue;
+        }
+
+        uint32_t word = 0;
+        bool ok;
+        if (conversion == 's') {
+            ok = nextString(arguments, text);
+        } else {
+            ok = nextWord(arguments, &word);
+        }
+        if (!ok) {
+            putchar('?');
+            continue;
+        }
+        // A '*' always comes before the conversion's own argument
+        switch (conversion) {
+            case 's':
+                if (starCount == 0) printf(spec, text);
+                else if (starCount == 1) printf(spec, stars[0], text);
+                else printf(spec, stars[0], stars[1], text);
+                break;
+            case 'd':
+            case 'i':
+                if (starCount == 0) printf(spec, (int32_t) word);
+                else if (starCount == 1) printf(spec, stars[0], (int32_t) word);
+                else printf(spec, stars[0], stars[1], (int32_t) word);
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G': {
+                float value;
+                memcpy(&value, &word, sizeof(value));
+                if (starCount == 0) printf(spec, (double) value);
+                else if (starCount == 1) printf(spec, stars[0], (double) value);
+                else printf(spec, stars[0], stars[1], (double) value);
+                break;
+            }
+            case 'p':
+                printf("0x%08x", word);
+                break;
+            default:
+                if (starCount == 0) printf(spec, word);
+                else if (starCount == 1) printf(spec, stars[0], word);
+                else printf(spec, stars[0], stars[1], word);
+                break;
+        }
+    }
+}
+
+typedef struct {
+    uint64_t micros;
+    uint32_t last;
+    bool haveTime;
+    uint32_t nextSequence;
+    bool haveSequence;
+} Timeline;
+
+// micros() wraps every ~71 minutes; records are in order, so a step back
+// is a wrap
+static double recordTime(Timeline& timeline, uint32_t micros) {
+    if (!timeline.haveTime) {
+        timeline.micros = micros;
+        timeline.haveTime = true;
+    } else {
+        timeline.micros += (uint32_t) (micros - timeline.last);
+    }
+    timeline.last = micros;
+    return timeline.micros / 1e6;
+}
+
+static void decodeTrace(const FormatTable& table, const uint8_t* bytes, size_t length) {
+    Timeline timeline;
+    memset(&timeline, 0, sizeof(timeline));
+    double previous = 0;
+
+    for (size_t at = 0; at < length;) {
+        size_t size = bytes[at];
+        if (size < TRACE_HEADER_SIZE || at + size > length) {
+            fprintf(stderr, "bad record at byte %zu; stopping\n", at);
+            return;
+        }
+        const uint8_t* record = bytes + at;
+        at += size;
+        uint32_t micros = getWord(record + 1);
+        uint32_t id = getWord(record + 5);
+        Arguments arguments = { record + TRACE_HEADER_SIZE, size - TRACE_HEADER_SIZE, 0, false };
+
+        if (id == TRACE_ID_CHUNK) {
+            uint32_t sequence = 0, dropped = 0;
+            nextWord(arguments, &sequence);
+            nextWord(arguments, &dropped);
+            stats.chunks++;
+            // The chunk says where it starts; anything between there and
+            // where the last one ended was lost on the way
+            if (timeline.haveSequence && sequence - dropped != timeline.nextSequence) {
+                uint32_t missing = sequence - dropped - timeline.nextSequence;
+                printf("-- %u records in chunks that didn't arrive --\n", missing);
+                stats.missing += missing;
+            }
+            if (dropped > 0) {
+                printf("-- %u records overwritten on the device --\n", dropped);
+                stats.dropped += dropped;
+            }
+            timeline.nextSequence = sequence;
+            timeline.haveSequence = true;
+            continue;
+        }
+
+        double time = recordTime(timeline, micros);
+        printf("%12.6f %+10.3fms ", time, stats.records > 0 ? (time - previous) * 1000 : 0.0);
+        previous = time;
+        stats.records++;
+        timeline.nextSequence++;
+
+        const char* format = lookupFormat(table, id);
+        if (format == NULL) {
+            stats.unknown++;
+            printf("unknown format %08x:", id);
+            for (size_t i = TRACE_HEADER_SIZE; i < size; i++) printf(" %02x", record[i]);
+            printf("\n");
+            continue;
+        }
+        printRecord(format, arguments);
+        if (arguments.exhausted) stats.truncated++;
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s firmware.elf [trace.bin | -]\n", argv[0]);
+        return 2;
+    }
+
+    size_t elfLength;
+    uint8_t* elf = readFile(argv[1], &elfLength);
+    if (elf == NULL) return 1;
+    FormatTable table;
+    if (!loadFormats(elf, elfLength, &table)) return 1;
+
+    if (argc == 2) {
+        for (size_t i = 0; i < table.count; i++) printf("%08x %s\n", table.formats[i].id, table.formats[i].format);
+        return 0;
+    }
+
+    size_t length;
+    uint8_t* bytes = readFile(argv[2], &length);
+    if (bytes == NULL) return 1;
+    decodeTrace(table, bytes, length);
+    free(bytes);
+
+    printf("\n%lu records in %lu chunks, %lu with unknown formats, %lu truncated\n",
+           stats.records, stats.chunks, stats.unknown, stats.truncated);
+    if (stats.dropped > 0 || stats.missing > 0) {
+        printf("%lu overwritten on the device, %lu in chunks that didn't arrive\n", stats.dropped, stats.missing);
+    }
+    return 0;
+}